@@ -0,0 +1,144 @@
+#!/usr/bin/perl
+
+# Converts access logs written with "log_format ... format=binary"
+# to tab-separated text, one line per entry.  A comment line with the
+# field names and sampling rate is printed whenever they change.
+#
+#   binlog2text.pl < access.bin
+#   zcat access.bin.gz | binlog2text.pl
+
+use warnings;
+use strict;
+
+binmode STDIN;
+
+my $buf = '';
+my $eof = 0;
+
+my (@fields, @strings);
+my $header = '';
+
+while (fill(1)) {
+	fill(5);
+
+	my $type = substr($buf, 0, 1);
+	my ($len, $pos) = varint($buf, 1);
+
+	fill($pos + $len) or die "truncated record\n";
+
+	my $rec = substr($buf, $pos, $len);
+	substr($buf, 0, $pos + $len) = '';
+
+	if ($type eq 'S') {
+		schema($rec);
+
+	} elsif ($type eq 'E') {
+		entry($rec);
+
+	} else {
+		die "unknown record type " . ord($type) . "\n";
+	}
+}
+
+sub fill {
+	my ($n) = @_;
+
+	while (length($buf) < $n && !$eof) {
+		read(STDIN, $buf, 65536, length $buf) or $eof = 1;
+	}
+
+	return length($buf) >= $n;
+}
+
+sub varint {
+	my ($s, $pos) = @_;
+	my ($n, $shift) = (0, 0);
+
+	while (1) {
+		die "truncated varint\n" if $pos >= length $s;
+
+		my $b = ord substr($s, $pos++, 1);
+		$n |= ($b & 0x7f) << $shift;
+
+		last unless $b & 0x80;
+		$shift += 7;
+	}
+
+	return ($n, $pos);
+}
+
+sub schema {
+	my ($rec) = @_;
+	my ($sample, $n, $len, $pos);
+
+	my $version = ord substr($rec, 0, 1);
+	my $flags = ord substr($rec, 1, 1);
+
+	die "unsupported version $version\n" if $version != 1;
+
+	@strings = () if $flags & 0x01;
+
+	($sample, $pos) = varint($rec, 2);
+	($n, $pos) = varint($rec, $pos);
+
+	@fields = ();
+
+	while ($n--) {
+		($len, $pos) = varint($rec, $pos);
+		push @fields, substr($rec, $pos, $len);
+		$pos += $len;
+	}
+
+	my $h = sprintf("# sample=%.2f%%\t%s", $sample / 100, join("\t", @fields));
+
+	if ($h ne $header) {
+		print "$h\n";
+		$header = $h;
+	}
+}
+
+sub entry {
+	my ($rec) = @_;
+	my ($v, $len, @values);
+	my $pos = 0;
+
+	while ($pos < length $rec) {
+		my $tag = ord substr($rec, $pos++, 1);
+
+		if ($tag == 0) {
+			push @values, '-';
+
+		} elsif ($tag == 1) {
+			($v, $pos) = varint($rec, $pos);
+			push @values, $v;
+
+		} elsif ($tag == 2 || $tag == 4) {
+			($len, $pos) = varint($rec, $pos);
+			$v = substr($rec, $pos, $len);
+			$pos += $len;
+
+			push @strings, $v if $tag == 4;
+			push @values, escape($v);
+
+		} elsif ($tag == 3) {
+			($v, $pos) = varint($rec, $pos);
+			die "unknown string $v\n" if $v > $#strings;
+			push @values, escape($strings[$v]);
+
+		} else {
+			die "unknown value tag $tag\n";
+		}
+	}
+
+	print join("\t", @values), "\n";
+}
+
+sub escape {
+	my ($s) = @_;
+
+	return '""' if $s eq '';
+
+	$s =~ s/([\x00-\x1f\x7f\\])/sprintf("\\x%02X", ord $1)/ge;
+
+	return $s;
+}
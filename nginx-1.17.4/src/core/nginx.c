@@ -38,6 +38,22 @@ static ngx_conf_enum_t  ngx_debug_points[] = {
 };
 
 
+static ngx_conf_enum_t  ngx_huge_pages[] = {
+    { ngx_string("off"), NGX_HUGE_PAGES_OFF },
+    { ngx_string("on"), NGX_HUGE_PAGES_ON },
+    { ngx_string("transparent"), NGX_HUGE_PAGES_TRANSPARENT },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_enum_t  ngx_reuseport_steering[] = {
+    { ngx_string("off"), NGX_REUSEPORT_STEERING_OFF },
+    { ngx_string("hash"), NGX_REUSEPORT_STEERING_HASH },
+    { ngx_string("cpu"), NGX_REUSEPORT_STEERING_CPU },
+    { ngx_null_string, 0 }
+};
+
+
 static ngx_command_t  ngx_core_commands[] = {
 
     { ngx_string("daemon"),
@@ -124,6 +140,41 @@ static ngx_command_t  ngx_core_commands[] = {
       offsetof(ngx_core_conf_t, rlimit_core),
       NULL },
 
+    { ngx_string("worker_pool_cache"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(ngx_core_conf_t, pool_cache),
+      NULL },
+
+    { ngx_string("huge_pages"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      0,
+      offsetof(ngx_core_conf_t, huge_pages),
+      &ngx_huge_pages },
+
+    { ngx_string("worker_huge_pages"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      0,
+      offsetof(ngx_core_conf_t, worker_huge_pages),
+      &ngx_huge_pages },
+
+    { ngx_string("worker_numa"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_core_conf_t, numa),
+      NULL },
+
+    { ngx_string("reuseport_steering"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      0,
+      offsetof(ngx_core_conf_t, reuseport_steering),
+      &ngx_reuseport_steering },
+
     { ngx_string("worker_shutdown_timeout"),
       NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -1036,6 +1087,12 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
     ccf->rlimit_nofile = NGX_CONF_UNSET;
     ccf->rlimit_core = NGX_CONF_UNSET;
 
+    ccf->pool_cache = NGX_CONF_UNSET_SIZE;
+    ccf->huge_pages = NGX_CONF_UNSET_UINT;
+    ccf->worker_huge_pages = NGX_CONF_UNSET_UINT;
+    ccf->numa = NGX_CONF_UNSET;
+    ccf->reuseport_steering = NGX_CONF_UNSET_UINT;
+
     ccf->user = (ngx_uid_t) NGX_CONF_UNSET_UINT;
     ccf->group = (ngx_gid_t) NGX_CONF_UNSET_UINT;
 
@@ -1061,6 +1118,59 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
 
     ngx_conf_init_value(ccf->worker_processes, 1);
     ngx_conf_init_value(ccf->debug_points, 0);
+    ngx_conf_init_size_value(ccf->pool_cache, 0);
+    ngx_conf_init_uint_value(ccf->huge_pages, NGX_HUGE_PAGES_OFF);
+    ngx_conf_init_uint_value(ccf->worker_huge_pages, NGX_HUGE_PAGES_OFF);
+
+#if !(NGX_HAVE_HUGE_PAGES)
+
+    if (ccf->huge_pages != NGX_HUGE_PAGES_OFF
+        || ccf->worker_huge_pages != NGX_HUGE_PAGES_OFF)
+    {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "huge pages are not supported on this platform, "
+                      "ignored");
+
+        ccf->huge_pages = NGX_HUGE_PAGES_OFF;
+        ccf->worker_huge_pages = NGX_HUGE_PAGES_OFF;
+    }
+
+#endif
+
+    ngx_conf_init_value(ccf->numa, 0);
+
+#if (NGX_HAVE_NUMA)
+
+    if (ccf->numa && !ccf->cpu_affinity_auto && ccf->cpu_affinity_n == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "\"worker_numa\" requires \"worker_cpu_affinity\"");
+        return NGX_CONF_ERROR;
+    }
+
+#else
+
+    if (ccf->numa) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "\"worker_numa\" is not supported on this platform, "
+                      "ignored");
+        ccf->numa = 0;
+    }
+
+#endif
+
+    ngx_conf_init_uint_value(ccf->reuseport_steering,
+                             NGX_REUSEPORT_STEERING_OFF);
+
+#if !(NGX_HAVE_REUSEPORT_BPF)
+
+    if (ccf->reuseport_steering != NGX_REUSEPORT_STEERING_OFF) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "\"reuseport_steering\" is not supported "
+                      "on this platform, ignored");
+        ccf->reuseport_steering = NGX_REUSEPORT_STEERING_OFF;
+    }
+
+#endif
 
 #if (NGX_HAVE_CPU_AFFINITY)
 
@@ -13,6 +13,9 @@
 ngx_os_io_t  ngx_io;
 
 
+#if (NGX_HAVE_REUSEPORT_BPF)
+static void ngx_steer_reuseport_sockets(ngx_cycle_t *cycle);
+#endif
 static void ngx_drain_connections(ngx_cycle_t *cycle);
 
 
@@ -72,10 +75,6 @@ ngx_create_listening(ngx_conf_t *cf, struct sockaddr *sockaddr,
 
     ngx_memcpy(ls->addr_text.data, text, len);
 
-#if !(NGX_WIN32)
-    ngx_rbtree_init(&ls->rbtree, &ls->sentinel, ngx_udp_rbtree_insert_value);
-#endif
-
     ls->fd = (ngx_socket_t) -1;
     ls->type = SOCK_STREAM;
 
@@ -1013,10 +1012,103 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
 #endif
     }
 
+#if (NGX_HAVE_REUSEPORT_BPF)
+    ngx_steer_reuseport_sockets(cycle);
+#endif
+
     return;
 }
 
 
+#if (NGX_HAVE_REUSEPORT_BPF)
+
+/*
+ * the sockets of a reuseport group are passed to the kernel program
+ * in the order of worker numbers, so a flow or a cpu is steered to
+ * the same worker number after reconfiguration
+ */
+
+static void
+ngx_steer_reuseport_sockets(ngx_cycle_t *cycle)
+{
+    ngx_uint_t        i, j, n;
+    ngx_socket_t     *fds;
+    ngx_listening_t  *ls;
+    ngx_core_conf_t  *ccf;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (ccf->reuseport_steering == NGX_REUSEPORT_STEERING_OFF
+        || ccf->worker_processes < 2)
+    {
+        return;
+    }
+
+    n = ccf->worker_processes;
+
+    fds = ngx_alloc(n * sizeof(ngx_socket_t), cycle->log);
+    if (fds == NULL) {
+        return;
+    }
+
+    ls = cycle->listening.elts;
+    for (i = 0; i < cycle->listening.nelts; i++) {
+
+        if (!ls[i].reuseport || ls[i].worker != 0) {
+            continue;
+        }
+
+        fds[0] = ls[i].fd;
+
+        for (j = 1; j < n; j++) {
+            fds[j] = (ngx_socket_t) -1;
+        }
+
+        for (j = 0; j < cycle->listening.nelts; j++) {
+
+            if (!ls[j].reuseport
+                || ls[j].worker == 0
+                || ls[j].worker >= n
+                || ls[j].type != ls[i].type
+                || ngx_cmp_sockaddr(ls[j].sockaddr, ls[j].socklen,
+                                    ls[i].sockaddr, ls[i].socklen, 1)
+                   != NGX_OK)
+            {
+                continue;
+            }
+
+            fds[ls[j].worker] = ls[j].fd;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (fds[j] == (ngx_socket_t) -1) {
+                break;
+            }
+        }
+
+        if (j < n) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                          "reuseport group of %V is incomplete, "
+                          "steering ignored", &ls[i].addr_text);
+            continue;
+        }
+
+        if (ngx_reuseport_attach_bpf(fds, n, ccf->reuseport_steering,
+                                     cycle->log)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                          "reuseport steering for %V failed, ignored",
+                          &ls[i].addr_text);
+        }
+    }
+
+    ngx_free(fds);
+}
+
+#endif
+
+
 void
 ngx_close_listening_sockets(ngx_cycle_t *cycle)
 {
@@ -1322,15 +1414,15 @@ ngx_close_idle_connections(ngx_cycle_t *cycle)
     ngx_uint_t         i;
     ngx_connection_t  *c;
 
-    c = cycle->connections;
-
     for (i = 0; i < cycle->connection_n; i++) {
 
+        c = ngx_cycle_connection(cycle, i);
+
         /* THREAD: lock */
 
-        if (c[i].fd != (ngx_socket_t) -1 && c[i].idle) {
-            c[i].close = 1;
-            c[i].read->handler(c[i].read);
+        if (c->fd != (ngx_socket_t) -1 && c->idle) {
+            c->close = 1;
+            c->read->handler(c->read);
         }
     }
 }
@@ -51,8 +51,7 @@ struct ngx_listening_s {
     ngx_listening_t    *previous;
     ngx_connection_t   *connection;
 
-    ngx_rbtree_t        rbtree;
-    ngx_rbtree_node_t   sentinel;
+    ngx_udp_table_t    *udp_table;
 
     ngx_uint_t          worker;
 
@@ -93,6 +92,11 @@ struct ngx_listening_s {
 };
 
 
+#define NGX_REUSEPORT_STEERING_OFF   0
+#define NGX_REUSEPORT_STEERING_HASH  1
+#define NGX_REUSEPORT_STEERING_CPU   2
+
+
 typedef enum {
     NGX_ERROR_ALERT = 0,
     NGX_ERROR_ERR,
@@ -149,6 +153,7 @@ struct ngx_connection_s {
 
     ngx_str_t           proxy_protocol_addr;
     in_port_t           proxy_protocol_port;
+    ngx_str_t           proxy_protocol_tlvs;
 
 #if (NGX_SSL || NGX_COMPAT)
     ngx_ssl_connection_t  *ssl;
@@ -457,6 +457,7 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
                 && !shm_zone[i].noreuse)
             {
                 shm_zone[i].shm.addr = oshm_zone[n].shm.addr;
+                shm_zone[i].shm.huge = oshm_zone[n].shm.huge;
 #if (NGX_WIN32)
                 shm_zone[i].shm.handle = oshm_zone[n].shm.handle;
 #endif
@@ -473,6 +474,8 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
             break;
         }
 
+        shm_zone[i].shm.huge = ccf->huge_pages;
+
         if (ngx_shm_alloc(&shm_zone[i].shm) != NGX_OK) {
             goto failed;
         }
@@ -1341,7 +1344,9 @@ ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
     shm_zone->shm.size = size;
     shm_zone->shm.name = *name;
     shm_zone->shm.exists = 0;
+    shm_zone->shm.huge = NGX_HUGE_PAGES_OFF;
     shm_zone->init = NULL;
+    shm_zone->unlock = NULL;
     shm_zone->tag = tag;
     shm_zone->noreuse = 0;
 
@@ -1373,7 +1378,7 @@ ngx_clean_old_cycles(ngx_event_t *ev)
         found = 0;
 
         for (n = 0; n < cycle[i]->connection_n; n++) {
-            if (cycle[i]->connections[n].fd != (ngx_socket_t) -1) {
+            if (ngx_cycle_connection(cycle[i], n)->fd != (ngx_socket_t) -1) {
                 found = 1;
 
                 ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0, "live fd:%ui", n);
@@ -1433,25 +1438,25 @@ ngx_shutdown_timer_handler(ngx_event_t *ev)
 
     cycle = ev->data;
 
-    c = cycle->connections;
-
     for (i = 0; i < cycle->connection_n; i++) {
 
-        if (c[i].fd == (ngx_socket_t) -1
-            || c[i].read == NULL
-            || c[i].read->accept
-            || c[i].read->channel
-            || c[i].read->resolver)
+        c = ngx_cycle_connection(cycle, i);
+
+        if (c->fd == (ngx_socket_t) -1
+            || c->read == NULL
+            || c->read->accept
+            || c->read->channel
+            || c->read->resolver)
         {
             continue;
         }
 
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
-                       "*%uA shutdown timeout", c[i].number);
+                       "*%uA shutdown timeout", c->number);
 
-        c[i].close = 1;
-        c[i].error = 1;
+        c->close = 1;
+        c->error = 1;
 
-        c[i].read->handler(c[i].read);
+        c->read->handler(c->read);
     }
 }
@@ -25,11 +25,14 @@
 typedef struct ngx_shm_zone_s  ngx_shm_zone_t;
 
 typedef ngx_int_t (*ngx_shm_zone_init_pt) (ngx_shm_zone_t *zone, void *data);
+typedef void (*ngx_shm_zone_unlock_pt) (ngx_shm_zone_t *zone, ngx_pid_t pid);
 
 struct ngx_shm_zone_s {
     void                     *data;
     ngx_shm_t                 shm;
     ngx_shm_zone_init_pt      init;
+    /* unlocks zone mutexes other than the slab pool one */
+    ngx_shm_zone_unlock_pt    unlock;
     void                     *tag;
     void                     *sync;
     ngx_uint_t                noreuse;  /* unsigned  noreuse:1; */
@@ -70,6 +73,8 @@ struct ngx_cycle_s {
     ngx_uint_t                files_n;
 
     ngx_connection_t         *connections;
+    /* the distance between adjacent connections in the array */
+    size_t                    connection_size;
     ngx_event_t              *read_events;
     ngx_event_t              *write_events;
 
@@ -97,6 +102,15 @@ typedef struct {
     ngx_int_t                 rlimit_nofile;
     off_t                     rlimit_core;
 
+    size_t                    pool_cache;
+
+    ngx_uint_t                huge_pages;
+    ngx_uint_t                worker_huge_pages;
+
+    ngx_flag_t                numa;
+
+    ngx_uint_t                reuseport_steering;
+
     int                       priority;
 
     ngx_uint_t                cpu_affinity_auto;
@@ -122,6 +136,10 @@ typedef struct {
 
 #define ngx_is_init_cycle(cycle)  (cycle->conf_ctx == NULL)
 
+#define ngx_cycle_connection(cycle, n)                                        \
+    ((ngx_connection_t *) ((u_char *) (cycle)->connections                    \
+                           + (n) * (cycle)->connection_size))
+
 
 ngx_cycle_t *ngx_init_cycle(ngx_cycle_t *old_cycle);
 ngx_int_t ngx_create_pidfile(ngx_str_t *name, ngx_log_t *log);
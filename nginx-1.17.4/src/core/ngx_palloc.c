@@ -13,6 +13,49 @@ static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size,
     ngx_uint_t align);
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static ngx_inline void ngx_pfree_large(ngx_pool_large_t *l);
+static void *ngx_pool_cache_alloc(size_t size, ngx_log_t *log);
+static void ngx_pool_cache_free(void *p, size_t size);
+
+
+/*
+ * The pool cache keeps the freed pool blocks and large allocations
+ * of a worker in power of two size classes from 256 bytes to 64K,
+ * up to the configured number of bytes in total.  The cached memory
+ * is only reused for the allocations of the same class.
+ */
+
+#define NGX_POOL_CACHE_MIN_SHIFT  8
+#define NGX_POOL_CACHE_MAX_SHIFT  16
+#define NGX_POOL_CACHE_CLASSES                                                \
+    (NGX_POOL_CACHE_MAX_SHIFT - NGX_POOL_CACHE_MIN_SHIFT + 1)
+
+#define ngx_pool_cacheable(size)                                              \
+    (ngx_pool_cache.max && (size) <= (size_t) 1 << NGX_POOL_CACHE_MAX_SHIFT)
+
+
+typedef struct ngx_pool_cache_block_s  ngx_pool_cache_block_t;
+
+struct ngx_pool_cache_block_s {
+    ngx_pool_cache_block_t  *next;
+};
+
+
+typedef struct {
+    size_t                   max;
+    ngx_pool_cache_block_t  *free[NGX_POOL_CACHE_CLASSES];
+} ngx_pool_cache_t;
+
+
+static ngx_pool_cache_t  ngx_pool_cache;
+ngx_pool_cache_stats_t   ngx_pool_cache_stats;
+
+
+void
+ngx_pool_cache_init(size_t max)
+{
+    ngx_pool_cache.max = max;
+}
 
 
 /**
@@ -22,10 +65,20 @@ ngx_pool_t *
 ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
+    ngx_uint_t   cached;
+
+    cached = ngx_pool_cacheable(size);
+
     /**
 	 * 相当于分配一块内存 ngx_alloc(size, log)
 	 */
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    if (cached) {
+        p = ngx_pool_cache_alloc(size, log);
+
+    } else {
+        p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    }
+
     if (p == NULL) {
         return NULL;
     }
@@ -50,6 +103,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
     p->large = NULL;
     p->cleanup = NULL;
     p->log = log;
+    p->cached = cached;
 
     return p;
 }
@@ -61,6 +115,7 @@ void
 ngx_destroy_pool(ngx_pool_t *pool)
 {
     ngx_pool_t          *p, *n;
+    ngx_uint_t           cached;
     ngx_pool_large_t    *l;
     ngx_pool_cleanup_t  *c;
     /* 首先清理pool->cleanup链表 */
@@ -97,12 +152,20 @@ ngx_destroy_pool(ngx_pool_t *pool)
     /* 清理pool->large链表（pool->large为单独的大数据内存块）  */
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pfree_large(l);
         }
     }
+
+    cached = pool->cached;
+
     /*pool1 pool2 pool3释放*/
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        if (cached) {
+            ngx_pool_cache_free(p, (size_t) (p->d.end - (u_char *) p));
+
+        } else {
+            ngx_free(p);
+        }
 
         if (n == NULL) {
             break;
@@ -123,7 +186,7 @@ ngx_reset_pool(ngx_pool_t *pool)
     /* 清理pool->large链表（pool->large为单独的大数据内存块）  */
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_pfree_large(l);
         }
     }
     /* 循环重新设置内存池data区域的 p->d.last；data区域数据并不擦除*/
@@ -215,7 +278,13 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
     /**
 	 * 相当于分配一块内存 ngx_alloc(size, log)
 	 */
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    if (pool->cached) {
+        m = ngx_pool_cache_alloc(psize, pool->log);
+
+    } else {
+        m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    }
+
     if (m == NULL) {
         return NULL;
     }
@@ -254,10 +323,19 @@ static void *
 ngx_palloc_large(ngx_pool_t *pool, size_t size)
 {
     void              *p;
+    size_t             cached;
     ngx_uint_t         n;
     ngx_pool_large_t  *large;
     /* 分配一块新的大内存块 */
-    p = ngx_alloc(size, pool->log);
+    if (ngx_pool_cacheable(size)) {
+        p = ngx_pool_cache_alloc(size, pool->log);
+        cached = size;
+
+    } else {
+        p = ngx_alloc(size, pool->log);
+        cached = 0;
+    }
+
     if (p == NULL) {
         return NULL;
     }
@@ -267,6 +345,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) {
             large->alloc = p;
+            large->size = cached;
             return p;
         }
 
@@ -282,6 +361,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     }
 
     large->alloc = p;
+    large->size = cached;
     large->next = pool->large;
     pool->large = large;
 
@@ -307,6 +387,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     }
 
     large->alloc = p;
+    large->size = 0;
     large->next = pool->large;
     pool->large = large;
 
@@ -325,7 +406,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_pfree_large(l);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -336,6 +417,77 @@ ngx_pfree(ngx_pool_t *pool, void *p)
 }
 
 
+static ngx_inline void
+ngx_pfree_large(ngx_pool_large_t *l)
+{
+    if (l->size) {
+        ngx_pool_cache_free(l->alloc, l->size);
+
+    } else {
+        ngx_free(l->alloc);
+    }
+}
+
+
+static void *
+ngx_pool_cache_alloc(size_t size, ngx_log_t *log)
+{
+    size_t                   csize;
+    ngx_uint_t               n;
+    ngx_pool_cache_block_t  *b;
+
+    for (n = 0; (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT) < size; n++) {
+        /* void */
+    }
+
+    csize = (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT);
+
+    b = ngx_pool_cache.free[n];
+
+    if (b) {
+        ngx_pool_cache.free[n] = b->next;
+
+        ngx_pool_cache_stats.size -= csize;
+        ngx_pool_cache_stats.hits++;
+
+        return b;
+    }
+
+    ngx_pool_cache_stats.misses++;
+
+    return ngx_memalign(NGX_POOL_ALIGNMENT, csize, log);
+}
+
+
+static void
+ngx_pool_cache_free(void *p, size_t size)
+{
+    size_t                   csize;
+    ngx_uint_t               n;
+    ngx_pool_cache_block_t  *b;
+
+    /* the pool log may be already freed, so nothing is logged here */
+
+    for (n = 0; (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT) < size; n++) {
+        /* void */
+    }
+
+    csize = (size_t) 1 << (n + NGX_POOL_CACHE_MIN_SHIFT);
+
+    if (ngx_pool_cache_stats.size + csize > ngx_pool_cache.max) {
+        ngx_pool_cache_stats.drops++;
+        ngx_free(p);
+        return;
+    }
+
+    b = p;
+    b->next = ngx_pool_cache.free[n];
+    ngx_pool_cache.free[n] = b;
+
+    ngx_pool_cache_stats.size += csize;
+}
+
+
 void *
 ngx_pcalloc(ngx_pool_t *pool, size_t size)
 {
@@ -43,6 +43,8 @@ typedef struct ngx_pool_large_s  ngx_pool_large_t;
 struct ngx_pool_large_s {
     ngx_pool_large_t     *next;/* 指向下一个存储地址 通过这个地址可以知道当前块长度 */
     void                 *alloc;/* 数据块指针地址 */
+    /* the requested size if allocated from the pool cache, 0 otherwise */
+    size_t                size;
 };
 
 
@@ -62,9 +64,19 @@ struct ngx_pool_s {
     ngx_pool_large_t     *large;/* 存储大数据的链表 */
     ngx_pool_cleanup_t   *cleanup;/* 可自定义回调函数，清除内存块分配的内存 */
     ngx_log_t            *log; /* 日志 */
+    /* the pool blocks are allocated from the pool cache */
+    ngx_uint_t            cached;  /* unsigned  cached:1; */
 };
 
 
+typedef struct {
+    ngx_uint_t            hits;
+    ngx_uint_t            misses;
+    ngx_uint_t            drops;
+    size_t                size;
+} ngx_pool_cache_stats_t;
+
+
 typedef struct {
     ngx_fd_t              fd;
     u_char               *name;
@@ -72,6 +84,8 @@ typedef struct {
 } ngx_pool_cleanup_file_t;
 
 
+void ngx_pool_cache_init(size_t max);
+
 ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log);
 void ngx_destroy_pool(ngx_pool_t *pool);
 void ngx_reset_pool(ngx_pool_t *pool);
@@ -89,4 +103,7 @@ void ngx_pool_cleanup_file(void *data);
 void ngx_pool_delete_file(void *data);
 
 
+extern ngx_pool_cache_stats_t  ngx_pool_cache_stats;
+
+
 #endif /* _NGX_PALLOC_H_INCLUDED_ */
@@ -12,6 +12,11 @@
 #define NGX_PROXY_PROTOCOL_AF_INET          1
 #define NGX_PROXY_PROTOCOL_AF_INET6         2
 
+#define NGX_PROXY_PROTOCOL_TLV_SSL          0x20
+#define NGX_PROXY_PROTOCOL_TLV_AWS          0xea
+
+#define NGX_PROXY_PROTOCOL_AWS_VPCE_ID      0x01
+
 
 #define ngx_proxy_protocol_parse_uint16(p)  ((p)[0] << 8 | (p)[1])
 
@@ -40,8 +45,52 @@ typedef struct {
 } ngx_proxy_protocol_inet6_addrs_t;
 
 
+typedef struct {
+    u_char                                  type;
+    u_char                                  len[2];
+} ngx_proxy_protocol_tlv_t;
+
+
+typedef struct {
+    u_char                                  client;
+    u_char                                  verify[4];
+} ngx_proxy_protocol_tlv_ssl_t;
+
+
+typedef struct {
+    ngx_str_t                               name;
+    ngx_uint_t                              type;
+} ngx_proxy_protocol_tlv_entry_t;
+
+
 static u_char *ngx_proxy_protocol_v2_read(ngx_connection_t *c, u_char *buf,
     u_char *last);
+static ngx_int_t ngx_proxy_protocol_lookup_tlv(ngx_connection_t *c,
+    ngx_str_t *tlvs, ngx_uint_t type, ngx_str_t *value);
+
+
+static const u_char  ngx_proxy_protocol_v2_signature[] =
+    "\r\n\r\n\0\r\nQUIT\n";
+
+
+static ngx_proxy_protocol_tlv_entry_t  ngx_proxy_protocol_tlv_entries[] = {
+    { ngx_string("alpn"),       0x01 },
+    { ngx_string("authority"),  0x02 },
+    { ngx_string("unique_id"),  0x05 },
+    { ngx_string("ssl"),        0x20 },
+    { ngx_string("netns"),      0x30 },
+    { ngx_null_string,          0x00 }
+};
+
+
+static ngx_proxy_protocol_tlv_entry_t  ngx_proxy_protocol_tlv_ssl_entries[] = {
+    { ngx_string("version"),    0x21 },
+    { ngx_string("cn"),         0x22 },
+    { ngx_string("cipher"),     0x23 },
+    { ngx_string("sig_alg"),    0x24 },
+    { ngx_string("key_alg"),    0x25 },
+    { ngx_null_string,          0x00 }
+};
 
 
 u_char *
@@ -51,17 +100,24 @@ ngx_proxy_protocol_read(ngx_connection_t *c, u_char *buf, u_char *last)
     u_char     ch, *p, *addr, *port;
     ngx_int_t  n;
 
-    static const u_char signature[] = "\r\n\r\n\0\r\nQUIT\n";
-
     p = buf;
     len = last - buf;
 
     if (len >= sizeof(ngx_proxy_protocol_header_t)
-        && memcmp(p, signature, sizeof(signature) - 1) == 0)
+        && ngx_memcmp(p, ngx_proxy_protocol_v2_signature,
+                      sizeof(ngx_proxy_protocol_v2_signature) - 1)
+           == 0)
     {
         return ngx_proxy_protocol_v2_read(c, buf, last);
     }
 
+    /* a text header is never longer than 107 bytes */
+
+    if (len > NGX_PROXY_PROTOCOL_V1_MAX_HEADER) {
+        last = buf + NGX_PROXY_PROTOCOL_V1_MAX_HEADER;
+        len = NGX_PROXY_PROTOCOL_V1_MAX_HEADER;
+    }
+
     if (len < 8 || ngx_strncmp(p, "PROXY ", 6) != 0) {
         goto invalid;
     }
@@ -173,7 +229,7 @@ ngx_proxy_protocol_write(ngx_connection_t *c, u_char *buf, u_char *last)
 {
     ngx_uint_t  port, lport;
 
-    if (last - buf < NGX_PROXY_PROTOCOL_MAX_HEADER) {
+    if (last - buf < NGX_PROXY_PROTOCOL_V1_MAX_HEADER) {
         return NULL;
     }
 
@@ -212,15 +268,102 @@ ngx_proxy_protocol_write(ngx_connection_t *c, u_char *buf, u_char *last)
 }
 
 
+u_char *
+ngx_proxy_protocol_v2_write(ngx_connection_t *c, u_char *buf, u_char *last)
+{
+    size_t                              len;
+    struct sockaddr_in                 *sin, *lsin;
+    ngx_proxy_protocol_header_t        *header;
+    ngx_proxy_protocol_inet_addrs_t    *in;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6                *sin6, *lsin6;
+    ngx_proxy_protocol_inet6_addrs_t   *in6;
+#endif
+
+    if (last - buf < NGX_PROXY_PROTOCOL_V2_MAX_HEADER) {
+        return NULL;
+    }
+
+    if (ngx_connection_local_sockaddr(c, NULL, 0) != NGX_OK) {
+        return NULL;
+    }
+
+    header = (ngx_proxy_protocol_header_t *) buf;
+
+    buf += sizeof(ngx_proxy_protocol_header_t);
+
+    ngx_memcpy(header->signature, ngx_proxy_protocol_v2_signature,
+               sizeof(header->signature));
+
+    /* version 2, PROXY command; STREAM or DGRAM transport */
+
+    header->version_command = 0x21;
+    header->family_transport = (c->type == SOCK_DGRAM) ? 2 : 1;
+
+    /* addresses of different families are sent as UNSPEC */
+
+    switch (c->sockaddr->sa_family == c->local_sockaddr->sa_family
+            ? c->sockaddr->sa_family : AF_UNSPEC)
+    {
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) c->sockaddr;
+        lsin = (struct sockaddr_in *) c->local_sockaddr;
+
+        in = (ngx_proxy_protocol_inet_addrs_t *) buf;
+
+        ngx_memcpy(in->src_addr, &sin->sin_addr, 4);
+        ngx_memcpy(in->dst_addr, &lsin->sin_addr, 4);
+        ngx_memcpy(in->src_port, &sin->sin_port, 2);
+        ngx_memcpy(in->dst_port, &lsin->sin_port, 2);
+
+        header->family_transport |= NGX_PROXY_PROTOCOL_AF_INET << 4;
+        len = sizeof(ngx_proxy_protocol_inet_addrs_t);
+
+        break;
+
+#if (NGX_HAVE_INET6)
+
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) c->sockaddr;
+        lsin6 = (struct sockaddr_in6 *) c->local_sockaddr;
+
+        in6 = (ngx_proxy_protocol_inet6_addrs_t *) buf;
+
+        ngx_memcpy(in6->src_addr, &sin6->sin6_addr, 16);
+        ngx_memcpy(in6->dst_addr, &lsin6->sin6_addr, 16);
+        ngx_memcpy(in6->src_port, &sin6->sin6_port, 2);
+        ngx_memcpy(in6->dst_port, &lsin6->sin6_port, 2);
+
+        header->family_transport |= NGX_PROXY_PROTOCOL_AF_INET6 << 4;
+        len = sizeof(ngx_proxy_protocol_inet6_addrs_t);
+
+        break;
+
+#endif
+
+    default:
+        header->family_transport = 0;
+        len = 0;
+    }
+
+    header->len[0] = (u_char) (len >> 8);
+    header->len[1] = (u_char) len;
+
+    return buf + len;
+}
+
+
 static u_char *
 ngx_proxy_protocol_v2_read(ngx_connection_t *c, u_char *buf, u_char *last)
 {
-    u_char                             *end;
-    size_t                              len;
+    u_char                             *end, *p;
+    size_t                              len, tlvs;
     socklen_t                           socklen;
     ngx_uint_t                          version, command, family, transport;
     ngx_sockaddr_t                      sockaddr;
     ngx_proxy_protocol_header_t        *header;
+    u_char                              text[NGX_SOCKADDR_STRLEN];
     ngx_proxy_protocol_inet_addrs_t    *in;
 #if (NGX_HAVE_INET6)
     ngx_proxy_protocol_inet6_addrs_t   *in6;
@@ -321,23 +464,229 @@ ngx_proxy_protocol_v2_read(ngx_connection_t *c, u_char *buf, u_char *last)
         return end;
     }
 
-    c->proxy_protocol_addr.data = ngx_pnalloc(c->pool, NGX_SOCKADDR_STRLEN);
-    if (c->proxy_protocol_addr.data == NULL) {
-        return NULL;
+    /* reject broken tlvs early, so lookups only walk valid ones */
+
+    for (p = buf; p != end; p += sizeof(ngx_proxy_protocol_tlv_t) + len) {
+
+        if ((size_t) (end - p) < sizeof(ngx_proxy_protocol_tlv_t)) {
+            goto broken;
+        }
+
+        len = ngx_proxy_protocol_parse_uint16(
+                  ((ngx_proxy_protocol_tlv_t *) p)->len);
+
+        if ((size_t) (end - p) - sizeof(ngx_proxy_protocol_tlv_t) < len) {
+            goto broken;
+        }
     }
 
-    c->proxy_protocol_addr.len = ngx_sock_ntop(&sockaddr.sockaddr, socklen,
-                                               c->proxy_protocol_addr.data,
-                                               NGX_SOCKADDR_STRLEN, 0);
+    len = ngx_sock_ntop(&sockaddr.sockaddr, socklen, text,
+                        NGX_SOCKADDR_STRLEN, 0);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
-                   "PROXY protocol v2 address: %V %d", &c->proxy_protocol_addr,
-                   c->proxy_protocol_port);
+    /*
+     * the header is usually read into a temporary buffer, so the address
+     * text and the tlvs are kept in a single allocation of the exact size;
+     * tlvs are only parsed when a variable asks for one of them
+     */
 
-    if (buf < end) {
-        ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
-                       "PROXY protocol v2 %z bytes of tlv ignored", end - buf);
+    tlvs = end - buf;
+
+    p = ngx_pnalloc(c->pool, len + tlvs);
+    if (p == NULL) {
+        return NULL;
     }
 
+    c->proxy_protocol_addr.len = len;
+    c->proxy_protocol_addr.data = p;
+
+    p = ngx_cpymem(p, text, len);
+
+    c->proxy_protocol_tlvs.len = tlvs;
+    c->proxy_protocol_tlvs.data = p;
+
+    ngx_memcpy(p, buf, tlvs);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "PROXY protocol v2 address: %V %d, tlvs: %uz",
+                   &c->proxy_protocol_addr, c->proxy_protocol_port, tlvs);
+
     return end;
+
+broken:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "broken PROXY protocol TLV");
+
+    return NULL;
+}
+
+
+ngx_int_t
+ngx_proxy_protocol_get_tlv(ngx_connection_t *c, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    u_char                          *p;
+    uint32_t                         verify;
+    ngx_int_t                        rc, type;
+    ngx_str_t                        ssl, tlvs;
+    ngx_proxy_protocol_tlv_ssl_t    *tlv_ssl;
+    ngx_proxy_protocol_tlv_entry_t  *te;
+
+    tlvs = c->proxy_protocol_tlvs;
+
+    if (name->len > 2
+        && name->data[0] == '0' && (name->data[1] | 0x20) == 'x')
+    {
+        type = ngx_hextoi(name->data + 2, name->len - 2);
+
+        if (type == NGX_ERROR || type > 0xff) {
+            goto unknown;
+        }
+
+        return ngx_proxy_protocol_lookup_tlv(c, &tlvs, type, value);
+    }
+
+    if (name->len == sizeof("aws_vpce_id") - 1
+        && ngx_strncmp(name->data, "aws_vpce_id", name->len) == 0)
+    {
+        rc = ngx_proxy_protocol_lookup_tlv(c, &tlvs, NGX_PROXY_PROTOCOL_TLV_AWS,
+                                           value);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        /* the first byte is the subtype */
+
+        if (value->len == 0
+            || value->data[0] != NGX_PROXY_PROTOCOL_AWS_VPCE_ID)
+        {
+            return NGX_DECLINED;
+        }
+
+        value->len--;
+        value->data++;
+
+        return NGX_OK;
+    }
+
+    if (name->len > 4 && ngx_strncmp(name->data, "ssl_", 4) == 0) {
+
+        rc = ngx_proxy_protocol_lookup_tlv(c, &tlvs,
+                                           NGX_PROXY_PROTOCOL_TLV_SSL, &ssl);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_OK && ssl.len < sizeof(ngx_proxy_protocol_tlv_ssl_t)) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "broken PROXY protocol ssl tlv");
+            return NGX_ERROR;
+        }
+
+        if (name->len == sizeof("ssl_verify") - 1
+            && ngx_strncmp(name->data, "ssl_verify", name->len) == 0)
+        {
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            tlv_ssl = (ngx_proxy_protocol_tlv_ssl_t *) ssl.data;
+
+            verify = (uint32_t) tlv_ssl->verify[0] << 24
+                     | tlv_ssl->verify[1] << 16
+                     | tlv_ssl->verify[2] << 8
+                     | tlv_ssl->verify[3];
+
+            p = ngx_pnalloc(c->pool, NGX_INT32_LEN);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            value->len = ngx_sprintf(p, "%uD", verify) - p;
+            value->data = p;
+
+            return NGX_OK;
+        }
+
+        for (te = ngx_proxy_protocol_tlv_ssl_entries; te->type; te++) {
+            if (te->name.len == name->len - 4
+                && ngx_strncmp(te->name.data, name->data + 4, te->name.len)
+                   == 0)
+            {
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+
+                /* subtypes follow the client and verify fields */
+
+                ssl.data += sizeof(ngx_proxy_protocol_tlv_ssl_t);
+                ssl.len -= sizeof(ngx_proxy_protocol_tlv_ssl_t);
+
+                return ngx_proxy_protocol_lookup_tlv(c, &ssl, te->type, value);
+            }
+        }
+
+        goto unknown;
+    }
+
+    for (te = ngx_proxy_protocol_tlv_entries; te->type; te++) {
+        if (te->name.len == name->len
+            && ngx_strncmp(te->name.data, name->data, name->len) == 0)
+        {
+            return ngx_proxy_protocol_lookup_tlv(c, &tlvs, te->type, value);
+        }
+    }
+
+unknown:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                  "unknown PROXY protocol TLV \"%V\"", name);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_proxy_protocol_lookup_tlv(ngx_connection_t *c, ngx_str_t *tlvs,
+    ngx_uint_t type, ngx_str_t *value)
+{
+    u_char                    *p;
+    size_t                     n, len;
+    ngx_proxy_protocol_tlv_t  *tlv;
+
+    p = tlvs->data;
+    n = tlvs->len;
+
+    while (n) {
+        if (n < sizeof(ngx_proxy_protocol_tlv_t)) {
+            goto broken;
+        }
+
+        tlv = (ngx_proxy_protocol_tlv_t *) p;
+        len = ngx_proxy_protocol_parse_uint16(tlv->len);
+
+        p += sizeof(ngx_proxy_protocol_tlv_t);
+        n -= sizeof(ngx_proxy_protocol_tlv_t);
+
+        if (n < len) {
+            goto broken;
+        }
+
+        if (tlv->type == type) {
+            value->len = len;
+            value->data = p;
+
+            return NGX_OK;
+        }
+
+        p += len;
+        n -= len;
+    }
+
+    return NGX_DECLINED;
+
+broken:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "broken PROXY protocol TLV");
+
+    return NGX_ERROR;
 }
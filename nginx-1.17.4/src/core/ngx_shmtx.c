@@ -13,12 +13,31 @@
 
 
 static void ngx_shmtx_wakeup(ngx_shmtx_t *mtx);
+static uint64_t ngx_shmtx_time(void);
+
+
+#if (NGX_HAVE_FUTEX)
+
+/*
+ * the futex is the 32-bit half of the lock word holding its low bits,
+ * that is, the owner pid; it changes on every unlock
+ */
+
+#if (NGX_HAVE_LITTLE_ENDIAN)
+#define ngx_shmtx_futex(mtx)  ((uint32_t *) (mtx)->lock)
+#else
+#define ngx_shmtx_futex(mtx)                                                 \
+    ((uint32_t *) (mtx)->lock + sizeof(ngx_atomic_t) / sizeof(uint32_t) - 1)
+#endif
+
+#endif
 
 
 ngx_int_t
 ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 {
     mtx->lock = &addr->lock;
+    mtx->sh = addr;
 
     if (mtx->spin == (ngx_uint_t) -1) {
         return NGX_OK;
@@ -26,7 +45,11 @@ ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 
     mtx->spin = 2048;
 
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_FUTEX)
+
+    mtx->wait = &addr->wait;
+
+#elif (NGX_HAVE_POSIX_SEM)
 
     mtx->wait = &addr->wait;
 
@@ -46,7 +69,7 @@ ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 void
 ngx_shmtx_destroy(ngx_shmtx_t *mtx)
 {
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_POSIX_SEM && !NGX_HAVE_FUTEX)
 
     if (mtx->semaphore) {
         if (sem_destroy(&mtx->sem) == -1) {
@@ -62,23 +85,114 @@ ngx_shmtx_destroy(ngx_shmtx_t *mtx)
 ngx_uint_t
 ngx_shmtx_trylock(ngx_shmtx_t *mtx)
 {
-    return (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid));
+    if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+        mtx->sh->acquired++;
+        return 1;
+    }
+
+    return 0;
 }
 
 
 void
 ngx_shmtx_lock(ngx_shmtx_t *mtx)
 {
-    ngx_uint_t         i, n;
+    uint64_t           start;
+    ngx_uint_t         n;
+#if (NGX_HAVE_FUTEX)
+    ngx_err_t          err;
+    ngx_uint_t         limit, slept;
+    ngx_atomic_uint_t  owner;
+#else
+    ngx_uint_t         i;
+#endif
 
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx lock");
 
+    if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+        mtx->sh->acquired++;
+        return;
+    }
+
+    start = ngx_shmtx_time();
+
+#if (NGX_HAVE_FUTEX)
+    slept = 0;
+#endif
+
     for ( ;; ) {
 
         if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
-            return;
+            break;
         }
 
+#if (NGX_HAVE_FUTEX)
+
+        /*
+         * spinning makes sense only while the owner is running; sleeping
+         * waiters mean the lock is held for long, so spinning is skipped,
+         * otherwise the spin limit adapts to the average number of spins
+         * that was needed to acquire the lock
+         */
+
+        if (ngx_ncpu > 1 && (mtx->wait == NULL || *mtx->wait == 0)) {
+
+            limit = ngx_min(mtx->spin, 2 * mtx->sh->spin + 16);
+
+            for (n = 1; n <= limit; n++) {
+
+                ngx_cpu_pause();
+
+                if (*mtx->lock == 0
+                    && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid))
+                {
+                    mtx->sh->spin += ((ngx_int_t) n
+                                      - (ngx_int_t) mtx->sh->spin) / 8;
+                    goto locked;
+                }
+            }
+        }
+
+        if (mtx->wait) {
+            (void) ngx_atomic_fetch_add(mtx->wait, 1);
+
+            owner = *mtx->lock;
+
+            if (owner == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+                (void) ngx_atomic_fetch_add(mtx->wait, -1);
+                break;
+            }
+
+            if (owner != 0) {
+                ngx_log_debug2(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                               "shmtx wait %P %uA", (ngx_pid_t) owner,
+                               *mtx->wait);
+
+                if (syscall(SYS_futex, ngx_shmtx_futex(mtx), FUTEX_WAIT,
+                            (uint32_t) owner, NULL, NULL, 0)
+                    == -1)
+                {
+                    err = ngx_errno;
+
+                    if (err != NGX_EAGAIN && err != NGX_EINTR) {
+                        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                                      "futex() failed while waiting on shmtx");
+                    }
+                }
+
+                ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                               "shmtx awoke");
+            }
+
+            (void) ngx_atomic_fetch_add(mtx->wait, -1);
+
+            slept = 1;
+
+            continue;
+        }
+
+#else
+
         if (ngx_ncpu > 1) {
 
             for (n = 1; n < mtx->spin; n <<= 1) {
@@ -90,7 +204,7 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
                 if (*mtx->lock == 0
                     && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid))
                 {
-                    return;
+                    goto locked;
                 }
             }
         }
@@ -102,7 +216,7 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
 
             if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
                 (void) ngx_atomic_fetch_add(mtx->wait, -1);
-                return;
+                break;
             }
 
             ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
@@ -126,10 +240,27 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
             continue;
         }
 
+#endif
+
 #endif
 
         ngx_sched_yield();
     }
+
+locked:
+
+#if (NGX_HAVE_FUTEX)
+
+    if (slept) {
+        /* the lock was held for long, the spin limit decays */
+        mtx->sh->spin -= mtx->sh->spin / 8;
+    }
+
+#endif
+
+    mtx->sh->acquired++;
+    mtx->sh->contended++;
+    mtx->sh->wait_time += ngx_shmtx_time() - start;
 }
 
 
@@ -164,7 +295,26 @@ ngx_shmtx_force_unlock(ngx_shmtx_t *mtx, ngx_pid_t pid)
 static void
 ngx_shmtx_wakeup(ngx_shmtx_t *mtx)
 {
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_FUTEX)
+
+    /* waiters increment and decrement the counter themselves */
+
+    if (mtx->wait == NULL || *mtx->wait == 0) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "shmtx wake %uA", *mtx->wait);
+
+    if (syscall(SYS_futex, ngx_shmtx_futex(mtx), FUTEX_WAKE, 1,
+                NULL, NULL, 0)
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "futex() failed while wake shmtx");
+    }
+
+#elif (NGX_HAVE_POSIX_SEM)
     ngx_atomic_uint_t  wait;
 
     if (!mtx->semaphore) {
@@ -196,6 +346,26 @@ ngx_shmtx_wakeup(ngx_shmtx_t *mtx)
 }
 
 
+static uint64_t
+ngx_shmtx_time(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+#else
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
 #else
 
 
@@ -13,21 +13,39 @@
 #include <ngx_core.h>
 
 
+#if (NGX_HAVE_ATOMIC_OPS && (NGX_HAVE_FUTEX || NGX_HAVE_POSIX_SEM))
+#define NGX_SHMTX_WAIT  1
+#endif
+
+
 typedef struct {
     ngx_atomic_t   lock;
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_SHMTX_WAIT)
     ngx_atomic_t   wait;
 #endif
+
+    /* the fields below are updated with the lock held */
+
+    /* the average number of spins needed to acquire the lock */
+    ngx_uint_t     spin;
+
+    ngx_uint_t     acquired;
+    ngx_uint_t     contended;
+    /* total time spent waiting for the lock, in microseconds */
+    uint64_t       wait_time;
 } ngx_shmtx_sh_t;
 
 
 typedef struct {
 #if (NGX_HAVE_ATOMIC_OPS)
-    ngx_atomic_t  *lock;
-#if (NGX_HAVE_POSIX_SEM)
-    ngx_atomic_t  *wait;
-    ngx_uint_t     semaphore;
-    sem_t          sem;
+    ngx_atomic_t    *lock;
+    ngx_shmtx_sh_t  *sh;
+#if (NGX_SHMTX_WAIT)
+    ngx_atomic_t    *wait;
+#endif
+#if (NGX_HAVE_POSIX_SEM && !NGX_HAVE_FUTEX)
+    ngx_uint_t       semaphore;
+    sem_t            sem;
 #endif
 #else
     ngx_fd_t       fd;
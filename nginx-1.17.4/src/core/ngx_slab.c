@@ -77,10 +77,59 @@ static void ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level,
     char *text);
 
 
+/*
+ * Pools with the "magazines" flag set keep up to NGX_SLAB_MAGAZINE_SIZE
+ * free chunks of each size in every worker process.  ngx_slab_alloc()
+ * and ngx_slab_free() use them without locking, and refill or drain
+ * them in batches of NGX_SLAB_MAGAZINE_BATCH chunks under the pool mutex.
+ *
+ * All magazines of a pool together hold at most 1/NGX_SLAB_MAGAZINE_SHARE
+ * of the pool.  A worker which finds the pool exhausted returns its own
+ * chunks and asks other workers to return theirs on their next magazine
+ * operation.
+ */
+
+#define NGX_SLAB_MAGAZINE_SIZE   32
+#define NGX_SLAB_MAGAZINE_BATCH  16
+#define NGX_SLAB_MAGAZINE_SLOTS  16
+#define NGX_SLAB_MAGAZINE_POOLS  16
+#define NGX_SLAB_MAGAZINE_SHARE  16
+
+
+typedef struct {
+    ngx_uint_t        n;
+    void             *chunks[NGX_SLAB_MAGAZINE_SIZE];
+} ngx_slab_magazine_t;
+
+
+typedef struct {
+    ngx_slab_pool_t      *pool;
+    ngx_uint_t            hits;
+    /* bytes held by the magazines of this worker, and their limit */
+    size_t                cached;
+    size_t                limit;
+    /* the last flush request of the pool seen */
+    ngx_uint_t            flush;
+    ngx_slab_magazine_t  *slots;
+} ngx_slab_magazines_t;
+
+
+static ngx_slab_magazines_t *ngx_slab_get_magazines(ngx_slab_pool_t *pool);
+static void *ngx_slab_magazine_alloc(ngx_slab_pool_t *pool, size_t size);
+static ngx_int_t ngx_slab_magazine_free(ngx_slab_pool_t *pool, void *p);
+static void ngx_slab_drain_magazines(ngx_slab_magazines_t *mags);
+static void ngx_slab_drain_magazine(ngx_slab_magazines_t *mags,
+    ngx_slab_magazine_t *mag, ngx_uint_t n);
+
+
 static ngx_uint_t  ngx_slab_max_size;
 static ngx_uint_t  ngx_slab_exact_size;
 static ngx_uint_t  ngx_slab_exact_shift;
 
+static ngx_uint_t            ngx_slab_magazines_enabled;
+static ngx_uint_t            ngx_slab_magazine_workers;
+static ngx_slab_magazines_t  ngx_slab_magazines[NGX_SLAB_MAGAZINE_POOLS];
+
 
 void
 ngx_slab_sizes_init(void)
@@ -159,6 +208,12 @@ ngx_slab_init(ngx_slab_pool_t *pool)
     pool->last = pool->pages + pages;
     pool->pfree = pages;
 
+    pool->mag_hits = 0;
+    pool->mag_refills = 0;
+    pool->mag_drains = 0;
+    pool->mag_flush = 0;
+    pool->magazines = 0;
+
     pool->log_nomem = 1;
     pool->log_ctx = &pool->zero;
     pool->zero = '\0';
@@ -170,6 +225,16 @@ ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 {
     void  *p;
 
+    if (pool->magazines && ngx_slab_magazines_enabled
+        && size <= ngx_slab_max_size)
+    {
+        p = ngx_slab_magazine_alloc(pool, size);
+
+        if (p) {
+            return p;
+        }
+    }
+
     ngx_shmtx_lock(&pool->mutex);
 
     p = ngx_slab_alloc_locked(pool, size);
@@ -449,6 +514,12 @@ ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size)
 void
 ngx_slab_free(ngx_slab_pool_t *pool, void *p)
 {
+    if (pool->magazines && ngx_slab_magazines_enabled
+        && ngx_slab_magazine_free(pool, p) == NGX_OK)
+    {
+        return;
+    }
+
     ngx_shmtx_lock(&pool->mutex);
 
     ngx_slab_free_locked(pool, p);
@@ -810,6 +881,346 @@ ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
 }
 
 
+void
+ngx_slab_enable_magazines(ngx_uint_t workers)
+{
+    ngx_slab_magazines_enabled = 1;
+    ngx_slab_magazine_workers = ngx_max(workers, 1);
+}
+
+
+void
+ngx_slab_flush_magazines(void)
+{
+    ngx_uint_t             i;
+    ngx_slab_magazines_t  *mags;
+
+    for (i = 0; i < NGX_SLAB_MAGAZINE_POOLS; i++) {
+        mags = &ngx_slab_magazines[i];
+
+        if (mags->pool == NULL) {
+            break;
+        }
+
+        ngx_shmtx_lock(&mags->pool->mutex);
+
+        ngx_slab_drain_magazines(mags);
+
+        ngx_shmtx_unlock(&mags->pool->mutex);
+    }
+
+    ngx_slab_magazines_enabled = 0;
+}
+
+
+static ngx_slab_magazines_t *
+ngx_slab_get_magazines(ngx_slab_pool_t *pool)
+{
+    ngx_uint_t             i;
+    ngx_slab_magazines_t  *mags;
+
+    for (i = 0; i < NGX_SLAB_MAGAZINE_POOLS; i++) {
+        mags = &ngx_slab_magazines[i];
+
+        if (mags->pool == pool) {
+            goto found;
+        }
+
+        if (mags->pool == NULL) {
+            mags->slots = ngx_calloc(NGX_SLAB_MAGAZINE_SLOTS
+                                     * sizeof(ngx_slab_magazine_t),
+                                     ngx_cycle->log);
+            if (mags->slots == NULL) {
+                return NULL;
+            }
+
+            mags->pool = pool;
+            mags->limit = (pool->end - pool->start)
+                          / (NGX_SLAB_MAGAZINE_SHARE
+                             * ngx_slab_magazine_workers);
+            mags->flush = pool->mag_flush;
+
+            goto found;
+        }
+    }
+
+    return NULL;
+
+found:
+
+    if (mags->flush != pool->mag_flush) {
+
+        /* another worker found the pool exhausted */
+
+        ngx_shmtx_lock(&pool->mutex);
+
+        ngx_slab_drain_magazines(mags);
+
+        ngx_shmtx_unlock(&pool->mutex);
+
+        return NULL;
+    }
+
+    return mags;
+}
+
+
+static void *
+ngx_slab_magazine_alloc(ngx_slab_pool_t *pool, size_t size)
+{
+    void                  *p;
+    size_t                 s;
+    ngx_uint_t             i, slot, shift, log_nomem;
+    ngx_slab_magazine_t   *mag;
+    ngx_slab_magazines_t  *mags;
+
+    if (size > pool->min_size) {
+        shift = 1;
+        for (s = size - 1; s >>= 1; shift++) { /* void */ }
+        slot = shift - pool->min_shift;
+
+    } else {
+        shift = pool->min_shift;
+        slot = 0;
+    }
+
+    if (slot >= NGX_SLAB_MAGAZINE_SLOTS) {
+        return NULL;
+    }
+
+    mags = ngx_slab_get_magazines(pool);
+    if (mags == NULL) {
+        return NULL;
+    }
+
+    mag = &mags->slots[slot];
+    s = (size_t) 1 << shift;
+
+    if (mag->n == 0) {
+
+        if (mags->cached + s > mags->limit) {
+            return NULL;
+        }
+
+        ngx_shmtx_lock(&pool->mutex);
+
+        /* a partial refill is not an allocation failure */
+
+        log_nomem = pool->log_nomem;
+        pool->log_nomem = 0;
+
+        p = NULL;
+
+        for (i = 0; i < NGX_SLAB_MAGAZINE_BATCH; i++) {
+
+            if (mags->cached + s > mags->limit) {
+                break;
+            }
+
+            p = ngx_slab_alloc_locked(pool, s);
+            if (p == NULL) {
+                break;
+            }
+
+            mag->chunks[mag->n++] = p;
+            mags->cached += s;
+        }
+
+        pool->log_nomem = log_nomem;
+
+        if (mag->n == 0) {
+
+            /*
+             * the pool is exhausted: return the chunks kept by this worker,
+             * ask other workers to do the same, and let the caller retry
+             * without magazines
+             */
+
+            pool->mag_flush++;
+
+            ngx_slab_drain_magazines(mags);
+
+            ngx_shmtx_unlock(&pool->mutex);
+
+            return NULL;
+        }
+
+        pool->mag_refills++;
+        pool->mag_hits += mags->hits;
+        mags->hits = 0;
+
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+
+    mags->hits++;
+
+    p = mag->chunks[--mag->n];
+    mags->cached -= s;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
+                   "slab alloc: %uz from magazine %p", size, p);
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_slab_magazine_free(ngx_slab_pool_t *pool, void *p)
+{
+    size_t                 size;
+    uintptr_t              m, *bitmap;
+    ngx_uint_t             i, n, slot, shift;
+    ngx_slab_page_t       *page;
+    ngx_slab_magazine_t   *mag;
+    ngx_slab_magazines_t  *mags;
+
+    if ((u_char *) p < pool->start || (u_char *) p >= pool->end) {
+        return NGX_DECLINED;
+    }
+
+    /*
+     * the type and the shift of a page do not change while a chunk is used;
+     * errors are left to ngx_slab_free_locked() to report
+     */
+
+    n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
+    page = &pool->pages[n];
+
+    switch (ngx_slab_page_type(page)) {
+
+    case NGX_SLAB_SMALL:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+        break;
+
+    case NGX_SLAB_EXACT:
+        shift = ngx_slab_exact_shift;
+        break;
+
+    case NGX_SLAB_BIG:
+        shift = page->slab & NGX_SLAB_SHIFT_MASK;
+        break;
+
+    default: /* NGX_SLAB_PAGE */
+        return NGX_DECLINED;
+    }
+
+    size = (size_t) 1 << shift;
+
+    if ((uintptr_t) p & (size - 1)) {
+        return NGX_DECLINED;
+    }
+
+    /* the chunk must still be allocated, as in ngx_slab_free_locked() */
+
+    n = ((uintptr_t) p & (ngx_pagesize - 1)) >> shift;
+
+    switch (ngx_slab_page_type(page)) {
+
+    case NGX_SLAB_SMALL:
+        m = (uintptr_t) 1 << (n % (8 * sizeof(uintptr_t)));
+        bitmap = (uintptr_t *)
+                             ((uintptr_t) p & ~((uintptr_t) ngx_pagesize - 1));
+        m &= bitmap[n / (8 * sizeof(uintptr_t))];
+        break;
+
+    case NGX_SLAB_EXACT:
+        m = ((uintptr_t) 1 << n) & page->slab;
+        break;
+
+    default: /* NGX_SLAB_BIG */
+        m = ((uintptr_t) 1 << (n + NGX_SLAB_MAP_SHIFT)) & page->slab;
+        break;
+    }
+
+    if (m == 0) {
+        return NGX_DECLINED;
+    }
+
+    slot = shift - pool->min_shift;
+
+    if (slot >= NGX_SLAB_MAGAZINE_SLOTS) {
+        return NGX_DECLINED;
+    }
+
+    mags = ngx_slab_get_magazines(pool);
+    if (mags == NULL) {
+        return NGX_DECLINED;
+    }
+
+    mag = &mags->slots[slot];
+
+    /* chunks kept by other workers cannot be checked */
+
+    for (i = 0; i < mag->n; i++) {
+        if (mag->chunks[i] == p) {
+            ngx_slab_error(pool, NGX_LOG_ALERT,
+                           "ngx_slab_free(): chunk is already free");
+            return NGX_OK;
+        }
+    }
+
+    if (mag->n == NGX_SLAB_MAGAZINE_SIZE) {
+        ngx_shmtx_lock(&pool->mutex);
+
+        ngx_slab_drain_magazine(mags, mag, NGX_SLAB_MAGAZINE_BATCH);
+
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+
+    if (mags->cached + size > mags->limit) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
+                   "slab free: %p to magazine", p);
+
+    mags->hits++;
+
+    mag->chunks[mag->n++] = p;
+    mags->cached += size;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_slab_drain_magazines(ngx_slab_magazines_t *mags)
+{
+    ngx_uint_t  slot;
+
+    for (slot = 0; slot < NGX_SLAB_MAGAZINE_SLOTS; slot++) {
+        ngx_slab_drain_magazine(mags, &mags->slots[slot],
+                                mags->slots[slot].n);
+    }
+
+    mags->flush = mags->pool->mag_flush;
+}
+
+
+static void
+ngx_slab_drain_magazine(ngx_slab_magazines_t *mags, ngx_slab_magazine_t *mag,
+    ngx_uint_t n)
+{
+    ngx_slab_pool_t  *pool;
+
+    pool = mags->pool;
+
+    if (n == 0) {
+        return;
+    }
+
+    mags->cached -= n << ((mag - mags->slots) + pool->min_shift);
+
+    while (n--) {
+        ngx_slab_free_locked(pool, mag->chunks[--mag->n]);
+    }
+
+    pool->mag_drains++;
+    pool->mag_hits += mags->hits;
+    mags->hits = 0;
+}
+
+
 static void
 ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level, char *text)
 {
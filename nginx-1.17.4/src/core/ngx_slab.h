@@ -44,6 +44,13 @@ typedef struct {
     ngx_slab_stat_t  *stats;
     ngx_uint_t        pfree;
 
+    /* allocations and frees served by worker magazines, refills, drains */
+    ngx_uint_t        mag_hits;
+    ngx_uint_t        mag_refills;
+    ngx_uint_t        mag_drains;
+    /* incremented to make workers return the chunks they keep */
+    ngx_uint_t        mag_flush;
+
     u_char           *start;
     u_char           *end;
 
@@ -53,6 +60,7 @@ typedef struct {
     u_char            zero;
 
     unsigned          log_nomem:1;
+    unsigned          magazines:1;
 
     void             *data;
     void             *addr;
@@ -67,6 +75,8 @@ void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size);
 void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_enable_magazines(ngx_uint_t workers);
+void ngx_slab_flush_magazines(void);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
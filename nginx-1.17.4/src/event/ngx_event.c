@@ -23,6 +23,7 @@ extern ngx_module_t ngx_select_module;
 static char *ngx_event_init_conf(ngx_cycle_t *cycle, void *conf);
 static ngx_int_t ngx_event_module_init(ngx_cycle_t *cycle);
 static ngx_int_t ngx_event_process_init(ngx_cycle_t *cycle);
+static ngx_int_t ngx_event_alloc_slots(ngx_cycle_t *cycle, ngx_uint_t huge);
 static char *ngx_events_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static char *ngx_event_connections(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -34,6 +35,19 @@ static char *ngx_event_debug_connection(ngx_conf_t *cf, ngx_command_t *cmd,
 static void *ngx_event_core_create_conf(ngx_cycle_t *cycle);
 static char *ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf);
 
+static char *ngx_event_udp_batch_check(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_event_udp_segmentation_check(ngx_conf_t *cf, void *post,
+    void *data);
+
+
+/* a connection and its events co-located for the compact layout */
+
+typedef struct {
+    ngx_connection_t      connection;
+    ngx_event_t           read;
+    ngx_event_t           write;
+} ngx_event_slot_t;
+
 
 static ngx_uint_t     ngx_timer_resolution;
 sig_atomic_t          ngx_event_timer_alarm;
@@ -117,6 +131,13 @@ ngx_module_t  ngx_events_module = {
 static ngx_str_t  event_core_name = ngx_string("event_core");
 
 
+static ngx_conf_post_t  ngx_event_udp_batch_post =
+    { ngx_event_udp_batch_check };
+
+static ngx_conf_post_t  ngx_event_udp_segmentation_post =
+    { ngx_event_udp_segmentation_check };
+
+
 static ngx_command_t  ngx_event_core_commands[] = {
 
     { ngx_string("worker_connections"),
@@ -154,6 +175,34 @@ static ngx_command_t  ngx_event_core_commands[] = {
       offsetof(ngx_event_conf_t, accept_mutex_delay),
       NULL },
 
+    { ngx_string("timer_wheel"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, timer_wheel),
+      NULL },
+
+    { ngx_string("compact_connections"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, compact_connections),
+      NULL },
+
+    { ngx_string("udp_batch"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_event_conf_t, udp_batch),
+      &ngx_event_udp_batch_post },
+
+    { ngx_string("udp_segmentation"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, udp_segmentation),
+      &ngx_event_udp_segmentation_post },
+
     { ngx_string("debug_connection"),
       NGX_EVENT_CONF|NGX_CONF_TAKE1,
       ngx_event_debug_connection,
@@ -542,6 +591,7 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     shm.size = size;
     ngx_str_set(&shm.name, "nginx_shared_zone");
     shm.log = cycle->log;
+    shm.huge = NGX_HUGE_PAGES_OFF;
 
     if (ngx_shm_alloc(&shm) != NGX_OK) {
         return NGX_ERROR;
@@ -641,7 +691,7 @@ ngx_event_process_init(ngx_cycle_t *cycle)
     ngx_queue_init(&ngx_posted_accept_events);
     ngx_queue_init(&ngx_posted_events);
 
-    if (ngx_event_timer_init(cycle->log) == NGX_ERROR) {
+    if (ngx_event_timer_init(cycle->log, ecf->timer_wheel) == NGX_ERROR) {
         return NGX_ERROR;
     }
 
@@ -720,16 +770,26 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 
 #endif
 
+    if (ecf->compact_connections) {
+        if (ngx_event_alloc_slots(cycle, ccf->worker_huge_pages) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        goto connections;
+    }
+
     cycle->connections =
-        ngx_alloc(sizeof(ngx_connection_t) * cycle->connection_n, cycle->log);
+        ngx_huge_alloc(sizeof(ngx_connection_t) * cycle->connection_n,
+                       ccf->worker_huge_pages, cycle->log);
     if (cycle->connections == NULL) {
         return NGX_ERROR;
     }
 
-    c = cycle->connections;
+    cycle->connection_size = sizeof(ngx_connection_t);
 
-    cycle->read_events = ngx_alloc(sizeof(ngx_event_t) * cycle->connection_n,
-                                   cycle->log);
+    cycle->read_events = ngx_huge_alloc(sizeof(ngx_event_t)
+                                        * cycle->connection_n,
+                                        ccf->worker_huge_pages, cycle->log);
     if (cycle->read_events == NULL) {
         return NGX_ERROR;
     }
@@ -740,8 +800,9 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         rev[i].instance = 1;
     }
 
-    cycle->write_events = ngx_alloc(sizeof(ngx_event_t) * cycle->connection_n,
-                                    cycle->log);
+    cycle->write_events = ngx_huge_alloc(sizeof(ngx_event_t)
+                                         * cycle->connection_n,
+                                         ccf->worker_huge_pages, cycle->log);
     if (cycle->write_events == NULL) {
         return NGX_ERROR;
     }
@@ -751,23 +812,40 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         wev[i].closed = 1;
     }
 
+    c = cycle->connections;
+
+    for (i = 0; i < cycle->connection_n; i++) {
+        c[i].read = &cycle->read_events[i];
+        c[i].write = &cycle->write_events[i];
+    }
+
+connections:
+
     i = cycle->connection_n;
     next = NULL;
 
     do {
         i--;
 
-        c[i].data = next;
-        c[i].read = &cycle->read_events[i];
-        c[i].write = &cycle->write_events[i];
-        c[i].fd = (ngx_socket_t) -1;
+        c = ngx_cycle_connection(cycle, i);
+
+        c->data = next;
+        c->fd = (ngx_socket_t) -1;
 
-        next = &c[i];
+        next = c;
     } while (i);
 
     cycle->free_connections = next;
     cycle->free_connection_n = cycle->connection_n;
 
+#if !(NGX_WIN32)
+
+    if (ngx_event_udp_init(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+#endif
+
     /* for each listening socket */
 
     ls = cycle->listening.elts;
@@ -904,6 +982,60 @@ ngx_event_process_init(ngx_cycle_t *cycle)
     return NGX_OK;
 }
 
+/*
+ * the compact layout places each connection and its read and write
+ * events in one cache line aligned slot, so handling an event touches
+ * adjacent memory instead of three separate arrays
+ */
+
+static ngx_int_t
+ngx_event_alloc_slots(ngx_cycle_t *cycle, ngx_uint_t huge)
+{
+    u_char            *p;
+    size_t             size;
+    ngx_uint_t         i;
+    ngx_event_slot_t  *slot;
+
+    size = ngx_align(sizeof(ngx_event_slot_t), ngx_cacheline_size);
+
+    if (huge != NGX_HUGE_PAGES_OFF
+        && size * cycle->connection_n >= NGX_HUGE_PAGE_SIZE)
+    {
+        p = ngx_huge_alloc(size * cycle->connection_n, huge, cycle->log);
+
+    } else {
+        p = ngx_memalign(ngx_cacheline_size, size * cycle->connection_n,
+                         cycle->log);
+    }
+
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < cycle->connection_n; i++) {
+        slot = (ngx_event_slot_t *) (p + i * size);
+
+        slot->connection.read = &slot->read;
+        slot->connection.write = &slot->write;
+
+        slot->read.closed = 1;
+        slot->read.instance = 1;
+        slot->write.closed = 1;
+    }
+
+    cycle->connections = (ngx_connection_t *) p;
+    cycle->connection_size = size;
+
+    cycle->read_events = NULL;
+    cycle->write_events = NULL;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "compact connections: %ui slots of %uz bytes",
+                   cycle->connection_n, size);
+
+    return NGX_OK;
+}
+
 
 ngx_int_t
 ngx_send_lowat(ngx_connection_t *c, size_t lowat)
@@ -1226,6 +1358,10 @@ ngx_event_core_create_conf(ngx_cycle_t *cycle)
     ecf->multi_accept = NGX_CONF_UNSET;
     ecf->accept_mutex = NGX_CONF_UNSET;
     ecf->accept_mutex_delay = NGX_CONF_UNSET_MSEC;
+    ecf->timer_wheel = NGX_CONF_UNSET;
+    ecf->compact_connections = NGX_CONF_UNSET;
+    ecf->udp_batch = NGX_CONF_UNSET;
+    ecf->udp_segmentation = NGX_CONF_UNSET;
     ecf->name = (void *) NGX_CONF_UNSET;
 
 #if (NGX_DEBUG)
@@ -1325,6 +1461,58 @@ ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ecf->multi_accept, 0);
     ngx_conf_init_value(ecf->accept_mutex, 0);
     ngx_conf_init_msec_value(ecf->accept_mutex_delay, 500);
+    ngx_conf_init_value(ecf->timer_wheel, 0);
+    ngx_conf_init_value(ecf->compact_connections, 0);
+    ngx_conf_init_value(ecf->udp_batch, 1);
+    ngx_conf_init_value(ecf->udp_segmentation, 0);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_event_udp_batch_check(ngx_conf_t *cf, void *post, void *data)
+{
+    ngx_int_t *np = data;
+
+    if (*np < 1 || *np > NGX_UDP_MAX_BATCH) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"udp_batch\" must be between 1 and %d",
+                           NGX_UDP_MAX_BATCH);
+        return NGX_CONF_ERROR;
+    }
+
+#if !(NGX_HAVE_MMSG)
+
+    if (*np > 1) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"udp_batch\" is not supported "
+                           "on this platform, ignored");
+
+        *np = 1;
+    }
+
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_event_udp_segmentation_check(ngx_conf_t *cf, void *post, void *data)
+{
+#if !(NGX_HAVE_UDP_SEGMENT)
+    ngx_flag_t *fp = data;
+
+    if (*fp) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"udp_segmentation\" is not supported "
+                           "on this platform, ignored");
+
+        *fp = 0;
+    }
+
+#endif
 
     return NGX_CONF_OK;
 }
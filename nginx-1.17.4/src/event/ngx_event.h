@@ -120,6 +120,9 @@ struct ngx_event_s {
 
     ngx_rbtree_node_t   timer;
 
+    /* the time the timer is moved to when it expires, see ngx_add_deadline */
+    ngx_msec_t       deadline;
+
     /* the posted queue */
     ngx_queue_t      queue;
 
@@ -198,6 +201,9 @@ extern ngx_event_actions_t   ngx_event_actions;
 #if (NGX_HAVE_EPOLLRDHUP)
 extern ngx_uint_t            ngx_use_epoll_rdhup;
 #endif
+#if (NGX_HAVE_UDP_SEGMENT)
+extern ngx_uint_t            ngx_udp_segmentation;
+#endif
 
 
 /*
@@ -420,6 +426,7 @@ extern ngx_uint_t            ngx_use_epoll_rdhup;
 
 #define ngx_add_timer        ngx_event_add_timer
 #define ngx_del_timer        ngx_event_del_timer
+#define ngx_add_deadline     ngx_event_add_deadline
 
 
 extern ngx_os_io_t  ngx_io;
@@ -446,6 +453,12 @@ typedef struct {
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_flag_t    timer_wheel;
+    ngx_flag_t    compact_connections;
+
+    ngx_int_t     udp_batch;
+    ngx_flag_t    udp_segmentation;
+
     u_char       *name;
 
 #if (NGX_DEBUG)
@@ -492,6 +505,31 @@ extern ngx_atomic_t  *ngx_stat_waiting;
 #define NGX_POST_EVENTS         2
 
 
+#define NGX_UDP_MAX_BATCH       64
+#define NGX_UDP_DATAGRAM_SIZE   65535
+
+
+typedef struct {
+    uint32_t                  hash;
+    ngx_udp_connection_t     *udp;
+} ngx_udp_entry_t;
+
+
+struct ngx_udp_table_s {
+    ngx_udp_entry_t          *entries;
+    ngx_uint_t                mask;
+    ngx_uint_t                used;       /* sessions and deleted entries */
+
+    ngx_uint_t                sessions;
+    ngx_uint_t                peak;
+    ngx_uint_t                dropped;    /* datagrams left in batches */
+    ngx_uint_t                lookups;
+    ngx_uint_t                probes;
+    ngx_uint_t                timed;
+    uint64_t                  time;       /* ns of the timed lookups */
+};
+
+
 extern sig_atomic_t           ngx_event_timer_alarm;
 extern ngx_uint_t             ngx_event_flags;
 extern ngx_module_t           ngx_events_module;
@@ -505,9 +543,8 @@ extern ngx_module_t           ngx_event_core_module;
 
 void ngx_event_accept(ngx_event_t *ev);
 #if !(NGX_WIN32)
+ngx_int_t ngx_event_udp_init(ngx_cycle_t *cycle);
 void ngx_event_recvmsg(ngx_event_t *ev);
-void ngx_udp_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 #endif
 void ngx_delete_udp_connection(void *data);
 ngx_int_t ngx_trylock_accept_mutex(ngx_cycle_t *cycle);
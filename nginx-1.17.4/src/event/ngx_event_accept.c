@@ -149,6 +149,12 @@ ngx_event_accept(ngx_event_t *ev)
 
         c->type = SOCK_STREAM;
 
+#if (NGX_HAVE_NUMA)
+        if (ngx_numa_node != -1) {
+            ngx_numa_account(s, ev->log);
+        }
+#endif
+
 #if (NGX_STAT_STUB)
         (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
 #endif
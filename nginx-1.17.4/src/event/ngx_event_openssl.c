@@ -8,6 +8,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
+#include <ngx_md5.h>
 
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
@@ -67,6 +68,17 @@ static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
     ngx_slab_pool_t *shpool, ngx_uint_t n);
 static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static u_char *ngx_ssl_client_session_key(ngx_connection_t *c,
+    ngx_str_t *name, ngx_str_t *id, size_t *len);
+static ngx_ssl_client_sess_t *ngx_ssl_client_session_lookup(
+    ngx_ssl_session_cache_t *cache, uint32_t hash, u_char *key, size_t len);
+static void ngx_ssl_client_session_free(ngx_ssl_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, ngx_ssl_client_sess_t *cs);
+static void ngx_ssl_expire_client_sessions(ngx_ssl_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, ngx_uint_t n);
+static void ngx_ssl_client_session_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
 
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 static int ngx_ssl_session_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
@@ -3696,6 +3708,505 @@ ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
 }
 
 
+/*
+ * upstream sessions are shared between workers and between the http
+ * and stream proxies; they are keyed by the binary peer address,
+ * the server name sent, and a digest of the SSL settings the session
+ * was made with (see ngx_ssl_client_session_id()), so a session is
+ * never offered to a server, with a certificate, or under a verification
+ * policy it was not made for
+ */
+
+ngx_shm_zone_t *
+ngx_ssl_client_session_cache_add(ngx_conf_t *cf, ngx_str_t *value)
+{
+    u_char          *p, *last;
+    ssize_t          n;
+    ngx_str_t        name, size;
+    ngx_shm_zone_t  *shm_zone;
+
+    if (value->len <= sizeof("shared:") - 1
+        || ngx_strncmp(value->data, "shared:", sizeof("shared:") - 1) != 0)
+    {
+        goto invalid;
+    }
+
+    name.data = value->data + sizeof("shared:") - 1;
+    last = value->data + value->len;
+
+    p = ngx_strlchr(name.data, last, ':');
+
+    if (p == NULL || p == name.data) {
+        goto invalid;
+    }
+
+    name.len = p - name.data;
+
+    size.data = p + 1;
+    size.len = last - size.data;
+
+    n = ngx_parse_size(&size);
+
+    if (n == NGX_ERROR) {
+        goto invalid;
+    }
+
+    if (n < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "session cache \"%V\" is too small", value);
+        return NULL;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, n, &ngx_openssl_module);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    shm_zone->init = ngx_ssl_client_session_cache_init;
+
+    return shm_zone;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid session cache \"%V\"", value);
+
+    return NULL;
+}
+
+
+/*
+ * a session resumed skips certificate verification, so sessions made
+ * with different protocols, ciphers, client certificate, or trust settings
+ * must not be shared even if they are stored in the same zone
+ */
+
+ngx_int_t
+ngx_ssl_client_session_id(ngx_conf_t *cf, ngx_str_t *id, ngx_uint_t protocols,
+    ngx_str_t *ciphers, ngx_str_t *certificate, ngx_uint_t verify,
+    ngx_uint_t depth, ngx_str_t *trusted, ngx_str_t *crl)
+{
+    u_char     *p;
+    ngx_str_t   empty;
+    ngx_md5_t   md5;
+    u_char      buf[7 * (NGX_INT_T_LEN + 1)];
+    u_char      digest[16];
+
+    if (!verify) {
+        ngx_str_null(&empty);
+
+        depth = 0;
+        trusted = &empty;
+        crl = &empty;
+    }
+
+    p = ngx_sprintf(buf, "%ui:%ui:%ui:%uz:%uz:%uz:%uz:",
+                    protocols, verify ? 1 : 0, depth, ciphers->len,
+                    certificate->len, trusted->len, crl->len);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, buf, p - buf);
+    ngx_md5_update(&md5, ciphers->data, ciphers->len);
+    ngx_md5_update(&md5, certificate->data, certificate->len);
+    ngx_md5_update(&md5, trusted->data, trusted->len);
+    ngx_md5_update(&md5, crl->data, crl->len);
+    ngx_md5_final(digest, &md5);
+
+    id->data = ngx_pnalloc(cf->pool, 2 * sizeof(digest));
+    if (id->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    id->len = ngx_hex_dump(id->data, digest, sizeof(digest)) - id->data;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_client_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                    len;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_session_cache_t  *cache;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    cache = ngx_slab_alloc(shpool, sizeof(ngx_ssl_session_cache_t));
+    if (cache == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = cache;
+    shm_zone->data = cache;
+
+    ngx_rbtree_init(&cache->session_rbtree, &cache->sentinel,
+                    ngx_ssl_client_session_rbtree_insert_value);
+
+    ngx_queue_init(&cache->expire_queue);
+
+    len = sizeof(" in SSL upstream session cache \"\"")
+          + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in SSL upstream session cache \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_set_cached_client_session(ngx_connection_t *c,
+    ngx_shm_zone_t *shm_zone, ngx_str_t *name, ngx_str_t *id)
+{
+    size_t                    len, slen;
+    u_char                   *key;
+    uint32_t                  hash;
+    ngx_int_t                 rc;
+    const u_char             *p;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_session_t        *sess;
+    ngx_ssl_client_sess_t    *cs;
+    ngx_ssl_session_cache_t  *cache;
+    u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
+
+    key = ngx_ssl_client_session_key(c, name, id, &len);
+    if (key == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_long(key, len);
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    slen = 0;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    cs = ngx_ssl_client_session_lookup(cache, hash, key, len);
+
+    if (cs) {
+        if (cs->expire > ngx_time()) {
+            slen = cs->len;
+            ngx_memcpy(buf, cs->data + cs->key_len, slen);
+
+        } else {
+            ngx_ssl_client_session_free(cache, shpool, cs);
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl get client session: %08XD:%uz", hash, slen);
+
+    if (slen == 0) {
+        return NGX_OK;
+    }
+
+    p = buf;
+    sess = d2i_SSL_SESSION(NULL, &p, slen);
+
+    if (sess == NULL) {
+        return NGX_OK;
+    }
+
+    rc = ngx_ssl_set_session(c, sess);
+
+    ngx_ssl_free_session(sess);
+
+    return rc;
+}
+
+
+void
+ngx_ssl_save_cached_client_session(ngx_connection_t *c,
+    ngx_shm_zone_t *shm_zone, ngx_str_t *name, ngx_str_t *id)
+{
+    int                       slen;
+    size_t                    len;
+    u_char                   *key, *p;
+    time_t                    expire;
+    uint32_t                  hash;
+    ngx_slab_pool_t          *shpool;
+    ngx_ssl_session_t        *sess;
+    ngx_ssl_client_sess_t    *cs;
+    ngx_ssl_session_cache_t  *cache;
+    u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
+
+    sess = ngx_ssl_get0_session(c);
+
+    if (sess == NULL) {
+        return;
+    }
+
+    slen = i2d_SSL_SESSION(sess, NULL);
+
+    /* do not cache too big session */
+
+    if (slen <= 0 || slen > (int) NGX_SSL_MAX_SESSION_SIZE) {
+        return;
+    }
+
+    p = buf;
+    i2d_SSL_SESSION(sess, &p);
+
+    expire = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+
+    if (expire <= ngx_time()) {
+        return;
+    }
+
+    key = ngx_ssl_client_session_key(c, name, id, &len);
+    if (key == NULL) {
+        return;
+    }
+
+    hash = ngx_crc32_long(key, len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl save client session: %08XD:%d", hash, slen);
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    /* only the latest session is kept for a key */
+
+    cs = ngx_ssl_client_session_lookup(cache, hash, key, len);
+
+    if (cs) {
+        ngx_ssl_client_session_free(cache, shpool, cs);
+    }
+
+    /* drop one or two expired sessions */
+    ngx_ssl_expire_client_sessions(cache, shpool, 1);
+
+    cs = ngx_slab_alloc_locked(shpool, offsetof(ngx_ssl_client_sess_t, data)
+                                       + len + slen);
+
+    if (cs == NULL) {
+
+        /* drop the oldest non-expired session and try once more */
+
+        ngx_ssl_expire_client_sessions(cache, shpool, 0);
+
+        cs = ngx_slab_alloc_locked(shpool,
+                                   offsetof(ngx_ssl_client_sess_t, data)
+                                   + len + slen);
+
+        if (cs == NULL) {
+            ngx_shmtx_unlock(&shpool->mutex);
+
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "could not allocate new session%s",
+                          shpool->log_ctx);
+            return;
+        }
+    }
+
+    cs->node.key = hash;
+    cs->expire = expire;
+    cs->key_len = len;
+    cs->len = slen;
+
+    p = ngx_cpymem(cs->data, key, len);
+    ngx_memcpy(p, buf, slen);
+
+    ngx_queue_insert_head(&cache->expire_queue, &cs->queue);
+
+    ngx_rbtree_insert(&cache->session_rbtree, &cs->node);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+static u_char *
+ngx_ssl_client_session_key(ngx_connection_t *c, ngx_str_t *name,
+    ngx_str_t *id, size_t *len)
+{
+    u_char  *key, *p;
+    size_t   n;
+
+    n = c->socklen + 1;
+
+    if (name) {
+        n += name->len;
+    }
+
+    if (id) {
+        n += 1 + id->len;
+    }
+
+    key = ngx_pnalloc(c->pool, n);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    p = ngx_cpymem(key, c->sockaddr, c->socklen);
+
+    *p++ = '/';
+
+    if (name) {
+        p = ngx_cpymem(p, name->data, name->len);
+    }
+
+    if (id) {
+        *p++ = '/';
+        p = ngx_cpymem(p, id->data, id->len);
+    }
+
+    *len = p - key;
+
+    return key;
+}
+
+
+static ngx_ssl_client_sess_t *
+ngx_ssl_client_session_lookup(ngx_ssl_session_cache_t *cache, uint32_t hash,
+    u_char *key, size_t len)
+{
+    ngx_int_t               rc;
+    ngx_rbtree_node_t      *node, *sentinel;
+    ngx_ssl_client_sess_t  *cs;
+
+    node = cache->session_rbtree.root;
+    sentinel = cache->session_rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        cs = (ngx_ssl_client_sess_t *) node;
+
+        rc = ngx_memn2cmp(key, cs->data, len, cs->key_len);
+
+        if (rc == 0) {
+            return cs;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_ssl_client_session_free(ngx_ssl_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, ngx_ssl_client_sess_t *cs)
+{
+    ngx_queue_remove(&cs->queue);
+
+    ngx_rbtree_delete(&cache->session_rbtree, &cs->node);
+
+    ngx_slab_free_locked(shpool, cs);
+}
+
+
+static void
+ngx_ssl_expire_client_sessions(ngx_ssl_session_cache_t *cache,
+    ngx_slab_pool_t *shpool, ngx_uint_t n)
+{
+    time_t                  now;
+    ngx_queue_t            *q;
+    ngx_ssl_client_sess_t  *cs;
+
+    now = ngx_time();
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&cache->expire_queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->expire_queue);
+
+        cs = ngx_queue_data(q, ngx_ssl_client_sess_t, queue);
+
+        if (n++ != 0 && cs->expire > now) {
+            return;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                       "expire client session: %08Xi", cs->node.key);
+
+        ngx_ssl_client_session_free(cache, shpool, cs);
+    }
+}
+
+
+static void
+ngx_ssl_client_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t      **p;
+    ngx_ssl_client_sess_t   *cs, *cs_temp;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cs = (ngx_ssl_client_sess_t *) node;
+            cs_temp = (ngx_ssl_client_sess_t *) temp;
+
+            p = (ngx_memn2cmp(cs->data, cs_temp->data, cs->key_len,
+                              cs_temp->key_len)
+                 < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 
 ngx_int_t
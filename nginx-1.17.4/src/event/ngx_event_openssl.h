@@ -133,6 +133,16 @@ typedef struct {
 } ngx_ssl_session_cache_t;
 
 
+typedef struct {
+    ngx_rbtree_node_t           node;
+    ngx_queue_t                 queue;
+    time_t                      expire;
+    size_t                      key_len;
+    size_t                      len;
+    u_char                      data[1];
+} ngx_ssl_client_sess_t;
+
+
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 
 typedef struct {
@@ -197,6 +207,17 @@ ngx_int_t ngx_ssl_session_cache(ngx_ssl_t *ssl, ngx_str_t *sess_ctx,
 ngx_int_t ngx_ssl_session_ticket_keys(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_array_t *paths);
 ngx_int_t ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data);
+ngx_shm_zone_t *ngx_ssl_client_session_cache_add(ngx_conf_t *cf,
+    ngx_str_t *value);
+ngx_int_t ngx_ssl_client_session_id(ngx_conf_t *cf, ngx_str_t *id,
+    ngx_uint_t protocols, ngx_str_t *ciphers, ngx_str_t *certificate,
+    ngx_uint_t verify, ngx_uint_t depth, ngx_str_t *trusted, ngx_str_t *crl);
+ngx_int_t ngx_ssl_client_session_cache_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+ngx_int_t ngx_ssl_set_cached_client_session(ngx_connection_t *c,
+    ngx_shm_zone_t *shm_zone, ngx_str_t *name, ngx_str_t *id);
+void ngx_ssl_save_cached_client_session(ngx_connection_t *c,
+    ngx_shm_zone_t *shm_zone, ngx_str_t *name, ngx_str_t *id);
 ngx_int_t ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c,
     ngx_uint_t flags);
 
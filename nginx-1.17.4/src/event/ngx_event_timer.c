@@ -10,9 +10,64 @@
 #include <ngx_event.h>
 
 
+/*
+ * the timing wheel has 256 slots of 1ms at the lowest level and four
+ * levels of 64 slots above it, each slot of a level spanning the whole
+ * previous level; a timer is linked into the slot of its expiry time
+ * and is moved down a level when the wheel reaches the start of the slot
+ */
+
+#define NGX_TIMER_WHEEL_LEVELS  5
+
+#define NGX_TIMER_WHEEL_BITS0   8
+#define NGX_TIMER_WHEEL_SIZE0   (1 << NGX_TIMER_WHEEL_BITS0)
+#define NGX_TIMER_WHEEL_MASK0   (NGX_TIMER_WHEEL_SIZE0 - 1)
+
+#define NGX_TIMER_WHEEL_BITS    6
+#define NGX_TIMER_WHEEL_SIZE    (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_MASK    (NGX_TIMER_WHEEL_SIZE - 1)
+
+#define NGX_TIMER_WHEEL_SLOTS                                                 \
+    (NGX_TIMER_WHEEL_SIZE0 + (NGX_TIMER_WHEEL_LEVELS - 1) * NGX_TIMER_WHEEL_SIZE)
+
+#define ngx_event_timer_wheel_shift(level)                                    \
+    (NGX_TIMER_WHEEL_BITS0 + ((level) - 1) * NGX_TIMER_WHEEL_BITS)
+
+#define ngx_event_timer_wheel_base(level)                                     \
+    (NGX_TIMER_WHEEL_SIZE0 + ((level) - 1) * NGX_TIMER_WHEEL_SIZE)
+
+
+typedef struct {
+    /* the next tick to be run */
+    ngx_msec_t          clock;
+    /* no timer expires or moves down a level before this tick */
+    ngx_msec_t          next;
+
+    /* timers in the wheel, the due list is not counted */
+    ngx_uint_t          timers;
+    /* timers per level, the last one counts the due list */
+    ngx_uint_t          count[NGX_TIMER_WHEEL_LEVELS + 1];
+
+    /* timers added with an expiry time before the clock */
+    ngx_rbtree_node_t   due;
+    ngx_rbtree_node_t   slots[NGX_TIMER_WHEEL_SLOTS];
+} ngx_event_timer_wheel_t;
+
+
+static ngx_msec_t ngx_event_find_timer_wheel(void);
+static void ngx_event_expire_timers_wheel(void);
+static ngx_int_t ngx_event_no_timers_left_wheel(void);
+static void ngx_event_timer_wheel_cascade(ngx_uint_t level, ngx_uint_t index);
+static void ngx_event_timer_wheel_next(void);
+static void ngx_event_timer_wheel_expire(ngx_rbtree_node_t *head);
+
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
+ngx_flag_t                       ngx_event_timer_wheel;
+static ngx_event_timer_wheel_t  *ngx_timer_wheel;
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -20,11 +75,45 @@ static ngx_rbtree_node_t  ngx_event_timer_sentinel;
  */
 
 ngx_int_t
-ngx_event_timer_init(ngx_log_t *log)
+ngx_event_timer_init(ngx_log_t *log, ngx_flag_t wheel)
 {
+    ngx_uint_t                i;
+    ngx_event_timer_wheel_t  *w;
+
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    ngx_event_timer_wheel = wheel;
+
+    if (!wheel) {
+        return NGX_OK;
+    }
+
+    if (ngx_timer_wheel == NULL) {
+        ngx_timer_wheel = ngx_alloc(sizeof(ngx_event_timer_wheel_t), log);
+        if (ngx_timer_wheel == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    w = ngx_timer_wheel;
+
+    w->clock = ngx_current_msec;
+    w->next = ngx_current_msec;
+    w->timers = 0;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_LEVELS + 1; i++) {
+        w->count[i] = 0;
+    }
+
+    w->due.left = &w->due;
+    w->due.right = &w->due;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_SLOTS; i++) {
+        w->slots[i].left = &w->slots[i];
+        w->slots[i].right = &w->slots[i];
+    }
+
     return NGX_OK;
 }
 
@@ -35,6 +124,10 @@ ngx_event_find_timer(void)
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_find_timer_wheel();
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
         return NGX_TIMER_INFINITE;
     }
@@ -56,6 +149,11 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_expire_timers_wheel();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -75,6 +173,18 @@ ngx_event_expire_timers(void)
 
         ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
 
+        if ((ngx_msec_int_t) (ev->deadline - ev->timer.key) > 0) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer move: %d: %M",
+                           ngx_event_ident(ev->data), ev->deadline);
+
+            ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+
+            ev->timer.key = ev->deadline;
+            ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+            continue;
+        }
+
         ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                        "event timer del: %d: %M",
                        ngx_event_ident(ev->data), ev->timer.key);
@@ -102,6 +212,10 @@ ngx_event_no_timers_left(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_no_timers_left_wheel();
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
     root = ngx_event_timer_rbtree.root;
 
@@ -124,3 +238,330 @@ ngx_event_no_timers_left(void)
 
     return NGX_OK;
 }
+
+
+void
+ngx_event_timer_wheel_insert(ngx_rbtree_node_t *node)
+{
+    ngx_uint_t                level, shift, index;
+    ngx_msec_t                expires, tick;
+    ngx_msec_int_t            diff;
+    ngx_rbtree_node_t        *head;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_timer_wheel;
+
+    expires = node->key;
+    diff = (ngx_msec_int_t) (expires - w->clock);
+
+    if (diff < 0) {
+        level = NGX_TIMER_WHEEL_LEVELS;
+        head = &w->due;
+        goto link;
+    }
+
+    if (diff < NGX_TIMER_WHEEL_SIZE0) {
+        level = 0;
+        tick = expires;
+        head = &w->slots[expires & NGX_TIMER_WHEEL_MASK0];
+        goto next;
+    }
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS - 1; level++) {
+        if ((ngx_msec_t) diff
+            >> ngx_event_timer_wheel_shift(level) < NGX_TIMER_WHEEL_SIZE)
+        {
+            break;
+        }
+    }
+
+    shift = ngx_event_timer_wheel_shift(level);
+
+    if ((ngx_msec_t) diff >> shift >= NGX_TIMER_WHEEL_SIZE) {
+
+        /* beyond the wheel range, the timer is cascaded to the top again */
+
+        expires = w->clock + ((ngx_msec_t) NGX_TIMER_WHEEL_SIZE << shift) - 1;
+    }
+
+    index = (expires >> shift) & NGX_TIMER_WHEEL_MASK;
+    tick = (expires >> shift) << shift;
+    head = &w->slots[ngx_event_timer_wheel_base(level) + index];
+
+next:
+
+    if (w->timers == 0 || (ngx_msec_int_t) (tick - w->next) < 0) {
+        w->next = tick;
+    }
+
+    w->timers++;
+
+link:
+
+    node->left = head->left;
+    node->right = head;
+    node->parent = head;
+    node->color = (u_char) level;
+
+    head->left->right = node;
+    head->left = node;
+
+    w->count[level]++;
+}
+
+
+void
+ngx_event_timer_wheel_delete(ngx_rbtree_node_t *node)
+{
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_timer_wheel;
+
+    node->left->right = node->right;
+    node->right->left = node->left;
+
+    w->count[node->color]--;
+
+    if (node->color != NGX_TIMER_WHEEL_LEVELS) {
+        w->timers--;
+    }
+}
+
+
+static ngx_msec_t
+ngx_event_find_timer_wheel(void)
+{
+    ngx_msec_int_t            timer;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_timer_wheel;
+
+    if (w->count[NGX_TIMER_WHEEL_LEVELS]) {
+        return 0;
+    }
+
+    if (w->timers == 0) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    timer = (ngx_msec_int_t) (w->next - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_event_expire_timers_wheel(void)
+{
+    ngx_uint_t                level, shift, index;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_timer_wheel;
+
+    for ( ;; ) {
+
+        ngx_event_timer_wheel_expire(&w->due);
+
+        if (w->timers == 0) {
+            w->clock = ngx_current_msec + 1;
+            return;
+        }
+
+        if ((ngx_msec_int_t) (w->next - w->clock) > 0) {
+
+            /* nothing happens until the next tick, skip to it */
+
+            if ((ngx_msec_int_t) (w->next - ngx_current_msec) > 0) {
+                w->clock = ngx_current_msec + 1;
+                return;
+            }
+
+            w->clock = w->next;
+        }
+
+        if ((ngx_msec_int_t) (ngx_current_msec - w->clock) < 0) {
+            return;
+        }
+
+        if ((w->clock & NGX_TIMER_WHEEL_MASK0) == 0) {
+
+            for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+                shift = ngx_event_timer_wheel_shift(level);
+                index = (w->clock >> shift) & NGX_TIMER_WHEEL_MASK;
+
+                ngx_event_timer_wheel_cascade(level, index);
+
+                if (index != 0) {
+                    break;
+                }
+            }
+        }
+
+        ngx_event_timer_wheel_expire(
+                                &w->slots[w->clock & NGX_TIMER_WHEEL_MASK0]);
+
+        w->clock++;
+
+        if ((ngx_msec_int_t) (w->next - w->clock) < 0) {
+            ngx_event_timer_wheel_next();
+        }
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_cascade(ngx_uint_t level, ngx_uint_t index)
+{
+    ngx_rbtree_node_t        *head, *node;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_timer_wheel;
+
+    head = &w->slots[ngx_event_timer_wheel_base(level) + index];
+
+    while (head->right != head) {
+        node = head->right;
+
+        ngx_event_timer_wheel_delete(node);
+        ngx_event_timer_wheel_insert(node);
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_next(void)
+{
+    ngx_uint_t                i, level, shift, found;
+    ngx_msec_t                pos, tick, next;
+    ngx_rbtree_node_t        *head;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_timer_wheel;
+
+    /* with no timers left the next one added sets the tick */
+
+    found = 0;
+    next = w->clock;
+
+    if (w->count[0]) {
+        for (i = 0; i < NGX_TIMER_WHEEL_SIZE0; i++) {
+            head = &w->slots[(w->clock + i) & NGX_TIMER_WHEEL_MASK0];
+
+            if (head->right != head) {
+                next = w->clock + i;
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        if (w->count[level] == 0) {
+            continue;
+        }
+
+        /*
+         * the slot of the clock is cascaded already unless the clock
+         * is exactly at its start
+         */
+
+        shift = ngx_event_timer_wheel_shift(level);
+        pos = w->clock >> shift;
+
+        if (w->clock & (((ngx_msec_t) 1 << shift) - 1)) {
+            pos++;
+        }
+
+        for (i = 0; i < NGX_TIMER_WHEEL_SIZE; i++) {
+            head = &w->slots[ngx_event_timer_wheel_base(level)
+                             + ((pos + i) & NGX_TIMER_WHEEL_MASK)];
+
+            if (head->right != head) {
+                tick = (pos + i) << shift;
+
+                if (!found || (ngx_msec_int_t) (tick - next) < 0) {
+                    next = tick;
+                    found = 1;
+                }
+
+                break;
+            }
+        }
+    }
+
+    w->next = next;
+}
+
+
+static void
+ngx_event_timer_wheel_expire(ngx_rbtree_node_t *head)
+{
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node;
+
+    while (head->right != head) {
+        node = head->right;
+
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        if ((ngx_msec_int_t) (ev->deadline - ev->timer.key) > 0) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer move: %d: %M",
+                           ngx_event_ident(ev->data), ev->deadline);
+
+            ngx_event_timer_wheel_delete(node);
+
+            ev->timer.key = ev->deadline;
+            ngx_event_timer_wheel_insert(node);
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "event timer del: %d: %M",
+                       ngx_event_ident(ev->data), ev->timer.key);
+
+        ngx_event_timer_wheel_delete(node);
+
+#if (NGX_DEBUG)
+        ev->timer.left = NULL;
+        ev->timer.right = NULL;
+        ev->timer.parent = NULL;
+#endif
+
+        ev->timer_set = 0;
+
+        ev->timedout = 1;
+
+        ev->handler(ev);
+    }
+}
+
+
+static ngx_int_t
+ngx_event_no_timers_left_wheel(void)
+{
+    ngx_uint_t                i;
+    ngx_event_t              *ev;
+    ngx_rbtree_node_t        *head, *node;
+    ngx_event_timer_wheel_t  *w;
+
+    w = ngx_timer_wheel;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_SLOTS + 1; i++) {
+        head = (i == NGX_TIMER_WHEEL_SLOTS) ? &w->due : &w->slots[i];
+
+        for (node = head->right; node != head; node = node->right) {
+            ev = (ngx_event_t *) ((char *) node
+                                  - offsetof(ngx_event_t, timer));
+
+            if (!ev->cancelable) {
+                return NGX_AGAIN;
+            }
+        }
+    }
+
+    /* only cancelable timers left */
+
+    return NGX_OK;
+}
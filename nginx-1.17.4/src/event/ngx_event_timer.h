@@ -19,13 +19,17 @@
 #define NGX_TIMER_LAZY_DELAY  300
 
 
-ngx_int_t ngx_event_timer_init(ngx_log_t *log);
+ngx_int_t ngx_event_timer_init(ngx_log_t *log, ngx_flag_t wheel);
 ngx_msec_t ngx_event_find_timer(void);
 void ngx_event_expire_timers(void);
 ngx_int_t ngx_event_no_timers_left(void);
 
+void ngx_event_timer_wheel_insert(ngx_rbtree_node_t *node);
+void ngx_event_timer_wheel_delete(ngx_rbtree_node_t *node);
+
 
 extern ngx_rbtree_t  ngx_event_timer_rbtree;
+extern ngx_flag_t    ngx_event_timer_wheel;
 
 
 static ngx_inline void
@@ -35,7 +39,12 @@ ngx_event_del_timer(ngx_event_t *ev)
                    "event timer del: %d: %M",
                     ngx_event_ident(ev->data), ev->timer.key);
 
-    ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_delete(&ev->timer);
+
+    } else {
+        ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
 #if (NGX_DEBUG)
     ev->timer.left = NULL;
@@ -60,7 +69,7 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
         /*
          * Use a previous timer value if difference between it and a new
          * value is less than NGX_TIMER_LAZY_DELAY milliseconds: this allows
-         * to minimize the rbtree operations for fast connections.
+         * to minimize the timer operations for fast connections.
          */
 
         diff = (ngx_msec_int_t) (key - ev->timer.key);
@@ -69,6 +78,8 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
             ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                            "event timer: %d, old: %M, new: %M",
                             ngx_event_ident(ev->data), ev->timer.key, key);
+
+            ev->deadline = ev->timer.key;
             return;
         }
 
@@ -76,15 +87,48 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
     }
 
     ev->timer.key = key;
+    ev->deadline = key;
 
     ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "event timer add: %d: %M:%M",
                     ngx_event_ident(ev->data), timer, ev->timer.key);
 
-    ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_insert(&ev->timer);
+
+    } else {
+        ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
     ev->timer_set = 1;
 }
 
 
+static ngx_inline void
+ngx_event_add_deadline(ngx_event_t *ev, ngx_msec_t timer)
+{
+    ngx_msec_t  key;
+
+    key = ngx_current_msec + timer;
+
+    if (ev->timer_set && (ngx_msec_int_t) (key - ev->timer.key) >= 0) {
+
+        /*
+         * A later deadline is only recorded: the timer is moved to it
+         * when it expires.  This avoids the timer operations for
+         * the timeouts re-armed on every I/O operation.
+         */
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "event timer deadline: %d, old: %M, new: %M",
+                        ngx_event_ident(ev->data), ev->timer.key, key);
+
+        ev->deadline = key;
+        return;
+    }
+
+    ngx_event_add_timer(ev, timer);
+}
+
+
 #endif /* _NGX_EVENT_TIMER_H_INCLUDED_ */
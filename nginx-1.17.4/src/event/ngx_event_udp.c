@@ -12,53 +12,181 @@
 
 #if !(NGX_WIN32)
 
+#define NGX_UDP_TABLE_SIZE    64
+#define NGX_UDP_DELETED       ((ngx_udp_connection_t *) -1)
+
+/* lookups are timed once in NGX_UDP_TIME_SAMPLE */
+#define NGX_UDP_TIME_SAMPLE   64
+
+
 struct ngx_udp_connection_s {
-    ngx_rbtree_node_t   node;
+    ngx_uint_t          index;
     ngx_connection_t   *connection;
     ngx_buf_t          *buffer;
+    ngx_uint_t          nbuffers;
 };
 
 
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
+#define NGX_UDP_PKTINFO_SIZE  CMSG_SPACE(sizeof(struct in6_pktinfo))
+#elif (NGX_HAVE_IP_PKTINFO)
+#define NGX_UDP_PKTINFO_SIZE  CMSG_SPACE(sizeof(struct in_pktinfo))
+#else
+#define NGX_UDP_PKTINFO_SIZE  CMSG_SPACE(sizeof(struct in_addr))
+#endif
+
+typedef union {
+    struct cmsghdr      cmsg;
+    u_char              data[NGX_UDP_PKTINFO_SIZE + CMSG_SPACE(sizeof(int))];
+} ngx_udp_control_t;
+
+#endif
+
+
+typedef struct {
+    ngx_sockaddr_t      sockaddr;
+    ngx_sockaddr_t      local_sockaddr;
+    struct iovec        iov;
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+    ngx_udp_control_t   control;
+#endif
+    size_t              len;
+    u_char              buffer[NGX_UDP_DATAGRAM_SIZE];
+} ngx_udp_slot_t;
+
+
+static ngx_int_t ngx_event_udp_recv(ngx_event_t *ev, ngx_connection_t *lc);
+static void ngx_event_udp_init_msghdr(ngx_listening_t *ls,
+    ngx_udp_slot_t *slot, struct msghdr *msg);
+static void ngx_event_udp_dispatch(ngx_connection_t *c, ngx_uint_t nbufs);
+static ngx_int_t ngx_event_udp_accept(ngx_event_t *ev, ngx_connection_t *lc,
+    uint32_t hash, struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen,
+    u_char *data, size_t size);
 static void ngx_close_accepted_udp_connection(ngx_connection_t *c);
 static ssize_t ngx_udp_shared_recv(ngx_connection_t *c, u_char *buf,
     size_t size);
-static ngx_int_t ngx_insert_udp_connection(ngx_connection_t *c);
-static ngx_connection_t *ngx_lookup_udp_connection(ngx_listening_t *ls,
+static uint32_t ngx_udp_flow_hash(ngx_listening_t *ls,
     struct sockaddr *sockaddr, socklen_t socklen,
     struct sockaddr *local_sockaddr, socklen_t local_socklen);
+static uint32_t ngx_udp_sockaddr_hash(struct sockaddr *sa, socklen_t socklen,
+    uint32_t hash);
+static ngx_int_t ngx_insert_udp_connection(ngx_connection_t *c,
+    uint32_t hash);
+static ngx_int_t ngx_udp_table_rebuild(ngx_udp_table_t *t, ngx_log_t *log);
+static ngx_connection_t *ngx_lookup_udp_connection(ngx_listening_t *ls,
+    uint32_t hash, struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen);
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+static uint64_t ngx_udp_time(void);
+#endif
 
 
-void
-ngx_event_recvmsg(ngx_event_t *ev)
+#if (NGX_HAVE_UDP_SEGMENT)
+ngx_uint_t               ngx_udp_segmentation;
+#endif
+
+static ngx_uint_t        ngx_udp_batch = 1;
+static ngx_udp_slot_t    ngx_udp_slot;
+static ngx_udp_slot_t   *ngx_udp_slots = &ngx_udp_slot;
+
+#if (NGX_HAVE_MMSG)
+static struct mmsghdr    ngx_udp_msgs[NGX_UDP_MAX_BATCH];
+#define ngx_udp_msghdr(i)  (&ngx_udp_msgs[i].msg_hdr)
+#else
+static struct msghdr     ngx_udp_msg;
+#define ngx_udp_msghdr(i)  (&ngx_udp_msg)
+#endif
+
+/* datagrams of one session received in a batch */
+static ngx_buf_t         ngx_udp_bufs[NGX_UDP_MAX_BATCH];
+
+
+ngx_int_t
+ngx_event_udp_init(ngx_cycle_t *cycle)
 {
-    ssize_t            n;
-    ngx_buf_t          buf;
-    ngx_log_t         *log;
-    ngx_err_t          err;
-    socklen_t          socklen, local_socklen;
-    ngx_event_t       *rev, *wev;
-    struct iovec       iov[1];
-    struct msghdr      msg;
-    ngx_sockaddr_t     sa, lsa;
-    struct sockaddr   *sockaddr, *local_sockaddr;
+    ngx_uint_t         i, udp;
     ngx_listening_t   *ls;
     ngx_event_conf_t  *ecf;
-    ngx_connection_t  *c, *lc;
-    static u_char      buffer[65535];
+#if (NGX_HAVE_UDP_SEGMENT)
+    int                gro;
+#endif
 
-#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+    ecf = ngx_event_get_conf(cycle->conf_ctx, ngx_event_core_module);
 
-#if (NGX_HAVE_IP_RECVDSTADDR)
-    u_char             msg_control[CMSG_SPACE(sizeof(struct in_addr))];
-#elif (NGX_HAVE_IP_PKTINFO)
-    u_char             msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#if (NGX_HAVE_UDP_SEGMENT)
+    ngx_udp_segmentation = ecf->udp_segmentation;
 #endif
 
-#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-    u_char             msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    udp = 0;
+
+    ls = cycle->listening.elts;
+    for (i = 0; i < cycle->listening.nelts; i++) {
+
+        if (ls[i].type != SOCK_DGRAM) {
+            continue;
+        }
+
+#if (NGX_HAVE_REUSEPORT)
+        if (ls[i].reuseport && ls[i].worker != ngx_worker) {
+            continue;
+        }
 #endif
 
+        udp = 1;
+
+#if (NGX_HAVE_UDP_SEGMENT)
+
+        if (ngx_udp_segmentation && ls[i].sockaddr->sa_family != AF_UNIX) {
+            gro = 1;
+
+            if (setsockopt(ls[i].fd, IPPROTO_UDP, UDP_GRO,
+                           (const void *) &gro, sizeof(int))
+                == -1)
+            {
+                ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                              "setsockopt(UDP_GRO) for %V failed, ignored",
+                              &ls[i].addr_text);
+            }
+        }
+
 #endif
+    }
+
+    if (!udp || ecf->udp_batch == 1) {
+        return NGX_OK;
+    }
+
+    ngx_udp_slots = ngx_alloc(ecf->udp_batch * sizeof(ngx_udp_slot_t),
+                              cycle->log);
+    if (ngx_udp_slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_udp_batch = ecf->udp_batch;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_event_recvmsg(ngx_event_t *ev)
+{
+    u_char            *p, *last;
+    size_t             size, segment;
+    uint32_t           hash;
+    ngx_buf_t         *b;
+    ngx_int_t          nmsgs;
+    ngx_uint_t         i, nbufs;
+    socklen_t          socklen, local_socklen;
+    struct msghdr     *msg;
+    ngx_udp_slot_t    *slot;
+    struct sockaddr   *sockaddr, *local_sockaddr;
+    ngx_listening_t   *ls;
+    ngx_event_conf_t  *ecf;
+    ngx_connection_t  *c, *lc, *run;
 
     if (ev->timedout) {
         if (ngx_enable_accept_events((ngx_cycle_t *) ngx_cycle) != NGX_OK) {
@@ -82,344 +210,520 @@ ngx_event_recvmsg(ngx_event_t *ev)
                    "recvmsg on %V, ready: %d", &ls->addr_text, ev->available);
 
     do {
-        ngx_memzero(&msg, sizeof(struct msghdr));
+        nmsgs = ngx_event_udp_recv(ev, lc);
 
-        iov[0].iov_base = (void *) buffer;
-        iov[0].iov_len = sizeof(buffer);
+        if (nmsgs == NGX_AGAIN || nmsgs == NGX_ERROR) {
+            return;
+        }
 
-        msg.msg_name = &sa;
-        msg.msg_namelen = sizeof(ngx_sockaddr_t);
-        msg.msg_iov = iov;
-        msg.msg_iovlen = 1;
+        /*
+         * consecutive datagrams of an existing session are passed
+         * to its read handler at once, so it may process them together
+         */
 
-#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+        run = NULL;
+        nbufs = 0;
 
-        if (ls->wildcard) {
+        for (i = 0; i < (ngx_uint_t) nmsgs; i++) {
 
-#if (NGX_HAVE_IP_RECVDSTADDR || NGX_HAVE_IP_PKTINFO)
-            if (ls->sockaddr->sa_family == AF_INET) {
-                msg.msg_control = &msg_control;
-                msg.msg_controllen = sizeof(msg_control);
-            }
-#endif
+            slot = &ngx_udp_slots[i];
+            msg = ngx_udp_msghdr(i);
 
-#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-            if (ls->sockaddr->sa_family == AF_INET6) {
-                msg.msg_control = &msg_control6;
-                msg.msg_controllen = sizeof(msg_control6);
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+            if (msg->msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                              "recvmsg() truncated data");
+                continue;
             }
 #endif
-        }
 
-#endif
+            sockaddr = msg->msg_name;
+            socklen = msg->msg_namelen;
 
-        n = recvmsg(lc->fd, &msg, 0);
+            if (socklen > (socklen_t) sizeof(ngx_sockaddr_t)) {
+                socklen = sizeof(ngx_sockaddr_t);
+            }
 
-        if (n == -1) {
-            err = ngx_socket_errno;
+            if (socklen == 0) {
 
-            if (err == NGX_EAGAIN) {
-                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
-                               "recvmsg() not ready");
-                return;
+                /*
+                 * on Linux recvmsg() returns zero msg_namelen
+                 * when receiving packets from unbound AF_UNIX sockets
+                 */
+
+                socklen = sizeof(struct sockaddr);
+                ngx_memzero(&slot->sockaddr, sizeof(struct sockaddr));
+                slot->sockaddr.sockaddr.sa_family = ls->sockaddr->sa_family;
             }
 
-            ngx_log_error(NGX_LOG_ALERT, ev->log, err, "recvmsg() failed");
+            local_sockaddr = ls->sockaddr;
+            local_socklen = ls->socklen;
 
-            return;
-        }
+            segment = slot->len;
 
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
-        if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
-            ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
-                          "recvmsg() truncated data");
-            continue;
-        }
-#endif
-
-        sockaddr = msg.msg_name;
-        socklen = msg.msg_namelen;
-
-        if (socklen > (socklen_t) sizeof(ngx_sockaddr_t)) {
-            socklen = sizeof(ngx_sockaddr_t);
-        }
 
-        if (socklen == 0) {
+            if (msg->msg_controllen) {
+                struct cmsghdr  *cmsg;
 
-            /*
-             * on Linux recvmsg() returns zero msg_namelen
-             * when receiving packets from unbound AF_UNIX sockets
-             */
+                if (ls->wildcard) {
+                    ngx_memcpy(&slot->local_sockaddr, local_sockaddr,
+                               local_socklen);
+                    local_sockaddr = &slot->local_sockaddr.sockaddr;
+                }
 
-            socklen = sizeof(struct sockaddr);
-            ngx_memzero(&sa, sizeof(struct sockaddr));
-            sa.sockaddr.sa_family = ls->sockaddr->sa_family;
-        }
+                for (cmsg = CMSG_FIRSTHDR(msg);
+                     cmsg != NULL;
+                     cmsg = CMSG_NXTHDR(msg, cmsg))
+                {
 
-        local_sockaddr = ls->sockaddr;
-        local_socklen = ls->socklen;
+#if (NGX_HAVE_UDP_SEGMENT)
 
-#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+                    if (cmsg->cmsg_level == IPPROTO_UDP
+                        && cmsg->cmsg_type == UDP_GRO)
+                    {
+                        /* datagrams coalesced by GRO, split them back */
 
-        if (ls->wildcard) {
-            struct cmsghdr  *cmsg;
+                        segment = *(int *) CMSG_DATA(cmsg);
+                        continue;
+                    }
 
-            ngx_memcpy(&lsa, local_sockaddr, local_socklen);
-            local_sockaddr = &lsa.sockaddr;
+#endif
 
-            for (cmsg = CMSG_FIRSTHDR(&msg);
-                 cmsg != NULL;
-                 cmsg = CMSG_NXTHDR(&msg, cmsg))
-            {
+                    if (!ls->wildcard) {
+                        continue;
+                    }
 
 #if (NGX_HAVE_IP_RECVDSTADDR)
 
-                if (cmsg->cmsg_level == IPPROTO_IP
-                    && cmsg->cmsg_type == IP_RECVDSTADDR
-                    && local_sockaddr->sa_family == AF_INET)
-                {
-                    struct in_addr      *addr;
-                    struct sockaddr_in  *sin;
+                    if (cmsg->cmsg_level == IPPROTO_IP
+                        && cmsg->cmsg_type == IP_RECVDSTADDR
+                        && local_sockaddr->sa_family == AF_INET)
+                    {
+                        struct in_addr      *addr;
+                        struct sockaddr_in  *sin;
 
-                    addr = (struct in_addr *) CMSG_DATA(cmsg);
-                    sin = (struct sockaddr_in *) local_sockaddr;
-                    sin->sin_addr = *addr;
+                        addr = (struct in_addr *) CMSG_DATA(cmsg);
+                        sin = (struct sockaddr_in *) local_sockaddr;
+                        sin->sin_addr = *addr;
 
-                    break;
-                }
+                        continue;
+                    }
 
 #elif (NGX_HAVE_IP_PKTINFO)
 
-                if (cmsg->cmsg_level == IPPROTO_IP
-                    && cmsg->cmsg_type == IP_PKTINFO
-                    && local_sockaddr->sa_family == AF_INET)
-                {
-                    struct in_pktinfo   *pkt;
-                    struct sockaddr_in  *sin;
+                    if (cmsg->cmsg_level == IPPROTO_IP
+                        && cmsg->cmsg_type == IP_PKTINFO
+                        && local_sockaddr->sa_family == AF_INET)
+                    {
+                        struct in_pktinfo   *pkt;
+                        struct sockaddr_in  *sin;
 
-                    pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
-                    sin = (struct sockaddr_in *) local_sockaddr;
-                    sin->sin_addr = pkt->ipi_addr;
+                        pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
+                        sin = (struct sockaddr_in *) local_sockaddr;
+                        sin->sin_addr = pkt->ipi_addr;
 
-                    break;
-                }
+                        continue;
+                    }
 
 #endif
 
 #if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
 
-                if (cmsg->cmsg_level == IPPROTO_IPV6
-                    && cmsg->cmsg_type == IPV6_PKTINFO
-                    && local_sockaddr->sa_family == AF_INET6)
-                {
-                    struct in6_pktinfo   *pkt6;
-                    struct sockaddr_in6  *sin6;
+                    if (cmsg->cmsg_level == IPPROTO_IPV6
+                        && cmsg->cmsg_type == IPV6_PKTINFO
+                        && local_sockaddr->sa_family == AF_INET6)
+                    {
+                        struct in6_pktinfo   *pkt6;
+                        struct sockaddr_in6  *sin6;
 
-                    pkt6 = (struct in6_pktinfo *) CMSG_DATA(cmsg);
-                    sin6 = (struct sockaddr_in6 *) local_sockaddr;
-                    sin6->sin6_addr = pkt6->ipi6_addr;
+                        pkt6 = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+                        sin6 = (struct sockaddr_in6 *) local_sockaddr;
+                        sin6->sin6_addr = pkt6->ipi6_addr;
 
-                    break;
-                }
+                        continue;
+                    }
 
 #endif
 
+                }
             }
-        }
 
 #endif
 
-        c = ngx_lookup_udp_connection(ls, sockaddr, socklen, local_sockaddr,
-                                      local_socklen);
+            p = slot->buffer;
+            last = p + slot->len;
 
-        if (c) {
+            hash = ngx_udp_flow_hash(ls, sockaddr, socklen,
+                                     local_sockaddr, local_socklen);
 
-#if (NGX_DEBUG)
-            if (c->log->log_level & NGX_LOG_DEBUG_EVENT) {
-                ngx_log_handler_pt  handler;
+            do {
+                size = ngx_min((size_t) (last - p), segment);
+
+                c = ngx_lookup_udp_connection(ls, hash, sockaddr, socklen,
+                                              local_sockaddr, local_socklen);
+
+                if (c != run || nbufs == NGX_UDP_MAX_BATCH) {
 
-                handler = c->log->handler;
-                c->log->handler = NULL;
+                    if (nbufs) {
+                        ngx_event_udp_dispatch(run, nbufs);
+                        nbufs = 0;
+                    }
 
-                ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                               "recvmsg: fd:%d n:%z", c->fd, n);
+                    run = c;
+                }
+
+                if (c) {
+                    b = &ngx_udp_bufs[nbufs++];
+
+                    ngx_memzero(b, sizeof(ngx_buf_t));
+
+                    b->pos = p;
+                    b->last = p + size;
+
+                } else if (ngx_event_udp_accept(ev, lc, hash,
+                                                sockaddr, socklen,
+                                                local_sockaddr, local_socklen,
+                                                p, size)
+                           != NGX_OK)
+                {
+                    return;
+                }
+
+                p += size;
+
+            } while (p < last);
 
-                c->log->handler = handler;
+            if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+                ev->available -= slot->len;
             }
+        }
+
+        if (nbufs) {
+            ngx_event_udp_dispatch(run, nbufs);
+        }
+
+    } while (ev->available);
+}
+
+
+static ngx_int_t
+ngx_event_udp_recv(ngx_event_t *ev, ngx_connection_t *lc)
+{
+    ssize_t           n;
+    ngx_err_t         err;
+    ngx_listening_t  *ls;
+#if (NGX_HAVE_MMSG)
+    int               nmsgs;
+    ngx_uint_t        i;
 #endif
 
-            ngx_memzero(&buf, sizeof(ngx_buf_t));
+    ls = lc->listening;
 
-            buf.pos = buffer;
-            buf.last = buffer + n;
+#if (NGX_HAVE_MMSG)
 
-            rev = c->read;
+    if (ngx_udp_batch > 1) {
 
-            c->udp->buffer = &buf;
+        for (i = 0; i < ngx_udp_batch; i++) {
+            ngx_event_udp_init_msghdr(ls, &ngx_udp_slots[i],
+                                      &ngx_udp_msgs[i].msg_hdr);
+        }
 
-            rev->ready = 1;
-            rev->active = 0;
+        nmsgs = recvmmsg(lc->fd, ngx_udp_msgs, ngx_udp_batch, 0, NULL);
 
-            rev->handler(rev);
+        if (nmsgs == -1) {
+            err = ngx_socket_errno;
 
-            if (c->udp) {
-                c->udp->buffer = NULL;
+            if (err == NGX_EAGAIN) {
+                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
+                               "recvmmsg() not ready");
+                return NGX_AGAIN;
             }
 
-            rev->ready = 0;
-            rev->active = 1;
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err, "recvmmsg() failed");
 
-            goto next;
+            return NGX_ERROR;
         }
 
-#if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_accepted, 1);
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "recvmmsg: %d datagrams", nmsgs);
+
+        for (i = 0; i < (ngx_uint_t) nmsgs; i++) {
+            ngx_udp_slots[i].len = ngx_udp_msgs[i].msg_len;
+        }
+
+        return nmsgs;
+    }
+
 #endif
 
-        ngx_accept_disabled = ngx_cycle->connection_n / 8
-                              - ngx_cycle->free_connection_n;
+    ngx_event_udp_init_msghdr(ls, &ngx_udp_slots[0], ngx_udp_msghdr(0));
 
-        c = ngx_get_connection(lc->fd, ev->log);
-        if (c == NULL) {
-            return;
+    n = recvmsg(lc->fd, ngx_udp_msghdr(0), 0);
+
+    if (n == -1) {
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
+                           "recvmsg() not ready");
+            return NGX_AGAIN;
         }
 
-        c->shared = 1;
-        c->type = SOCK_DGRAM;
-        c->socklen = socklen;
+        ngx_log_error(NGX_LOG_ALERT, ev->log, err, "recvmsg() failed");
 
-#if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+        return NGX_ERROR;
+    }
+
+    ngx_udp_slots[0].len = n;
+
+    return 1;
+}
+
+
+static void
+ngx_event_udp_init_msghdr(ngx_listening_t *ls, ngx_udp_slot_t *slot,
+    struct msghdr *msg)
+{
+    ngx_memzero(msg, sizeof(struct msghdr));
+
+    slot->iov.iov_base = (void *) slot->buffer;
+    slot->iov.iov_len = NGX_UDP_DATAGRAM_SIZE;
+
+    msg->msg_name = &slot->sockaddr;
+    msg->msg_namelen = sizeof(ngx_sockaddr_t);
+    msg->msg_iov = &slot->iov;
+    msg->msg_iovlen = 1;
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+    if (ls->wildcard
+#if (NGX_HAVE_UDP_SEGMENT)
+        || ngx_udp_segmentation
 #endif
+       )
+    {
+        msg->msg_control = &slot->control;
+        msg->msg_controllen = sizeof(ngx_udp_control_t);
+    }
 
-        c->pool = ngx_create_pool(ls->pool_size, ev->log);
-        if (c->pool == NULL) {
-            ngx_close_accepted_udp_connection(c);
-            return;
-        }
+#endif
+}
 
-        c->sockaddr = ngx_palloc(c->pool, socklen);
-        if (c->sockaddr == NULL) {
-            ngx_close_accepted_udp_connection(c);
-            return;
-        }
 
-        ngx_memcpy(c->sockaddr, sockaddr, socklen);
+static void
+ngx_event_udp_dispatch(ngx_connection_t *c, ngx_uint_t nbufs)
+{
+    ngx_event_t  *rev;
 
-        log = ngx_palloc(c->pool, sizeof(ngx_log_t));
-        if (log == NULL) {
-            ngx_close_accepted_udp_connection(c);
-            return;
+#if (NGX_DEBUG)
+    if (c->log->log_level & NGX_LOG_DEBUG_EVENT) {
+        ngx_uint_t          i;
+        ngx_log_handler_pt  handler;
+
+        handler = c->log->handler;
+        c->log->handler = NULL;
+
+        for (i = 0; i < nbufs; i++) {
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "recvmsg: fd:%d n:%z", c->fd,
+                           ngx_udp_bufs[i].last - ngx_udp_bufs[i].pos);
         }
 
-        *log = ls->log;
+        c->log->handler = handler;
+    }
+#endif
 
-        c->recv = ngx_udp_shared_recv;
-        c->send = ngx_udp_send;
-        c->send_chain = ngx_udp_send_chain;
+    c->udp->buffer = ngx_udp_bufs;
+    c->udp->nbuffers = nbufs;
 
-        c->log = log;
-        c->pool->log = log;
-        c->listening = ls;
+    rev = c->read;
 
-        if (local_sockaddr == &lsa.sockaddr) {
-            local_sockaddr = ngx_palloc(c->pool, local_socklen);
-            if (local_sockaddr == NULL) {
-                ngx_close_accepted_udp_connection(c);
-                return;
-            }
+    rev->ready = 1;
+    rev->active = 0;
 
-            ngx_memcpy(local_sockaddr, &lsa, local_socklen);
-        }
+    rev->handler(rev);
 
-        c->local_sockaddr = local_sockaddr;
-        c->local_socklen = local_socklen;
+    if (c->udp) {
 
-        c->buffer = ngx_create_temp_buf(c->pool, n);
-        if (c->buffer == NULL) {
-            ngx_close_accepted_udp_connection(c);
-            return;
+        if (c->udp->nbuffers) {
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "udp dropped %ui datagrams", c->udp->nbuffers);
+
+            c->listening->udp_table->dropped += c->udp->nbuffers;
         }
 
-        c->buffer->last = ngx_cpymem(c->buffer->last, buffer, n);
+        c->udp->buffer = NULL;
+        c->udp->nbuffers = 0;
+    }
 
-        rev = c->read;
-        wev = c->write;
+    rev->ready = 0;
+    rev->active = 1;
+}
 
-        rev->active = 1;
-        wev->ready = 1;
 
-        rev->log = log;
-        wev->log = log;
+static ngx_int_t
+ngx_event_udp_accept(ngx_event_t *ev, ngx_connection_t *lc, uint32_t hash,
+    struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen,
+    u_char *data, size_t size)
+{
+    ngx_log_t         *log;
+    ngx_event_t       *rev, *wev;
+    ngx_listening_t   *ls;
+    ngx_connection_t  *c;
+#if (NGX_DEBUG)
+    ngx_event_conf_t  *ecf;
+#endif
 
-        /*
-         * TODO: MT: - ngx_atomic_fetch_add()
-         *             or protection by critical section or light mutex
-         *
-         * TODO: MP: - allocated in a shared memory
-         *           - ngx_atomic_fetch_add()
-         *             or protection by critical section or light mutex
-         */
+    ls = lc->listening;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_accepted, 1);
+#endif
+
+    ngx_accept_disabled = ngx_cycle->connection_n / 8
+                          - ngx_cycle->free_connection_n;
 
-        c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    c = ngx_get_connection(lc->fd, ev->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->shared = 1;
+    c->type = SOCK_DGRAM;
+    c->socklen = socklen;
 
 #if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_handled, 1);
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
 #endif
 
-        if (ls->addr_ntop) {
-            c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
-            if (c->addr_text.data == NULL) {
-                ngx_close_accepted_udp_connection(c);
-                return;
-            }
+    c->pool = ngx_create_pool(ls->pool_size, ev->log);
+    if (c->pool == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
 
-            c->addr_text.len = ngx_sock_ntop(c->sockaddr, c->socklen,
-                                             c->addr_text.data,
-                                             ls->addr_text_max_len, 0);
-            if (c->addr_text.len == 0) {
-                ngx_close_accepted_udp_connection(c);
-                return;
-            }
-        }
+    c->sockaddr = ngx_palloc(c->pool, socklen);
+    if (c->sockaddr == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
 
-#if (NGX_DEBUG)
-        {
-        ngx_str_t  addr;
-        u_char     text[NGX_SOCKADDR_STRLEN];
+    ngx_memcpy(c->sockaddr, sockaddr, socklen);
 
-        ngx_debug_accepted_connection(ecf, c);
+    log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
 
-        if (log->log_level & NGX_LOG_DEBUG_EVENT) {
-            addr.data = text;
-            addr.len = ngx_sock_ntop(c->sockaddr, c->socklen, text,
-                                     NGX_SOCKADDR_STRLEN, 1);
+    *log = ls->log;
 
-            ngx_log_debug4(NGX_LOG_DEBUG_EVENT, log, 0,
-                           "*%uA recvmsg: %V fd:%d n:%z",
-                           c->number, &addr, c->fd, n);
-        }
+    c->recv = ngx_udp_shared_recv;
+    c->send = ngx_udp_send;
+    c->send_chain = ngx_udp_send_chain;
 
+    c->log = log;
+    c->pool->log = log;
+    c->listening = ls;
+
+    if (local_sockaddr != ls->sockaddr) {
+        c->local_sockaddr = ngx_palloc(c->pool, local_socklen);
+        if (c->local_sockaddr == NULL) {
+            ngx_close_accepted_udp_connection(c);
+            return NGX_ERROR;
         }
+
+        ngx_memcpy(c->local_sockaddr, local_sockaddr, local_socklen);
+
+    } else {
+        c->local_sockaddr = local_sockaddr;
+    }
+
+    c->local_socklen = local_socklen;
+
+    c->buffer = ngx_create_temp_buf(c->pool, size);
+    if (c->buffer == NULL) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
+
+    c->buffer->last = ngx_cpymem(c->buffer->last, data, size);
+
+    rev = c->read;
+    wev = c->write;
+
+    rev->active = 1;
+    wev->ready = 1;
+
+    rev->log = log;
+    wev->log = log;
+
+    /*
+     * TODO: MT: - ngx_atomic_fetch_add()
+     *             or protection by critical section or light mutex
+     *
+     * TODO: MP: - allocated in a shared memory
+     *           - ngx_atomic_fetch_add()
+     *             or protection by critical section or light mutex
+     */
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_handled, 1);
 #endif
 
-        if (ngx_insert_udp_connection(c) != NGX_OK) {
+    if (ls->addr_ntop) {
+        c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
+        if (c->addr_text.data == NULL) {
             ngx_close_accepted_udp_connection(c);
-            return;
+            return NGX_ERROR;
         }
 
-        log->data = NULL;
-        log->handler = NULL;
+        c->addr_text.len = ngx_sock_ntop(c->sockaddr, c->socklen,
+                                         c->addr_text.data,
+                                         ls->addr_text_max_len, 0);
+        if (c->addr_text.len == 0) {
+            ngx_close_accepted_udp_connection(c);
+            return NGX_ERROR;
+        }
+    }
 
-        ls->handler(c);
+#if (NGX_DEBUG)
+    {
+    ngx_str_t  addr;
+    u_char     text[NGX_SOCKADDR_STRLEN];
 
-    next:
+    ecf = ngx_event_get_conf(ngx_cycle->conf_ctx, ngx_event_core_module);
 
-        if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
-            ev->available -= n;
-        }
+    ngx_debug_accepted_connection(ecf, c);
 
-    } while (ev->available);
+    if (log->log_level & NGX_LOG_DEBUG_EVENT) {
+        addr.data = text;
+        addr.len = ngx_sock_ntop(c->sockaddr, c->socklen, text,
+                                 NGX_SOCKADDR_STRLEN, 1);
+
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "*%uA recvmsg: %V fd:%d n:%uz",
+                       c->number, &addr, c->fd, size);
+    }
+
+    }
+#endif
+
+    if (ngx_insert_udp_connection(c, hash) != NGX_OK) {
+        ngx_close_accepted_udp_connection(c);
+        return NGX_ERROR;
+    }
+
+    log->data = NULL;
+    log->handler = NULL;
+
+    ls->handler(c);
+
+    return NGX_OK;
 }
 
 
@@ -452,10 +756,26 @@ ngx_udp_shared_recv(ngx_connection_t *c, u_char *buf, size_t size)
 
     b = c->udp->buffer;
 
+    /*
+     * a datagram which does not fit into the buffer is truncated
+     * only if it is the first one passed to the handler, the next
+     * ones are not read; datagrams left unread when the handler
+     * returns are dropped and counted in the table of the listener
+     */
+
+    if (b->last - b->pos > (ssize_t) size && b != ngx_udp_bufs) {
+        return NGX_AGAIN;
+    }
+
     n = ngx_min(b->last - b->pos, (ssize_t) size);
 
     ngx_memcpy(buf, b->pos, n);
 
+    if (--c->udp->nbuffers) {
+        c->udp->buffer++;
+        return n;
+    }
+
     c->udp->buffer = NULL;
 
     c->read->ready = 0;
@@ -465,63 +785,72 @@ ngx_udp_shared_recv(ngx_connection_t *c, u_char *buf, size_t size)
 }
 
 
-void
-ngx_udp_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
-{
-    ngx_int_t               rc;
-    ngx_connection_t       *c, *ct;
-    ngx_rbtree_node_t     **p;
-    ngx_udp_connection_t   *udp, *udpt;
-
-    for ( ;; ) {
+/*
+ * sessions of a listener are kept in a per-worker hash table
+ * with open addressing and linear probing; deleted entries are
+ * only marked and are dropped in a batch when the table is rebuilt
+ */
 
-        if (node->key < temp->key) {
+static uint32_t
+ngx_udp_flow_hash(ngx_listening_t *ls, struct sockaddr *sockaddr,
+    socklen_t socklen, struct sockaddr *local_sockaddr,
+    socklen_t local_socklen)
+{
+    uint32_t  hash;
 
-            p = &temp->left;
+    hash = ngx_udp_sockaddr_hash(sockaddr, socklen, 0);
 
-        } else if (node->key > temp->key) {
+    if (ls->wildcard) {
+        hash = ngx_udp_sockaddr_hash(local_sockaddr, local_socklen, hash);
+    }
 
-            p = &temp->right;
+    return hash;
+}
 
-        } else { /* node->key == temp->key */
 
-            udp = (ngx_udp_connection_t *) node;
-            c = udp->connection;
+static uint32_t
+ngx_udp_sockaddr_hash(struct sockaddr *sa, socklen_t socklen, uint32_t hash)
+{
+    uint64_t              key;
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin6;
+#endif
 
-            udpt = (ngx_udp_connection_t *) temp;
-            ct = udpt->connection;
+    switch (sa->sa_family) {
 
-            rc = ngx_cmp_sockaddr(c->sockaddr, c->socklen,
-                                  ct->sockaddr, ct->socklen, 1);
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) sa;
 
-            if (rc == 0 && c->listening->wildcard) {
-                rc = ngx_cmp_sockaddr(c->local_sockaddr, c->local_socklen,
-                                      ct->local_sockaddr, ct->local_socklen, 1);
-            }
+        key = ngx_murmur_hash2(sin6->sin6_addr.s6_addr, 16);
+        key = key << 16 | sin6->sin6_port;
+        break;
+#endif
 
-            p = (rc < 0) ? &temp->left : &temp->right;
-        }
+    case AF_INET:
+        sin = (struct sockaddr_in *) sa;
 
-        if (*p == sentinel) {
-            break;
-        }
+        key = (uint64_t) sin->sin_addr.s_addr << 16 | sin->sin_port;
+        break;
 
-        temp = *p;
+    default: /* AF_UNIX */
+        key = ngx_murmur_hash2((u_char *) sa, socklen);
+        break;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    key = (key ^ hash) * 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t) (key >> 32);
 }
 
 
 static ngx_int_t
-ngx_insert_udp_connection(ngx_connection_t *c)
+ngx_insert_udp_connection(ngx_connection_t *c, uint32_t hash)
 {
-    uint32_t               hash;
+    ngx_uint_t             i;
+    ngx_udp_table_t       *t;
+    ngx_udp_entry_t       *e;
     ngx_pool_cleanup_t    *cln;
     ngx_udp_connection_t  *udp;
 
@@ -529,23 +858,31 @@ ngx_insert_udp_connection(ngx_connection_t *c)
         return NGX_OK;
     }
 
-    udp = ngx_pcalloc(c->pool, sizeof(ngx_udp_connection_t));
-    if (udp == NULL) {
-        return NGX_ERROR;
-    }
+    t = c->listening->udp_table;
 
-    udp->connection = c;
+    if (t == NULL) {
+        t = ngx_calloc(sizeof(ngx_udp_table_t), c->log);
+        if (t == NULL) {
+            return NGX_ERROR;
+        }
 
-    ngx_crc32_init(hash);
-    ngx_crc32_update(&hash, (u_char *) c->sockaddr, c->socklen);
+        c->listening->udp_table = t;
+    }
+
+    /* the load factor including deleted entries is kept below 1/2 */
 
-    if (c->listening->wildcard) {
-        ngx_crc32_update(&hash, (u_char *) c->local_sockaddr, c->local_socklen);
+    if (2 * (t->used + 1) > t->mask + 1) {
+        if (ngx_udp_table_rebuild(t, c->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
     }
 
-    ngx_crc32_final(hash);
+    udp = ngx_pcalloc(c->pool, sizeof(ngx_udp_connection_t));
+    if (udp == NULL) {
+        return NGX_ERROR;
+    }
 
-    udp->node.key = hash;
+    udp->connection = c;
 
     cln = ngx_pool_cleanup_add(c->pool, 0);
     if (cln == NULL) {
@@ -555,7 +892,29 @@ ngx_insert_udp_connection(ngx_connection_t *c)
     cln->data = c;
     cln->handler = ngx_delete_udp_connection;
 
-    ngx_rbtree_insert(&c->listening->rbtree, &udp->node);
+    /* the session is not in the table, a deleted entry may be reused */
+
+    for (i = hash & t->mask; /* void */ ; i = (i + 1) & t->mask) {
+        e = &t->entries[i];
+
+        if (e->udp == NULL) {
+            t->used++;
+            break;
+        }
+
+        if (e->udp == NGX_UDP_DELETED) {
+            break;
+        }
+    }
+
+    e->hash = hash;
+    e->udp = udp;
+
+    udp->index = i;
+
+    if (++t->sessions > t->peak) {
+        t->peak = t->sessions;
+    }
 
     c->udp = udp;
 
@@ -563,30 +922,100 @@ ngx_insert_udp_connection(ngx_connection_t *c)
 }
 
 
+static ngx_int_t
+ngx_udp_table_rebuild(ngx_udp_table_t *t, ngx_log_t *log)
+{
+    ngx_uint_t        i, n, size;
+    ngx_udp_entry_t  *entries, *e;
+
+    size = NGX_UDP_TABLE_SIZE;
+
+    while (size < 4 * (t->sessions + 1)) {
+        size *= 2;
+    }
+
+    entries = ngx_calloc(size * sizeof(ngx_udp_entry_t), log);
+    if (entries == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (t->entries) {
+        for (i = 0; i <= t->mask; i++) {
+            e = &t->entries[i];
+
+            if (e->udp == NULL || e->udp == NGX_UDP_DELETED) {
+                continue;
+            }
+
+            for (n = e->hash & (size - 1);
+                 entries[n].udp;
+                 n = (n + 1) & (size - 1))
+            { /* void */ }
+
+            entries[n] = *e;
+            e->udp->index = n;
+        }
+
+        ngx_free(t->entries);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "udp table rebuilt: %ui sessions, %ui deleted, %ui slots",
+                   t->sessions, t->used - t->sessions, size);
+
+    t->entries = entries;
+    t->mask = size - 1;
+    t->used = t->sessions;
+
+    return NGX_OK;
+}
+
+
 void
 ngx_delete_udp_connection(void *data)
 {
     ngx_connection_t  *c = data;
 
+    ngx_uint_t        i;
+    ngx_udp_table_t  *t;
+
     if (c->udp == NULL) {
         return;
     }
 
-    ngx_rbtree_delete(&c->listening->rbtree, &c->udp->node);
+    t = c->listening->udp_table;
+    i = c->udp->index;
+
+    /* an entry followed by an empty one does not break probe sequences */
+
+    if (t->entries[(i + 1) & t->mask].udp == NULL) {
+        t->entries[i].udp = NULL;
+        t->used--;
+
+    } else {
+        t->entries[i].udp = NGX_UDP_DELETED;
+    }
+
+    t->sessions--;
 
     c->udp = NULL;
 }
 
 
 static ngx_connection_t *
-ngx_lookup_udp_connection(ngx_listening_t *ls, struct sockaddr *sockaddr,
-    socklen_t socklen, struct sockaddr *local_sockaddr, socklen_t local_socklen)
+ngx_lookup_udp_connection(ngx_listening_t *ls, uint32_t hash,
+    struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen)
 {
-    uint32_t               hash;
     ngx_int_t              rc;
+    ngx_uint_t             i;
     ngx_connection_t      *c;
-    ngx_rbtree_node_t     *node, *sentinel;
+    ngx_udp_table_t       *t;
+    ngx_udp_entry_t       *e;
     ngx_udp_connection_t  *udp;
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    uint64_t               start;
+#endif
 
 #if (NGX_HAVE_UNIX_DOMAIN)
 
@@ -604,54 +1033,76 @@ ngx_lookup_udp_connection(ngx_listening_t *ls, struct sockaddr *sockaddr,
 
 #endif
 
-    node = ls->rbtree.root;
-    sentinel = ls->rbtree.sentinel;
-
-    ngx_crc32_init(hash);
-    ngx_crc32_update(&hash, (u_char *) sockaddr, socklen);
+    t = ls->udp_table;
 
-    if (ls->wildcard) {
-        ngx_crc32_update(&hash, (u_char *) local_sockaddr, local_socklen);
+    if (t == NULL) {
+        return NULL;
     }
 
-    ngx_crc32_final(hash);
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    start = (t->lookups % NGX_UDP_TIME_SAMPLE == 0) ? ngx_udp_time() : 0;
+#endif
 
-    while (node != sentinel) {
+    t->lookups++;
 
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
+    c = NULL;
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
-        }
+    for (i = hash & t->mask; /* void */ ; i = (i + 1) & t->mask) {
+        e = &t->entries[i];
 
-        /* hash == node->key */
+        t->probes++;
 
-        udp = (ngx_udp_connection_t *) node;
+        udp = e->udp;
 
-        c = udp->connection;
+        if (udp == NULL) {
+            break;
+        }
+
+        if (udp == NGX_UDP_DELETED || e->hash != hash) {
+            continue;
+        }
 
         rc = ngx_cmp_sockaddr(sockaddr, socklen,
-                              c->sockaddr, c->socklen, 1);
+                              udp->connection->sockaddr,
+                              udp->connection->socklen, 1);
 
         if (rc == 0 && ls->wildcard) {
             rc = ngx_cmp_sockaddr(local_sockaddr, local_socklen,
-                                  c->local_sockaddr, c->local_socklen, 1);
+                                  udp->connection->local_sockaddr,
+                                  udp->connection->local_socklen, 1);
         }
 
         if (rc == 0) {
-            return c;
+            c = udp->connection;
+            break;
         }
+    }
 
-        node = (rc < 0) ? node->left : node->right;
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    if (start) {
+        t->time += ngx_udp_time() - start;
+        t->timed++;
     }
+#endif
 
-    return NULL;
+    return c;
 }
 
+
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+
+static uint64_t
+ngx_udp_time(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif
+
 #else
 
 void
@@ -0,0 +1,436 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <brotli/encode.h>
+
+
+typedef struct {
+    ngx_http_compress_conf_t   compress;
+
+    ngx_int_t                  level;
+    size_t                     lgwin;
+} ngx_http_brotli_conf_t;
+
+
+static ngx_int_t ngx_http_brotli_filter_test(ngx_http_request_t *r);
+static ngx_int_t ngx_http_brotli_filter_init_state(
+    ngx_http_compress_ctx_t *ctx);
+static ngx_int_t ngx_http_brotli_filter_compress(ngx_http_compress_ctx_t *ctx);
+static void ngx_http_brotli_filter_done(ngx_http_compress_ctx_t *ctx);
+
+static void *ngx_http_brotli_filter_alloc(void *opaque, size_t size);
+static void ngx_http_brotli_filter_free(void *opaque, void *address);
+
+static ngx_int_t ngx_http_brotli_add_variables(ngx_conf_t *cf);
+
+static ngx_int_t ngx_http_brotli_filter_init(ngx_conf_t *cf);
+static void *ngx_http_brotli_create_conf(ngx_conf_t *cf);
+static char *ngx_http_brotli_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_http_brotli_window(ngx_conf_t *cf, void *post, void *data);
+
+
+static ngx_conf_num_bounds_t  ngx_http_brotli_comp_level_bounds = {
+    ngx_conf_check_num_bounds, BROTLI_MIN_QUALITY, BROTLI_MAX_QUALITY
+};
+
+static ngx_conf_post_handler_pt  ngx_http_brotli_window_p =
+    ngx_http_brotli_window;
+
+
+static ngx_command_t  ngx_http_brotli_filter_commands[] = {
+
+    { ngx_string("brotli"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_brotli_conf_t, compress.enable),
+      NULL },
+
+    { ngx_string("brotli_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_brotli_conf_t, compress.bufs),
+      NULL },
+
+    { ngx_string("brotli_types"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_types_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_brotli_conf_t, compress.types_keys),
+      &ngx_http_html_default_types[0] },
+
+    { ngx_string("brotli_comp_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_brotli_conf_t, level),
+      &ngx_http_brotli_comp_level_bounds },
+
+    { ngx_string("brotli_window"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_brotli_conf_t, lgwin),
+      &ngx_http_brotli_window_p },
+
+    { ngx_string("postpone_brotli"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_brotli_conf_t, compress.postpone),
+      NULL },
+
+    { ngx_string("brotli_no_buffer"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_brotli_conf_t, compress.no_buffer),
+      NULL },
+
+    { ngx_string("brotli_min_length"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_brotli_conf_t, compress.min_length),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_brotli_filter_module_ctx = {
+    ngx_http_brotli_add_variables,         /* preconfiguration */
+    ngx_http_brotli_filter_init,           /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_brotli_create_conf,           /* create location configuration */
+    ngx_http_brotli_merge_conf             /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_brotli_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_brotli_filter_module_ctx,    /* module context */
+    ngx_http_brotli_filter_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_http_brotli_ratio = ngx_string("brotli_ratio");
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+static ngx_http_compress_method_t  ngx_http_brotli_method = {
+    ngx_string("br"),
+    &ngx_http_brotli_filter_module,
+    NGX_ERROR,
+    ngx_http_brotli_filter_init_state,
+    ngx_http_brotli_filter_compress,
+    ngx_http_brotli_filter_done
+};
+
+
+static ngx_int_t
+ngx_http_brotli_header_filter(ngx_http_request_t *r)
+{
+    if (ngx_http_compress_header_filter(r, &ngx_http_brotli_method)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_next_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_brotli_filter_test(ngx_http_request_t *r)
+{
+    ngx_http_brotli_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_brotli_filter_module);
+
+    return ngx_http_compress_test(r, &conf->compress);
+}
+
+
+static ngx_int_t
+ngx_http_brotli_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    return ngx_http_compress_body_filter(r, in, &ngx_http_brotli_method,
+                                         ngx_http_next_body_filter);
+}
+
+
+static ngx_int_t
+ngx_http_brotli_filter_init_state(ngx_http_compress_ctx_t *ctx)
+{
+    uint32_t                 lgwin;
+    ngx_http_request_t      *r;
+    BrotliEncoderState      *encoder;
+    ngx_http_brotli_conf_t  *conf;
+
+    r = ctx->request;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_brotli_filter_module);
+
+    /*
+     * the encoder state and its ring buffer are allocated from
+     * the request pool, so no cleanup is needed if the request
+     * is terminated in the middle of the compression
+     */
+
+    encoder = BrotliEncoderCreateInstance(ngx_http_brotli_filter_alloc,
+                                          ngx_http_brotli_filter_free, ctx);
+    if (encoder == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "BrotliEncoderCreateInstance() failed");
+        return NGX_ERROR;
+    }
+
+    ctx->state = encoder;
+
+    lgwin = (uint32_t) conf->lgwin;
+
+    if (r->headers_out.content_length_n > 0) {
+
+        /* there is no need in a window larger than the response */
+
+        while (lgwin > BROTLI_MIN_WINDOW_BITS
+               && r->headers_out.content_length_n
+                  <= (off_t) (((size_t) 1 << (lgwin - 1)) - 16))
+        {
+            lgwin--;
+        }
+
+        (void) BrotliEncoderSetParameter(encoder, BROTLI_PARAM_SIZE_HINT,
+                         (uint32_t) ngx_min(r->headers_out.content_length_n,
+                                            (off_t) 0x3fffffff));
+    }
+
+    if (!BrotliEncoderSetParameter(encoder, BROTLI_PARAM_QUALITY,
+                                   (uint32_t) conf->level)
+        || !BrotliEncoderSetParameter(encoder, BROTLI_PARAM_LGWIN, lgwin))
+    {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "BrotliEncoderSetParameter() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_brotli_filter_compress(ngx_http_compress_ctx_t *ctx)
+{
+    uint8_t                 *next_out;
+    const uint8_t           *next_in;
+    BrotliEncoderState      *encoder;
+    BrotliEncoderOperation   op;
+
+    encoder = ctx->state;
+
+    switch (ctx->op) {
+
+    case NGX_HTTP_COMPRESS_FINISH:
+        op = BROTLI_OPERATION_FINISH;
+        break;
+
+    case NGX_HTTP_COMPRESS_FLUSH:
+        op = BROTLI_OPERATION_FLUSH;
+        break;
+
+    default: /* NGX_HTTP_COMPRESS_PROCESS */
+        op = BROTLI_OPERATION_PROCESS;
+    }
+
+    next_in = ctx->next_in;
+    next_out = ctx->next_out;
+
+    if (!BrotliEncoderCompressStream(encoder, op, &ctx->avail_in, &next_in,
+                                     &ctx->avail_out, &next_out, NULL))
+    {
+        ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, 0,
+                      "BrotliEncoderCompressStream() failed: %d", op);
+        return NGX_ERROR;
+    }
+
+    ctx->next_in = (u_char *) next_in;
+    ctx->next_out = next_out;
+
+    switch (ctx->op) {
+
+    case NGX_HTTP_COMPRESS_FINISH:
+        ctx->finished = BrotliEncoderIsFinished(encoder) ? 1 : 0;
+        break;
+
+    case NGX_HTTP_COMPRESS_FLUSH:
+        ctx->finished = (ctx->avail_in == 0
+                         && !BrotliEncoderHasMoreOutput(encoder));
+        break;
+
+    default: /* NGX_HTTP_COMPRESS_PROCESS */
+        ctx->finished = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_brotli_filter_done(ngx_http_compress_ctx_t *ctx)
+{
+    BrotliEncoderDestroyInstance(ctx->state);
+}
+
+
+static void *
+ngx_http_brotli_filter_alloc(void *opaque, size_t size)
+{
+    ngx_http_compress_ctx_t *ctx = opaque;
+
+    void  *p;
+
+    p = ngx_palloc(ctx->request->pool, size);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                   "brotli alloc: %uz p:%p", size, p);
+
+    return p;
+}
+
+
+static void
+ngx_http_brotli_filter_free(void *opaque, void *address)
+{
+    ngx_http_compress_ctx_t *ctx = opaque;
+
+    if (address) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                       "brotli free: %p", address);
+
+        (void) ngx_pfree(ctx->request->pool, address);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_brotli_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var;
+
+    var = ngx_http_add_variable(cf, &ngx_http_brotli_ratio,
+                                NGX_HTTP_VAR_NOHASH);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_compress_ratio_variable;
+    var->data = (uintptr_t) &ngx_http_brotli_filter_module;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_brotli_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_brotli_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_brotli_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    ngx_http_compress_init_conf(&conf->compress);
+
+    conf->level = NGX_CONF_UNSET;
+    conf->lgwin = NGX_CONF_UNSET_SIZE;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_brotli_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_brotli_conf_t *prev = parent;
+    ngx_http_brotli_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->level, prev->level, 4);
+    ngx_conf_merge_size_value(conf->lgwin, prev->lgwin, 19);
+
+    return ngx_http_compress_merge_conf(cf, &prev->compress, &conf->compress);
+}
+
+
+static ngx_int_t
+ngx_http_brotli_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_brotli_method.encoding = ngx_http_add_encoding(cf,
+                                                 &ngx_http_brotli_method.name,
+                                                 ngx_http_brotli_filter_test);
+    if (ngx_http_brotli_method.encoding == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_brotli_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_brotli_body_filter;
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_brotli_window(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *np = data;
+
+    size_t  lgwin, wsize;
+
+    lgwin = BROTLI_MAX_WINDOW_BITS;
+
+    for (wsize = (size_t) 1 << BROTLI_MAX_WINDOW_BITS;
+         lgwin >= BROTLI_MIN_WINDOW_BITS;
+         wsize >>= 1)
+    {
+        if (wsize == *np) {
+            *np = lgwin;
+
+            return NGX_CONF_OK;
+        }
+
+        lgwin--;
+    }
+
+    return "must be a power of two between 1k and 16m";
+}
@@ -0,0 +1,420 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * The module keeps the compressed representations of a cached response
+ * as separate cache entries, one per content coding.
+ *
+ * The ngx_http_cache_compressed_filter_module header filter runs before
+ * the compression filters.  If the response is sent from cache and
+ * a representation in the selected coding is already cached, it is sent
+ * instead of the identity body by ngx_http_cache_send(), and compression
+ * filters are bypassed as the response has Content-Encoding set.
+ * Otherwise, the ngx_http_cache_compressed_store_filter_module filters,
+ * which run after the compression filters, save the compressed body
+ * to the cache.
+ */
+
+
+typedef struct {
+    ngx_flag_t                  enable;
+} ngx_http_cache_compressed_conf_t;
+
+
+typedef struct {
+    ngx_http_cache_encoded_t    encoded;
+    ngx_str_t                  *encoding;
+    ngx_temp_file_t            *temp_file;
+
+    unsigned                    store:1;
+} ngx_http_cache_compressed_ctx_t;
+
+
+static ngx_int_t ngx_http_cache_compressed_send(ngx_http_request_t *r,
+    ngx_http_cache_compressed_ctx_t *ctx);
+
+static void *ngx_http_cache_compressed_create_conf(ngx_conf_t *cf);
+static char *ngx_http_cache_compressed_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static ngx_int_t ngx_http_cache_compressed_filter_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_cache_compressed_store_filter_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_cache_compressed_filter_commands[] = {
+
+    { ngx_string("cache_compressed"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_cache_compressed_conf_t, enable),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_cache_compressed_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_cache_compressed_filter_init, /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_cache_compressed_create_conf, /* create location configuration */
+    ngx_http_cache_compressed_merge_conf   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_cache_compressed_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_cache_compressed_filter_module_ctx, /* module context */
+    ngx_http_cache_compressed_filter_commands, /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_module_t  ngx_http_cache_compressed_store_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_cache_compressed_store_filter_init, /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_cache_compressed_store_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_cache_compressed_store_filter_module_ctx, /* module context */
+    NULL,                                  /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_header_filter_pt  ngx_http_next_store_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_store_body_filter;
+
+
+static ngx_int_t
+ngx_http_cache_compressed_header_filter(ngx_http_request_t *r)
+{
+    ngx_int_t                          n, rc;
+    ngx_http_encoding_t               *enc;
+    ngx_http_core_main_conf_t         *cmcf;
+    ngx_http_cache_compressed_ctx_t   *ctx;
+    ngx_http_cache_compressed_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r,
+                                        ngx_http_cache_compressed_filter_module);
+
+    /*
+     * filters which change the body for every request
+     * make the result of compression uncacheable
+     */
+
+    if (!conf->enable
+        || r != r->main
+        || r->cache == NULL
+        || r->upstream == NULL
+        || r->header_only
+        || (r->headers_out.content_encoding
+            && r->headers_out.content_encoding->value.len)
+        || r->filter_need_in_memory
+        || r->filter_need_temporary
+        || r->preserve_body)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    n = ngx_http_select_encoding(r);
+
+    if (n == NGX_DECLINED) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_cache_compressed_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    enc = cmcf->encodings.elts;
+    ctx->encoding = &enc[n].name;
+
+    if (ngx_http_file_cache_encoded_init(r, &ctx->encoded, ctx->encoding)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_cache_compressed_filter_module);
+
+    if (r->cached) {
+        rc = ngx_http_file_cache_encoded_open(r, &ctx->encoded);
+
+        if (rc == NGX_OK) {
+            return ngx_http_cache_compressed_send(r, ctx);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        /* rc == NGX_DECLINED */
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http cache compressed store: \"%V\"", ctx->encoding);
+
+    ctx->store = 1;
+
+    return ngx_http_next_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_cache_compressed_send(ngx_http_request_t *r,
+    ngx_http_cache_compressed_ctx_t *ctx)
+{
+    ngx_table_elt_t  *h;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http cache compressed send: \"%V\"", ctx->encoding);
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Content-Encoding");
+    h->value = *ctx->encoding;
+    r->headers_out.content_encoding = h;
+
+    r->gzip_vary = 1;
+
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+    ngx_http_weak_etag(r);
+
+    r->headers_out.content_length_n = ctx->encoded.length
+                                      - ctx->encoded.body_start;
+
+    r->cache->encoded = &ctx->encoded;
+
+    return ngx_http_next_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_cache_compressed_store_header_filter(ngx_http_request_t *r)
+{
+    ngx_table_elt_t                  *h;
+    ngx_temp_file_t                  *tf;
+    ngx_http_cache_compressed_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_cache_compressed_filter_module);
+
+    if (ctx == NULL || !ctx->store) {
+        return ngx_http_next_store_header_filter(r);
+    }
+
+    /* make sure the response is compressed with the selected coding */
+
+    h = r->headers_out.content_encoding;
+
+    if (h == NULL
+        || h->value.len != ctx->encoding->len
+        || ngx_strncasecmp(h->value.data, ctx->encoding->data,
+                           ctx->encoding->len)
+           != 0)
+    {
+        ctx->store = 0;
+        return ngx_http_next_store_header_filter(r);
+    }
+
+    tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+    if (tf == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * the temporary file is created next to the cache file,
+     * the space for the cache file header is reserved
+     */
+
+    tf->file.fd = NGX_INVALID_FILE;
+    tf->file.name = ctx->encoded.file.name;
+    tf->file.log = r->connection->log;
+    tf->path = r->cache->file_cache->path;
+    tf->pool = r->pool;
+    tf->persistent = 1;
+    tf->clean = 1;
+    tf->offset = r->cache->header_start;
+
+    ctx->temp_file = tf;
+
+    return ngx_http_next_store_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_cache_compressed_store_body_filter(ngx_http_request_t *r,
+    ngx_chain_t *in)
+{
+    off_t                             size;
+    ssize_t                           n;
+    ngx_uint_t                        last;
+    ngx_chain_t                      *cl;
+    ngx_temp_file_t                  *tf;
+    ngx_http_upstream_t              *u;
+    ngx_http_cache_compressed_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_cache_compressed_filter_module);
+
+    if (ctx == NULL || !ctx->store || in == NULL) {
+        return ngx_http_next_store_body_filter(r, in);
+    }
+
+    size = 0;
+    last = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+
+        if (cl->buf->last_buf) {
+            last = 1;
+        }
+
+        if (ngx_buf_special(cl->buf)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(cl->buf)) {
+            ctx->store = 0;
+            return ngx_http_next_store_body_filter(r, in);
+        }
+
+        size += ngx_buf_size(cl->buf);
+    }
+
+    tf = ctx->temp_file;
+
+    if (size) {
+        n = ngx_write_chain_to_temp_file(tf, in);
+
+        if (n == NGX_ERROR) {
+            ctx->store = 0;
+            return ngx_http_next_store_body_filter(r, in);
+        }
+
+        tf->offset += n;
+    }
+
+    if (!last) {
+        return ngx_http_next_store_body_filter(r, in);
+    }
+
+    ctx->store = 0;
+
+    /*
+     * the identity response must have been cached: either it was sent
+     * from cache or it is being cached as it is received from upstream
+     */
+
+    u = r->upstream;
+
+    if (tf->file.fd != NGX_INVALID_FILE
+        && (r->cached || (u->header_sent && u->cacheable)))
+    {
+        ngx_http_file_cache_encoded_update(r, &ctx->encoded, tf);
+    }
+
+    return ngx_http_next_store_body_filter(r, in);
+}
+
+
+static void *
+ngx_http_cache_compressed_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_cache_compressed_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_cache_compressed_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->enable = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_cache_compressed_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_cache_compressed_conf_t *prev = parent;
+    ngx_http_cache_compressed_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_cache_compressed_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_cache_compressed_header_filter;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_cache_compressed_store_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_store_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_cache_compressed_store_header_filter;
+
+    ngx_http_next_store_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_cache_compressed_store_body_filter;
+
+    return NGX_OK;
+}
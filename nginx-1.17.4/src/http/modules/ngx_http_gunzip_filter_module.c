@@ -20,24 +20,38 @@ typedef struct {
 
 
 typedef struct {
-    ngx_chain_t         *in;
-    ngx_chain_t         *free;
-    ngx_chain_t         *busy;
-    ngx_chain_t         *out;
-    ngx_chain_t        **last_out;
-
-    ngx_buf_t           *in_buf;
-    ngx_buf_t           *out_buf;
-    ngx_int_t            bufs;
-
-    unsigned             started:1;
-    unsigned             flush:4;
-    unsigned             redo:1;
-    unsigned             done:1;
-    unsigned             nomem:1;
+    ngx_int_t            states;
+} ngx_http_gunzip_main_conf_t;
 
+
+typedef struct {
     z_stream             zstream;
-    ngx_http_request_t  *request;
+    ngx_queue_t          queue;
+    ngx_pool_t          *pool;
+    ngx_log_t           *log;
+} ngx_http_gunzip_state_t;
+
+
+typedef struct {
+    ngx_chain_t              *in;
+    ngx_chain_t              *free;
+    ngx_chain_t              *busy;
+    ngx_chain_t              *out;
+    ngx_chain_t             **last_out;
+
+    ngx_buf_t                *in_buf;
+    ngx_buf_t                *out_buf;
+    ngx_int_t                 bufs;
+
+    unsigned                  started:1;
+    unsigned                  flush:4;
+    unsigned                  redo:1;
+    unsigned                  done:1;
+    unsigned                  nomem:1;
+
+    ngx_http_gunzip_state_t  *state;
+    z_stream                 *zstream;
+    ngx_http_request_t       *request;
 } ngx_http_gunzip_ctx_t;
 
 
@@ -52,14 +66,23 @@ static ngx_int_t ngx_http_gunzip_filter_inflate(ngx_http_request_t *r,
 static ngx_int_t ngx_http_gunzip_filter_inflate_end(ngx_http_request_t *r,
     ngx_http_gunzip_ctx_t *ctx);
 
+static ngx_http_gunzip_state_t *ngx_http_gunzip_state_get(
+    ngx_http_request_t *r);
+static void ngx_http_gunzip_state_free(ngx_http_request_t *r,
+    ngx_http_gunzip_state_t *st);
+static void ngx_http_gunzip_filter_cleanup(void *data);
 static void *ngx_http_gunzip_filter_alloc(void *opaque, u_int items,
     u_int size);
 static void ngx_http_gunzip_filter_free(void *opaque, void *address);
 
 static ngx_int_t ngx_http_gunzip_filter_init(ngx_conf_t *cf);
+static void *ngx_http_gunzip_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_gunzip_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_gunzip_create_conf(ngx_conf_t *cf);
 static char *ngx_http_gunzip_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
+static ngx_int_t ngx_http_gunzip_init_process(ngx_cycle_t *cycle);
+static void ngx_http_gunzip_exit_process(ngx_cycle_t *cycle);
 
 
 static ngx_command_t  ngx_http_gunzip_filter_commands[] = {
@@ -78,6 +101,13 @@ static ngx_command_t  ngx_http_gunzip_filter_commands[] = {
       offsetof(ngx_http_gunzip_conf_t, bufs),
       NULL },
 
+    { ngx_string("gunzip_state_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_gunzip_main_conf_t, states),
+      NULL },
+
       ngx_null_command
 };
 
@@ -86,8 +116,8 @@ static ngx_http_module_t  ngx_http_gunzip_filter_module_ctx = {
     NULL,                                  /* preconfiguration */
     ngx_http_gunzip_filter_init,           /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_gunzip_create_main_conf,      /* create main configuration */
+    ngx_http_gunzip_init_main_conf,        /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -104,10 +134,10 @@ ngx_module_t  ngx_http_gunzip_filter_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_gunzip_init_process,          /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_gunzip_exit_process,          /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -116,6 +146,13 @@ ngx_module_t  ngx_http_gunzip_filter_module = {
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 
+/* idle inflate states of the worker process, most recently used first */
+
+static ngx_queue_t  ngx_http_gunzip_states;
+static ngx_uint_t   ngx_http_gunzip_nstates;
+static ngx_uint_t   ngx_http_gunzip_state_hits;
+static ngx_uint_t   ngx_http_gunzip_state_misses;
+
 
 static ngx_int_t
 ngx_http_gunzip_header_filter(ngx_http_request_t *r)
@@ -294,6 +331,11 @@ failed:
 
     ctx->done = 1;
 
+    if (ctx->state) {
+        ngx_http_gunzip_state_free(r, ctx->state);
+        ctx->state = NULL;
+    }
+
     return NGX_ERROR;
 }
 
@@ -302,24 +344,25 @@ static ngx_int_t
 ngx_http_gunzip_filter_inflate_start(ngx_http_request_t *r,
     ngx_http_gunzip_ctx_t *ctx)
 {
-    int  rc;
-
-    ctx->zstream.next_in = Z_NULL;
-    ctx->zstream.avail_in = 0;
-
-    ctx->zstream.zalloc = ngx_http_gunzip_filter_alloc;
-    ctx->zstream.zfree = ngx_http_gunzip_filter_free;
-    ctx->zstream.opaque = ctx;
+    ngx_pool_cleanup_t  *cln;
 
-    /* windowBits +16 to decode gzip, zlib 1.2.0.4+ */
-    rc = inflateInit2(&ctx->zstream, MAX_WBITS + 16);
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
 
-    if (rc != Z_OK) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                      "inflateInit2() failed: %d", rc);
+    ctx->state = ngx_http_gunzip_state_get(r);
+    if (ctx->state == NULL) {
         return NGX_ERROR;
     }
 
+    if (ctx->state->pool == NULL) {
+        cln->handler = ngx_http_gunzip_filter_cleanup;
+        cln->data = ctx;
+    }
+
+    ctx->zstream = &ctx->state->zstream;
+
     ctx->started = 1;
 
     ctx->last_out = &ctx->out;
@@ -333,7 +376,7 @@ static ngx_int_t
 ngx_http_gunzip_filter_add_data(ngx_http_request_t *r,
     ngx_http_gunzip_ctx_t *ctx)
 {
-    if (ctx->zstream.avail_in || ctx->flush != Z_NO_FLUSH || ctx->redo) {
+    if (ctx->zstream->avail_in || ctx->flush != Z_NO_FLUSH || ctx->redo) {
         return NGX_OK;
     }
 
@@ -347,13 +390,13 @@ ngx_http_gunzip_filter_add_data(ngx_http_request_t *r,
     ctx->in_buf = ctx->in->buf;
     ctx->in = ctx->in->next;
 
-    ctx->zstream.next_in = ctx->in_buf->pos;
-    ctx->zstream.avail_in = ctx->in_buf->last - ctx->in_buf->pos;
+    ctx->zstream->next_in = ctx->in_buf->pos;
+    ctx->zstream->avail_in = ctx->in_buf->last - ctx->in_buf->pos;
 
     ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "gunzip in_buf:%p ni:%p ai:%ud",
                    ctx->in_buf,
-                   ctx->zstream.next_in, ctx->zstream.avail_in);
+                   ctx->zstream->next_in, ctx->zstream->avail_in);
 
     if (ctx->in_buf->last_buf || ctx->in_buf->last_in_chain) {
         ctx->flush = Z_FINISH;
@@ -361,7 +404,7 @@ ngx_http_gunzip_filter_add_data(ngx_http_request_t *r,
     } else if (ctx->in_buf->flush) {
         ctx->flush = Z_SYNC_FLUSH;
 
-    } else if (ctx->zstream.avail_in == 0) {
+    } else if (ctx->zstream->avail_in == 0) {
         /* ctx->flush == Z_NO_FLUSH */
         return NGX_AGAIN;
     }
@@ -376,7 +419,7 @@ ngx_http_gunzip_filter_get_buf(ngx_http_request_t *r,
 {
     ngx_http_gunzip_conf_t  *conf;
 
-    if (ctx->zstream.avail_out) {
+    if (ctx->zstream->avail_out) {
         return NGX_OK;
     }
 
@@ -404,8 +447,8 @@ ngx_http_gunzip_filter_get_buf(ngx_http_request_t *r,
         return NGX_DECLINED;
     }
 
-    ctx->zstream.next_out = ctx->out_buf->pos;
-    ctx->zstream.avail_out = conf->bufs.size;
+    ctx->zstream->next_out = ctx->out_buf->pos;
+    ctx->zstream->avail_out = conf->bufs.size;
 
     return NGX_OK;
 }
@@ -421,11 +464,11 @@ ngx_http_gunzip_filter_inflate(ngx_http_request_t *r,
 
     ngx_log_debug6(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "inflate in: ni:%p no:%p ai:%ud ao:%ud fl:%d redo:%d",
-                   ctx->zstream.next_in, ctx->zstream.next_out,
-                   ctx->zstream.avail_in, ctx->zstream.avail_out,
+                   ctx->zstream->next_in, ctx->zstream->next_out,
+                   ctx->zstream->avail_in, ctx->zstream->avail_out,
                    ctx->flush, ctx->redo);
 
-    rc = inflate(&ctx->zstream, ctx->flush);
+    rc = inflate(ctx->zstream, ctx->flush);
 
     if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -435,25 +478,25 @@ ngx_http_gunzip_filter_inflate(ngx_http_request_t *r,
 
     ngx_log_debug5(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "inflate out: ni:%p no:%p ai:%ud ao:%ud rc:%d",
-                   ctx->zstream.next_in, ctx->zstream.next_out,
-                   ctx->zstream.avail_in, ctx->zstream.avail_out,
+                   ctx->zstream->next_in, ctx->zstream->next_out,
+                   ctx->zstream->avail_in, ctx->zstream->avail_out,
                    rc);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "gunzip in_buf:%p pos:%p",
                    ctx->in_buf, ctx->in_buf->pos);
 
-    if (ctx->zstream.next_in) {
-        ctx->in_buf->pos = ctx->zstream.next_in;
+    if (ctx->zstream->next_in) {
+        ctx->in_buf->pos = ctx->zstream->next_in;
 
-        if (ctx->zstream.avail_in == 0) {
-            ctx->zstream.next_in = NULL;
+        if (ctx->zstream->avail_in == 0) {
+            ctx->zstream->next_in = NULL;
         }
     }
 
-    ctx->out_buf->last = ctx->zstream.next_out;
+    ctx->out_buf->last = ctx->zstream->next_out;
 
-    if (ctx->zstream.avail_out == 0) {
+    if (ctx->zstream->avail_out == 0) {
 
         /* zlib wants to output some more data */
 
@@ -493,7 +536,7 @@ ngx_http_gunzip_filter_inflate(ngx_http_request_t *r,
             }
 
         } else {
-            ctx->zstream.avail_out = 0;
+            ctx->zstream->avail_out = 0;
         }
 
         b->flush = 1;
@@ -506,7 +549,7 @@ ngx_http_gunzip_filter_inflate(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    if (ctx->flush == Z_FINISH && ctx->zstream.avail_in == 0) {
+    if (ctx->flush == Z_FINISH && ctx->zstream->avail_in == 0) {
 
         if (rc != Z_STREAM_END) {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
@@ -521,9 +564,9 @@ ngx_http_gunzip_filter_inflate(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    if (rc == Z_STREAM_END && ctx->zstream.avail_in > 0) {
+    if (rc == Z_STREAM_END && ctx->zstream->avail_in > 0) {
 
-        rc = inflateReset(&ctx->zstream);
+        rc = inflateReset(ctx->zstream);
 
         if (rc != Z_OK) {
             ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
@@ -549,7 +592,7 @@ ngx_http_gunzip_filter_inflate(ngx_http_request_t *r,
             return NGX_ERROR;
         }
 
-        ctx->zstream.avail_out = 0;
+        ctx->zstream->avail_out = 0;
 
         cl->buf = b;
         cl->next = NULL;
@@ -567,20 +610,14 @@ static ngx_int_t
 ngx_http_gunzip_filter_inflate_end(ngx_http_request_t *r,
     ngx_http_gunzip_ctx_t *ctx)
 {
-    int           rc;
     ngx_buf_t    *b;
     ngx_chain_t  *cl;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "gunzip inflate end");
 
-    rc = inflateEnd(&ctx->zstream);
-
-    if (rc != Z_OK) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                      "inflateEnd() failed: %d", rc);
-        return NGX_ERROR;
-    }
+    ngx_http_gunzip_state_free(r, ctx->state);
+    ctx->state = NULL;
 
     b = ctx->out_buf;
 
@@ -612,28 +649,214 @@ ngx_http_gunzip_filter_inflate_end(ngx_http_request_t *r,
 }
 
 
+static ngx_http_gunzip_state_t *
+ngx_http_gunzip_state_get(ngx_http_request_t *r)
+{
+    int                           rc;
+    ngx_queue_t                  *q;
+    ngx_http_gunzip_state_t      *st;
+    ngx_http_gunzip_main_conf_t  *gmcf;
+
+    gmcf = ngx_http_get_module_main_conf(r, ngx_http_gunzip_filter_module);
+
+    if (gmcf->states == 0) {
+
+        /* without the cache the state lives in the request pool */
+
+        st = ngx_palloc(r->pool, sizeof(ngx_http_gunzip_state_t));
+        if (st == NULL) {
+            return NULL;
+        }
+
+        st->pool = r->pool;
+
+        goto init;
+    }
+
+    if (!ngx_queue_empty(&ngx_http_gunzip_states)) {
+        q = ngx_queue_head(&ngx_http_gunzip_states);
+        ngx_queue_remove(q);
+        ngx_http_gunzip_nstates--;
+
+        st = ngx_queue_data(q, ngx_http_gunzip_state_t, queue);
+        st->log = r->connection->log;
+
+        /* inflateReset() keeps the window allocated */
+
+        rc = inflateReset(&st->zstream);
+
+        st->zstream.next_in = Z_NULL;
+        st->zstream.avail_in = 0;
+        st->zstream.next_out = Z_NULL;
+        st->zstream.avail_out = 0;
+
+        if (rc == Z_OK) {
+            ngx_http_gunzip_state_hits++;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "gunzip state reuse: %p", st);
+
+            return st;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "inflateReset() failed: %d", rc);
+
+        (void) inflateEnd(&st->zstream);
+        ngx_free(st);
+    }
+
+    ngx_http_gunzip_state_misses++;
+
+    st = ngx_alloc(sizeof(ngx_http_gunzip_state_t), r->connection->log);
+    if (st == NULL) {
+        return NULL;
+    }
+
+    st->pool = NULL;
+
+init:
+
+    st->log = r->connection->log;
+
+    ngx_memzero(&st->zstream, sizeof(z_stream));
+
+    st->zstream.zalloc = ngx_http_gunzip_filter_alloc;
+    st->zstream.zfree = ngx_http_gunzip_filter_free;
+    st->zstream.opaque = st;
+
+    /* windowBits +16 to decode gzip, zlib 1.2.0.4+ */
+    rc = inflateInit2(&st->zstream, MAX_WBITS + 16);
+
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "inflateInit2() failed: %d", rc);
+
+        if (st->pool == NULL) {
+            ngx_free(st);
+        }
+
+        return NULL;
+    }
+
+    return st;
+}
+
+
+static void
+ngx_http_gunzip_state_free(ngx_http_request_t *r, ngx_http_gunzip_state_t *st)
+{
+    int                           rc;
+    ngx_queue_t                  *q;
+    ngx_http_gunzip_state_t      *last;
+    ngx_http_gunzip_main_conf_t  *gmcf;
+
+    if (st->pool) {
+        rc = inflateEnd(&st->zstream);
+
+        if (rc != Z_OK) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "inflateEnd() failed: %d", rc);
+        }
+
+        return;
+    }
+
+    gmcf = ngx_http_get_module_main_conf(r, ngx_http_gunzip_filter_module);
+
+    if (ngx_http_gunzip_nstates >= (ngx_uint_t) gmcf->states) {
+        q = ngx_queue_last(&ngx_http_gunzip_states);
+        ngx_queue_remove(q);
+
+        last = ngx_queue_data(q, ngx_http_gunzip_state_t, queue);
+        last->log = r->connection->log;
+
+        (void) inflateEnd(&last->zstream);
+        ngx_free(last);
+
+    } else {
+        ngx_http_gunzip_nstates++;
+    }
+
+    ngx_queue_insert_head(&ngx_http_gunzip_states, &st->queue);
+}
+
+
+static void
+ngx_http_gunzip_filter_cleanup(void *data)
+{
+    ngx_http_gunzip_ctx_t *ctx = data;
+
+    if (ctx->state) {
+        ngx_http_gunzip_state_free(ctx->request, ctx->state);
+        ctx->state = NULL;
+    }
+}
+
+
 static void *
 ngx_http_gunzip_filter_alloc(void *opaque, u_int items, u_int size)
 {
-    ngx_http_gunzip_ctx_t *ctx = opaque;
+    ngx_http_gunzip_state_t *st = opaque;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, st->log, 0,
                    "gunzip alloc: n:%ud s:%ud",
                    items, size);
 
-    return ngx_palloc(ctx->request->pool, items * size);
+    if (st->pool) {
+        return ngx_palloc(st->pool, items * size);
+    }
+
+    return ngx_alloc(items * size, st->log);
 }
 
 
 static void
 ngx_http_gunzip_filter_free(void *opaque, void *address)
 {
-#if 0
-    ngx_http_gunzip_ctx_t *ctx = opaque;
+    ngx_http_gunzip_state_t *st = opaque;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, st->log, 0,
                    "gunzip free: %p", address);
-#endif
+
+    /*
+     * inflateEnd() frees the window and the inflate state, which are
+     * large allocations of the request pool and are released at once
+     */
+
+    if (st->pool) {
+        (void) ngx_pfree(st->pool, address);
+        return;
+    }
+
+    ngx_free(address);
+}
+
+
+static void *
+ngx_http_gunzip_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_gunzip_main_conf_t  *gmcf;
+
+    gmcf = ngx_palloc(cf->pool, sizeof(ngx_http_gunzip_main_conf_t));
+    if (gmcf == NULL) {
+        return NULL;
+    }
+
+    gmcf->states = NGX_CONF_UNSET;
+
+    return gmcf;
+}
+
+
+static char *
+ngx_http_gunzip_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_gunzip_main_conf_t *gmcf = conf;
+
+    ngx_conf_init_value(gmcf->states, 0);
+
+    return NGX_CONF_OK;
 }
 
 
@@ -685,3 +908,40 @@ ngx_http_gunzip_filter_init(ngx_conf_t *cf)
 
     return NGX_OK;
 }
+
+
+static ngx_int_t
+ngx_http_gunzip_init_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_init(&ngx_http_gunzip_states);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_gunzip_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_t              *q;
+    ngx_http_gunzip_state_t  *st;
+
+    if (ngx_http_gunzip_state_hits) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "gunzip state cache: %ui hits, %ui misses",
+                      ngx_http_gunzip_state_hits,
+                      ngx_http_gunzip_state_misses);
+    }
+
+    while (!ngx_queue_empty(&ngx_http_gunzip_states)) {
+        q = ngx_queue_head(&ngx_http_gunzip_states);
+        ngx_queue_remove(q);
+
+        st = ngx_queue_data(q, ngx_http_gunzip_state_t, queue);
+        st->log = cycle->log;
+
+        (void) inflateEnd(&st->zstream);
+        ngx_free(st);
+    }
+
+    ngx_http_gunzip_nstates = 0;
+}
@@ -31,41 +31,64 @@ typedef struct {
 
 
 typedef struct {
-    ngx_chain_t         *in;
-    ngx_chain_t         *free;
-    ngx_chain_t         *busy;
-    ngx_chain_t         *out;
-    ngx_chain_t        **last_out;
+    ngx_int_t            states;
+} ngx_http_gzip_main_conf_t;
 
-    ngx_chain_t         *copied;
-    ngx_chain_t         *copy_buf;
 
-    ngx_buf_t           *in_buf;
-    ngx_buf_t           *out_buf;
-    ngx_int_t            bufs;
+typedef struct {
+    z_stream             zstream;
+    ngx_queue_t          queue;
 
-    void                *preallocated;
     char                *free_mem;
     ngx_uint_t           allocated;
 
+    int                  level;
     int                  wbits;
     int                  memlevel;
 
-    unsigned             flush:4;
-    unsigned             redo:1;
-    unsigned             done:1;
-    unsigned             nomem:1;
-    unsigned             buffering:1;
     unsigned             intel:1;
 
-    size_t               zin;
-    size_t               zout;
+    ngx_pool_t          *pool;
+    ngx_log_t           *log;
+} ngx_http_gzip_state_t;
 
-    z_stream             zstream;
-    ngx_http_request_t  *request;
+
+typedef struct {
+    ngx_chain_t            *in;
+    ngx_chain_t            *free;
+    ngx_chain_t            *busy;
+    ngx_chain_t            *out;
+    ngx_chain_t           **last_out;
+
+    ngx_chain_t            *copied;
+    ngx_chain_t            *copy_buf;
+
+    ngx_buf_t              *in_buf;
+    ngx_buf_t              *out_buf;
+    ngx_int_t               bufs;
+
+    ngx_http_gzip_state_t  *state;
+    ngx_uint_t              allocated;
+
+    int                     wbits;
+    int                     memlevel;
+
+    unsigned                flush:4;
+    unsigned                redo:1;
+    unsigned                done:1;
+    unsigned                nomem:1;
+    unsigned                buffering:1;
+    unsigned                intel:1;
+
+    size_t                  zin;
+    size_t                  zout;
+
+    z_stream               *zstream;
+    ngx_http_request_t     *request;
 } ngx_http_gzip_ctx_t;
 
 
+static ngx_int_t ngx_http_gzip_filter_test(ngx_http_request_t *r);
 static void ngx_http_gzip_filter_memory(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 static ngx_int_t ngx_http_gzip_filter_buffer(ngx_http_gzip_ctx_t *ctx,
@@ -81,6 +104,11 @@ static ngx_int_t ngx_http_gzip_filter_deflate(ngx_http_request_t *r,
 static ngx_int_t ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx);
 
+static ngx_http_gzip_state_t *ngx_http_gzip_state_get(ngx_http_request_t *r,
+    ngx_http_gzip_ctx_t *ctx, int level);
+static void ngx_http_gzip_state_free(ngx_http_request_t *r,
+    ngx_http_gzip_state_t *st);
+static void ngx_http_gzip_filter_cleanup(void *data);
 static void *ngx_http_gzip_filter_alloc(void *opaque, u_int items,
     u_int size);
 static void ngx_http_gzip_filter_free(void *opaque, void *address);
@@ -92,11 +120,15 @@ static ngx_int_t ngx_http_gzip_ratio_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 
 static ngx_int_t ngx_http_gzip_filter_init(ngx_conf_t *cf);
+static void *ngx_http_gzip_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_gzip_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_gzip_create_conf(ngx_conf_t *cf);
 static char *ngx_http_gzip_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
 static char *ngx_http_gzip_window(ngx_conf_t *cf, void *post, void *data);
 static char *ngx_http_gzip_hash(ngx_conf_t *cf, void *post, void *data);
+static ngx_int_t ngx_http_gzip_init_process(ngx_cycle_t *cycle);
+static void ngx_http_gzip_exit_process(ngx_cycle_t *cycle);
 
 
 static ngx_conf_num_bounds_t  ngx_http_gzip_comp_level_bounds = {
@@ -173,6 +205,13 @@ static ngx_command_t  ngx_http_gzip_filter_commands[] = {
       offsetof(ngx_http_gzip_conf_t, min_length),
       NULL },
 
+    { ngx_string("gzip_state_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_gzip_main_conf_t, states),
+      NULL },
+
       ngx_null_command
 };
 
@@ -181,8 +220,8 @@ static ngx_http_module_t  ngx_http_gzip_filter_module_ctx = {
     ngx_http_gzip_add_variables,           /* preconfiguration */
     ngx_http_gzip_filter_init,             /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_gzip_create_main_conf,        /* create main configuration */
+    ngx_http_gzip_init_main_conf,          /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -199,10 +238,10 @@ ngx_module_t  ngx_http_gzip_filter_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_gzip_init_process,            /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_gzip_exit_process,            /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -214,6 +253,14 @@ static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 
 static ngx_uint_t  ngx_http_gzip_assume_intel;
+static ngx_int_t   ngx_http_gzip_encoding;
+
+/* idle deflate states of the worker process, most recently used first */
+
+static ngx_queue_t  ngx_http_gzip_states;
+static ngx_uint_t   ngx_http_gzip_nstates;
+static ngx_uint_t   ngx_http_gzip_state_hits;
+static ngx_uint_t   ngx_http_gzip_state_misses;
 
 
 static ngx_int_t
@@ -223,19 +270,7 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
     ngx_http_gzip_ctx_t   *ctx;
     ngx_http_gzip_conf_t  *conf;
 
-    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
-
-    if (!conf->enable
-        || (r->headers_out.status != NGX_HTTP_OK
-            && r->headers_out.status != NGX_HTTP_FORBIDDEN
-            && r->headers_out.status != NGX_HTTP_NOT_FOUND)
-        || (r->headers_out.content_encoding
-            && r->headers_out.content_encoding->value.len)
-        || (r->headers_out.content_length_n != -1
-            && r->headers_out.content_length_n < conf->min_length)
-        || ngx_http_test_content_type(r, &conf->types) == NULL
-        || r->header_only)
-    {
+    if (ngx_http_gzip_filter_test(r) != NGX_OK) {
         return ngx_http_next_header_filter(r);
     }
 
@@ -253,15 +288,12 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
     }
 #endif
 
-    if (!r->gzip_tested) {
-        if (ngx_http_gzip_ok(r) != NGX_OK) {
-            return ngx_http_next_header_filter(r);
-        }
-
-    } else if (!r->gzip_ok) {
+    if (ngx_http_select_encoding(r) != ngx_http_gzip_encoding) {
         return ngx_http_next_header_filter(r);
     }
 
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
     ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_gzip_ctx_t));
     if (ctx == NULL) {
         return NGX_ERROR;
@@ -294,6 +326,31 @@ ngx_http_gzip_header_filter(ngx_http_request_t *r)
 }
 
 
+static ngx_int_t
+ngx_http_gzip_filter_test(ngx_http_request_t *r)
+{
+    ngx_http_gzip_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
+
+    if (!conf->enable
+        || (r->headers_out.status != NGX_HTTP_OK
+            && r->headers_out.status != NGX_HTTP_FORBIDDEN
+            && r->headers_out.status != NGX_HTTP_NOT_FOUND)
+        || (r->headers_out.content_encoding
+            && r->headers_out.content_encoding->value.len)
+        || (r->headers_out.content_length_n != -1
+            && r->headers_out.content_length_n < conf->min_length)
+        || ngx_http_test_content_type(r, &conf->types) == NULL
+        || r->header_only)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
@@ -341,7 +398,7 @@ ngx_http_gzip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         }
     }
 
-    if (ctx->preallocated == NULL) {
+    if (ctx->zstream == NULL) {
         if (ngx_http_gzip_filter_deflate_start(r, ctx) != NGX_OK) {
             goto failed;
         }
@@ -451,10 +508,9 @@ failed:
 
     ctx->done = 1;
 
-    if (ctx->preallocated) {
-        deflateEnd(&ctx->zstream);
-
-        ngx_pfree(r->pool, ctx->preallocated);
+    if (ctx->state) {
+        ngx_http_gzip_state_free(r, ctx->state);
+        ctx->state = NULL;
     }
 
     ngx_http_gzip_filter_free_copy_buf(r, ctx);
@@ -495,8 +551,9 @@ ngx_http_gzip_filter_memory(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
      * We preallocate a memory for zlib in one buffer (200K-400K), this
      * decreases a number of malloc() and free() calls and also probably
      * decreases a number of syscalls (sbrk()/mmap() and so on).
-     * Besides we free the memory as soon as a gzipping will complete
-     * and do not wait while a whole response will be sent to a client.
+     * Besides we release the memory as soon as a gzipping will complete
+     * and do not wait while a whole response will be sent to a client,
+     * so it may be reused by the next response, see gzip_state_cache.
      *
      * 8K is for zlib deflate_state, it takes
      *  *) 5816 bytes on i386 and sparc64 (32-bit mode)
@@ -599,31 +656,28 @@ static ngx_int_t
 ngx_http_gzip_filter_deflate_start(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx)
 {
-    int                    rc;
+    ngx_pool_cleanup_t    *cln;
     ngx_http_gzip_conf_t  *conf;
 
     conf = ngx_http_get_module_loc_conf(r, ngx_http_gzip_filter_module);
 
-    ctx->preallocated = ngx_palloc(r->pool, ctx->allocated);
-    if (ctx->preallocated == NULL) {
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->free_mem = ctx->preallocated;
-
-    ctx->zstream.zalloc = ngx_http_gzip_filter_alloc;
-    ctx->zstream.zfree = ngx_http_gzip_filter_free;
-    ctx->zstream.opaque = ctx;
-
-    rc = deflateInit2(&ctx->zstream, (int) conf->level, Z_DEFLATED,
-                      ctx->wbits + 16, ctx->memlevel, Z_DEFAULT_STRATEGY);
-
-    if (rc != Z_OK) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                      "deflateInit2() failed: %d", rc);
+    ctx->state = ngx_http_gzip_state_get(r, ctx, (int) conf->level);
+    if (ctx->state == NULL) {
         return NGX_ERROR;
     }
 
+    if (ctx->state->pool == NULL) {
+        cln->handler = ngx_http_gzip_filter_cleanup;
+        cln->data = ctx;
+    }
+
+    ctx->zstream = &ctx->state->zstream;
+
     ctx->last_out = &ctx->out;
     ctx->flush = Z_NO_FLUSH;
 
@@ -636,7 +690,7 @@ ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 {
     ngx_chain_t  *cl;
 
-    if (ctx->zstream.avail_in || ctx->flush != Z_NO_FLUSH || ctx->redo) {
+    if (ctx->zstream->avail_in || ctx->flush != Z_NO_FLUSH || ctx->redo) {
         return NGX_OK;
     }
 
@@ -670,13 +724,13 @@ ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
         ngx_free_chain(r->pool, cl);
     }
 
-    ctx->zstream.next_in = ctx->in_buf->pos;
-    ctx->zstream.avail_in = ctx->in_buf->last - ctx->in_buf->pos;
+    ctx->zstream->next_in = ctx->in_buf->pos;
+    ctx->zstream->avail_in = ctx->in_buf->last - ctx->in_buf->pos;
 
     ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "gzip in_buf:%p ni:%p ai:%ud",
                    ctx->in_buf,
-                   ctx->zstream.next_in, ctx->zstream.avail_in);
+                   ctx->zstream->next_in, ctx->zstream->avail_in);
 
     if (ctx->in_buf->last_buf) {
         ctx->flush = Z_FINISH;
@@ -684,7 +738,7 @@ ngx_http_gzip_filter_add_data(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
     } else if (ctx->in_buf->flush) {
         ctx->flush = Z_SYNC_FLUSH;
 
-    } else if (ctx->zstream.avail_in == 0) {
+    } else if (ctx->zstream->avail_in == 0) {
         /* ctx->flush == Z_NO_FLUSH */
         return NGX_AGAIN;
     }
@@ -699,7 +753,7 @@ ngx_http_gzip_filter_get_buf(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
     ngx_chain_t           *cl;
     ngx_http_gzip_conf_t  *conf;
 
-    if (ctx->zstream.avail_out) {
+    if (ctx->zstream->avail_out) {
         return NGX_OK;
     }
 
@@ -729,8 +783,8 @@ ngx_http_gzip_filter_get_buf(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
         return NGX_DECLINED;
     }
 
-    ctx->zstream.next_out = ctx->out_buf->pos;
-    ctx->zstream.avail_out = conf->bufs.size;
+    ctx->zstream->next_out = ctx->out_buf->pos;
+    ctx->zstream->avail_out = conf->bufs.size;
 
     return NGX_OK;
 }
@@ -746,11 +800,11 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 
     ngx_log_debug6(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                  "deflate in: ni:%p no:%p ai:%ud ao:%ud fl:%d redo:%d",
-                 ctx->zstream.next_in, ctx->zstream.next_out,
-                 ctx->zstream.avail_in, ctx->zstream.avail_out,
+                 ctx->zstream->next_in, ctx->zstream->next_out,
+                 ctx->zstream->avail_in, ctx->zstream->avail_out,
                  ctx->flush, ctx->redo);
 
-    rc = deflate(&ctx->zstream, ctx->flush);
+    rc = deflate(ctx->zstream, ctx->flush);
 
     if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
         ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
@@ -760,25 +814,25 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
 
     ngx_log_debug5(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "deflate out: ni:%p no:%p ai:%ud ao:%ud rc:%d",
-                   ctx->zstream.next_in, ctx->zstream.next_out,
-                   ctx->zstream.avail_in, ctx->zstream.avail_out,
+                   ctx->zstream->next_in, ctx->zstream->next_out,
+                   ctx->zstream->avail_in, ctx->zstream->avail_out,
                    rc);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "gzip in_buf:%p pos:%p",
                    ctx->in_buf, ctx->in_buf->pos);
 
-    if (ctx->zstream.next_in) {
-        ctx->in_buf->pos = ctx->zstream.next_in;
+    if (ctx->zstream->next_in) {
+        ctx->in_buf->pos = ctx->zstream->next_in;
 
-        if (ctx->zstream.avail_in == 0) {
-            ctx->zstream.next_in = NULL;
+        if (ctx->zstream->avail_in == 0) {
+            ctx->zstream->next_in = NULL;
         }
     }
 
-    ctx->out_buf->last = ctx->zstream.next_out;
+    ctx->out_buf->last = ctx->zstream->next_out;
 
-    if (ctx->zstream.avail_out == 0 && rc != Z_STREAM_END) {
+    if (ctx->zstream->avail_out == 0 && rc != Z_STREAM_END) {
 
         /* zlib wants to output some more gzipped data */
 
@@ -818,7 +872,7 @@ ngx_http_gzip_filter_deflate(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx)
             }
 
         } else {
-            ctx->zstream.avail_out = 0;
+            ctx->zstream->avail_out = 0;
         }
 
         b->flush = 1;
@@ -867,22 +921,17 @@ static ngx_int_t
 ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     ngx_http_gzip_ctx_t *ctx)
 {
-    int           rc;
     ngx_buf_t    *b;
     ngx_chain_t  *cl;
 
-    ctx->zin = ctx->zstream.total_in;
-    ctx->zout = ctx->zstream.total_out;
+    ctx->zin = ctx->zstream->total_in;
+    ctx->zout = ctx->zstream->total_out;
 
-    rc = deflateEnd(&ctx->zstream);
+    ctx->zstream->avail_in = 0;
+    ctx->zstream->avail_out = 0;
 
-    if (rc != Z_OK) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
-                      "deflateEnd() failed: %d", rc);
-        return NGX_ERROR;
-    }
-
-    ngx_pfree(r->pool, ctx->preallocated);
+    ngx_http_gzip_state_free(r, ctx->state);
+    ctx->state = NULL;
 
     cl = ngx_alloc_chain_link(r->pool);
     if (cl == NULL) {
@@ -902,9 +951,6 @@ ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
     *ctx->last_out = cl;
     ctx->last_out = &cl->next;
 
-    ctx->zstream.avail_in = 0;
-    ctx->zstream.avail_out = 0;
-
     ctx->done = 1;
 
     r->connection->buffered &= ~NGX_HTTP_GZIP_BUFFERED;
@@ -913,10 +959,185 @@ ngx_http_gzip_filter_deflate_end(ngx_http_request_t *r,
 }
 
 
+static ngx_http_gzip_state_t *
+ngx_http_gzip_state_get(ngx_http_request_t *r, ngx_http_gzip_ctx_t *ctx,
+    int level)
+{
+    int                         rc;
+    ngx_queue_t                *q;
+    ngx_http_gzip_state_t      *st;
+    ngx_http_gzip_main_conf_t  *gmcf;
+
+    gmcf = ngx_http_get_module_main_conf(r, ngx_http_gzip_filter_module);
+
+    if (gmcf->states == 0) {
+
+        /* without the cache the state lives in the request pool */
+
+        st = ngx_palloc(r->pool,
+                        sizeof(ngx_http_gzip_state_t) + ctx->allocated);
+        if (st == NULL) {
+            return NULL;
+        }
+
+        st->pool = r->pool;
+
+        goto init;
+    }
+
+    for (q = ngx_queue_head(&ngx_http_gzip_states);
+         q != ngx_queue_sentinel(&ngx_http_gzip_states);
+         q = ngx_queue_next(q))
+    {
+        st = ngx_queue_data(q, ngx_http_gzip_state_t, queue);
+
+        if (st->level != level
+            || st->wbits != ctx->wbits
+            || st->memlevel != ctx->memlevel)
+        {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_http_gzip_nstates--;
+
+        st->log = r->connection->log;
+
+        rc = deflateReset(&st->zstream);
+
+        st->zstream.next_in = Z_NULL;
+        st->zstream.avail_in = 0;
+        st->zstream.next_out = Z_NULL;
+        st->zstream.avail_out = 0;
+
+        if (rc != Z_OK) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "deflateReset() failed: %d", rc);
+
+            (void) deflateEnd(&st->zstream);
+            ngx_free(st);
+
+            break;
+        }
+
+        ngx_http_gzip_state_hits++;
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "gzip state reuse: %p l:%d w:%d m:%d",
+                       st, level, ctx->wbits, ctx->memlevel);
+
+        return st;
+    }
+
+    ngx_http_gzip_state_misses++;
+
+    st = ngx_alloc(sizeof(ngx_http_gzip_state_t) + ctx->allocated,
+                   r->connection->log);
+    if (st == NULL) {
+        return NULL;
+    }
+
+    st->pool = NULL;
+
+init:
+
+    st->free_mem = (char *) st + sizeof(ngx_http_gzip_state_t);
+    st->allocated = ctx->allocated;
+
+    st->level = level;
+    st->wbits = ctx->wbits;
+    st->memlevel = ctx->memlevel;
+    st->intel = ctx->intel;
+    st->log = r->connection->log;
+
+    ngx_memzero(&st->zstream, sizeof(z_stream));
+
+    st->zstream.zalloc = ngx_http_gzip_filter_alloc;
+    st->zstream.zfree = ngx_http_gzip_filter_free;
+    st->zstream.opaque = st;
+
+    rc = deflateInit2(&st->zstream, level, Z_DEFLATED,
+                      ctx->wbits + 16, ctx->memlevel, Z_DEFAULT_STRATEGY);
+
+    if (rc != Z_OK) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "deflateInit2() failed: %d", rc);
+
+        if (st->pool) {
+            ngx_pfree(st->pool, st);
+
+        } else {
+            ngx_free(st);
+        }
+
+        return NULL;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "gzip state new: %p l:%d w:%d m:%d",
+                   st, level, ctx->wbits, ctx->memlevel);
+
+    return st;
+}
+
+
+static void
+ngx_http_gzip_state_free(ngx_http_request_t *r, ngx_http_gzip_state_t *st)
+{
+    int                         rc;
+    ngx_queue_t                *q;
+    ngx_http_gzip_state_t      *last;
+    ngx_http_gzip_main_conf_t  *gmcf;
+
+    if (st->pool) {
+        rc = deflateEnd(&st->zstream);
+
+        if (rc != Z_OK && rc != Z_DATA_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                          "deflateEnd() failed: %d", rc);
+        }
+
+        ngx_pfree(st->pool, st);
+
+        return;
+    }
+
+    gmcf = ngx_http_get_module_main_conf(r, ngx_http_gzip_filter_module);
+
+    if (ngx_http_gzip_nstates >= (ngx_uint_t) gmcf->states) {
+        q = ngx_queue_last(&ngx_http_gzip_states);
+        ngx_queue_remove(q);
+
+        last = ngx_queue_data(q, ngx_http_gzip_state_t, queue);
+        last->log = r->connection->log;
+
+        (void) deflateEnd(&last->zstream);
+        ngx_free(last);
+
+    } else {
+        ngx_http_gzip_nstates++;
+    }
+
+    ngx_queue_insert_head(&ngx_http_gzip_states, &st->queue);
+}
+
+
+static void
+ngx_http_gzip_filter_cleanup(void *data)
+{
+    ngx_http_gzip_ctx_t *ctx = data;
+
+    if (ctx->state) {
+        ngx_http_gzip_state_free(ctx->request, ctx->state);
+        ctx->state = NULL;
+    }
+}
+
+
 static void *
 ngx_http_gzip_filter_alloc(void *opaque, u_int items, u_int size)
 {
-    ngx_http_gzip_ctx_t *ctx = opaque;
+    ngx_http_gzip_state_t *st = opaque;
 
     void        *p;
     ngx_uint_t   alloc;
@@ -933,28 +1154,32 @@ ngx_http_gzip_filter_alloc(void *opaque, u_int items, u_int size)
         alloc = 8192;
     }
 
-    if (alloc <= ctx->allocated) {
-        p = ctx->free_mem;
-        ctx->free_mem += alloc;
-        ctx->allocated -= alloc;
+    if (alloc <= st->allocated) {
+        p = st->free_mem;
+        st->free_mem += alloc;
+        st->allocated -= alloc;
 
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, st->log, 0,
                        "gzip alloc: n:%ud s:%ud a:%ui p:%p",
                        items, size, alloc, p);
 
         return p;
     }
 
-    if (ctx->intel) {
-        ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, 0,
+    if (st->intel) {
+        ngx_log_error(NGX_LOG_ALERT, st->log, 0,
                       "gzip filter failed to use preallocated memory: "
-                      "%ud of %ui", items * size, ctx->allocated);
+                      "%ud of %ui", items * size, st->allocated);
 
     } else {
         ngx_http_gzip_assume_intel = 1;
     }
 
-    p = ngx_palloc(ctx->request->pool, items * size);
+    if (st->pool) {
+        return ngx_palloc(st->pool, items * size);
+    }
+
+    p = ngx_alloc(items * size, st->log);
 
     return p;
 }
@@ -963,12 +1188,22 @@ ngx_http_gzip_filter_alloc(void *opaque, u_int items, u_int size)
 static void
 ngx_http_gzip_filter_free(void *opaque, void *address)
 {
-#if 0
-    ngx_http_gzip_ctx_t *ctx = opaque;
+    ngx_http_gzip_state_t *st = opaque;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, st->log, 0,
                    "gzip free: %p", address);
-#endif
+
+    /*
+     * the preallocated memory is freed with the state itself,
+     * and the request pool memory with the pool
+     */
+
+    if (st->pool == NULL
+        && ((char *) address < (char *) st
+            || (char *) address >= st->free_mem + st->allocated))
+    {
+        ngx_free(address);
+    }
 }
 
 
@@ -1046,6 +1281,33 @@ ngx_http_gzip_ratio_variable(ngx_http_request_t *r,
 }
 
 
+static void *
+ngx_http_gzip_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_gzip_main_conf_t  *gmcf;
+
+    gmcf = ngx_palloc(cf->pool, sizeof(ngx_http_gzip_main_conf_t));
+    if (gmcf == NULL) {
+        return NULL;
+    }
+
+    gmcf->states = NGX_CONF_UNSET;
+
+    return gmcf;
+}
+
+
+static char *
+ngx_http_gzip_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_gzip_main_conf_t *gmcf = conf;
+
+    ngx_conf_init_value(gmcf->states, 0);
+
+    return NGX_CONF_OK;
+}
+
+
 static void *
 ngx_http_gzip_create_conf(ngx_conf_t *cf)
 {
@@ -1112,6 +1374,14 @@ ngx_http_gzip_merge_conf(ngx_conf_t *cf, void *parent, void *child)
 static ngx_int_t
 ngx_http_gzip_filter_init(ngx_conf_t *cf)
 {
+    ngx_str_t  name = ngx_string("gzip");
+
+    ngx_http_gzip_encoding = ngx_http_add_encoding(cf, &name,
+                                                   ngx_http_gzip_filter_test);
+    if (ngx_http_gzip_encoding == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
     ngx_http_next_header_filter = ngx_http_top_header_filter;
     ngx_http_top_header_filter = ngx_http_gzip_header_filter;
 
@@ -1168,3 +1438,39 @@ ngx_http_gzip_hash(ngx_conf_t *cf, void *post, void *data)
 
     return "must be 512, 1k, 2k, 4k, 8k, 16k, 32k, 64k, or 128k";
 }
+
+
+static ngx_int_t
+ngx_http_gzip_init_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_init(&ngx_http_gzip_states);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_gzip_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_t            *q;
+    ngx_http_gzip_state_t  *st;
+
+    if (ngx_http_gzip_state_hits) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "gzip state cache: %ui hits, %ui misses",
+                      ngx_http_gzip_state_hits, ngx_http_gzip_state_misses);
+    }
+
+    while (!ngx_queue_empty(&ngx_http_gzip_states)) {
+        q = ngx_queue_head(&ngx_http_gzip_states);
+        ngx_queue_remove(q);
+
+        st = ngx_queue_data(q, ngx_http_gzip_state_t, queue);
+        st->log = cycle->log;
+
+        (void) deflateEnd(&st->zstream);
+        ngx_free(st);
+    }
+
+    ngx_http_gzip_nstates = 0;
+}
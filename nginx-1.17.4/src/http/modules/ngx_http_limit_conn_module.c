@@ -18,15 +18,73 @@ typedef struct {
 } ngx_http_limit_conn_node_t;
 
 
+/*
+ * Nodes of synchronized zones are preceded by a link, which links them
+ * into the changes of the zone while the count is changed since the last
+ * synchronization, and points to itself otherwise.  The link is not
+ * allocated in other zones.
+ */
+
+#define ngx_http_limit_conn_link(lc)                                          \
+    ((ngx_queue_t *) ((u_char *) (lc) - offsetof(ngx_rbtree_node_t, color)) \
+     - 1)
+
+#define ngx_http_limit_conn_link_data(q)                                      \
+    ((ngx_http_limit_conn_node_t *) &((ngx_rbtree_node_t *) ((q) + 1))->color)
+
+
 typedef struct {
     ngx_shm_zone_t            *shm_zone;
     ngx_rbtree_node_t         *node;
 } ngx_http_limit_conn_cleanup_t;
 
 
+/*
+ * Only changed counts are sent, and all counts are sent again once in
+ * NGX_HTTP_LIMIT_CONN_REFRESH rounds, so that lost datagrams do not leave
+ * stale counts behind.  Connection counts of peers are kept per peer in
+ * direct-mapped tables indexed by the key hash.  A count is used while
+ * the peer is alive and the count was reported after the previous refresh
+ * of the peer.
+ */
+
+#define NGX_HTTP_LIMIT_CONN_SLOTS    4096
+#define NGX_HTTP_LIMIT_CONN_REFRESH  10
+
+
+typedef struct {
+    uint32_t                   hash;
+    u_short                    conn;
+    u_short                    seq;
+} ngx_http_limit_conn_slot_t;
+
+
+typedef struct {
+    ngx_msec_t                 last;
+    uint32_t                   epoch;
+    uint32_t                   seq;
+} ngx_http_limit_conn_peer_t;
+
+
 typedef struct {
-    ngx_rbtree_t              *rbtree;
-    ngx_http_complex_value_t   key;
+    ngx_uint_t                   npeers;
+    ngx_msec_t                   ttl;
+    ngx_http_limit_conn_peer_t  *peers;
+    ngx_http_limit_conn_slot_t  *slots;
+} ngx_http_limit_conn_remote_t;
+
+
+typedef struct {
+    ngx_rbtree_t                  *rbtree;
+    ngx_http_complex_value_t       key;
+    ngx_http_limit_sync_zone_t    *sync;
+    ngx_http_limit_conn_remote_t  *remote;
+    /* nodes changed since the last synchronization */
+    ngx_queue_t                   *dirty;
+    /* round of the last refresh, used by the sending worker only */
+    uint32_t                       refreshed;
+    /* size of the link preceding nodes */
+    size_t                         link;
 } ngx_http_limit_conn_ctx_t;
 
 
@@ -45,8 +103,20 @@ typedef struct {
 
 static ngx_rbtree_node_t *ngx_http_limit_conn_lookup(ngx_rbtree_t *rbtree,
     ngx_str_t *key, uint32_t hash);
+static ngx_inline void ngx_http_limit_conn_changed(
+    ngx_http_limit_conn_ctx_t *ctx, ngx_http_limit_conn_node_t *lc);
 static void ngx_http_limit_conn_cleanup(void *data);
 static ngx_inline void ngx_http_limit_conn_cleanup_all(ngx_pool_t *pool);
+static ngx_uint_t ngx_http_limit_conn_remote(
+    ngx_http_limit_conn_remote_t *remote, uint32_t hash);
+static ngx_int_t ngx_http_limit_conn_sync_collect(
+    ngx_http_limit_sync_zone_t *zone, ngx_array_t *entries, ngx_pool_t *pool);
+static ngx_int_t ngx_http_limit_conn_sync_entry(ngx_array_t *entries,
+    ngx_pool_t *pool, ngx_http_limit_conn_node_t *lc);
+static void ngx_http_limit_conn_sync_merge(ngx_http_limit_sync_zone_t *zone,
+    ngx_http_limit_sync_msg_t *msg);
+static ngx_int_t ngx_http_limit_conn_init_remote(ngx_shm_zone_t *shm_zone,
+    ngx_http_limit_conn_ctx_t *octx);
 
 static void *ngx_http_limit_conn_create_conf(ngx_conf_t *cf);
 static char *ngx_http_limit_conn_merge_conf(ngx_conf_t *cf, void *parent,
@@ -75,7 +145,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_conn_status_bounds = {
 static ngx_command_t  ngx_http_limit_conn_commands[] = {
 
     { ngx_string("limit_conn_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
       ngx_http_limit_conn_zone,
       0,
       0,
@@ -143,7 +213,7 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
     size_t                          n;
     uint32_t                        hash;
     ngx_str_t                       key;
-    ngx_uint_t                      i;
+    ngx_uint_t                      i, remote;
     ngx_slab_pool_t                *shpool;
     ngx_rbtree_node_t              *node;
     ngx_pool_cleanup_t             *cln;
@@ -187,11 +257,19 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 
         ngx_shmtx_lock(&shpool->mutex);
 
+        remote = ctx->remote ? ngx_http_limit_conn_remote(ctx->remote, hash)
+                             : 0;
+
         node = ngx_http_limit_conn_lookup(ctx->rbtree, &key, hash);
 
         if (node == NULL) {
 
-            n = offsetof(ngx_rbtree_node_t, color)
+            if (remote >= limits[i].conn) {
+                goto limit;
+            }
+
+            n = ctx->link
+                + offsetof(ngx_rbtree_node_t, color)
                 + offsetof(ngx_http_limit_conn_node_t, data)
                 + key.len;
 
@@ -203,8 +281,14 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
                 return lccf->status_code;
             }
 
+            node = (ngx_rbtree_node_t *) ((u_char *) node + ctx->link);
+
             lc = (ngx_http_limit_conn_node_t *) &node->color;
 
+            if (ctx->link) {
+                ngx_queue_init(ngx_http_limit_conn_link(lc));
+            }
+
             node->key = hash;
             lc->len = (u_char) key.len;
             lc->conn = 1;
@@ -212,23 +296,19 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
 
             ngx_rbtree_insert(ctx->rbtree, node);
 
+            ngx_http_limit_conn_changed(ctx, lc);
+
         } else {
 
             lc = (ngx_http_limit_conn_node_t *) &node->color;
 
-            if ((ngx_uint_t) lc->conn >= limits[i].conn) {
-
-                ngx_shmtx_unlock(&shpool->mutex);
-
-                ngx_log_error(lccf->log_level, r->connection->log, 0,
-                              "limiting connections by zone \"%V\"",
-                              &limits[i].shm_zone->shm.name);
-
-                ngx_http_limit_conn_cleanup_all(r->pool);
-                return lccf->status_code;
+            if ((ngx_uint_t) lc->conn + remote >= limits[i].conn) {
+                goto limit;
             }
 
             lc->conn++;
+
+            ngx_http_limit_conn_changed(ctx, lc);
         }
 
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -250,6 +330,17 @@ ngx_http_limit_conn_handler(ngx_http_request_t *r)
     }
 
     return NGX_DECLINED;
+
+limit:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_error(lccf->log_level, r->connection->log, 0,
+                  "limiting connections by zone \"%V\"",
+                  &limits[i].shm_zone->shm.name);
+
+    ngx_http_limit_conn_cleanup_all(r->pool);
+    return lccf->status_code;
 }
 
 
@@ -355,15 +446,39 @@ ngx_http_limit_conn_cleanup(void *data)
 
     lc->conn--;
 
-    if (lc->conn == 0) {
+    if (ctx->dirty) {
+
+        /* a node without connections is deleted once it is synchronized */
+
+        ngx_http_limit_conn_changed(ctx, lc);
+
+    } else if (lc->conn == 0) {
         ngx_rbtree_delete(ctx->rbtree, node);
-        ngx_slab_free_locked(shpool, node);
+        ngx_slab_free_locked(shpool, (u_char *) node - ctx->link);
     }
 
     ngx_shmtx_unlock(&shpool->mutex);
 }
 
 
+static ngx_inline void
+ngx_http_limit_conn_changed(ngx_http_limit_conn_ctx_t *ctx,
+    ngx_http_limit_conn_node_t *lc)
+{
+    ngx_queue_t  *q;
+
+    if (ctx->dirty == NULL) {
+        return;
+    }
+
+    q = ngx_http_limit_conn_link(lc);
+
+    if (ngx_queue_empty(q)) {
+        ngx_queue_insert_tail(ctx->dirty, q);
+    }
+}
+
+
 static ngx_inline void
 ngx_http_limit_conn_cleanup_all(ngx_pool_t *pool)
 {
@@ -380,6 +495,273 @@ ngx_http_limit_conn_cleanup_all(ngx_pool_t *pool)
 }
 
 
+static ngx_uint_t
+ngx_http_limit_conn_remote(ngx_http_limit_conn_remote_t *remote,
+    uint32_t hash)
+{
+    ngx_uint_t                   i, n;
+    ngx_http_limit_conn_peer_t  *peer;
+    ngx_http_limit_conn_slot_t  *slot;
+
+    n = 0;
+
+    for (i = 0; i < remote->npeers; i++) {
+        peer = &remote->peers[i];
+
+        if (ngx_current_msec - peer->last > remote->ttl) {
+            continue;
+        }
+
+        slot = &remote->slots[i * NGX_HTTP_LIMIT_CONN_SLOTS
+                              + hash % NGX_HTTP_LIMIT_CONN_SLOTS];
+
+        /* refreshes may be a round late */
+
+        if (slot->hash == hash
+            && (u_short) ((u_short) peer->seq - slot->seq)
+               <= 2 * NGX_HTTP_LIMIT_CONN_REFRESH)
+        {
+            n += slot->conn;
+        }
+    }
+
+    return n;
+}
+
+
+static ngx_int_t
+ngx_http_limit_conn_sync_collect(ngx_http_limit_sync_zone_t *zone,
+    ngx_array_t *entries, ngx_pool_t *pool)
+{
+    uint32_t                      seq;
+    ngx_int_t                     rc;
+    ngx_uint_t                    refresh;
+    ngx_queue_t                  *q;
+    ngx_slab_pool_t              *shpool;
+    ngx_rbtree_node_t            *node, *root, *sentinel;
+    ngx_http_limit_conn_ctx_t    *ctx;
+    ngx_http_limit_conn_node_t   *lc;
+
+    ctx = zone->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) zone->shm_zone->shm.addr;
+
+    seq = zone->conf->seq;
+
+    refresh = (ctx->dirty == NULL
+               || ctx->refreshed == 0
+               || seq - ctx->refreshed >= NGX_HTTP_LIMIT_CONN_REFRESH);
+
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (refresh) {
+        ctx->refreshed = seq;
+
+        root = ctx->rbtree->root;
+        sentinel = ctx->rbtree->sentinel;
+
+        if (root != sentinel) {
+
+            for (node = ngx_rbtree_min(root, sentinel);
+                 node;
+                 node = ngx_rbtree_next(ctx->rbtree, node))
+            {
+                lc = (ngx_http_limit_conn_node_t *) &node->color;
+
+                rc = ngx_http_limit_conn_sync_entry(entries, pool, lc);
+                if (rc != NGX_OK) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+    if (ctx->dirty == NULL) {
+        goto done;
+    }
+
+    while (!ngx_queue_empty(ctx->dirty)) {
+        q = ngx_queue_head(ctx->dirty);
+        lc = ngx_http_limit_conn_link_data(q);
+
+        if (!refresh) {
+            rc = ngx_http_limit_conn_sync_entry(entries, pool, lc);
+            if (rc != NGX_OK) {
+                goto done;
+            }
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_init(q);
+
+        if (lc->conn == 0) {
+            node = (ngx_rbtree_node_t *)
+                       ((u_char *) lc - offsetof(ngx_rbtree_node_t, color));
+
+            ngx_rbtree_delete(ctx->rbtree, node);
+            ngx_slab_free_locked(shpool, (u_char *) node - ctx->link);
+        }
+    }
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_limit_conn_sync_entry(ngx_array_t *entries, ngx_pool_t *pool,
+    ngx_http_limit_conn_node_t *lc)
+{
+    ngx_http_limit_sync_entry_t  *e;
+
+    e = ngx_array_push(entries);
+    if (e == NULL) {
+        return NGX_ERROR;
+    }
+
+    e->key.len = lc->len;
+    e->key.data = ngx_pnalloc(pool, lc->len);
+    if (e->key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(e->key.data, lc->data, lc->len);
+
+    e->value = lc->conn;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_conn_sync_merge(ngx_http_limit_sync_zone_t *zone,
+    ngx_http_limit_sync_msg_t *msg)
+{
+    uint32_t                       hash;
+    ngx_uint_t                     i;
+    ngx_slab_pool_t               *shpool;
+    ngx_http_limit_conn_ctx_t     *ctx;
+    ngx_http_limit_conn_peer_t    *peer;
+    ngx_http_limit_conn_slot_t    *slot;
+    ngx_http_limit_conn_remote_t  *remote;
+
+    ctx = zone->shm_zone->data;
+    remote = ctx->remote;
+
+    if (remote == NULL || msg->peer >= remote->npeers) {
+        return;
+    }
+
+    shpool = (ngx_slab_pool_t *) zone->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    peer = &remote->peers[msg->peer];
+
+    if (peer->last == 0 || msg->epoch != peer->epoch) {
+
+        /* the peer was restarted, counts it reported before are obsolete */
+
+        ngx_memzero(&remote->slots[msg->peer * NGX_HTTP_LIMIT_CONN_SLOTS],
+                    NGX_HTTP_LIMIT_CONN_SLOTS
+                    * sizeof(ngx_http_limit_conn_slot_t));
+
+        peer->epoch = msg->epoch;
+        peer->seq = msg->seq;
+
+    } else if ((int32_t) (msg->seq - peer->seq) < 0) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+
+    } else {
+        peer->seq = msg->seq;
+    }
+
+    peer->last = ngx_current_msec;
+
+    for (i = 0; i < msg->nelts; i++) {
+
+        hash = ngx_crc32_short(msg->entries[i].key.data,
+                               msg->entries[i].key.len);
+
+        slot = &remote->slots[msg->peer * NGX_HTTP_LIMIT_CONN_SLOTS
+                              + hash % NGX_HTTP_LIMIT_CONN_SLOTS];
+
+        slot->hash = hash;
+        slot->conn = (u_short) ngx_min(msg->entries[i].value, 65535);
+        slot->seq = (u_short) msg->seq;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+static ngx_int_t
+ngx_http_limit_conn_init_remote(ngx_shm_zone_t *shm_zone,
+    ngx_http_limit_conn_ctx_t *octx)
+{
+    size_t                         size;
+    ngx_uint_t                     npeers;
+    ngx_slab_pool_t               *shpool;
+    ngx_http_limit_conn_ctx_t     *ctx;
+    ngx_http_limit_conn_remote_t  *remote;
+
+    ctx = shm_zone->data;
+    npeers = ctx->sync->conf->peers.nelts;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (octx && octx->dirty) {
+        ctx->dirty = octx->dirty;
+
+    } else {
+        ctx->dirty = ngx_slab_alloc(shpool, sizeof(ngx_queue_t));
+        if (ctx->dirty == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_queue_init(ctx->dirty);
+    }
+
+    /*
+     * the table of the previous configuration is still used by old
+     * workers, so it is not freed if the number of peers changes
+     */
+
+    if (octx && octx->remote && octx->remote->npeers == npeers) {
+        ctx->remote = octx->remote;
+        ctx->remote->ttl = 3 * ctx->sync->conf->interval;
+        return NGX_OK;
+    }
+
+    size = sizeof(ngx_http_limit_conn_remote_t)
+           + npeers * sizeof(ngx_http_limit_conn_peer_t)
+           + npeers * NGX_HTTP_LIMIT_CONN_SLOTS
+             * sizeof(ngx_http_limit_conn_slot_t);
+
+    remote = ngx_slab_calloc(shpool, size);
+    if (remote == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "limit_conn_zone \"%V\" is too small to be synchronized",
+                      &shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    remote->npeers = npeers;
+    remote->ttl = 3 * ctx->sync->conf->interval;
+    remote->peers = (ngx_http_limit_conn_peer_t *) &remote[1];
+    remote->slots = (ngx_http_limit_conn_slot_t *) &remote->peers[npeers];
+
+    ctx->remote = remote;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
@@ -406,8 +788,21 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
+        if (ctx->link != octx->link) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_conn_zone \"%V\" %s synchronized "
+                          "while previously it %s",
+                          &shm_zone->shm.name, ctx->link ? "is" : "is not",
+                          octx->link ? "was" : "was not");
+            return NGX_ERROR;
+        }
+
         ctx->rbtree = octx->rbtree;
 
+        if (ctx->sync) {
+            return ngx_http_limit_conn_init_remote(shm_zone, octx);
+        }
+
         return NGX_OK;
     }
 
@@ -416,6 +811,8 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     if (shm_zone->shm.exists) {
         ctx->rbtree = shpool->data;
 
+        /* counts of peers are not kept in an inherited zone */
+
         return NGX_OK;
     }
 
@@ -444,6 +841,10 @@ ngx_http_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     ngx_sprintf(shpool->log_ctx, " in limit_conn_zone \"%V\"%Z",
                 &shm_zone->shm.name);
 
+    if (ctx->sync) {
+        return ngx_http_limit_conn_init_remote(shm_zone, NULL);
+    }
+
     return NGX_OK;
 }
 
@@ -495,7 +896,7 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u_char                            *p;
     ssize_t                            size;
     ngx_str_t                         *value, name, s;
-    ngx_uint_t                         i;
+    ngx_uint_t                         i, sync;
     ngx_shm_zone_t                    *shm_zone;
     ngx_http_limit_conn_ctx_t         *ctx;
     ngx_http_compile_complex_value_t   ccv;
@@ -518,6 +919,7 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     size = 0;
+    sync = 0;
     name.len = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -556,6 +958,11 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "sync") == 0) {
+            sync = 1;
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -586,6 +993,19 @@ ngx_http_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     shm_zone->init = ngx_http_limit_conn_init_zone;
     shm_zone->data = ctx;
 
+    if (sync) {
+        ctx->sync = ngx_http_limit_sync_add_zone(cf, shm_zone,
+                                                 NGX_HTTP_LIMIT_SYNC_CONN);
+        if (ctx->sync == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->sync->collect = ngx_http_limit_conn_sync_collect;
+        ctx->sync->merge = ngx_http_limit_conn_sync_merge;
+
+        ctx->link = sizeof(ngx_queue_t);
+    }
+
     return NGX_CONF_OK;
 }
 
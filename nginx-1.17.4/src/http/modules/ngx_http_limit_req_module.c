@@ -14,6 +14,8 @@ typedef struct {
     u_char                       color;
     u_char                       dummy;
     u_short                      len;
+    /* excess accounted locally since the last synchronization */
+    uint32_t                     delta;
     ngx_queue_t                  queue;
     ngx_msec_t                   last;
     /* integer value, 1 corresponds to 0.001 r/s */
@@ -23,20 +25,62 @@ typedef struct {
 } ngx_http_limit_req_node_t;
 
 
+/*
+ * Nodes of synchronized zones are preceded by a link, which links them
+ * into the changes of the shard while delta is not zero.  The link is not
+ * allocated in other zones, and delta occupies what would be padding on
+ * 64-bit platforms.
+ */
+
+#define ngx_http_limit_req_link(lr)                                           \
+    ((ngx_queue_t *) ((u_char *) (lr) - offsetof(ngx_rbtree_node_t, color)) \
+     - 1)
+
+#define ngx_http_limit_req_link_data(q)                                       \
+    ((ngx_http_limit_req_node_t *) &((ngx_rbtree_node_t *) ((q) + 1))->color)
+
+
 typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   queue;
+    /* nodes changed since the last synchronization */
+    ngx_queue_t                   dirty;
+    /* used if there are several shards */
+    ngx_shmtx_sh_t                lock;
+    ngx_shmtx_t                   mutex;
 } ngx_http_limit_req_shctx_t;
 
 
+#define NGX_HTTP_LIMIT_REQ_LEASES    1024
+#define NGX_HTTP_LIMIT_REQ_LEASE_KEY 32
+
+
 typedef struct {
-    ngx_http_limit_req_shctx_t  *sh;
+    uint32_t                     hash;
+    u_short                      len;
+    u_short                      left;
+    /* excess charged for the requests in the lease */
+    ngx_uint_t                   excess;
+    ngx_msec_t                   expire;
+    u_char                       key[NGX_HTTP_LIMIT_REQ_LEASE_KEY];
+} ngx_http_limit_req_lease_t;
+
+
+typedef struct {
+    ngx_http_limit_req_shctx_t **sh;
+    ngx_uint_t                   shards;
     ngx_slab_pool_t             *shpool;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   rate;
     ngx_http_complex_value_t     key;
     ngx_http_limit_req_node_t   *node;
+    ngx_http_limit_req_shctx_t  *shard;
+    ngx_uint_t                   lease;
+    ngx_http_limit_req_lease_t  *leases;
+    ngx_http_limit_sync_zone_t  *sync;
+    /* size of the link preceding nodes */
+    size_t                       link;
 } ngx_http_limit_req_ctx_t;
 
 
@@ -58,12 +102,33 @@ typedef struct {
 
 
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
+static ngx_inline ngx_shmtx_t *ngx_http_limit_req_mutex(
+    ngx_http_limit_req_ctx_t *ctx, ngx_http_limit_req_shctx_t *sh);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
-    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
+static ngx_inline void ngx_http_limit_req_charge(
+    ngx_http_limit_req_ctx_t *ctx, ngx_http_limit_req_shctx_t *sh,
+    ngx_http_limit_req_node_t *lr, ngx_uint_t delta);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
-    ngx_uint_t n);
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t n);
+static void *ngx_http_limit_req_reclaim(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, size_t size);
+static ngx_int_t ngx_http_limit_req_use_lease(
+    ngx_http_limit_req_limit_t *limit, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep);
+static ngx_uint_t ngx_http_limit_req_grant_lease(
+    ngx_http_limit_req_limit_t *limit, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t excess);
+static ngx_int_t ngx_http_limit_req_sync_collect(
+    ngx_http_limit_sync_zone_t *zone, ngx_array_t *entries, ngx_pool_t *pool);
+static void ngx_http_limit_req_sync_merge(ngx_http_limit_sync_zone_t *zone,
+    ngx_http_limit_sync_msg_t *msg);
+static void ngx_http_limit_req_sync_node(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, uint32_t hash, ngx_str_t *key,
+    ngx_uint_t delta);
 
 static void *ngx_http_limit_req_create_conf(ngx_conf_t *cf);
 static char *ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent,
@@ -92,7 +157,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req_status_bounds = {
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_limit_req_zone,
       0,
       0,
@@ -167,10 +232,12 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
     uint32_t                     hash;
     ngx_str_t                    key;
     ngx_int_t                    rc;
-    ngx_uint_t                   n, excess;
+    ngx_uint_t                   n, excess, account;
     ngx_msec_t                   delay;
+    ngx_shmtx_t                 *mutex;
     ngx_http_limit_req_ctx_t    *ctx;
     ngx_http_limit_req_conf_t   *lrcf;
+    ngx_http_limit_req_shctx_t  *sh;
     ngx_http_limit_req_limit_t  *limit, *limits;
 
     if (r->main->limit_req_set) {
@@ -212,12 +279,25 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        account = (n == lrcf->limits.nelts - 1);
 
-        rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
-                                       (n == lrcf->limits.nelts - 1));
+        if (account
+            && ngx_http_limit_req_use_lease(limit, hash, &key, &excess)
+               == NGX_OK)
+        {
+            rc = NGX_OK;
+
+        } else {
+            sh = ctx->sh[hash % ctx->shards];
+            mutex = ngx_http_limit_req_mutex(ctx, sh);
+
+            ngx_shmtx_lock(mutex);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            rc = ngx_http_limit_req_lookup(limit, sh, hash, &key, &excess,
+                                           account);
+
+            ngx_shmtx_unlock(mutex);
+        }
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -251,11 +331,13 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
                 continue;
             }
 
-            ngx_shmtx_lock(&ctx->shpool->mutex);
+            mutex = ngx_http_limit_req_mutex(ctx, ctx->shard);
+
+            ngx_shmtx_lock(mutex);
 
             ctx->node->count--;
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            ngx_shmtx_unlock(mutex);
 
             ctx->node = NULL;
         }
@@ -374,12 +456,24 @@ ngx_http_limit_req_rbtree_insert_value(ngx_rbtree_node_t *temp,
 }
 
 
+static ngx_inline ngx_shmtx_t *
+ngx_http_limit_req_mutex(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh)
+{
+    /* a single shard is protected by the slab pool mutex */
+
+    return (ctx->shards == 1) ? &ctx->shpool->mutex : &sh->mutex;
+}
+
+
 static ngx_int_t
-ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
-    ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
+ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account)
 {
     size_t                      size;
     ngx_int_t                   rc, excess;
+    ngx_uint_t                  charge;
     ngx_msec_t                  now;
     ngx_msec_int_t              ms;
     ngx_rbtree_node_t          *node, *sentinel;
@@ -390,8 +484,8 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -413,7 +507,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
         if (rc == 0) {
             ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+            ngx_queue_insert_head(&sh->queue, &lr->queue);
 
             ms = (ngx_msec_int_t) (now - lr->last);
 
@@ -437,7 +531,12 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
             }
 
             if (account) {
-                lr->excess = excess;
+                charge = ngx_http_limit_req_grant_lease(limit, hash, key,
+                                                        excess);
+
+                lr->excess = excess + charge;
+
+                ngx_http_limit_req_charge(ctx, sh, lr, 1000 + charge);
 
                 if (ms) {
                     lr->last = now;
@@ -449,6 +548,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
             lr->count++;
 
             ctx->node = lr;
+            ctx->shard = sh;
 
             return NGX_AGAIN;
         }
@@ -458,18 +558,26 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     *ep = 0;
 
-    size = offsetof(ngx_rbtree_node_t, color)
+    size = ctx->link
+           + offsetof(ngx_rbtree_node_t, color)
            + offsetof(ngx_http_limit_req_node_t, data)
            + key->len;
 
-    ngx_http_limit_req_expire(ctx, 1);
+    ngx_http_limit_req_expire(ctx, sh, 1);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, size);
+    node = (ctx->shards == 1) ? ngx_slab_alloc_locked(ctx->shpool, size)
+                              : ngx_slab_alloc(ctx->shpool, size);
 
     if (node == NULL) {
-        ngx_http_limit_req_expire(ctx, 0);
+        ngx_http_limit_req_expire(ctx, sh, 0);
+
+        node = (ctx->shards == 1) ? ngx_slab_alloc_locked(ctx->shpool, size)
+                                  : ngx_slab_alloc(ctx->shpool, size);
+
+        if (node == NULL && ctx->shards > 1) {
+            node = ngx_http_limit_req_reclaim(ctx, sh, size);
+        }
 
-        node = ngx_slab_alloc_locked(ctx->shpool, size);
         if (node == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", ctx->shpool->log_ctx);
@@ -477,20 +585,27 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
         }
     }
 
+    node = (ngx_rbtree_node_t *) ((u_char *) node + ctx->link);
+
     node->key = hash;
 
     lr = (ngx_http_limit_req_node_t *) &node->color;
 
     lr->len = (u_short) key->len;
     lr->excess = 0;
+    lr->delta = 0;
 
     ngx_memcpy(lr->data, key->data, key->len);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_rbtree_insert(&sh->rbtree, node);
 
-    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+    ngx_queue_insert_head(&sh->queue, &lr->queue);
 
     if (account) {
+        lr->excess = ngx_http_limit_req_grant_lease(limit, hash, key, 0);
+
+        ngx_http_limit_req_charge(ctx, sh, lr, 1000 + lr->excess);
+
         lr->last = now;
         lr->count = 0;
         return NGX_OK;
@@ -500,17 +615,107 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
     lr->count = 1;
 
     ctx->node = lr;
+    ctx->shard = sh;
 
     return NGX_AGAIN;
 }
 
 
+/*
+ * A lease lets a worker serve the next requests with the same key without
+ * locking the shared zone.  The requests are charged in advance, and only
+ * if the charged excess stays within the delay and burst limits, so leases
+ * never allow more requests than configured.  A lease is valid until the
+ * charged excess would have leaked anyway.
+ */
+
+static ngx_int_t
+ngx_http_limit_req_use_lease(ngx_http_limit_req_limit_t *limit,
+    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep)
+{
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_lease_t  *ls;
+
+    ctx = limit->shm_zone->data;
+
+    if (ctx->leases == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ls = &ctx->leases[hash % NGX_HTTP_LIMIT_REQ_LEASES];
+
+    if (ls->left == 0
+        || ls->hash != hash
+        || ls->len != key->len
+        || ls->excess > limit->delay
+        || ls->excess > limit->burst
+        || (ngx_msec_int_t) (ls->expire - ngx_current_msec) <= 0
+        || ngx_memcmp(ls->key, key->data, key->len) != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    ls->left--;
+
+    *ep = ls->excess;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_limit_req_grant_lease(ngx_http_limit_req_limit_t *limit,
+    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t excess)
+{
+    ngx_uint_t                   charge;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_lease_t  *ls;
+
+    ctx = limit->shm_zone->data;
+
+    if (ctx->lease < 2 || key->len > NGX_HTTP_LIMIT_REQ_LEASE_KEY) {
+        return 0;
+    }
+
+    charge = (ctx->lease - 1) * 1000;
+
+    if (excess + charge > limit->delay || excess + charge > limit->burst) {
+        return 0;
+    }
+
+    if (ctx->leases == NULL) {
+
+        /* leases are per worker and are freed with the cycle */
+
+        ctx->leases = ngx_pcalloc(ngx_cycle->pool, NGX_HTTP_LIMIT_REQ_LEASES
+                                  * sizeof(ngx_http_limit_req_lease_t));
+        if (ctx->leases == NULL) {
+            ctx->lease = 0;
+            return 0;
+        }
+    }
+
+    ls = &ctx->leases[hash % NGX_HTTP_LIMIT_REQ_LEASES];
+
+    ls->hash = (uint32_t) hash;
+    ls->len = (u_short) key->len;
+    ls->left = (u_short) (ctx->lease - 1);
+    ls->excess = excess + charge;
+    ls->expire = ngx_current_msec + charge * 1000 / ctx->rate;
+
+    ngx_memcpy(ls->key, key->data, key->len);
+
+    return charge;
+}
+
+
 static ngx_msec_t
 ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
     ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit)
 {
     ngx_int_t                   excess;
     ngx_msec_t                  now, delay, max_delay;
+    ngx_shmtx_t                *mutex;
     ngx_msec_int_t              ms;
     ngx_http_limit_req_ctx_t   *ctx;
     ngx_http_limit_req_node_t  *lr;
@@ -533,7 +738,9 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        mutex = ngx_http_limit_req_mutex(ctx, ctx->shard);
+
+        ngx_shmtx_lock(mutex);
 
         now = ngx_current_msec;
         ms = (ngx_msec_int_t) (now - lr->last);
@@ -558,7 +765,9 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
         lr->excess = excess;
         lr->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_http_limit_req_charge(ctx, ctx->shard, lr, 1000);
+
+        ngx_shmtx_unlock(mutex);
 
         ctx->node = NULL;
 
@@ -579,8 +788,33 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 }
 
 
+static ngx_inline void
+ngx_http_limit_req_charge(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, ngx_http_limit_req_node_t *lr,
+    ngx_uint_t delta)
+{
+    if (ctx->sync == NULL) {
+        return;
+    }
+
+    if (lr->delta == 0) {
+        ngx_queue_insert_tail(&sh->dirty, ngx_http_limit_req_link(lr));
+    }
+
+    /* delta must not wrap to zero while the node is linked */
+
+    if (delta > NGX_MAX_UINT32_VALUE - lr->delta) {
+        lr->delta = NGX_MAX_UINT32_VALUE;
+        return;
+    }
+
+    lr->delta += delta;
+}
+
+
 static void
-ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
+ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, ngx_uint_t n)
 {
     ngx_int_t                   excess;
     ngx_msec_t                  now;
@@ -599,11 +833,11 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
+        if (ngx_queue_empty(&sh->queue)) {
             return;
         }
 
-        q = ngx_queue_last(&ctx->sh->queue);
+        q = ngx_queue_last(&sh->queue);
 
         lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
 
@@ -635,23 +869,297 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
         ngx_queue_remove(q);
 
+        if (lr->delta) {
+            ngx_queue_remove(ngx_http_limit_req_link(lr));
+        }
+
         node = (ngx_rbtree_node_t *)
                    ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        ngx_rbtree_delete(&sh->rbtree, node);
+
+        if (ctx->shards == 1) {
+            ngx_slab_free_locked(ctx->shpool, (u_char *) node - ctx->link);
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        } else {
+            ngx_slab_free(ctx->shpool, (u_char *) node - ctx->link);
+        }
     }
 }
 
 
+/*
+ * All shards allocate nodes from the same zone, so if the zone is still
+ * full after the oldest node of the locked shard was deleted, the oldest
+ * nodes of the other shards are deleted too, oldest first.  The other
+ * shards are only try-locked, since their owners may be waiting for the
+ * shard locked by us.
+ */
+
+static void *
+ngx_http_limit_req_reclaim(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, size_t size)
+{
+    void                        *p;
+    ngx_uint_t                   i, n;
+    ngx_msec_t                   now;
+    ngx_queue_t                 *q;
+    ngx_msec_int_t               ms, oldest;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_shctx_t  *osh, *victim;
+
+    now = ngx_current_msec;
+
+    for (n = 1; n < ctx->shards; n++) {
+
+        victim = NULL;
+        oldest = -1;
+
+        for (i = 0; i < ctx->shards; i++) {
+            osh = ctx->sh[i];
+
+            if (osh == sh || !ngx_shmtx_trylock(&osh->mutex)) {
+                continue;
+            }
+
+            if (!ngx_queue_empty(&osh->queue)) {
+                q = ngx_queue_last(&osh->queue);
+                lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
+
+                ms = (ngx_msec_int_t) (now - lr->last);
+
+                if (lr->count == 0 && ms > oldest) {
+                    oldest = ms;
+                    victim = osh;
+                }
+            }
+
+            ngx_shmtx_unlock(&osh->mutex);
+        }
+
+        if (victim == NULL) {
+            return NULL;
+        }
+
+        if (!ngx_shmtx_trylock(&victim->mutex)) {
+            continue;
+        }
+
+        ngx_http_limit_req_expire(ctx, victim, 0);
+
+        ngx_shmtx_unlock(&victim->mutex);
+
+        p = ngx_slab_alloc(ctx->shpool, size);
+
+        if (p) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Only nodes charged since the previous synchronization round are linked
+ * into the changes of a shard, so only they are looked through.  Excess
+ * received from peers is added to the nodes as is and leaks with the
+ * configured rate, as if the requests were accounted locally.
+ */
+
+static ngx_int_t
+ngx_http_limit_req_sync_collect(ngx_http_limit_sync_zone_t *zone,
+    ngx_array_t *entries, ngx_pool_t *pool)
+{
+    ngx_uint_t                    i;
+    ngx_queue_t                  *q;
+    ngx_shmtx_t                  *mutex;
+    ngx_http_limit_req_ctx_t     *ctx;
+    ngx_http_limit_req_node_t    *lr;
+    ngx_http_limit_req_shctx_t   *sh;
+    ngx_http_limit_sync_entry_t  *e;
+
+    ctx = zone->shm_zone->data;
+
+    for (i = 0; i < ctx->shards; i++) {
+        sh = ctx->sh[i];
+        mutex = ngx_http_limit_req_mutex(ctx, sh);
+
+        ngx_shmtx_lock(mutex);
+
+        while (!ngx_queue_empty(&sh->dirty)) {
+            q = ngx_queue_head(&sh->dirty);
+            lr = ngx_http_limit_req_link_data(q);
+
+            e = ngx_array_push(entries);
+            if (e == NULL) {
+                ngx_shmtx_unlock(mutex);
+                return NGX_ERROR;
+            }
+
+            e->key.len = lr->len;
+            e->key.data = ngx_pnalloc(pool, lr->len);
+            if (e->key.data == NULL) {
+                ngx_shmtx_unlock(mutex);
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(e->key.data, lr->data, lr->len);
+
+            e->value = lr->delta;
+            lr->delta = 0;
+
+            ngx_queue_remove(q);
+        }
+
+        ngx_shmtx_unlock(mutex);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_req_sync_merge(ngx_http_limit_sync_zone_t *zone,
+    ngx_http_limit_sync_msg_t *msg)
+{
+    uint32_t                     hash;
+    ngx_uint_t                   i;
+    ngx_shmtx_t                 *mutex;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_shctx_t  *sh;
+
+    ctx = zone->shm_zone->data;
+
+    for (i = 0; i < msg->nelts; i++) {
+
+        if (msg->entries[i].key.len == 0 || msg->entries[i].value == 0) {
+            continue;
+        }
+
+        hash = ngx_crc32_short(msg->entries[i].key.data,
+                               msg->entries[i].key.len);
+
+        sh = ctx->sh[hash % ctx->shards];
+        mutex = ngx_http_limit_req_mutex(ctx, sh);
+
+        ngx_shmtx_lock(mutex);
+
+        ngx_http_limit_req_sync_node(ctx, sh, hash, &msg->entries[i].key,
+                                     msg->entries[i].value);
+
+        ngx_shmtx_unlock(mutex);
+    }
+}
+
+
+static void
+ngx_http_limit_req_sync_node(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *sh, uint32_t hash, ngx_str_t *key,
+    ngx_uint_t delta)
+{
+    size_t                      size;
+    ngx_int_t                   rc, excess;
+    ngx_msec_t                  now;
+    ngx_msec_int_t              ms;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_http_limit_req_node_t  *lr;
+
+    now = ngx_current_msec;
+
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_http_limit_req_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, lr->data, key->len, (size_t) lr->len);
+
+        if (rc == 0) {
+            ms = (ngx_msec_int_t) (now - lr->last);
+
+            if (ms < -60000) {
+                ms = 1;
+
+            } else if (ms < 0) {
+                ms = 0;
+            }
+
+            excess = lr->excess - ctx->rate * ms / 1000;
+
+            if (excess < 0) {
+                excess = 0;
+            }
+
+            lr->excess = excess + delta;
+
+            if (ms) {
+                lr->last = now;
+            }
+
+            return;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* excess from peers never evicts local nodes by force */
+
+    size = ctx->link
+           + offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_limit_req_node_t, data)
+           + key->len;
+
+    ngx_http_limit_req_expire(ctx, sh, 1);
+
+    node = (ctx->shards == 1) ? ngx_slab_alloc_locked(ctx->shpool, size)
+                              : ngx_slab_alloc(ctx->shpool, size);
+    if (node == NULL) {
+        return;
+    }
+
+    node = (ngx_rbtree_node_t *) ((u_char *) node + ctx->link);
+
+    node->key = hash;
+
+    lr = (ngx_http_limit_req_node_t *) &node->color;
+
+    lr->len = (u_short) key->len;
+    lr->excess = delta;
+    lr->delta = 0;
+    lr->last = now;
+    lr->count = 0;
+
+    ngx_memcpy(lr->data, key->data, key->len);
+
+    ngx_rbtree_insert(&sh->rbtree, node);
+
+    ngx_queue_insert_head(&sh->queue, &lr->queue);
+}
+
+
 static ngx_int_t
 ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_limit_req_ctx_t  *octx = data;
 
-    size_t                     len;
-    ngx_http_limit_req_ctx_t  *ctx;
+    size_t                       len;
+    ngx_uint_t                   i;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_shctx_t  *sh;
 
     ctx = shm_zone->data;
 
@@ -669,6 +1177,23 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
+        if (ctx->shards != octx->shards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->shards, octx->shards);
+            return NGX_ERROR;
+        }
+
+        if (ctx->link != octx->link) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" %s synchronized "
+                          "while previously it %s",
+                          &shm_zone->shm.name, ctx->link ? "is" : "is not",
+                          octx->link ? "was" : "was not");
+            return NGX_ERROR;
+        }
+
         ctx->sh = octx->sh;
         ctx->shpool = octx->shpool;
 
@@ -683,17 +1208,40 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
+    ctx->sh = ngx_slab_alloc(ctx->shpool,
+                             ctx->shards * sizeof(ngx_http_limit_req_shctx_t *));
     if (ctx->sh == NULL) {
         return NGX_ERROR;
     }
 
     ctx->shpool->data = ctx->sh;
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_req_rbtree_insert_value);
+    /* nodes of sharded zones are allocated without the zone lock held */
+
+    ctx->shpool->magazines = (ctx->shards > 1);
+
+    /* shards are allocated separately to keep them in different cache lines */
+
+    for (i = 0; i < ctx->shards; i++) {
+        sh = ngx_slab_calloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
 
-    ngx_queue_init(&ctx->sh->queue);
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
+
+        ngx_queue_init(&sh->queue);
+        ngx_queue_init(&sh->dirty);
+
+        if (ctx->shards > 1
+            && ngx_shmtx_create(&sh->mutex, &sh->lock, NULL) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ctx->sh[i] = sh;
+    }
 
     len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
 
@@ -711,6 +1259,28 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 
+static void
+ngx_http_limit_req_unlock_zone(ngx_shm_zone_t *shm_zone, ngx_pid_t pid)
+{
+    ngx_uint_t                 i;
+    ngx_http_limit_req_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (ctx->sh == NULL) {
+        return;
+    }
+
+    for (i = 0; i < ctx->shards; i++) {
+        if (ngx_shmtx_force_unlock(&ctx->sh[i]->mutex, pid)) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "limit_req \"%V\" shard %ui was locked by %P",
+                          &shm_zone->shm.name, i, pid);
+        }
+    }
+}
+
+
 static void *
 ngx_http_limit_req_create_conf(ngx_conf_t *cf)
 {
@@ -767,14 +1337,21 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t                             len;
     ssize_t                            size;
     ngx_str_t                         *value, name, s;
-    ngx_int_t                          rate, scale;
-    ngx_uint_t                         i;
+    ngx_int_t                          rate, scale, shards, lease;
+    ngx_uint_t                         i, sync;
     ngx_shm_zone_t                    *shm_zone;
     ngx_http_limit_req_ctx_t          *ctx;
     ngx_http_compile_complex_value_t   ccv;
 
     value = cf->args->elts;
 
+    if (cf->args->nelts < 4) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of arguments in \"%V\" directive",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
     ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req_ctx_t));
     if (ctx == NULL) {
         return NGX_CONF_ERROR;
@@ -793,6 +1370,9 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     rate = 1;
     scale = 1;
+    shards = 1;
+    lease = 1;
+    sync = 0;
     name.len = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -855,6 +1435,45 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of shards \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+            if (shards > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"shards\" requires atomic operations "
+                                   "support");
+                return NGX_CONF_ERROR;
+            }
+#endif
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "sync") == 0) {
+            sync = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "lease=", 6) == 0) {
+
+            lease = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (lease <= 0 || lease > 65535) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lease size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -868,6 +1487,8 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     ctx->rate = rate * 1000 / scale;
+    ctx->shards = shards;
+    ctx->lease = lease;
 
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
@@ -887,6 +1508,23 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     shm_zone->init = ngx_http_limit_req_init_zone;
     shm_zone->data = ctx;
 
+    if (shards > 1) {
+        shm_zone->unlock = ngx_http_limit_req_unlock_zone;
+    }
+
+    if (sync) {
+        ctx->sync = ngx_http_limit_sync_add_zone(cf, shm_zone,
+                                                 NGX_HTTP_LIMIT_SYNC_REQ);
+        if (ctx->sync == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->sync->collect = ngx_http_limit_req_sync_collect;
+        ctx->sync->merge = ngx_http_limit_req_sync_merge;
+
+        ctx->link = sizeof(ngx_queue_t);
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -0,0 +1,961 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_sha1.h>
+
+
+/*
+ * Zones of limit_req and limit_conn marked with the "sync" parameter are
+ * exchanged with peer nginx instances over UDP.  Once in an interval the
+ * first worker collects the local changes of each zone and sends them to
+ * all peers; any worker may receive a datagram and merge it into the zone.
+ * Nothing is sent or waited for while processing requests, and the state
+ * of a peer is seen at most one interval late.
+ *
+ * A datagram consists of a header
+ *
+ *     "NLS" 0x02, type (1 byte), zone name length (1 byte),
+ *     epoch (4 bytes), round (4 bytes), time (4 bytes),
+ *     index (2 bytes), zone name
+ *
+ * followed by entries of key length (2 bytes), key and value (4 bytes).
+ * Integers are in network byte order.  If a secret is configured, the
+ * datagram ends with HMAC-SHA1 of everything before it, and datagrams
+ * without a valid one are dropped.
+ *
+ * The epoch is the time the sender loaded its configuration, the round
+ * follows the monotonic clock, and the index counts datagrams sent in
+ * the round.  The last epoch, round and index accepted from each peer
+ * are kept in shared memory, and a datagram is only accepted if it comes
+ * later and its time is within NGX_HTTP_LIMIT_SYNC_WINDOW seconds of ours,
+ * so a captured datagram cannot be replayed.
+ */
+
+
+#define NGX_HTTP_LIMIT_SYNC_DATAGRAM  1400
+#define NGX_HTTP_LIMIT_SYNC_HEADER    20
+#define NGX_HTTP_LIMIT_SYNC_MAC       20
+#define NGX_HTTP_LIMIT_SYNC_BLOCK     64
+#define NGX_HTTP_LIMIT_SYNC_WINDOW    30
+
+
+typedef struct {
+    uint32_t                     epoch;
+    uint32_t                     round;
+    ngx_uint_t                   index;
+} ngx_http_limit_sync_peer_t;
+
+
+typedef struct {
+    ngx_uint_t                   npeers;
+    ngx_http_limit_sync_peer_t   peers[1];
+} ngx_http_limit_sync_shctx_t;
+
+
+static void ngx_http_limit_sync_handler(ngx_connection_t *c);
+static ngx_int_t ngx_http_limit_sync_process(ngx_connection_t *c);
+static ngx_int_t ngx_http_limit_sync_accept(ngx_http_limit_sync_conf_t *lscf,
+    ngx_uint_t peer, uint32_t epoch, uint32_t round, ngx_uint_t index);
+static void ngx_http_limit_sync_timer_handler(ngx_event_t *ev);
+static void ngx_http_limit_sync_send_zone(ngx_http_limit_sync_conf_t *lscf,
+    ngx_http_limit_sync_zone_t *zone, ngx_log_t *log);
+static void ngx_http_limit_sync_send(ngx_http_limit_sync_conf_t *lscf,
+    u_char *buf, size_t len, ngx_log_t *log);
+static void ngx_http_limit_sync_sign(ngx_http_limit_sync_conf_t *lscf,
+    u_char *buf, size_t len, u_char *mac);
+
+static ngx_int_t ngx_http_limit_sync_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void *ngx_http_limit_sync_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_limit_sync_init_main_conf(ngx_conf_t *cf, void *conf);
+static char *ngx_http_limit_sync(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_limit_sync_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_limit_sync_commands[] = {
+
+    { ngx_string("limit_sync"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_limit_sync,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_limit_sync_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    ngx_http_limit_sync_create_main_conf,  /* create main configuration */
+    ngx_http_limit_sync_init_main_conf,    /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_limit_sync_module = {
+    NGX_MODULE_V1,
+    &ngx_http_limit_sync_module_ctx,       /* module context */
+    ngx_http_limit_sync_commands,          /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_limit_sync_init_process,      /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static u_char  ngx_http_limit_sync_magic[] = { 'N', 'L', 'S', 0x02 };
+
+static ngx_str_t  ngx_http_limit_sync_zone_name = ngx_string("limit_sync");
+
+
+ngx_http_limit_sync_zone_t *
+ngx_http_limit_sync_add_zone(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone,
+    ngx_uint_t type)
+{
+    ngx_http_limit_sync_conf_t   *lscf;
+    ngx_http_limit_sync_zone_t   *zone, **zp;
+
+    if (shm_zone->shm.name.len > 255) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone name \"%V\" is too long to be synchronized",
+                           &shm_zone->shm.name);
+        return NULL;
+    }
+
+    lscf = ngx_http_conf_get_module_main_conf(cf, ngx_http_limit_sync_module);
+
+    zone = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_sync_zone_t));
+    if (zone == NULL) {
+        return NULL;
+    }
+
+    zp = ngx_array_push(&lscf->zones);
+    if (zp == NULL) {
+        return NULL;
+    }
+
+    zone->shm_zone = shm_zone;
+    zone->type = type;
+    zone->conf = lscf;
+
+    *zp = zone;
+
+    return zone;
+}
+
+
+static void
+ngx_http_limit_sync_handler(ngx_connection_t *c)
+{
+    if (ngx_http_limit_sync_process(c) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "invalid limit sync datagram from %V", &c->addr_text);
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
+#endif
+
+    ngx_close_connection(c);
+    ngx_destroy_pool(c->pool);
+}
+
+
+static ngx_int_t
+ngx_http_limit_sync_process(ngx_connection_t *c)
+{
+    u_char                       *p, *last;
+    size_t                        len;
+    time_t                        now, sent;
+    uint32_t                      seq, epoch;
+    ngx_str_t                     name;
+    ngx_uint_t                    i, type, diff, index;
+    ngx_addr_t                   *peer;
+    ngx_array_t                  *entries;
+    ngx_http_limit_sync_msg_t     msg;
+    ngx_http_limit_sync_conf_t   *lscf;
+    ngx_http_limit_sync_zone_t  **zones, *zone;
+    ngx_http_limit_sync_entry_t  *e;
+    u_char                        mac[NGX_HTTP_LIMIT_SYNC_MAC];
+
+    lscf = c->listening->servers;
+
+    peer = lscf->peers.elts;
+
+    for (i = 0; i < lscf->peers.nelts; i++) {
+        if (ngx_cmp_sockaddr(c->sockaddr, c->socklen,
+                             peer[i].sockaddr, peer[i].socklen, 1)
+            == NGX_OK)
+        {
+            break;
+        }
+    }
+
+    if (i == lscf->peers.nelts) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "limit sync datagram from unknown peer %V",
+                      &c->addr_text);
+        return NGX_DECLINED;
+    }
+
+    msg.peer = i;
+
+    p = c->buffer->pos;
+    last = c->buffer->last;
+
+    if (lscf->key) {
+
+        if (last - p < NGX_HTTP_LIMIT_SYNC_HEADER + NGX_HTTP_LIMIT_SYNC_MAC) {
+            return NGX_ERROR;
+        }
+
+        last -= NGX_HTTP_LIMIT_SYNC_MAC;
+
+        ngx_http_limit_sync_sign(lscf, p, last - p, mac);
+
+        /* compared in constant time */
+
+        diff = 0;
+
+        for (i = 0; i < NGX_HTTP_LIMIT_SYNC_MAC; i++) {
+            diff |= mac[i] ^ last[i];
+        }
+
+        if (diff) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (last - p < NGX_HTTP_LIMIT_SYNC_HEADER
+        || ngx_memcmp(p, ngx_http_limit_sync_magic, 4) != 0)
+    {
+        return NGX_ERROR;
+    }
+
+    type = p[4];
+    name.len = p[5];
+
+    epoch = ((uint32_t) p[6] << 24) | (p[7] << 16) | (p[8] << 8) | p[9];
+    seq = ((uint32_t) p[10] << 24) | (p[11] << 16) | (p[12] << 8) | p[13];
+    sent = ((uint32_t) p[14] << 24) | (p[15] << 16) | (p[16] << 8) | p[17];
+    index = (p[18] << 8) | p[19];
+
+    p += NGX_HTTP_LIMIT_SYNC_HEADER;
+
+    now = ngx_time();
+
+    if (sent < now - NGX_HTTP_LIMIT_SYNC_WINDOW
+        || sent > now + NGX_HTTP_LIMIT_SYNC_WINDOW)
+    {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "stale limit sync datagram from %V", &c->addr_text);
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_limit_sync_accept(lscf, msg.peer, epoch, seq, index)
+        != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "replayed limit sync datagram from %V", &c->addr_text);
+        return NGX_DECLINED;
+    }
+
+    if ((size_t) (last - p) < name.len) {
+        return NGX_ERROR;
+    }
+
+    name.data = p;
+    p += name.len;
+
+    zones = lscf->zones.elts;
+
+    for (i = 0; i < lscf->zones.nelts; i++) {
+        zone = zones[i];
+
+        if (zone->type == type
+            && zone->shm_zone->shm.name.len == name.len
+            && ngx_strncmp(zone->shm_zone->shm.name.data, name.data, name.len)
+               == 0)
+        {
+            goto found;
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "limit sync: unknown zone \"%V\"", &name);
+
+    return NGX_OK;
+
+found:
+
+    entries = ngx_array_create(c->pool, 32,
+                               sizeof(ngx_http_limit_sync_entry_t));
+    if (entries == NULL) {
+        return NGX_OK;
+    }
+
+    while (p < last) {
+
+        if (last - p < 2) {
+            return NGX_ERROR;
+        }
+
+        len = (p[0] << 8) | p[1];
+        p += 2;
+
+        if ((size_t) (last - p) < len + 4) {
+            return NGX_ERROR;
+        }
+
+        e = ngx_array_push(entries);
+        if (e == NULL) {
+            return NGX_OK;
+        }
+
+        e->key.len = len;
+        e->key.data = p;
+        p += len;
+
+        e->value = ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        p += 4;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "limit sync: zone \"%V\" peer:%ui round:%uD entries:%ui",
+                   &name, msg.peer, seq, entries->nelts);
+
+    msg.epoch = epoch;
+    msg.seq = seq;
+    msg.entries = entries->elts;
+    msg.nelts = entries->nelts;
+
+    zone->merge(zone, &msg);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_limit_sync_accept(ngx_http_limit_sync_conf_t *lscf, ngx_uint_t peer,
+    uint32_t epoch, uint32_t round, ngx_uint_t index)
+{
+    ngx_int_t                     rc;
+    ngx_slab_pool_t              *shpool;
+    ngx_http_limit_sync_peer_t   *p;
+    ngx_http_limit_sync_shctx_t  *sh;
+
+    shpool = (ngx_slab_pool_t *) lscf->shm_zone->shm.addr;
+    sh = lscf->shm_zone->data;
+
+    if (peer >= sh->npeers) {
+        return NGX_DECLINED;
+    }
+
+    p = &sh->peers[peer];
+
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (epoch == p->epoch) {
+
+        if ((int32_t) (round - p->round) < 0
+            || (round == p->round && index <= p->index))
+        {
+            rc = NGX_DECLINED;
+        }
+
+    } else if ((int32_t) (epoch - p->epoch) < 0 && p->epoch != 0) {
+
+        /* the peer loaded its configuration again since then */
+
+        rc = NGX_DECLINED;
+    }
+
+    if (rc == NGX_OK) {
+        p->epoch = epoch;
+        p->round = round;
+        p->index = index;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return rc;
+}
+
+
+static void
+ngx_http_limit_sync_timer_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                    i;
+    ngx_http_limit_sync_conf_t   *lscf;
+    ngx_http_limit_sync_zone_t  **zones;
+
+    lscf = ev->data;
+
+    /* the socket is closed on graceful shutdown */
+
+    if (ngx_exiting || lscf->listening->fd == (ngx_socket_t) -1) {
+        return;
+    }
+
+    /*
+     * rounds are derived from time, so that a worker started
+     * after reconfiguration continues the numbering
+     */
+
+    lscf->seq = (uint32_t) (ngx_current_msec / lscf->interval);
+    lscf->index = 0;
+
+    zones = lscf->zones.elts;
+
+    for (i = 0; i < lscf->zones.nelts; i++) {
+        ngx_http_limit_sync_send_zone(lscf, zones[i], ev->log);
+    }
+
+    ngx_add_timer(ev, lscf->interval);
+}
+
+
+static void
+ngx_http_limit_sync_send_zone(ngx_http_limit_sync_conf_t *lscf,
+    ngx_http_limit_sync_zone_t *zone, ngx_log_t *log)
+{
+    u_char                       *p, *start, *last;
+    size_t                        len;
+    ngx_str_t                    *name;
+    ngx_uint_t                    i;
+    ngx_pool_t                   *pool;
+    ngx_array_t                   entries;
+    ngx_http_limit_sync_entry_t  *e;
+    u_char                        buf[NGX_HTTP_LIMIT_SYNC_DATAGRAM];
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (pool == NULL) {
+        return;
+    }
+
+    if (ngx_array_init(&entries, pool, 64,
+                       sizeof(ngx_http_limit_sync_entry_t))
+        != NGX_OK)
+    {
+        goto done;
+    }
+
+    if (zone->collect(zone, &entries, pool) != NGX_OK) {
+        goto done;
+    }
+
+    /*
+     * connection counts are sent even if none of them changed,
+     * so that peers know that the counts they got are still in use
+     */
+
+    if (entries.nelts == 0 && zone->type == NGX_HTTP_LIMIT_SYNC_REQ) {
+        goto done;
+    }
+
+    name = &zone->shm_zone->shm.name;
+
+    p = ngx_cpymem(buf, ngx_http_limit_sync_magic, 4);
+
+    *p++ = (u_char) zone->type;
+    *p++ = (u_char) name->len;
+    *p++ = (u_char) (lscf->epoch >> 24);
+    *p++ = (u_char) (lscf->epoch >> 16);
+    *p++ = (u_char) (lscf->epoch >> 8);
+    *p++ = (u_char) lscf->epoch;
+    *p++ = (u_char) (lscf->seq >> 24);
+    *p++ = (u_char) (lscf->seq >> 16);
+    *p++ = (u_char) (lscf->seq >> 8);
+    *p++ = (u_char) lscf->seq;
+
+    /* time and index are set for each datagram when it is sent */
+
+    p += 6;
+
+    start = ngx_cpymem(p, name->data, name->len);
+    last = buf + NGX_HTTP_LIMIT_SYNC_DATAGRAM;
+
+    if (lscf->key) {
+        last -= NGX_HTTP_LIMIT_SYNC_MAC;
+    }
+
+    p = start;
+    e = entries.elts;
+
+    for (i = 0; i < entries.nelts; i++) {
+
+        len = 2 + e[i].key.len + 4;
+
+        if (len > (size_t) (last - start)) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "limit sync key is too long in zone \"%V\"", name);
+            continue;
+        }
+
+        if (len > (size_t) (last - p)) {
+            ngx_http_limit_sync_send(lscf, buf, p - buf, log);
+            p = start;
+        }
+
+        *p++ = (u_char) (e[i].key.len >> 8);
+        *p++ = (u_char) e[i].key.len;
+
+        p = ngx_cpymem(p, e[i].key.data, e[i].key.len);
+
+        *p++ = (u_char) (e[i].value >> 24);
+        *p++ = (u_char) (e[i].value >> 16);
+        *p++ = (u_char) (e[i].value >> 8);
+        *p++ = (u_char) e[i].value;
+    }
+
+    ngx_http_limit_sync_send(lscf, buf, p - buf, log);
+
+done:
+
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_http_limit_sync_send(ngx_http_limit_sync_conf_t *lscf, u_char *buf,
+    size_t len, ngx_log_t *log)
+{
+    u_char      *p;
+    ssize_t      n;
+    time_t       now;
+    ngx_err_t    err;
+    ngx_uint_t   i, level;
+    ngx_addr_t  *peer;
+
+    if (lscf->index > 0xffff) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "too many limit sync datagrams in a round");
+        return;
+    }
+
+    now = ngx_time();
+
+    p = buf + 14;
+
+    *p++ = (u_char) (now >> 24);
+    *p++ = (u_char) (now >> 16);
+    *p++ = (u_char) (now >> 8);
+    *p++ = (u_char) now;
+    *p++ = (u_char) (lscf->index >> 8);
+    *p++ = (u_char) lscf->index;
+
+    lscf->index++;
+
+    /* the buffer has room for the signature */
+
+    if (lscf->key) {
+        ngx_http_limit_sync_sign(lscf, buf, len, buf + len);
+        len += NGX_HTTP_LIMIT_SYNC_MAC;
+    }
+
+    peer = lscf->peers.elts;
+
+    for (i = 0; i < lscf->peers.nelts; i++) {
+
+        n = sendto(lscf->listening->fd, buf, len, 0,
+                   peer[i].sockaddr, peer[i].socklen);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "limit sync: sendto %V %uz: %z",
+                       &peer[i].name, len, n);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            /* the datagram is lost, the next round brings newer state */
+
+            level = (err == NGX_EAGAIN) ? NGX_LOG_INFO : NGX_LOG_ERR;
+
+            ngx_log_error(level, log, err, "limit sync sendto() to %V failed",
+                          &peer[i].name);
+        }
+    }
+}
+
+
+static void
+ngx_http_limit_sync_sign(ngx_http_limit_sync_conf_t *lscf, u_char *buf,
+    size_t len, u_char *mac)
+{
+    ngx_uint_t  i;
+    ngx_sha1_t  sha1;
+    u_char      pad[NGX_HTTP_LIMIT_SYNC_BLOCK];
+
+    for (i = 0; i < NGX_HTTP_LIMIT_SYNC_BLOCK; i++) {
+        pad[i] = lscf->key[i] ^ 0x36;
+    }
+
+    ngx_sha1_init(&sha1);
+    ngx_sha1_update(&sha1, pad, NGX_HTTP_LIMIT_SYNC_BLOCK);
+    ngx_sha1_update(&sha1, buf, len);
+    ngx_sha1_final(mac, &sha1);
+
+    for (i = 0; i < NGX_HTTP_LIMIT_SYNC_BLOCK; i++) {
+        pad[i] = lscf->key[i] ^ 0x5c;
+    }
+
+    ngx_sha1_init(&sha1);
+    ngx_sha1_update(&sha1, pad, NGX_HTTP_LIMIT_SYNC_BLOCK);
+    ngx_sha1_update(&sha1, mac, NGX_HTTP_LIMIT_SYNC_MAC);
+    ngx_sha1_final(mac, &sha1);
+}
+
+
+static ngx_int_t
+ngx_http_limit_sync_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_limit_sync_conf_t  *lscf = shm_zone->data;
+
+    size_t                        len;
+    ngx_uint_t                    npeers;
+    ngx_slab_pool_t              *shpool;
+    ngx_http_limit_sync_shctx_t  *sh, *osh;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    npeers = lscf->peers.nelts;
+
+    /* the state of peers is kept over reconfiguration if they are the same */
+
+    osh = data;
+
+    if (osh && osh->npeers == npeers) {
+        shm_zone->data = osh;
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    len = offsetof(ngx_http_limit_sync_shctx_t, peers)
+          + npeers * sizeof(ngx_http_limit_sync_peer_t);
+
+    sh = ngx_slab_calloc(shpool, len);
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    sh->npeers = npeers;
+
+    if (osh) {
+        ngx_slab_free(shpool, osh);
+    }
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_limit_sync_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_sync_conf_t  *lscf;
+
+    lscf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_sync_conf_t));
+    if (lscf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     lscf->listen = NULL;
+     *     lscf->key = NULL;
+     *     lscf->listening = NULL;
+     *     lscf->shm_zone = NULL;
+     *     lscf->seq = 0;
+     *     lscf->index = 0;
+     *     lscf->event = { 0 };
+     */
+
+    if (ngx_array_init(&lscf->peers, cf->pool, 2, sizeof(ngx_addr_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&lscf->zones, cf->pool, 2,
+                       sizeof(ngx_http_limit_sync_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    lscf->interval = NGX_CONF_UNSET_MSEC;
+
+    return lscf;
+}
+
+
+static char *
+ngx_http_limit_sync_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_limit_sync_conf_t *lscf = conf;
+
+    if (lscf->zones.nelts && lscf->listen == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zones with the \"sync\" parameter "
+                           "require the \"limit_sync\" directive");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_init_msec_value(lscf->interval, 100);
+
+    lscf->epoch = (uint32_t) ngx_time();
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_sync(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_sync_conf_t *lscf = conf;
+
+    ngx_str_t        *value, s;
+    ngx_url_t         u;
+    ngx_uint_t        i;
+    ngx_sha1_t        sha1;
+    ngx_msec_t        interval;
+    ngx_addr_t       *peer;
+    ngx_listening_t  *ls;
+
+    if (lscf->listen) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "listen=", 7) == 0) {
+
+            ngx_memzero(&u, sizeof(ngx_url_t));
+
+            u.url.len = value[i].len - 7;
+            u.url.data = value[i].data + 7;
+            u.listen = 1;
+
+            if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+                if (u.err) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "%s in \"%V\"", u.err, &value[i]);
+                }
+
+                return NGX_CONF_ERROR;
+            }
+
+            if (u.no_port) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "no port in \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            lscf->listen = &u.addrs[0];
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "peer=", 5) == 0) {
+
+            ngx_memzero(&u, sizeof(ngx_url_t));
+
+            u.url.len = value[i].len - 5;
+            u.url.data = value[i].data + 5;
+
+            if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+                if (u.err) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "%s in \"%V\"", u.err, &value[i]);
+                }
+
+                return NGX_CONF_ERROR;
+            }
+
+            if (u.no_port) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "no port in \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            peer = ngx_array_push_n(&lscf->peers, u.naddrs);
+            if (peer == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memcpy(peer, u.addrs, u.naddrs * sizeof(ngx_addr_t));
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            interval = ngx_parse_time(&s, 0);
+
+            if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid interval \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            lscf->interval = interval;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "secret=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            if (s.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid secret \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            lscf->key = ngx_pcalloc(cf->pool, NGX_HTTP_LIMIT_SYNC_BLOCK);
+            if (lscf->key == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            /* a secret longer than the block is hashed, as in RFC 2104 */
+
+            if (s.len > NGX_HTTP_LIMIT_SYNC_BLOCK) {
+                ngx_sha1_init(&sha1);
+                ngx_sha1_update(&sha1, s.data, s.len);
+                ngx_sha1_final(lscf->key, &sha1);
+
+            } else {
+                ngx_memcpy(lscf->key, s.data, s.len);
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lscf->listen == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"listen\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lscf->peers.nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"peer\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    lscf->shm_zone = ngx_shared_memory_add(cf, &ngx_http_limit_sync_zone_name,
+                                           8 * ngx_pagesize,
+                                           &ngx_http_limit_sync_module);
+    if (lscf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    lscf->shm_zone->init = ngx_http_limit_sync_init_zone;
+    lscf->shm_zone->data = lscf;
+
+    ls = ngx_create_listening(cf, lscf->listen->sockaddr,
+                              lscf->listen->socklen);
+    if (ls == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ls->type = SOCK_DGRAM;
+    ls->addr_ntop = 1;
+    ls->handler = ngx_http_limit_sync_handler;
+    ls->pool_size = 256;
+    ls->servers = lscf;
+
+    ls->logp = &cf->cycle->new_log;
+    ls->log.data = &ls->addr_text;
+    ls->log.handler = ngx_accept_log_error;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_limit_sync_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                   i;
+    ngx_listening_t             *ls;
+    ngx_http_limit_sync_conf_t  *lscf;
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    lscf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_limit_sync_module);
+
+    if (lscf == NULL || lscf->zones.nelts == 0) {
+        return NGX_OK;
+    }
+
+    ls = cycle->listening.elts;
+
+    for (i = 0; i < cycle->listening.nelts; i++) {
+        if (ls[i].handler == ngx_http_limit_sync_handler) {
+            lscf->listening = &ls[i];
+            break;
+        }
+    }
+
+    if (lscf->listening == NULL) {
+        return NGX_OK;
+    }
+
+    lscf->event.handler = ngx_http_limit_sync_timer_handler;
+    lscf->event.data = lscf;
+    lscf->event.log = cycle->log;
+    lscf->event.cancelable = 1;
+
+    ngx_add_timer(&lscf->event, lscf->interval);
+
+    return NGX_OK;
+}
@@ -0,0 +1,84 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_LIMIT_SYNC_H_INCLUDED_
+#define _NGX_HTTP_LIMIT_SYNC_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_LIMIT_SYNC_REQ      1
+#define NGX_HTTP_LIMIT_SYNC_CONN     2
+
+
+typedef struct ngx_http_limit_sync_zone_s  ngx_http_limit_sync_zone_t;
+
+
+typedef struct {
+    ngx_str_t                        key;
+    uint32_t                         value;
+} ngx_http_limit_sync_entry_t;
+
+
+typedef struct {
+    /* index of the sending peer */
+    ngx_uint_t                       peer;
+    /* configuration load time of the sending peer */
+    uint32_t                         epoch;
+    /* synchronization round of the sending peer */
+    uint32_t                         seq;
+    ngx_http_limit_sync_entry_t     *entries;
+    ngx_uint_t                       nelts;
+} ngx_http_limit_sync_msg_t;
+
+
+typedef ngx_int_t (*ngx_http_limit_sync_collect_pt)(
+    ngx_http_limit_sync_zone_t *zone, ngx_array_t *entries, ngx_pool_t *pool);
+typedef void (*ngx_http_limit_sync_merge_pt)(ngx_http_limit_sync_zone_t *zone,
+    ngx_http_limit_sync_msg_t *msg);
+
+
+typedef struct {
+    ngx_addr_t                      *listen;
+    /* array of ngx_addr_t */
+    ngx_array_t                      peers;
+    /* array of ngx_http_limit_sync_zone_t * */
+    ngx_array_t                      zones;
+    ngx_msec_t                       interval;
+    /* HMAC key block derived from the secret, or NULL */
+    u_char                          *key;
+
+    ngx_listening_t                 *listening;
+    ngx_shm_zone_t                  *shm_zone;
+    uint32_t                         epoch;
+    uint32_t                         seq;
+    /* datagrams sent in the round */
+    ngx_uint_t                       index;
+    ngx_event_t                      event;
+} ngx_http_limit_sync_conf_t;
+
+
+struct ngx_http_limit_sync_zone_s {
+    ngx_shm_zone_t                  *shm_zone;
+    ngx_uint_t                       type;
+    ngx_http_limit_sync_collect_pt   collect;
+    ngx_http_limit_sync_merge_pt     merge;
+    ngx_http_limit_sync_conf_t      *conf;
+};
+
+
+ngx_http_limit_sync_zone_t *ngx_http_limit_sync_add_zone(ngx_conf_t *cf,
+    ngx_shm_zone_t *shm_zone, ngx_uint_t type);
+
+
+extern ngx_module_t  ngx_http_limit_sync_module;
+
+
+#endif /* _NGX_HTTP_LIMIT_SYNC_H_INCLUDED_ */
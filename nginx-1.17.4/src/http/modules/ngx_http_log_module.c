@@ -31,10 +31,24 @@ struct ngx_http_log_op_s {
 };
 
 
+typedef uint64_t (*ngx_http_log_int_pt) (ngx_http_request_t *r);
+
+
+typedef struct {
+    ngx_str_t                   name;
+    ngx_uint_t                  type;
+    ngx_int_t                   index;      /* variable index */
+    ngx_http_log_int_pt         value;
+} ngx_http_log_field_t;
+
+
 typedef struct {
     ngx_str_t                   name;
     ngx_array_t                *flushes;
     ngx_array_t                *ops;        /* array of ngx_http_log_op_t */
+
+    ngx_array_t                *fields;     /* array of ngx_http_log_field_t */
+    ngx_str_t                   schema;
 } ngx_http_log_fmt_t;
 
 
@@ -44,6 +58,53 @@ typedef struct {
 } ngx_http_log_main_conf_t;
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_fd_t                    fd;
+    u_char                     *buf;
+    size_t                      len;
+    ngx_int_t                   gzip;
+
+    ssize_t                     n;
+    ngx_err_t                   err;
+    ngx_atomic_t                done;
+
+    unsigned                    dup:1;      /* fd is closed after writing */
+} ngx_http_log_thread_ctx_t;
+
+
+typedef struct {
+    u_char                     *bufs;       /* nbufs buffers of size bytes */
+    size_t                     *used;
+    size_t                      size;
+    ngx_uint_t                  nbufs;
+
+    ngx_uint_t                  fill;       /* buffer being filled */
+    ngx_uint_t                  io;         /* oldest queued buffer */
+    ngx_uint_t                  queued;
+
+    ngx_thread_pool_t          *thread_pool;
+    ngx_thread_task_t          *task;
+
+    ngx_uint_t                  dropped;
+    ngx_uint_t                  reported;
+    time_t                      drop_log_time;
+
+    unsigned                    block:1;
+    unsigned                    busy:1;
+} ngx_http_log_async_t;
+
+#endif
+
+
+typedef struct {
+    uint32_t                    hash;
+    uint32_t                    len;
+    u_char                     *data;
+} ngx_http_log_intern_t;
+
+
 typedef struct {
     u_char                     *start;
     u_char                     *pos;
@@ -52,6 +113,19 @@ typedef struct {
     ngx_event_t                *event;
     ngx_msec_t                  flush;
     ngx_int_t                   gzip;
+
+#if (NGX_THREADS)
+    ngx_http_log_async_t       *async;
+#endif
+
+    /* binary format strings interned within the buffer */
+
+    ngx_http_log_intern_t      *intern;
+    u_short                    *slots;
+    ngx_uint_t                  nintern;
+
+    ngx_http_log_fmt_t         *schema;
+    ngx_uint_t                  schema_sample;
 } ngx_http_log_buf_t;
 
 
@@ -69,6 +143,7 @@ typedef struct {
     ngx_syslog_peer_t          *syslog_peer;
     ngx_http_log_fmt_t         *format;
     ngx_http_complex_value_t   *filter;
+    ngx_uint_t                  sample;     /* in 1/10000, 0 is all */
 } ngx_http_log_t;
 
 
@@ -95,6 +170,33 @@ typedef struct {
 #define NGX_HTTP_LOG_ESCAPE_NONE     2
 
 
+#define NGX_HTTP_LOG_BINARY_VERSION  1
+
+#define NGX_HTTP_LOG_RECORD_SCHEMA   'S'
+#define NGX_HTTP_LOG_RECORD_ENTRY    'E'
+
+/* the record length is written as a varint of at most 4 bytes */
+#define NGX_HTTP_LOG_RECORD_HEADER   5
+
+#define NGX_HTTP_LOG_SCHEMA_RESET    0x01
+
+#define NGX_HTTP_LOG_FIELD_INT       0
+#define NGX_HTTP_LOG_FIELD_STRING    1
+#define NGX_HTTP_LOG_FIELD_INTERN    2
+#define NGX_HTTP_LOG_FIELD_NUMBER    3
+
+#define NGX_HTTP_LOG_VALUE_NULL      0
+#define NGX_HTTP_LOG_VALUE_INT       1
+#define NGX_HTTP_LOG_VALUE_STRING    2
+#define NGX_HTTP_LOG_VALUE_REF       3
+#define NGX_HTTP_LOG_VALUE_DEF       4
+
+#define NGX_HTTP_LOG_VARINT_LEN      10
+
+#define NGX_HTTP_LOG_INTERN_MAX      256
+#define NGX_HTTP_LOG_INTERN_SLOTS    512
+
+
 static void ngx_http_log_write(ngx_http_request_t *r, ngx_http_log_t *log,
     u_char *buf, size_t len);
 static ssize_t ngx_http_log_script_write(ngx_http_request_t *r,
@@ -111,6 +213,35 @@ static void ngx_http_log_gzip_free(void *opaque, void *address);
 static void ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log);
 static void ngx_http_log_flush_handler(ngx_event_t *ev);
 
+static size_t ngx_http_log_binary_length(ngx_http_request_t *r,
+    ngx_http_log_t *log);
+static u_char *ngx_http_log_binary(ngx_http_request_t *r, ngx_http_log_t *log,
+    ngx_http_log_buf_t *buffer, u_char *buf);
+static u_char *ngx_http_log_binary_string(ngx_http_log_buf_t *buffer,
+    u_char *p, u_char *data, size_t len);
+static u_char *ngx_http_log_binary_record(u_char *start, u_char type,
+    u_char *last);
+static u_char *ngx_http_log_varint(u_char *p, uint64_t n);
+static uint64_t ngx_http_log_binary_status(ngx_http_request_t *r);
+static uint64_t ngx_http_log_binary_bytes_sent(ngx_http_request_t *r);
+static uint64_t ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r);
+static uint64_t ngx_http_log_binary_request_length(ngx_http_request_t *r);
+static uint64_t ngx_http_log_binary_request_time(ngx_http_request_t *r);
+static uint64_t ngx_http_log_binary_msec(ngx_http_request_t *r);
+
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_log_async_reserve(ngx_open_file_t *file, size_t len,
+    ngx_log_t *log);
+static void ngx_http_log_async_queue(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_async_post(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_async_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_log_async_event_handler(ngx_event_t *ev);
+static void ngx_http_log_async_done(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_async_drain(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_http_log_async_write(ngx_open_file_t *file, u_char *buf,
+    size_t len, ngx_log_t *log);
+#endif
+
 static u_char *ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf,
     ngx_http_log_op_t *op);
 static u_char *ngx_http_log_time(ngx_http_request_t *r, u_char *buf,
@@ -157,6 +288,10 @@ static char *ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_log_compile_format(ngx_conf_t *cf,
     ngx_array_t *flushes, ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s);
+static char *ngx_http_log_compile_binary(ngx_conf_t *cf,
+    ngx_http_log_fmt_t *fmt, ngx_array_t *args, ngx_uint_t s);
+static ngx_int_t ngx_http_log_binary_buffer(ngx_conf_t *cf,
+    ngx_http_log_buf_t *buffer);
 static char *ngx_http_log_open_file_cache(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_log_init(ngx_conf_t *cf);
@@ -250,6 +385,24 @@ static ngx_http_log_var_t  ngx_http_log_vars[] = {
 };
 
 
+typedef struct {
+    ngx_str_t                   name;
+    ngx_http_log_int_pt         value;
+} ngx_http_log_int_t;
+
+
+static ngx_http_log_int_t  ngx_http_log_ints[] = {
+    { ngx_string("status"), ngx_http_log_binary_status },
+    { ngx_string("bytes_sent"), ngx_http_log_binary_bytes_sent },
+    { ngx_string("body_bytes_sent"), ngx_http_log_binary_body_bytes_sent },
+    { ngx_string("request_length"), ngx_http_log_binary_request_length },
+    { ngx_string("request_time"), ngx_http_log_binary_request_time },
+    { ngx_string("msec"), ngx_http_log_binary_msec },
+
+    { ngx_null_string, NULL }
+};
+
+
 static ngx_int_t
 ngx_http_log_handler(ngx_http_request_t *r)
 {
@@ -275,6 +428,12 @@ ngx_http_log_handler(ngx_http_request_t *r)
     log = lcf->logs->elts;
     for (l = 0; l < lcf->logs->nelts; l++) {
 
+        if (log[l].sample
+            && (ngx_uint_t) ngx_random() % 10000 >= log[l].sample)
+        {
+            continue;
+        }
+
         if (log[l].filter) {
             if (ngx_http_complex_value(r, log[l].filter, &val) != NGX_OK) {
                 return NGX_ERROR;
@@ -298,14 +457,21 @@ ngx_http_log_handler(ngx_http_request_t *r)
 
         ngx_http_script_flush_no_cacheable_variables(r, log[l].format->flushes);
 
-        len = 0;
         op = log[l].format->ops->elts;
-        for (i = 0; i < log[l].format->ops->nelts; i++) {
-            if (op[i].len == 0) {
-                len += op[i].getlen(r, op[i].data);
 
-            } else {
-                len += op[i].len;
+        if (log[l].format->fields) {
+            len = ngx_http_log_binary_length(r, &log[l]);
+
+        } else {
+            len = 0;
+
+            for (i = 0; i < log[l].format->ops->nelts; i++) {
+                if (op[i].len == 0) {
+                    len += op[i].getlen(r, op[i].data);
+
+                } else {
+                    len += op[i].len;
+                }
             }
         }
 
@@ -327,10 +493,23 @@ ngx_http_log_handler(ngx_http_request_t *r)
 
             if (len > (size_t) (buffer->last - buffer->pos)) {
 
-                ngx_http_log_write(r, &log[l], buffer->start,
-                                   buffer->pos - buffer->start);
+#if (NGX_THREADS)
+                if (buffer->async) {
+                    if (ngx_http_log_async_reserve(log[l].file, len,
+                                                   r->connection->log)
+                        != NGX_OK)
+                    {
+                        continue;
+                    }
+
+                } else
+#endif
+                {
+                    ngx_http_log_write(r, &log[l], buffer->start,
+                                       buffer->pos - buffer->start);
 
-                buffer->pos = buffer->start;
+                    buffer->pos = buffer->start;
+                }
             }
 
             if (len <= (size_t) (buffer->last - buffer->pos)) {
@@ -341,11 +520,16 @@ ngx_http_log_handler(ngx_http_request_t *r)
                     ngx_add_timer(buffer->event, buffer->flush);
                 }
 
-                for (i = 0; i < log[l].format->ops->nelts; i++) {
-                    p = op[i].run(r, p, &op[i]);
-                }
+                if (log[l].format->fields) {
+                    p = ngx_http_log_binary(r, &log[l], buffer, p);
+
+                } else {
+                    for (i = 0; i < log[l].format->ops->nelts; i++) {
+                        p = op[i].run(r, p, &op[i]);
+                    }
 
-                ngx_linefeed(p);
+                    ngx_linefeed(p);
+                }
 
                 buffer->pos = p;
 
@@ -364,6 +548,12 @@ ngx_http_log_handler(ngx_http_request_t *r)
             return NGX_ERROR;
         }
 
+        if (log[l].format->fields) {
+            p = ngx_http_log_binary(r, &log[l], NULL, line);
+            ngx_http_log_write(r, &log[l], line, p - line);
+            continue;
+        }
+
         p = line;
 
         if (log[l].syslog_peer) {
@@ -762,213 +952,865 @@ ngx_http_log_flush(ngx_open_file_t *file, ngx_log_t *log)
 static void
 ngx_http_log_flush_handler(ngx_event_t *ev)
 {
+#if (NGX_THREADS)
+    ngx_open_file_t       *file;
+    ngx_http_log_buf_t    *buffer;
+    ngx_http_log_async_t  *async;
+#endif
+
     ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, 0,
                    "http log buffer flush handler");
 
-    ngx_http_log_flush(ev->data, ev->log);
-}
-
-
-static u_char *
-ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    size_t     len;
-    uintptr_t  data;
-
-    len = op->len;
-    data = op->data;
+#if (NGX_THREADS)
 
-    while (len--) {
-        *buf++ = (u_char) (data & 0xff);
-        data >>= 8;
-    }
+    file = ev->data;
+    buffer = file->data;
+    async = buffer->async;
 
-    return buf;
-}
+    if (async) {
 
+        if (buffer->pos == buffer->start) {
+            return;
+        }
 
-static u_char *
-ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    return ngx_cpymem(buf, (u_char *) op->data, op->len);
-}
+        if (async->queued + 1 < async->nbufs) {
+            ngx_http_log_async_queue(file, ev->log);
+            return;
+        }
 
+        /* all buffers are queued, retry when the writer catches up */
 
-static u_char *
-ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
-{
-    if (r->pipeline) {
-        *buf = 'p';
-    } else {
-        *buf = '.';
+        ngx_add_timer(ev, buffer->flush);
+        return;
     }
 
-    return buf + 1;
+#endif
+
+    ngx_http_log_flush(ev->data, ev->log);
 }
 
 
-static u_char *
-ngx_http_log_time(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
-{
-    return ngx_cpymem(buf, ngx_cached_http_log_time.data,
-                      ngx_cached_http_log_time.len);
-}
+#if (NGX_THREADS)
 
-static u_char *
-ngx_http_log_iso8601(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+static ngx_int_t
+ngx_http_log_async_reserve(ngx_open_file_t *file, size_t len, ngx_log_t *log)
 {
-    return ngx_cpymem(buf, ngx_cached_http_log_iso8601.data,
-                      ngx_cached_http_log_iso8601.len);
-}
+    ngx_http_log_buf_t    *buffer;
+    ngx_http_log_async_t  *async;
 
-static u_char *
-ngx_http_log_msec(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
-{
-    ngx_time_t  *tp;
+    buffer = file->data;
+    async = buffer->async;
 
-    tp = ngx_timeofday();
+    if (len > async->size) {
 
-    return ngx_sprintf(buf, "%T.%03M", tp->sec, tp->msec);
-}
+        /*
+         * the entry does not fit into a buffer and is written directly,
+         * so all entries queued before it are written first
+         */
 
+        ngx_http_log_async_drain(file, log);
+        return NGX_OK;
+    }
 
-static u_char *
-ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    ngx_time_t      *tp;
-    ngx_msec_int_t   ms;
+    if (async->queued + 1 < async->nbufs) {
+        ngx_http_log_async_queue(file, log);
+        return NGX_OK;
+    }
 
-    tp = ngx_timeofday();
+    if (async->block) {
+        ngx_http_log_async_drain(file, log);
+        return NGX_OK;
+    }
 
-    ms = (ngx_msec_int_t)
-             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
-    ms = ngx_max(ms, 0);
+    async->dropped++;
 
-    return ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000, ms % 1000);
+    return NGX_DECLINED;
 }
 
 
-static u_char *
-ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+static void
+ngx_http_log_async_queue(ngx_open_file_t *file, ngx_log_t *log)
 {
-    ngx_uint_t  status;
+    ngx_http_log_buf_t    *buffer;
+    ngx_http_log_async_t  *async;
 
-    if (r->err_status) {
-        status = r->err_status;
+    buffer = file->data;
+    async = buffer->async;
 
-    } else if (r->headers_out.status) {
-        status = r->headers_out.status;
+    async->used[async->fill] = buffer->pos - buffer->start;
+    async->queued++;
 
-    } else if (r->http_version == NGX_HTTP_VERSION_9) {
-        status = 9;
+    async->fill = (async->fill + 1) % async->nbufs;
 
-    } else {
-        status = 0;
+    buffer->start = async->bufs + async->fill * async->size;
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + async->size;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
     }
 
-    return ngx_sprintf(buf, "%03ui", status);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http log queue: %ui of %ui buffers",
+                   async->queued, async->nbufs);
+
+    ngx_http_log_async_post(file, log);
 }
 
 
-static u_char *
-ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
+static void
+ngx_http_log_async_post(ngx_open_file_t *file, ngx_log_t *log)
 {
-    return ngx_sprintf(buf, "%O", r->connection->sent);
-}
+    ngx_thread_task_t          *task;
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_async_t       *async;
+    ngx_http_log_thread_ctx_t  *ctx;
 
+    buffer = file->data;
+    async = buffer->async;
 
-/*
- * although there is a real $body_bytes_sent variable,
- * this log operation code function is more optimized for logging
- */
+    task = async->task;
+    ctx = task->ctx;
 
-static u_char *
-ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    off_t  length;
+    while (async->queued && !async->busy) {
 
-    length = r->connection->sent - r->header_size;
+        /*
+         * the thread writes to a duplicate of the descriptor, so the file
+         * may be reopened and the original descriptor closed meanwhile
+         */
 
-    if (length > 0) {
-        return ngx_sprintf(buf, "%O", length);
-    }
+        ctx->fd = dup(file->fd);
+        ctx->dup = 1;
 
-    *buf = '0';
+        if (ctx->fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "dup(\"%s\") failed", file->name.data);
 
-    return buf + 1;
-}
+            ctx->fd = file->fd;
+            ctx->dup = 0;
+        }
 
+        ctx->buf = async->bufs + async->io * async->size;
+        ctx->len = async->used[async->io];
+        ctx->gzip = buffer->gzip;
+        ctx->done = 0;
 
-static u_char *
-ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
-    ngx_http_log_op_t *op)
-{
-    return ngx_sprintf(buf, "%O", r->request_length);
+        if (ctx->dup
+            && ngx_thread_task_post(async->thread_pool, task) == NGX_OK)
+        {
+            async->busy = 1;
+            return;
+        }
+
+        /*
+         * the thread pool queue is full or the descriptor was not
+         * duplicated, write the buffer in place
+         */
+
+        ngx_http_log_async_thread_handler(ctx, log);
+        ngx_http_log_async_done(file, log);
+    }
 }
 
 
-static ngx_int_t
-ngx_http_log_variable_compile(ngx_conf_t *cf, ngx_http_log_op_t *op,
-    ngx_str_t *value, ngx_uint_t escape)
+static void
+ngx_http_log_async_thread_handler(void *data, ngx_log_t *log)
 {
-    ngx_int_t  index;
+    ngx_http_log_thread_ctx_t *ctx = data;
 
-    index = ngx_http_get_variable_index(cf, value);
-    if (index == NGX_ERROR) {
-        return NGX_ERROR;
-    }
+    ssize_t  n;
 
-    op->len = 0;
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "http log thread: fd:%d %uz", ctx->fd, ctx->len);
 
-    switch (escape) {
-    case NGX_HTTP_LOG_ESCAPE_JSON:
-        op->getlen = ngx_http_log_json_variable_getlen;
-        op->run = ngx_http_log_json_variable;
-        break;
+#if (NGX_ZLIB)
+    if (ctx->gzip) {
+        n = ngx_http_log_gzip(ctx->fd, ctx->buf, ctx->len, ctx->gzip, log);
+    } else {
+        n = ngx_write_fd(ctx->fd, ctx->buf, ctx->len);
+    }
+#else
+    n = ngx_write_fd(ctx->fd, ctx->buf, ctx->len);
+#endif
 
-    case NGX_HTTP_LOG_ESCAPE_NONE:
-        op->getlen = ngx_http_log_unescaped_variable_getlen;
-        op->run = ngx_http_log_unescaped_variable;
-        break;
+    ctx->n = n;
+    ctx->err = (n == -1) ? ngx_errno : 0;
 
-    default: /* NGX_HTTP_LOG_ESCAPE_DEFAULT */
-        op->getlen = ngx_http_log_variable_getlen;
-        op->run = ngx_http_log_variable;
+    if (ctx->dup) {
+        (void) ngx_close_file(ctx->fd);
     }
 
-    op->data = index;
+    ngx_memory_barrier();
 
-    return NGX_OK;
+    ctx->done = 1;
 }
 
 
-static size_t
-ngx_http_log_variable_getlen(ngx_http_request_t *r, uintptr_t data)
+static void
+ngx_http_log_async_event_handler(ngx_event_t *ev)
 {
-    uintptr_t                   len;
-    ngx_http_variable_value_t  *value;
+    ngx_open_file_t       *file;
+    ngx_http_log_buf_t    *buffer;
+    ngx_http_log_async_t  *async;
 
-    value = ngx_http_get_indexed_variable(r, data);
-
-    if (value == NULL || value->not_found) {
-        return 1;
-    }
+    file = ev->data;
+    buffer = file->data;
+    async = buffer->async;
 
-    len = ngx_http_log_escape(NULL, value->data, value->len);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http log thread event handler");
 
-    value->escape = len ? 1 : 0;
+    async->busy = 0;
 
-    return value->len + len * 3;
+    ngx_http_log_async_done(file, ev->log);
+    ngx_http_log_async_post(file, ev->log);
 }
 
 
-static u_char *
-ngx_http_log_variable(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+static void
+ngx_http_log_async_done(ngx_open_file_t *file, ngx_log_t *log)
+{
+    time_t                      now;
+    ngx_http_log_buf_t         *buffer;
+    ngx_http_log_async_t       *async;
+    ngx_http_log_thread_ctx_t  *ctx;
+
+    buffer = file->data;
+    async = buffer->async;
+    ctx = async->task->ctx;
+
+    if (ctx->n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ctx->err,
+                      ngx_write_fd_n " to \"%s\" failed", file->name.data);
+
+    } else if ((size_t) ctx->n != ctx->len) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      file->name.data, ctx->n, ctx->len);
+    }
+
+    async->io = (async->io + 1) % async->nbufs;
+    async->queued--;
+
+    if (async->dropped == async->reported) {
+        return;
+    }
+
+    now = ngx_time();
+
+    if (now - async->drop_log_time > 59) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "%ui entries to \"%s\" dropped, all buffers were busy",
+                      async->dropped - async->reported, file->name.data);
+
+        async->reported = async->dropped;
+        async->drop_log_time = now;
+    }
+}
+
+
+static void
+ngx_http_log_async_drain(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_uint_t             i, n, skip;
+    ngx_http_log_buf_t    *buffer;
+    ngx_http_log_async_t  *async;
+
+    buffer = file->data;
+    async = buffer->async;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http log drain: %ui buffers", async->queued);
+
+    /*
+     * the buffer being written by the thread is not waited for: it is
+     * released by the completion event handler, and the thread writes
+     * to its own descriptor, which stays valid if the file is reopened;
+     * the entries of the buffer may thus follow the ones written here
+     */
+
+    skip = async->busy;
+
+    for (i = skip; i < async->queued; i++) {
+        n = (async->io + i) % async->nbufs;
+
+        ngx_http_log_async_write(file, async->bufs + n * async->size,
+                                 async->used[n], log);
+    }
+
+    ngx_http_log_async_write(file, buffer->start, buffer->pos - buffer->start,
+                             log);
+
+    async->queued = skip;
+    async->fill = (async->io + skip) % async->nbufs;
+
+    buffer->start = async->bufs + async->fill * async->size;
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + async->size;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+
+    if (async->dropped != async->reported) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "%ui entries to \"%s\" dropped, all buffers were busy",
+                      async->dropped - async->reported, file->name.data);
+
+        async->reported = async->dropped;
+    }
+}
+
+
+static void
+ngx_http_log_async_write(ngx_open_file_t *file, u_char *buf, size_t len,
+    ngx_log_t *log)
+{
+    ssize_t              n;
+#if (NGX_ZLIB)
+    ngx_http_log_buf_t  *buffer;
+#endif
+
+    if (len == 0) {
+        return;
+    }
+
+#if (NGX_ZLIB)
+    buffer = file->data;
+
+    if (buffer->gzip) {
+        n = ngx_http_log_gzip(file->fd, buf, len, buffer->gzip, log);
+    } else {
+        n = ngx_write_fd(file->fd, buf, len);
+    }
+#else
+    n = ngx_write_fd(file->fd, buf, len);
+#endif
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_write_fd_n " to \"%s\" failed",
+                      file->name.data);
+
+    } else if ((size_t) n != len) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      file->name.data, n, len);
+    }
+}
+
+#endif
+
+
+static u_char *
+ngx_http_log_copy_short(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    size_t     len;
+    uintptr_t  data;
+
+    len = op->len;
+    data = op->data;
+
+    while (len--) {
+        *buf++ = (u_char) (data & 0xff);
+        data >>= 8;
+    }
+
+    return buf;
+}
+
+
+static u_char *
+ngx_http_log_copy_long(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+}
+
+
+static u_char *
+ngx_http_log_pipe(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    if (r->pipeline) {
+        *buf = 'p';
+    } else {
+        *buf = '.';
+    }
+
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_http_log_time(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_time.data,
+                      ngx_cached_http_log_time.len);
+}
+
+static u_char *
+ngx_http_log_iso8601(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_iso8601.data,
+                      ngx_cached_http_log_iso8601.len);
+}
+
+static u_char *
+ngx_http_log_msec(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    return ngx_sprintf(buf, "%T.%03M", tp->sec, tp->msec);
+}
+
+
+static u_char *
+ngx_http_log_request_time(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    ngx_time_t      *tp;
+    ngx_msec_int_t   ms;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    return ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000, ms % 1000);
+}
+
+
+static u_char *
+ngx_http_log_status(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
+{
+    ngx_uint_t  status;
+
+    if (r->err_status) {
+        status = r->err_status;
+
+    } else if (r->headers_out.status) {
+        status = r->headers_out.status;
+
+    } else if (r->http_version == NGX_HTTP_VERSION_9) {
+        status = 9;
+
+    } else {
+        status = 0;
+    }
+
+    return ngx_sprintf(buf, "%03ui", status);
+}
+
+
+static u_char *
+ngx_http_log_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", r->connection->sent);
+}
+
+
+/*
+ * although there is a real $body_bytes_sent variable,
+ * this log operation code function is more optimized for logging
+ */
+
+static u_char *
+ngx_http_log_body_bytes_sent(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    off_t  length;
+
+    length = r->connection->sent - r->header_size;
+
+    if (length > 0) {
+        return ngx_sprintf(buf, "%O", length);
+    }
+
+    *buf = '0';
+
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_http_log_request_length(ngx_http_request_t *r, u_char *buf,
+    ngx_http_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", r->request_length);
+}
+
+
+/*
+ * The binary format is a sequence of records, each is a type byte followed
+ * by a varint payload length.  A schema record carries the format version,
+ * flags, sampling rate and field names, and precedes the entries that use it.
+ * An entry has a tagged value for each field.  Strings in "intern" fields
+ * are defined once per buffer and then referred to by their number; the
+ * table is reset at the start of each buffer, so that every written buffer
+ * is self-contained.
+ */
+
+static size_t
+ngx_http_log_binary_length(ngx_http_request_t *r, ngx_http_log_t *log)
+{
+    size_t                      len;
+    ngx_uint_t                  i;
+    ngx_http_log_field_t       *field;
+    ngx_http_variable_value_t  *vv;
+
+    len = NGX_HTTP_LOG_RECORD_HEADER + 2 + NGX_HTTP_LOG_VARINT_LEN
+          + log->format->schema.len
+          + NGX_HTTP_LOG_RECORD_HEADER;
+
+    field = log->format->fields->elts;
+
+    for (i = 0; i < log->format->fields->nelts; i++) {
+
+        len += 1 + NGX_HTTP_LOG_VARINT_LEN;
+
+        if (field[i].type == NGX_HTTP_LOG_FIELD_INT) {
+            continue;
+        }
+
+        vv = ngx_http_get_indexed_variable(r, field[i].index);
+
+        if (vv && !vv->not_found) {
+            len += vv->len;
+        }
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_http_log_binary(ngx_http_request_t *r, ngx_http_log_t *log,
+    ngx_http_log_buf_t *buffer, u_char *buf)
+{
+    u_char                     *p, *last, flags;
+    uint64_t                    n;
+    ngx_uint_t                  i, k, first, sample;
+    ngx_http_log_fmt_t         *fmt;
+    ngx_http_log_field_t       *field;
+    ngx_http_variable_value_t  *vv;
+
+    fmt = log->format;
+    sample = log->sample ? log->sample : 10000;
+
+    flags = 0;
+
+    if (buffer && buf == buffer->start) {
+        ngx_memzero(buffer->slots,
+                    NGX_HTTP_LOG_INTERN_SLOTS * sizeof(u_short));
+
+        buffer->nintern = 0;
+        buffer->schema = NULL;
+
+        flags = NGX_HTTP_LOG_SCHEMA_RESET;
+    }
+
+    if (buffer == NULL
+        || buffer->schema != fmt
+        || buffer->schema_sample != sample)
+    {
+        p = buf + NGX_HTTP_LOG_RECORD_HEADER;
+
+        *p++ = NGX_HTTP_LOG_BINARY_VERSION;
+        *p++ = flags;
+        p = ngx_http_log_varint(p, sample);
+        p = ngx_cpymem(p, fmt->schema.data, fmt->schema.len);
+
+        buf = ngx_http_log_binary_record(buf, NGX_HTTP_LOG_RECORD_SCHEMA, p);
+
+        if (buffer) {
+            buffer->schema = fmt;
+            buffer->schema_sample = sample;
+        }
+    }
+
+    first = buffer ? buffer->nintern : 0;
+
+    p = buf + NGX_HTTP_LOG_RECORD_HEADER;
+
+    field = fmt->fields->elts;
+
+    for (i = 0; i < fmt->fields->nelts; i++) {
+
+        if (field[i].type == NGX_HTTP_LOG_FIELD_INT) {
+            *p++ = NGX_HTTP_LOG_VALUE_INT;
+            p = ngx_http_log_varint(p, field[i].value(r));
+            continue;
+        }
+
+        vv = ngx_http_get_indexed_variable(r, field[i].index);
+
+        if (vv == NULL || vv->not_found) {
+            *p++ = NGX_HTTP_LOG_VALUE_NULL;
+            continue;
+        }
+
+        if (field[i].type == NGX_HTTP_LOG_FIELD_NUMBER
+            && vv->len && vv->len < NGX_INT64_LEN - 1)
+        {
+            n = 0;
+
+            for (k = 0; k < vv->len; k++) {
+                if (vv->data[k] < '0' || vv->data[k] > '9') {
+                    break;
+                }
+
+                n = n * 10 + (vv->data[k] - '0');
+            }
+
+            if (k == vv->len) {
+                *p++ = NGX_HTTP_LOG_VALUE_INT;
+                p = ngx_http_log_varint(p, n);
+                continue;
+            }
+        }
+
+        if (field[i].type == NGX_HTTP_LOG_FIELD_INTERN && buffer) {
+            p = ngx_http_log_binary_string(buffer, p, vv->data, vv->len);
+            continue;
+        }
+
+        *p++ = NGX_HTTP_LOG_VALUE_STRING;
+        p = ngx_http_log_varint(p, vv->len);
+        p = ngx_cpymem(p, vv->data, vv->len);
+    }
+
+    last = ngx_http_log_binary_record(buf, NGX_HTTP_LOG_RECORD_ENTRY, p);
+
+    if (buffer && last != p) {
+
+        /* strings defined in this entry were moved with it */
+
+        for (k = first; k < buffer->nintern; k++) {
+            buffer->intern[k].data -= p - last;
+        }
+    }
+
+    return last;
+}
+
+
+static u_char *
+ngx_http_log_binary_string(ngx_http_log_buf_t *buffer, u_char *p,
+    u_char *data, size_t len)
+{
+    uint32_t                hash;
+    ngx_uint_t              slot, n;
+    ngx_http_log_intern_t  *in;
+
+    hash = ngx_crc32_short(data, len);
+
+    for (slot = hash % NGX_HTTP_LOG_INTERN_SLOTS;
+         buffer->slots[slot];
+         slot = (slot + 1) % NGX_HTTP_LOG_INTERN_SLOTS)
+    {
+        n = buffer->slots[slot] - 1;
+        in = &buffer->intern[n];
+
+        if (in->hash == hash
+            && in->len == len
+            && ngx_memcmp(in->data, data, len) == 0)
+        {
+            *p++ = NGX_HTTP_LOG_VALUE_REF;
+            return ngx_http_log_varint(p, n);
+        }
+    }
+
+    if (buffer->nintern == NGX_HTTP_LOG_INTERN_MAX) {
+        *p++ = NGX_HTTP_LOG_VALUE_STRING;
+        p = ngx_http_log_varint(p, len);
+        return ngx_cpymem(p, data, len);
+    }
+
+    /* the string gets the next number implicitly */
+
+    *p++ = NGX_HTTP_LOG_VALUE_DEF;
+    p = ngx_http_log_varint(p, len);
+
+    in = &buffer->intern[buffer->nintern++];
+
+    in->hash = hash;
+    in->len = len;
+    in->data = p;
+
+    buffer->slots[slot] = (u_short) buffer->nintern;
+
+    return ngx_cpymem(p, data, len);
+}
+
+
+static u_char *
+ngx_http_log_binary_record(u_char *start, u_char type, u_char *last)
+{
+    u_char  *p, *data;
+    size_t   len;
+
+    data = start + NGX_HTTP_LOG_RECORD_HEADER;
+    len = last - data;
+
+    p = start;
+
+    *p++ = type;
+    p = ngx_http_log_varint(p, len);
+
+    if (p != data) {
+        ngx_memmove(p, data, len);
+    }
+
+    return p + len;
+}
+
+
+static u_char *
+ngx_http_log_varint(u_char *p, uint64_t n)
+{
+    while (n >= 0x80) {
+        *p++ = (u_char) (n | 0x80);
+        n >>= 7;
+    }
+
+    *p++ = (u_char) n;
+
+    return p;
+}
+
+
+static uint64_t
+ngx_http_log_binary_status(ngx_http_request_t *r)
+{
+    if (r->err_status) {
+        return r->err_status;
+    }
+
+    if (r->headers_out.status) {
+        return r->headers_out.status;
+    }
+
+    if (r->http_version == NGX_HTTP_VERSION_9) {
+        return 9;
+    }
+
+    return 0;
+}
+
+
+static uint64_t
+ngx_http_log_binary_bytes_sent(ngx_http_request_t *r)
+{
+    return r->connection->sent;
+}
+
+
+static uint64_t
+ngx_http_log_binary_body_bytes_sent(ngx_http_request_t *r)
+{
+    off_t  length;
+
+    length = r->connection->sent - r->header_size;
+
+    return length > 0 ? length : 0;
+}
+
+
+static uint64_t
+ngx_http_log_binary_request_length(ngx_http_request_t *r)
+{
+    return r->request_length;
+}
+
+
+static uint64_t
+ngx_http_log_binary_request_time(ngx_http_request_t *r)
+{
+    ngx_time_t      *tp;
+    ngx_msec_int_t   ms;
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+
+    return ngx_max(ms, 0);
+}
+
+
+static uint64_t
+ngx_http_log_binary_msec(ngx_http_request_t *r)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    return (uint64_t) tp->sec * 1000 + tp->msec;
+}
+
+
+static ngx_int_t
+ngx_http_log_variable_compile(ngx_conf_t *cf, ngx_http_log_op_t *op,
+    ngx_str_t *value, ngx_uint_t escape)
+{
+    ngx_int_t  index;
+
+    index = ngx_http_get_variable_index(cf, value);
+    if (index == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    op->len = 0;
+
+    switch (escape) {
+    case NGX_HTTP_LOG_ESCAPE_JSON:
+        op->getlen = ngx_http_log_json_variable_getlen;
+        op->run = ngx_http_log_json_variable;
+        break;
+
+    case NGX_HTTP_LOG_ESCAPE_NONE:
+        op->getlen = ngx_http_log_unescaped_variable_getlen;
+        op->run = ngx_http_log_unescaped_variable;
+        break;
+
+    default: /* NGX_HTTP_LOG_ESCAPE_DEFAULT */
+        op->getlen = ngx_http_log_variable_getlen;
+        op->run = ngx_http_log_variable;
+    }
+
+    op->data = index;
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_log_variable_getlen(ngx_http_request_t *r, uintptr_t data)
+{
+    uintptr_t                   len;
+    ngx_http_variable_value_t  *value;
+
+    value = ngx_http_get_indexed_variable(r, data);
+
+    if (value == NULL || value->not_found) {
+        return 1;
+    }
+
+    len = ngx_http_log_escape(NULL, value->data, value->len);
+
+    value->escape = len ? 1 : 0;
+
+    return value->len + len * 3;
+}
+
+
+static u_char *
+ngx_http_log_variable(ngx_http_request_t *r, u_char *buf, ngx_http_log_op_t *op)
 {
     ngx_http_variable_value_t  *value;
 
@@ -1148,6 +1990,7 @@ ngx_http_log_create_main_conf(ngx_conf_t *cf)
     ngx_str_set(&fmt->name, "combined");
 
     fmt->flushes = NULL;
+    fmt->fields = NULL;
 
     fmt->ops = ngx_array_create(cf->pool, 16, sizeof(ngx_http_log_op_t));
     if (fmt->ops == NULL) {
@@ -1240,10 +2083,10 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_log_loc_conf_t *llcf = conf;
 
     ssize_t                            size;
-    ngx_int_t                          gzip;
+    ngx_int_t                          gzip, nbufs, block, rate;
     ngx_uint_t                         i, n;
     ngx_msec_t                         flush;
-    ngx_str_t                         *value, name, s;
+    ngx_str_t                         *value, name, s, *tpname;
     ngx_http_log_t                    *log;
     ngx_syslog_peer_t                 *peer;
     ngx_http_log_buf_t                *buffer;
@@ -1251,6 +2094,10 @@ ngx_http_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_log_main_conf_t          *lmcf;
     ngx_http_script_compile_t          sc;
     ngx_http_compile_complex_value_t   ccv;
+#if (NGX_THREADS)
+    ngx_thread_pool_t                 *tp;
+    ngx_http_log_async_t              *async;
+#endif
 
     value = cf->args->elts;
 
@@ -1361,9 +2208,18 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    if (log->format->fields && log->syslog_peer) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "binary log format cannot be used with syslog");
+        return NGX_CONF_ERROR;
+    }
+
     size = 0;
     flush = 0;
     gzip = 0;
+    nbufs = 0;
+    block = -1;
+    tpname = NULL;
 
     for (i = 3; i < cf->args->nelts; i++) {
 
@@ -1430,6 +2286,100 @@ process_formats:
 #endif
         }
 
+        if (ngx_strncmp(value[i].data, "threads", 7) == 0
+            && (value[i].len == 7 || value[i].data[7] == '='))
+        {
+#if (NGX_THREADS)
+            if (size == 0) {
+                size = 64 * 1024;
+            }
+
+            if (value[i].len == 7) {
+                ngx_str_set(&s, "default");
+
+            } else {
+                s.len = value[i].len - 8;
+                s.data = value[i].data + 8;
+
+                if (s.len == 0) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid thread pool name \"%V\"",
+                                       &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+            }
+
+            tpname = ngx_palloc(cf->pool, sizeof(ngx_str_t));
+            if (tpname == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *tpname = s;
+
+            continue;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"threads\" is unsupported on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strncmp(value[i].data, "buffers=", 8) == 0) {
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            nbufs = ngx_atoi(s.data, s.len);
+
+            if (nbufs < 2) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of buffers \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "overflow=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            if (s.len == 4 && ngx_strncmp(s.data, "drop", 4) == 0) {
+                block = 0;
+
+            } else if (s.len == 5 && ngx_strncmp(s.data, "block", 5) == 0) {
+                block = 1;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid overflow policy \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sample=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            rate = NGX_ERROR;
+
+            if (s.len > 1 && s.data[s.len - 1] == '%') {
+                rate = ngx_atofp(s.data, s.len - 1, 2);
+            }
+
+            if (rate <= 0 || rate > 10000) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sampling rate \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            log->sample = (rate == 10000) ? 0 : rate;
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "if=", 3) == 0) {
             s.len = value[i].len - 3;
             s.data = value[i].data + 3;
@@ -1465,6 +2415,21 @@ process_formats:
         return NGX_CONF_ERROR;
     }
 
+    if ((nbufs || block != -1) && tpname == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no threads are defined for access_log \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (nbufs == 0) {
+        nbufs = 4;
+    }
+
+    if (block == -1) {
+        block = 1;
+    }
+
     if (size) {
 
         if (log->script) {
@@ -1482,6 +2447,24 @@ process_formats:
         if (log->file->data) {
             buffer = log->file->data;
 
+#if (NGX_THREADS)
+            async = buffer->async;
+
+            if ((async == NULL) != (tpname == NULL)
+                || (async
+                    && (async->nbufs != (ngx_uint_t) nbufs
+                        || async->block != block
+                        || async->thread_pool
+                           != ngx_thread_pool_add(cf, tpname))))
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "access_log \"%V\" already defined "
+                                   "with conflicting parameters",
+                                   &value[1]);
+                return NGX_CONF_ERROR;
+            }
+#endif
+
             if (buffer->last - buffer->start != size
                 || buffer->flush != flush
                 || buffer->gzip != gzip)
@@ -1493,6 +2476,12 @@ process_formats:
                 return NGX_CONF_ERROR;
             }
 
+            if (log->format->fields
+                && ngx_http_log_binary_buffer(cf, buffer) != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
             return NGX_CONF_OK;
         }
 
@@ -1501,7 +2490,9 @@ process_formats:
             return NGX_CONF_ERROR;
         }
 
-        buffer->start = ngx_pnalloc(cf->pool, size);
+        /* with threads, the buffer is the first one of the ring */
+
+        buffer->start = ngx_pnalloc(cf->pool, tpname ? nbufs * size : size);
         if (buffer->start == NULL) {
             return NGX_CONF_ERROR;
         }
@@ -1525,8 +2516,59 @@ process_formats:
 
         buffer->gzip = gzip;
 
+        if (log->format->fields
+            && ngx_http_log_binary_buffer(cf, buffer) != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
         log->file->flush = ngx_http_log_flush;
         log->file->data = buffer;
+
+#if (NGX_THREADS)
+
+        if (tpname == NULL) {
+            return NGX_CONF_OK;
+        }
+
+        tp = ngx_thread_pool_add(cf, tpname);
+        if (tp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        async = ngx_pcalloc(cf->pool, sizeof(ngx_http_log_async_t));
+        if (async == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        async->bufs = buffer->start;
+
+        async->used = ngx_pcalloc(cf->pool, nbufs * sizeof(size_t));
+        if (async->used == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        async->size = size;
+        async->nbufs = nbufs;
+        async->block = block;
+        async->thread_pool = tp;
+
+        async->task = ngx_thread_task_alloc(cf->pool,
+                                            sizeof(ngx_http_log_thread_ctx_t));
+        if (async->task == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        async->task->handler = ngx_http_log_async_thread_handler;
+        async->task->event.data = log->file;
+        async->task->event.handler = ngx_http_log_async_event_handler;
+        async->task->event.log = &cf->cycle->new_log;
+
+        buffer->async = async;
+
+        log->file->flush = ngx_http_log_async_drain;
+
+#endif
     }
 
     return NGX_CONF_OK;
@@ -1562,6 +2604,7 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     fmt->name = value[1];
+    fmt->fields = NULL;
 
     fmt->flushes = ngx_array_create(cf->pool, 4, sizeof(ngx_int_t));
     if (fmt->flushes == NULL) {
@@ -1573,10 +2616,167 @@ ngx_http_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (ngx_strcmp(value[2].data, "format=binary") == 0) {
+        return ngx_http_log_compile_binary(cf, fmt, cf->args, 3);
+    }
+
     return ngx_http_log_compile_format(cf, fmt->flushes, fmt->ops, cf->args, 2);
 }
 
 
+static char *
+ngx_http_log_compile_binary(ngx_conf_t *cf, ngx_http_log_fmt_t *fmt,
+    ngx_array_t *args, ngx_uint_t s)
+{
+    u_char                *p, *type;
+    size_t                 len;
+    ngx_int_t             *flush;
+    ngx_str_t             *value, var;
+    ngx_uint_t             i;
+    ngx_http_log_int_t    *v;
+    ngx_http_log_field_t  *field;
+
+    value = args->elts;
+
+    if (s == args->nelts) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no fields in binary log format \"%V\"",
+                           &fmt->name);
+        return NGX_CONF_ERROR;
+    }
+
+    fmt->fields = ngx_array_create(cf->pool, args->nelts - s,
+                                   sizeof(ngx_http_log_field_t));
+    if (fmt->fields == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    len = NGX_HTTP_LOG_VARINT_LEN;
+
+    for ( /* void */ ; s < args->nelts; s++) {
+
+        if (value[s].len < 2 || value[s].data[0] != '$') {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid binary log field \"%V\"", &value[s]);
+            return NGX_CONF_ERROR;
+        }
+
+        field = ngx_array_push(fmt->fields);
+        if (field == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        var.data = value[s].data + 1;
+        var.len = value[s].len - 1;
+
+        type = ngx_strlchr(var.data, var.data + var.len, ':');
+
+        if (type) {
+            var.len = type - var.data;
+            type++;
+        }
+
+        field->name = var;
+        field->value = NULL;
+
+        if (type == NULL) {
+
+            for (v = ngx_http_log_ints; v->name.len; v++) {
+
+                if (v->name.len == var.len
+                    && ngx_strncmp(v->name.data, var.data, var.len) == 0)
+                {
+                    field->type = NGX_HTTP_LOG_FIELD_INT;
+                    field->value = v->value;
+                    break;
+                }
+            }
+
+            if (field->value) {
+                goto next;
+            }
+
+            field->type = NGX_HTTP_LOG_FIELD_STRING;
+
+        } else if (ngx_strcmp(type, "str") == 0) {
+            field->type = NGX_HTTP_LOG_FIELD_STRING;
+
+        } else if (ngx_strcmp(type, "intern") == 0) {
+            field->type = NGX_HTTP_LOG_FIELD_INTERN;
+
+        } else if (ngx_strcmp(type, "int") == 0) {
+            field->type = NGX_HTTP_LOG_FIELD_NUMBER;
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unknown binary log field type \"%s\"", type);
+            return NGX_CONF_ERROR;
+        }
+
+        field->index = ngx_http_get_variable_index(cf, &var);
+        if (field->index == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        flush = ngx_array_push(fmt->flushes);
+        if (flush == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *flush = field->index;
+
+    next:
+
+        len += NGX_HTTP_LOG_VARINT_LEN + var.len;
+    }
+
+    /* the field count and names part of the schema record */
+
+    p = ngx_pnalloc(cf->pool, len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    fmt->schema.data = p;
+
+    p = ngx_http_log_varint(p, fmt->fields->nelts);
+
+    field = fmt->fields->elts;
+
+    for (i = 0; i < fmt->fields->nelts; i++) {
+        p = ngx_http_log_varint(p, field[i].name.len);
+        p = ngx_cpymem(p, field[i].name.data, field[i].name.len);
+    }
+
+    fmt->schema.len = p - fmt->schema.data;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_log_binary_buffer(ngx_conf_t *cf, ngx_http_log_buf_t *buffer)
+{
+    if (buffer->intern) {
+        return NGX_OK;
+    }
+
+    buffer->intern = ngx_palloc(cf->pool, NGX_HTTP_LOG_INTERN_MAX
+                                          * sizeof(ngx_http_log_intern_t));
+    if (buffer->intern == NULL) {
+        return NGX_ERROR;
+    }
+
+    buffer->slots = ngx_pcalloc(cf->pool, NGX_HTTP_LOG_INTERN_SLOTS
+                                          * sizeof(u_short));
+    if (buffer->slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
 static char *
 ngx_http_log_compile_format(ngx_conf_t *cf, ngx_array_t *flushes,
     ngx_array_t *ops, ngx_array_t *args, ngx_uint_t s)
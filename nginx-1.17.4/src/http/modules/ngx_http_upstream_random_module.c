@@ -9,6 +9,12 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_UPSTREAM_RANDOM_HEADER     1
+#define NGX_HTTP_UPSTREAM_RANDOM_LAST_BYTE  2
+
+#define NGX_HTTP_UPSTREAM_RANDOM_DECAY      10000
+
+
 typedef struct {
     ngx_http_upstream_rr_peer_t          *peer;
     ngx_uint_t                            range;
@@ -17,6 +23,7 @@ typedef struct {
 
 typedef struct {
     ngx_uint_t                            two;
+    ngx_uint_t                            least_time;
     ngx_http_upstream_random_range_t     *ranges;
 } ngx_http_upstream_random_srv_conf_t;
 
@@ -26,6 +33,7 @@ typedef struct {
     ngx_http_upstream_rr_peer_data_t      rrp;
 
     ngx_http_upstream_random_srv_conf_t  *conf;
+    ngx_http_request_t                   *request;
     u_char                                tries;
 } ngx_http_upstream_random_peer_data_t;
 
@@ -41,6 +49,10 @@ static ngx_int_t ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc,
     void *data);
 static ngx_int_t ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc,
     void *data);
+static void ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_uint_t ngx_http_upstream_random_response_time(
+    ngx_http_upstream_rr_peer_t *peer);
 static ngx_uint_t ngx_http_upstream_peek_random_peer(
     ngx_http_upstream_rr_peers_t *peers,
     ngx_http_upstream_random_peer_data_t *rp);
@@ -180,7 +192,12 @@ ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
         r->upstream->peer.get = ngx_http_upstream_get_random_peer;
     }
 
+    if (rcf->least_time) {
+        r->upstream->peer.free = ngx_http_upstream_free_random_peer;
+    }
+
     rp->conf = rcf;
+    rp->request = r;
     rp->tries = 0;
 
     ngx_http_upstream_rr_peers_rlock(rp->rrp.peers);
@@ -363,7 +380,28 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
         }
 
         if (prev) {
-            if (peer->conns * prev->weight > prev->conns * peer->weight) {
+            if (rp->conf->least_time) {
+
+                /*
+                 * peers are compared by the average response time
+                 * multiplied by the number of requests in flight
+                 */
+
+                if ((uint64_t)
+                    (ngx_http_upstream_random_response_time(peer) + 1)
+                    * (peer->conns + 1) * prev->weight
+                    > (uint64_t)
+                      (ngx_http_upstream_random_response_time(prev) + 1)
+                      * (prev->conns + 1) * peer->weight)
+                {
+                    peer = prev;
+                    n = p / (8 * sizeof(uintptr_t));
+                    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+                }
+
+            } else if (peer->conns * prev->weight
+                       > prev->conns * peer->weight)
+            {
                 peer = prev;
                 n = p / (8 * sizeof(uintptr_t));
                 m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
@@ -403,6 +441,104 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 }
 
 
+/*
+ * the response time of a peer is an exponentially weighted moving
+ * average in 1/16 of a millisecond, with each new sample weighted 1/8;
+ * the average also decays with time (see below), so a peer that was
+ * slow or failed and is no longer chosen gets a new sample eventually
+ */
+
+static void
+ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_random_peer_data_t  *rp = data;
+
+    ngx_msec_t                     time;
+    ngx_uint_t                     sample;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    u = rp->request->upstream;
+    peer = rp->rrp.current;
+    peers = rp->rrp.peers;
+
+    if (rp->conf->least_time == NGX_HTTP_UPSTREAM_RANDOM_HEADER
+        && u->state
+        && u->state->header_time != (ngx_msec_t) -1)
+    {
+        time = u->state->header_time;
+
+    } else {
+        time = ngx_current_msec - u->start_time;
+    }
+
+    sample = (ngx_uint_t) time << 4;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    peer->response_time = ngx_http_upstream_random_response_time(peer);
+    peer->response_updated = ngx_current_msec;
+
+    /* a failed peer should not look fast because it fails fast */
+
+    if ((state & NGX_PEER_FAILED) && sample < peer->response_time * 2) {
+        sample = peer->response_time * 2;
+    }
+
+    if (peer->response_time == 0) {
+        peer->response_time = sample;
+
+    } else {
+        peer->response_time = peer->response_time
+                              - peer->response_time / 8 + sample / 8;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free random peer: %M, average %ui/16 ms, conns %ui",
+                   time, peer->response_time, peer->conns);
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_http_upstream_free_round_robin_peer(pc, data, state);
+}
+
+
+/*
+ * the average is halved for every NGX_HTTP_UPSTREAM_RANDOM_DECAY
+ * milliseconds since it was last updated, linearly within a period
+ */
+
+static ngx_uint_t
+ngx_http_upstream_random_response_time(ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t  rt, n;
+    ngx_msec_t  elapsed;
+
+    rt = peer->response_time;
+    elapsed = ngx_current_msec - peer->response_updated;
+
+    if (rt == 0 || (ngx_msec_int_t) elapsed <= 0) {
+        return rt;
+    }
+
+    n = elapsed / NGX_HTTP_UPSTREAM_RANDOM_DECAY;
+
+    if (n >= 8 * sizeof(ngx_uint_t)) {
+        return 0;
+    }
+
+    rt >>= n;
+
+    elapsed %= NGX_HTTP_UPSTREAM_RANDOM_DECAY;
+
+    return rt - (uint64_t) rt * elapsed / (2 * NGX_HTTP_UPSTREAM_RANDOM_DECAY);
+}
+
+
 static ngx_uint_t
 ngx_http_upstream_peek_random_peer(ngx_http_upstream_rr_peers_t *peers,
     ngx_http_upstream_random_peer_data_t *rp)
@@ -443,6 +579,7 @@ ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->two = 0;
+     *     conf->least_time = 0;
      */
 
     return conf;
@@ -492,11 +629,21 @@ ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_OK;
     }
 
-    if (ngx_strcmp(value[2].data, "least_conn") != 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[2]);
-        return NGX_CONF_ERROR;
+    if (ngx_strcmp(value[2].data, "least_conn") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[2].data, "least_time=header") == 0) {
+        rcf->least_time = NGX_HTTP_UPSTREAM_RANDOM_HEADER;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[2].data, "least_time=last_byte") == 0) {
+        rcf->least_time = NGX_HTTP_UPSTREAM_RANDOM_LAST_BYTE;
+        return NGX_CONF_OK;
     }
 
-    return NGX_CONF_OK;
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+    return NGX_CONF_ERROR;
 }
@@ -0,0 +1,343 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_ZONE_STATUS_SLOTS  16
+
+
+typedef struct {
+    size_t             size;
+    ngx_uint_t         pages;
+    ngx_uint_t         pfree;
+    ngx_uint_t         mag_hits;
+    ngx_uint_t         mag_refills;
+    ngx_uint_t         mag_drains;
+    ngx_uint_t         acquired;
+    ngx_uint_t         contended;
+    uint64_t           wait_time;
+    ngx_uint_t         min_shift;
+    ngx_uint_t         nslots;
+    ngx_slab_stat_t    stats[NGX_HTTP_ZONE_STATUS_SLOTS];
+} ngx_http_zone_status_t;
+
+
+static ngx_int_t ngx_http_zone_status_handler(ngx_http_request_t *r);
+static void ngx_http_zone_status_get(ngx_shm_zone_t *shm_zone,
+    ngx_http_zone_status_t *zs);
+static ngx_uint_t ngx_http_zone_status_udp(ngx_listening_t *ls);
+static u_char *ngx_http_zone_status_udp_write(u_char *p, ngx_listening_t *ls);
+static char *ngx_http_zone_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_zone_status_commands[] = {
+
+    { ngx_string("zone_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_zone_status,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_zone_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_zone_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_zone_status_module_ctx,      /* module context */
+    ngx_http_zone_status_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_zone_status_handler(ngx_http_request_t *r)
+{
+    size_t                   size;
+    ngx_int_t                rc;
+    ngx_buf_t               *b;
+    ngx_uint_t               i, n;
+    ngx_chain_t              out;
+    ngx_list_part_t         *part;
+    ngx_shm_zone_t          *shm_zone;
+    ngx_listening_t         *ls;
+    ngx_slab_stat_t         *stat;
+    ngx_http_zone_status_t   zs;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    size = 0;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        size += sizeof("zone \"\": size  pages  free \n") - 1
+                + shm_zone[i].shm.name.len + 3 * NGX_INT_T_LEN
+                + sizeof("    magazines: hits  refills  drains \n") - 1
+                + 3 * NGX_INT_T_LEN
+                + sizeof("    mutex: acquired  contended  wait us\n") - 1
+                + 2 * NGX_INT_T_LEN + NGX_INT64_LEN
+                + NGX_HTTP_ZONE_STATUS_SLOTS
+                  * (sizeof("    chunk : total  used  reqs  fails \n") - 1
+                     + 5 * NGX_INT_T_LEN);
+    }
+
+    ls = ngx_cycle->listening.elts;
+    for (i = 0; i < ngx_cycle->listening.nelts; i++) {
+
+        if (!ngx_http_zone_status_udp(&ls[i])) {
+            continue;
+        }
+
+        size += sizeof("listen \"\" udp: sessions  peak  slots  dropped \n")
+                - 1 + ls[i].addr_text.len + 4 * NGX_INT_T_LEN
+                + sizeof("    lookups  probes  time ns\n") - 1
+                + 2 * NGX_INT_T_LEN + NGX_INT64_LEN;
+    }
+
+    if (size == 0) {
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = 0;
+        r->header_only = 1;
+
+        return ngx_http_send_header(r);
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        ngx_http_zone_status_get(&shm_zone[i], &zs);
+
+        b->last = ngx_sprintf(b->last, "zone \"%V\": size %uz pages %ui "
+                              "free %ui\n", &shm_zone[i].shm.name, zs.size,
+                              zs.pages, zs.pfree);
+
+        b->last = ngx_sprintf(b->last, "    magazines: hits %ui refills %ui "
+                              "drains %ui\n", zs.mag_hits, zs.mag_refills,
+                              zs.mag_drains);
+
+        b->last = ngx_sprintf(b->last, "    mutex: acquired %ui contended %ui "
+                              "wait %uLus\n", zs.acquired, zs.contended,
+                              zs.wait_time);
+
+        for (n = 0; n < zs.nslots; n++) {
+            stat = &zs.stats[n];
+
+            if (stat->total == 0 && stat->reqs == 0) {
+                continue;
+            }
+
+            b->last = ngx_sprintf(b->last, "    chunk %uz: total %ui used %ui "
+                                  "reqs %ui fails %ui\n",
+                                  (size_t) 1 << (n + zs.min_shift),
+                                  stat->total, stat->used, stat->reqs,
+                                  stat->fails);
+        }
+    }
+
+    for (i = 0; i < ngx_cycle->listening.nelts; i++) {
+
+        if (!ngx_http_zone_status_udp(&ls[i])) {
+            continue;
+        }
+
+        b->last = ngx_http_zone_status_udp_write(b->last, &ls[i]);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static void
+ngx_http_zone_status_get(ngx_shm_zone_t *shm_zone, ngx_http_zone_status_t *zs)
+{
+    ngx_uint_t        n;
+    ngx_slab_pool_t  *shpool;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    zs->size = shm_zone->shm.size;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    zs->pages = shpool->last - shpool->pages;
+    zs->pfree = shpool->pfree;
+    zs->mag_hits = shpool->mag_hits;
+    zs->mag_refills = shpool->mag_refills;
+    zs->mag_drains = shpool->mag_drains;
+    zs->min_shift = shpool->min_shift;
+
+    zs->acquired = shpool->lock.acquired;
+    zs->contended = shpool->lock.contended;
+    zs->wait_time = shpool->lock.wait_time;
+
+    n = ngx_pagesize_shift - shpool->min_shift;
+
+    if (n > NGX_HTTP_ZONE_STATUS_SLOTS) {
+        n = NGX_HTTP_ZONE_STATUS_SLOTS;
+    }
+
+    ngx_memcpy(zs->stats, shpool->stats, n * sizeof(ngx_slab_stat_t));
+    zs->nslots = n;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+/*
+ * udp session tables are per worker, so only listeners
+ * of the worker which handles the request are reported
+ */
+
+static ngx_uint_t
+ngx_http_zone_status_udp(ngx_listening_t *ls)
+{
+    if (ls->type != SOCK_DGRAM) {
+        return 0;
+    }
+
+#if (NGX_HAVE_REUSEPORT)
+    if (ls->reuseport && ls->worker != ngx_worker) {
+        return 0;
+    }
+#endif
+
+    return 1;
+}
+
+
+static u_char *
+ngx_http_zone_status_udp_write(u_char *p, ngx_listening_t *ls)
+{
+    uint64_t          time;
+    ngx_udp_table_t  *t, empty;
+
+    t = ls->udp_table;
+
+    if (t == NULL) {
+        ngx_memzero(&empty, sizeof(ngx_udp_table_t));
+        t = &empty;
+    }
+
+    /* the average of the sampled lookups */
+
+    time = t->timed ? t->time / t->timed : 0;
+
+    p = ngx_sprintf(p, "listen \"%V\" udp: sessions %ui peak %ui slots %ui "
+                    "dropped %ui\n",
+                    &ls->addr_text, t->sessions, t->peak,
+                    t->entries ? t->mask + 1 : 0, t->dropped);
+
+    return ngx_sprintf(p, "    lookups %ui probes %ui time %uLns\n",
+                       t->lookups, t->probes, time);
+}
+
+
+static char *
+ngx_http_zone_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_zone_status_handler;
+
+    return NGX_CONF_OK;
+}
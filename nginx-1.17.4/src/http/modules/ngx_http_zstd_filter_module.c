@@ -0,0 +1,426 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <zstd.h>
+
+
+typedef struct {
+    ngx_http_compress_conf_t   compress;
+
+    ngx_int_t                  level;
+    size_t                     wlog;
+} ngx_http_zstd_conf_t;
+
+
+static ngx_int_t ngx_http_zstd_filter_test(ngx_http_request_t *r);
+static ngx_int_t ngx_http_zstd_filter_init_state(ngx_http_compress_ctx_t *ctx);
+static ngx_int_t ngx_http_zstd_filter_compress(ngx_http_compress_ctx_t *ctx);
+static void ngx_http_zstd_filter_done(ngx_http_compress_ctx_t *ctx);
+static void ngx_http_zstd_filter_cleanup(void *data);
+
+static ngx_int_t ngx_http_zstd_add_variables(ngx_conf_t *cf);
+
+static ngx_int_t ngx_http_zstd_filter_init(ngx_conf_t *cf);
+static void *ngx_http_zstd_create_conf(ngx_conf_t *cf);
+static char *ngx_http_zstd_merge_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static char *ngx_http_zstd_comp_level(ngx_conf_t *cf, void *post, void *data);
+static char *ngx_http_zstd_window(ngx_conf_t *cf, void *post, void *data);
+
+
+static ngx_conf_post_handler_pt  ngx_http_zstd_comp_level_p =
+    ngx_http_zstd_comp_level;
+static ngx_conf_post_handler_pt  ngx_http_zstd_window_p =
+    ngx_http_zstd_window;
+
+
+static ngx_command_t  ngx_http_zstd_filter_commands[] = {
+
+    { ngx_string("zstd"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF
+                        |NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, compress.enable),
+      NULL },
+
+    { ngx_string("zstd_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, compress.bufs),
+      NULL },
+
+    { ngx_string("zstd_types"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_types_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, compress.types_keys),
+      &ngx_http_html_default_types[0] },
+
+    { ngx_string("zstd_comp_level"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, level),
+      &ngx_http_zstd_comp_level_p },
+
+    { ngx_string("zstd_window"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, wlog),
+      &ngx_http_zstd_window_p },
+
+    { ngx_string("postpone_zstd"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, compress.postpone),
+      NULL },
+
+    { ngx_string("zstd_no_buffer"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, compress.no_buffer),
+      NULL },
+
+    { ngx_string("zstd_min_length"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zstd_conf_t, compress.min_length),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_zstd_filter_module_ctx = {
+    ngx_http_zstd_add_variables,           /* preconfiguration */
+    ngx_http_zstd_filter_init,             /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_zstd_create_conf,             /* create location configuration */
+    ngx_http_zstd_merge_conf               /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_zstd_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_zstd_filter_module_ctx,      /* module context */
+    ngx_http_zstd_filter_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_http_zstd_ratio = ngx_string("zstd_ratio");
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+static ngx_http_compress_method_t  ngx_http_zstd_method = {
+    ngx_string("zstd"),
+    &ngx_http_zstd_filter_module,
+    NGX_ERROR,
+    ngx_http_zstd_filter_init_state,
+    ngx_http_zstd_filter_compress,
+    ngx_http_zstd_filter_done
+};
+
+
+static ngx_int_t
+ngx_http_zstd_header_filter(ngx_http_request_t *r)
+{
+    if (ngx_http_compress_header_filter(r, &ngx_http_zstd_method)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_next_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_test(ngx_http_request_t *r)
+{
+    ngx_http_zstd_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_zstd_filter_module);
+
+    return ngx_http_compress_test(r, &conf->compress);
+}
+
+
+static ngx_int_t
+ngx_http_zstd_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    return ngx_http_compress_body_filter(r, in, &ngx_http_zstd_method,
+                                         ngx_http_next_body_filter);
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_init_state(ngx_http_compress_ctx_t *ctx)
+{
+    size_t                 rc;
+    ZSTD_CCtx             *cctx;
+    ngx_pool_cleanup_t    *cln;
+    ngx_http_request_t    *r;
+    ngx_http_zstd_conf_t  *conf;
+
+    r = ctx->request;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_zstd_filter_module);
+
+    /*
+     * the stable zstd API does not allow to specify an allocator,
+     * so the context is freed by the pool cleanup handler if the request
+     * is terminated in the middle of the compression
+     */
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cctx = ZSTD_createCCtx();
+    if (cctx == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "ZSTD_createCCtx() failed");
+        return NGX_ERROR;
+    }
+
+    ctx->state = cctx;
+
+    cln->handler = ngx_http_zstd_filter_cleanup;
+    cln->data = ctx;
+
+    rc = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                (int) conf->level);
+
+    if (!ZSTD_isError(rc) && conf->wlog) {
+        rc = ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, (int) conf->wlog);
+    }
+
+    /*
+     * the source size is not pledged: filters which run earlier may
+     * change the length of the body, and zstd fails a stream which is
+     * longer or shorter than pledged
+     */
+
+    if (ZSTD_isError(rc)) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "ZSTD_CCtx_setParameter() failed: %s",
+                      ZSTD_getErrorName(rc));
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_compress(ngx_http_compress_ctx_t *ctx)
+{
+    size_t             rc;
+    ZSTD_inBuffer      input;
+    ZSTD_outBuffer     output;
+    ZSTD_EndDirective  mode;
+
+    switch (ctx->op) {
+
+    case NGX_HTTP_COMPRESS_FINISH:
+        mode = ZSTD_e_end;
+        break;
+
+    case NGX_HTTP_COMPRESS_FLUSH:
+        mode = ZSTD_e_flush;
+        break;
+
+    default: /* NGX_HTTP_COMPRESS_PROCESS */
+        mode = ZSTD_e_continue;
+    }
+
+    input.src = ctx->next_in;
+    input.size = ctx->avail_in;
+    input.pos = 0;
+
+    output.dst = ctx->next_out;
+    output.size = ctx->avail_out;
+    output.pos = 0;
+
+    rc = ZSTD_compressStream2(ctx->state, &output, &input, mode);
+
+    if (ZSTD_isError(rc)) {
+        ngx_log_error(NGX_LOG_ALERT, ctx->request->connection->log, 0,
+                      "ZSTD_compressStream2() failed: %d, %s",
+                      mode, ZSTD_getErrorName(rc));
+        return NGX_ERROR;
+    }
+
+    ctx->next_in += input.pos;
+    ctx->avail_in -= input.pos;
+
+    ctx->next_out += output.pos;
+    ctx->avail_out -= output.pos;
+
+    /* for ZSTD_e_flush and ZSTD_e_end, 0 means the data are fully flushed */
+
+    ctx->finished = (mode != ZSTD_e_continue && rc == 0);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_zstd_filter_done(ngx_http_compress_ctx_t *ctx)
+{
+    ZSTD_freeCCtx(ctx->state);
+}
+
+
+static void
+ngx_http_zstd_filter_cleanup(void *data)
+{
+    ngx_http_compress_ctx_t *ctx = data;
+
+    if (ctx->state) {
+        ZSTD_freeCCtx(ctx->state);
+        ctx->state = NULL;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_zstd_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var;
+
+    var = ngx_http_add_variable(cf, &ngx_http_zstd_ratio, NGX_HTTP_VAR_NOHASH);
+    if (var == NULL) {
+        return NGX_ERROR;
+    }
+
+    var->get_handler = ngx_http_compress_ratio_variable;
+    var->data = (uintptr_t) &ngx_http_zstd_filter_module;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_zstd_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_zstd_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_zstd_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    ngx_http_compress_init_conf(&conf->compress);
+
+    conf->level = NGX_CONF_UNSET;
+    conf->wlog = NGX_CONF_UNSET_SIZE;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_zstd_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_zstd_conf_t *prev = parent;
+    ngx_http_zstd_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->level, prev->level, 3);
+    ngx_conf_merge_size_value(conf->wlog, prev->wlog, 0);
+
+    return ngx_http_compress_merge_conf(cf, &prev->compress, &conf->compress);
+}
+
+
+static ngx_int_t
+ngx_http_zstd_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_zstd_method.encoding = ngx_http_add_encoding(cf,
+                                                 &ngx_http_zstd_method.name,
+                                                 ngx_http_zstd_filter_test);
+    if (ngx_http_zstd_method.encoding == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_zstd_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_zstd_body_filter;
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_zstd_comp_level(ngx_conf_t *cf, void *post, void *data)
+{
+    ngx_int_t *np = data;
+
+    if (*np < ZSTD_minCLevel() || *np > ZSTD_maxCLevel() || *np == 0) {
+        return "is out of the range supported by the zstd library";
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_zstd_window(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *np = data;
+
+    size_t  wlog, wsize;
+
+    /*
+     * the "zstd" content coding limits the window to 8m,
+     * larger windows are not guaranteed to be decoded by clients
+     */
+
+    wlog = 23;
+
+    for (wsize = 8 * 1024 * 1024; wlog >= 10; wsize >>= 1) {
+
+        if (wsize == *np) {
+            *np = wlog;
+
+            return NGX_CONF_OK;
+        }
+
+        wlog--;
+    }
+
+    return "must be a power of two between 1k and 8m";
+}
@@ -62,6 +62,17 @@ typedef struct {
 } ngx_http_file_cache_node_t;
 
 
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_t                       file;
+    off_t                            body_start;
+    off_t                            length;
+
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_node_t      *node;
+} ngx_http_cache_encoded_t;
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -91,6 +102,7 @@ struct ngx_http_cache_s {
     ngx_uint_t                       vary_tag;
 
     ngx_buf_t                       *buf;
+    ngx_http_cache_encoded_t        *encoded;
 
     ngx_http_file_cache_t           *file_cache;
     ngx_http_file_cache_node_t      *node;
@@ -193,6 +205,12 @@ void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
+ngx_int_t ngx_http_file_cache_encoded_init(ngx_http_request_t *r,
+    ngx_http_cache_encoded_t *e, ngx_str_t *encoding);
+ngx_int_t ngx_http_file_cache_encoded_open(ngx_http_request_t *r,
+    ngx_http_cache_encoded_t *e);
+void ngx_http_file_cache_encoded_update(ngx_http_request_t *r,
+    ngx_http_cache_encoded_t *e, ngx_temp_file_t *tf);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
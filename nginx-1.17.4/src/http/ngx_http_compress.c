@@ -0,0 +1,714 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * the buffering, output buffer management and flush handling shared
+ * by the streaming compression filters, a method only provides
+ * the functions to create, run and destroy its compressor state
+ */
+
+
+static ngx_int_t ngx_http_compress_buffer(ngx_http_compress_ctx_t *ctx,
+    ngx_chain_t *in);
+static ngx_int_t ngx_http_compress_add_data(ngx_http_request_t *r,
+    ngx_http_compress_ctx_t *ctx);
+static ngx_int_t ngx_http_compress_get_buf(ngx_http_request_t *r,
+    ngx_http_compress_ctx_t *ctx);
+static ngx_int_t ngx_http_compress_run(ngx_http_request_t *r,
+    ngx_http_compress_ctx_t *ctx);
+static ngx_int_t ngx_http_compress_end(ngx_http_request_t *r,
+    ngx_http_compress_ctx_t *ctx);
+static void ngx_http_compress_done(ngx_http_compress_ctx_t *ctx);
+static void ngx_http_compress_free_copy_buf(ngx_http_request_t *r,
+    ngx_http_compress_ctx_t *ctx);
+
+
+ngx_int_t
+ngx_http_compress_test(ngx_http_request_t *r, ngx_http_compress_conf_t *conf)
+{
+    if (!conf->enable
+        || (r->headers_out.status != NGX_HTTP_OK
+            && r->headers_out.status != NGX_HTTP_FORBIDDEN
+            && r->headers_out.status != NGX_HTTP_NOT_FOUND)
+        || (r->headers_out.content_encoding
+            && r->headers_out.content_encoding->value.len)
+        || (r->headers_out.content_length_n != -1
+            && r->headers_out.content_length_n < conf->min_length)
+        || ngx_http_test_content_type(r, &conf->types) == NULL
+        || r->header_only)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_compress_header_filter(ngx_http_request_t *r,
+    ngx_http_compress_method_t *method)
+{
+    ngx_table_elt_t           *h;
+    ngx_http_compress_ctx_t   *ctx;
+    ngx_http_compress_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, (*method->module));
+
+    if (ngx_http_compress_test(r, conf) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    r->gzip_vary = 1;
+
+#if (NGX_HTTP_DEGRADATION)
+    {
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->gzip_disable_degradation && ngx_http_degraded(r)) {
+        return NGX_DECLINED;
+    }
+    }
+#endif
+
+    if (ngx_http_select_encoding(r) != method->encoding) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_compress_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, (*method->module));
+
+    ctx->method = method;
+    ctx->conf = conf;
+    ctx->request = r;
+    ctx->buffering = (conf->postpone != 0);
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Content-Encoding");
+    h->value = method->name;
+    r->headers_out.content_encoding = h;
+
+    r->main_filter_need_in_memory = 1;
+
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+    ngx_http_weak_etag(r);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_compress_body_filter(ngx_http_request_t *r, ngx_chain_t *in,
+    ngx_http_compress_method_t *method, ngx_http_output_body_filter_pt next)
+{
+    ngx_int_t                 rc;
+    ngx_uint_t                flush;
+    ngx_chain_t              *cl;
+    ngx_http_compress_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, (*method->module));
+
+    if (ctx == NULL || ctx->done || r->header_only) {
+        return next(r, in);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http %V filter", &method->name);
+
+    if (ctx->buffering) {
+
+        /*
+         * as with gzip, postpone the compressor state allocation
+         * until we have enough data to compress
+         */
+
+        if (in) {
+            switch (ngx_http_compress_buffer(ctx, in)) {
+
+            case NGX_OK:
+                return NGX_OK;
+
+            case NGX_DONE:
+                in = NULL;
+                break;
+
+            default:  /* NGX_ERROR */
+                goto failed;
+            }
+
+        } else {
+            ctx->buffering = 0;
+        }
+    }
+
+    if (ctx->state == NULL) {
+        if (method->init(ctx) != NGX_OK) {
+            goto failed;
+        }
+
+        ctx->last_out = &ctx->out;
+        ctx->op = NGX_HTTP_COMPRESS_PROCESS;
+    }
+
+    if (in) {
+        if (ngx_chain_add_copy(r->pool, &ctx->in, in) != NGX_OK) {
+            goto failed;
+        }
+
+        r->connection->buffered |= NGX_HTTP_GZIP_BUFFERED;
+    }
+
+    if (ctx->nomem) {
+
+        /* flush busy buffers */
+
+        if (next(r, NULL) == NGX_ERROR) {
+            goto failed;
+        }
+
+        cl = NULL;
+
+        ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &cl,
+                                (ngx_buf_tag_t) method->module);
+        ctx->nomem = 0;
+        flush = 0;
+
+    } else {
+        flush = ctx->busy ? 1 : 0;
+    }
+
+    for ( ;; ) {
+
+        /* cycle while we can write to a client */
+
+        for ( ;; ) {
+
+            /* cycle while there is data to feed the compressor and ... */
+
+            rc = ngx_http_compress_add_data(r, ctx);
+
+            if (rc == NGX_DECLINED) {
+                break;
+            }
+
+            if (rc == NGX_AGAIN) {
+                continue;
+            }
+
+
+            /* ... there are buffers to write the compressor output */
+
+            rc = ngx_http_compress_get_buf(r, ctx);
+
+            if (rc == NGX_DECLINED) {
+                break;
+            }
+
+            if (rc == NGX_ERROR) {
+                goto failed;
+            }
+
+
+            rc = ngx_http_compress_run(r, ctx);
+
+            if (rc == NGX_OK) {
+                break;
+            }
+
+            if (rc == NGX_ERROR) {
+                goto failed;
+            }
+
+            /* rc == NGX_AGAIN */
+        }
+
+        if (ctx->out == NULL && !flush) {
+            ngx_http_compress_free_copy_buf(r, ctx);
+
+            return ctx->busy ? NGX_AGAIN : NGX_OK;
+        }
+
+        rc = next(r, ctx->out);
+
+        if (rc == NGX_ERROR) {
+            goto failed;
+        }
+
+        ngx_http_compress_free_copy_buf(r, ctx);
+
+        ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &ctx->out,
+                                (ngx_buf_tag_t) method->module);
+        ctx->last_out = &ctx->out;
+
+        ctx->nomem = 0;
+        flush = 0;
+
+        if (ctx->done) {
+            return rc;
+        }
+    }
+
+    /* unreachable */
+
+failed:
+
+    ctx->done = 1;
+
+    ngx_http_compress_done(ctx);
+
+    ngx_http_compress_free_copy_buf(r, ctx);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_compress_buffer(ngx_http_compress_ctx_t *ctx, ngx_chain_t *in)
+{
+    size_t               size, buffered;
+    ngx_buf_t           *b, *buf;
+    ngx_chain_t         *cl, **ll;
+    ngx_http_request_t  *r;
+
+    r = ctx->request;
+
+    r->connection->buffered |= NGX_HTTP_GZIP_BUFFERED;
+
+    buffered = 0;
+    ll = &ctx->in;
+
+    for (cl = ctx->in; cl; cl = cl->next) {
+        buffered += cl->buf->last - cl->buf->pos;
+        ll = &cl->next;
+    }
+
+    while (in) {
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = in->buf;
+
+        size = b->last - b->pos;
+        buffered += size;
+
+        if (b->flush || b->last_buf || buffered > ctx->conf->postpone) {
+            ctx->buffering = 0;
+        }
+
+        if (ctx->buffering && size) {
+
+            buf = ngx_create_temp_buf(r->pool, size);
+            if (buf == NULL) {
+                return NGX_ERROR;
+            }
+
+            buf->last = ngx_cpymem(buf->pos, b->pos, size);
+            b->pos = b->last;
+
+            buf->last_buf = b->last_buf;
+            buf->tag = (ngx_buf_tag_t) ctx->method->module;
+
+            cl->buf = buf;
+
+        } else {
+            cl->buf = b;
+        }
+
+        *ll = cl;
+        ll = &cl->next;
+        in = in->next;
+    }
+
+    *ll = NULL;
+
+    return ctx->buffering ? NGX_OK : NGX_DONE;
+}
+
+
+static ngx_int_t
+ngx_http_compress_add_data(ngx_http_request_t *r, ngx_http_compress_ctx_t *ctx)
+{
+    ngx_chain_t  *cl;
+
+    if (ctx->avail_in || ctx->op != NGX_HTTP_COMPRESS_PROCESS || ctx->redo) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "%V in: %p", &ctx->method->name, ctx->in);
+
+    if (ctx->in == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (ctx->copy_buf) {
+
+        /*
+         * to avoid CPU cache trashing we do not free() just quit buf,
+         * but postpone free()ing after compressing and data output
+         */
+
+        ctx->copy_buf->next = ctx->copied;
+        ctx->copied = ctx->copy_buf;
+        ctx->copy_buf = NULL;
+    }
+
+    cl = ctx->in;
+    ctx->in_buf = cl->buf;
+    ctx->in = cl->next;
+
+    if (ctx->in_buf->tag == (ngx_buf_tag_t) ctx->method->module) {
+        ctx->copy_buf = cl;
+
+    } else {
+        ngx_free_chain(r->pool, cl);
+    }
+
+    ctx->next_in = ctx->in_buf->pos;
+    ctx->avail_in = ctx->in_buf->last - ctx->in_buf->pos;
+    ctx->zin += ctx->avail_in;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "%V in_buf:%p ni:%p ai:%uz", &ctx->method->name,
+                   ctx->in_buf, ctx->next_in, ctx->avail_in);
+
+    if (ctx->in_buf->last_buf) {
+        ctx->op = NGX_HTTP_COMPRESS_FINISH;
+
+    } else if (ctx->in_buf->flush) {
+        ctx->op = NGX_HTTP_COMPRESS_FLUSH;
+
+    } else if (ctx->avail_in == 0) {
+        /* ctx->op == NGX_HTTP_COMPRESS_PROCESS */
+        return NGX_AGAIN;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_compress_get_buf(ngx_http_request_t *r, ngx_http_compress_ctx_t *ctx)
+{
+    ngx_chain_t               *cl;
+    ngx_http_compress_conf_t  *conf;
+
+    if (ctx->avail_out) {
+        return NGX_OK;
+    }
+
+    conf = ctx->conf;
+
+    if (ctx->free) {
+
+        cl = ctx->free;
+        ctx->out_buf = cl->buf;
+        ctx->free = cl->next;
+
+        ngx_free_chain(r->pool, cl);
+
+    } else if (ctx->bufs < conf->bufs.num) {
+
+        ctx->out_buf = ngx_create_temp_buf(r->pool, conf->bufs.size);
+        if (ctx->out_buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->out_buf->tag = (ngx_buf_tag_t) ctx->method->module;
+        ctx->out_buf->recycled = 1;
+        ctx->bufs++;
+
+    } else {
+        ctx->nomem = 1;
+        return NGX_DECLINED;
+    }
+
+    ctx->next_out = ctx->out_buf->pos;
+    ctx->avail_out = conf->bufs.size;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_compress_run(ngx_http_request_t *r, ngx_http_compress_ctx_t *ctx)
+{
+    u_char       *out;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    ngx_log_debug7(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "%V in: ni:%p no:%p ai:%uz ao:%uz op:%ui redo:%d",
+                   &ctx->method->name, ctx->next_in, ctx->next_out,
+                   ctx->avail_in, ctx->avail_out, ctx->op, ctx->redo);
+
+    out = ctx->next_out;
+
+    if (ctx->method->compress(ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ctx->zout += ctx->next_out - out;
+
+    ngx_log_debug6(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "%V out: ni:%p no:%p ai:%uz ao:%uz fin:%d",
+                   &ctx->method->name, ctx->next_in, ctx->next_out,
+                   ctx->avail_in, ctx->avail_out, ctx->finished);
+
+    ctx->in_buf->pos = ctx->next_in;
+    ctx->out_buf->last = ctx->next_out;
+
+    if (ctx->avail_out == 0 && !ctx->finished) {
+
+        /* the compressor wants to output some more compressed data */
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = ctx->out_buf;
+        cl->next = NULL;
+        *ctx->last_out = cl;
+        ctx->last_out = &cl->next;
+
+        ctx->redo = 1;
+
+        return NGX_AGAIN;
+    }
+
+    ctx->redo = 0;
+
+    if (ctx->op == NGX_HTTP_COMPRESS_FLUSH) {
+
+        ctx->op = NGX_HTTP_COMPRESS_PROCESS;
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = ctx->out_buf;
+
+        if (ngx_buf_size(b) == 0) {
+
+            b = ngx_calloc_buf(ctx->request->pool);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+        } else {
+            ctx->avail_out = 0;
+        }
+
+        b->flush = 1;
+
+        cl->buf = b;
+        cl->next = NULL;
+        *ctx->last_out = cl;
+        ctx->last_out = &cl->next;
+
+        r->connection->buffered &= ~NGX_HTTP_GZIP_BUFFERED;
+
+        return NGX_OK;
+    }
+
+    if (ctx->finished) {
+
+        if (ngx_http_compress_end(r, ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (ctx->conf->no_buffer && ctx->in == NULL) {
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = ctx->out_buf;
+        cl->next = NULL;
+        *ctx->last_out = cl;
+        ctx->last_out = &cl->next;
+
+        return NGX_OK;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_compress_end(ngx_http_request_t *r, ngx_http_compress_ctx_t *ctx)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    ngx_http_compress_done(ctx);
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = ctx->out_buf;
+
+    if (ngx_buf_size(b) == 0) {
+        b->temporary = 0;
+    }
+
+    b->last_buf = 1;
+
+    cl->buf = b;
+    cl->next = NULL;
+    *ctx->last_out = cl;
+    ctx->last_out = &cl->next;
+
+    ctx->avail_in = 0;
+    ctx->avail_out = 0;
+
+    ctx->done = 1;
+
+    r->connection->buffered &= ~NGX_HTTP_GZIP_BUFFERED;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_compress_done(ngx_http_compress_ctx_t *ctx)
+{
+    if (ctx->state) {
+        ctx->method->done(ctx);
+        ctx->state = NULL;
+    }
+}
+
+
+static void
+ngx_http_compress_free_copy_buf(ngx_http_request_t *r,
+    ngx_http_compress_ctx_t *ctx)
+{
+    ngx_chain_t  *cl;
+
+    for (cl = ctx->copied; cl; cl = cl->next) {
+        ngx_pfree(r->pool, cl->buf->start);
+    }
+
+    ctx->copied = NULL;
+}
+
+
+ngx_int_t
+ngx_http_compress_ratio_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_module_t  *module = (ngx_module_t *) data;
+
+    ngx_uint_t                zint, zfrac;
+    ngx_http_compress_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, (*module));
+
+    if (ctx == NULL || !ctx->done || ctx->zout == 0 || ctx->zin == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    v->data = ngx_pnalloc(r->pool, NGX_INT32_LEN + 3);
+    if (v->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    zint = (ngx_uint_t) (ctx->zin / ctx->zout);
+    zfrac = (ngx_uint_t) ((ctx->zin * 100 / ctx->zout) % 100);
+
+    if ((ctx->zin * 1000 / ctx->zout) % 10 > 4) {
+
+        /* the rounding, e.g., 2.125 to 2.13 */
+
+        zfrac++;
+
+        if (zfrac > 99) {
+            zint++;
+            zfrac = 0;
+        }
+    }
+
+    v->len = ngx_sprintf(v->data, "%ui.%02ui", zint, zfrac) - v->data;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_compress_init_conf(ngx_http_compress_conf_t *conf)
+{
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->bufs.num = 0;
+     *     conf->types = { NULL };
+     *     conf->types_keys = NULL;
+     */
+
+    conf->enable = NGX_CONF_UNSET;
+    conf->no_buffer = NGX_CONF_UNSET;
+
+    conf->postpone = NGX_CONF_UNSET_SIZE;
+    conf->min_length = NGX_CONF_UNSET;
+}
+
+
+char *
+ngx_http_compress_merge_conf(ngx_conf_t *cf, ngx_http_compress_conf_t *prev,
+    ngx_http_compress_conf_t *conf)
+{
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_value(conf->no_buffer, prev->no_buffer, 0);
+
+    ngx_conf_merge_bufs_value(conf->bufs, prev->bufs,
+                              (128 * 1024) / ngx_pagesize, ngx_pagesize);
+
+    ngx_conf_merge_size_value(conf->postpone, prev->postpone, 0);
+    ngx_conf_merge_value(conf->min_length, prev->min_length, 20);
+
+    if (ngx_http_merge_types(cf, &conf->types_keys, &conf->types,
+                             &prev->types_keys, &prev->types,
+                             ngx_http_html_default_types)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,108 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_COMPRESS_H_INCLUDED_
+#define _NGX_HTTP_COMPRESS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_COMPRESS_PROCESS  0
+#define NGX_HTTP_COMPRESS_FLUSH    1
+#define NGX_HTTP_COMPRESS_FINISH   2
+
+
+typedef struct ngx_http_compress_ctx_s  ngx_http_compress_ctx_t;
+
+typedef ngx_int_t (*ngx_http_compress_init_pt)(ngx_http_compress_ctx_t *ctx);
+typedef ngx_int_t (*ngx_http_compress_run_pt)(ngx_http_compress_ctx_t *ctx);
+typedef void (*ngx_http_compress_done_pt)(ngx_http_compress_ctx_t *ctx);
+
+
+typedef struct {
+    ngx_str_t                    name;
+    ngx_module_t                *module;
+    ngx_int_t                    encoding;
+
+    ngx_http_compress_init_pt    init;
+    ngx_http_compress_run_pt     compress;
+    ngx_http_compress_done_pt    done;
+} ngx_http_compress_method_t;
+
+
+/* must be the first member of a compression module configuration */
+
+typedef struct {
+    ngx_flag_t                   enable;
+    ngx_flag_t                   no_buffer;
+
+    ngx_hash_t                   types;
+
+    ngx_bufs_t                   bufs;
+
+    size_t                       postpone;
+    ssize_t                      min_length;
+
+    ngx_array_t                 *types_keys;
+} ngx_http_compress_conf_t;
+
+
+struct ngx_http_compress_ctx_s {
+    ngx_chain_t                 *in;
+    ngx_chain_t                 *free;
+    ngx_chain_t                 *busy;
+    ngx_chain_t                 *out;
+    ngx_chain_t                **last_out;
+
+    ngx_chain_t                 *copied;
+    ngx_chain_t                 *copy_buf;
+
+    ngx_buf_t                   *in_buf;
+    ngx_buf_t                   *out_buf;
+    ngx_int_t                    bufs;
+
+    void                        *state;
+    ngx_uint_t                   op;
+
+    u_char                      *next_in;
+    size_t                       avail_in;
+    u_char                      *next_out;
+    size_t                       avail_out;
+
+    unsigned                     redo:1;
+    unsigned                     done:1;
+    unsigned                     nomem:1;
+    unsigned                     buffering:1;
+    unsigned                     finished:1;
+
+    size_t                       zin;
+    size_t                       zout;
+
+    ngx_http_compress_method_t  *method;
+    ngx_http_compress_conf_t    *conf;
+    ngx_http_request_t          *request;
+};
+
+
+ngx_int_t ngx_http_compress_test(ngx_http_request_t *r,
+    ngx_http_compress_conf_t *conf);
+ngx_int_t ngx_http_compress_header_filter(ngx_http_request_t *r,
+    ngx_http_compress_method_t *method);
+ngx_int_t ngx_http_compress_body_filter(ngx_http_request_t *r,
+    ngx_chain_t *in, ngx_http_compress_method_t *method,
+    ngx_http_output_body_filter_pt next);
+ngx_int_t ngx_http_compress_ratio_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+void ngx_http_compress_init_conf(ngx_http_compress_conf_t *conf);
+char *ngx_http_compress_merge_conf(ngx_conf_t *cf,
+    ngx_http_compress_conf_t *prev, ngx_http_compress_conf_t *conf);
+
+
+#endif /* _NGX_HTTP_COMPRESS_H_INCLUDED_ */
@@ -72,7 +72,8 @@ static char *ngx_http_core_internal(ngx_conf_t *cf, ngx_command_t *cmd,
 static char *ngx_http_core_resolver(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 #if (NGX_HTTP_GZIP)
-static ngx_int_t ngx_http_gzip_accept_encoding(ngx_str_t *ae);
+static ngx_int_t ngx_http_compress_ok(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_accept_encoding(ngx_str_t *ae, char *e, size_t n);
 static ngx_uint_t ngx_http_gzip_quantity(u_char *p, u_char *last);
 static char *ngx_http_gzip_disable(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -1926,11 +1927,7 @@ ngx_http_auth_basic_user(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_gzip_ok(ngx_http_request_t *r)
 {
-    time_t                     date, expires;
-    ngx_uint_t                 p;
-    ngx_array_t               *cc;
-    ngx_table_elt_t           *e, *d, *ae;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_table_elt_t  *ae;
 
     r->gzip_tested = 1;
 
@@ -1957,11 +1954,35 @@ ngx_http_gzip_ok(ngx_http_request_t *r)
      */
 
     if (ngx_memcmp(ae->value.data, "gzip,", 5) != 0
-        && ngx_http_gzip_accept_encoding(&ae->value) != NGX_OK)
+        && ngx_http_accept_encoding(&ae->value, "gzip", 4) == 0)
     {
         return NGX_DECLINED;
     }
 
+    if (ngx_http_compress_ok(r) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    r->gzip_ok = 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * the response compression policy shared by all content codings:
+ * gzip_http_version, gzip_proxied, gzip_disable
+ */
+
+static ngx_int_t
+ngx_http_compress_ok(ngx_http_request_t *r)
+{
+    time_t                     date, expires;
+    ngx_uint_t                 p;
+    ngx_array_t               *cc;
+    ngx_table_elt_t           *e, *d;
+    ngx_http_core_loc_conf_t  *clcf;
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (r->headers_in.msie6 && clcf->gzip_disable_msie6) {
@@ -2078,21 +2099,112 @@ ok:
 
 #endif
 
-    r->gzip_ok = 1;
-
     return NGX_OK;
 }
 
 
+ngx_int_t
+ngx_http_add_encoding(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_http_encoding_test_pt test)
+{
+    ngx_http_encoding_t        *enc;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    if (cmcf->encodings.nelts == NGX_HTTP_MAX_ENCODINGS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "too many content codings");
+        return NGX_ERROR;
+    }
+
+    enc = ngx_array_push(&cmcf->encodings);
+    if (enc == NULL) {
+        return NGX_ERROR;
+    }
+
+    enc->name = *name;
+    enc->test = test;
+
+    return cmcf->encodings.nelts - 1;
+}
+
+
+/*
+ * selects a content coding for the response among the registered ones:
+ * the coding with the highest "q" value in the "Accept-Encoding" header
+ * wins provided that its module is willing to compress the response,
+ * the last registered coding is preferred if "q" values are equal;
+ * as with gzip, a coding must be listed explicitly, "*" is not honored
+ */
+
+ngx_int_t
+ngx_http_select_encoding(ngx_http_request_t *r)
+{
+    ngx_int_t                   i;
+    ngx_uint_t                  q, best;
+    ngx_table_elt_t            *ae;
+    ngx_http_encoding_t        *enc;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    if (r->encoding_tested) {
+        return r->encoding ? (ngx_int_t) r->encoding - 1 : NGX_DECLINED;
+    }
+
+    r->encoding_tested = 1;
+
+    if (r != r->main) {
+        return NGX_DECLINED;
+    }
+
+    ae = r->headers_in.accept_encoding;
+    if (ae == NULL || ae->value.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_compress_ok(r) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    enc = cmcf->encodings.elts;
+    best = 0;
+
+    for (i = cmcf->encodings.nelts - 1; i >= 0; i--) {
+
+        q = ngx_http_accept_encoding(&ae->value, (char *) enc[i].name.data,
+                                     enc[i].name.len);
+
+        if (q <= best) {
+            continue;
+        }
+
+        if (enc[i].test(r) != NGX_OK) {
+            continue;
+        }
+
+        best = q;
+        r->encoding = i + 1;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http encoding: %ui q:%ui", r->encoding, best);
+
+    return r->encoding ? (ngx_int_t) r->encoding - 1 : NGX_DECLINED;
+}
+
+
 /*
- * gzip is enabled for the following quantities:
+ * returns the "q" value of the coding in thousandths,
+ * e.g., gzip is enabled for the following quantities:
  *     "gzip; q=0.001" ... "gzip; q=1.000"
  * gzip is disabled for the following quantities:
  *     "gzip; q=0" ... "gzip; q=0.000", and for any invalid cases
  */
 
-static ngx_int_t
-ngx_http_gzip_accept_encoding(ngx_str_t *ae)
+static ngx_uint_t
+ngx_http_accept_encoding(ngx_str_t *ae, char *e, size_t n)
 {
     u_char  *p, *start, *last;
 
@@ -2100,34 +2212,34 @@ ngx_http_gzip_accept_encoding(ngx_str_t *ae)
     last = start + ae->len;
 
     for ( ;; ) {
-        p = ngx_strcasestrn(start, "gzip", 4 - 1);
+        p = ngx_strcasestrn(start, e, n - 1);
         if (p == NULL) {
-            return NGX_DECLINED;
+            return 0;
         }
 
         if (p == start || (*(p - 1) == ',' || *(p - 1) == ' ')) {
             break;
         }
 
-        start = p + 4;
+        start = p + n;
     }
 
-    p += 4;
+    p += n;
 
     while (p < last) {
         switch (*p++) {
         case ',':
-            return NGX_OK;
+            return 1000;
         case ';':
             goto quantity;
         case ' ':
             continue;
         default:
-            return NGX_DECLINED;
+            return 0;
         }
     }
 
-    return NGX_OK;
+    return 1000;
 
 quantity:
 
@@ -2139,23 +2251,19 @@ quantity:
         case ' ':
             continue;
         default:
-            return NGX_DECLINED;
+            return 0;
         }
     }
 
-    return NGX_OK;
+    return 1000;
 
 equal:
 
     if (p + 2 > last || *p++ != '=') {
-        return NGX_DECLINED;
-    }
-
-    if (ngx_http_gzip_quantity(p, last) == 0) {
-        return NGX_DECLINED;
+        return 0;
     }
 
-    return NGX_OK;
+    return ngx_http_gzip_quantity(p, last);
 }
 
 
@@ -2171,7 +2279,7 @@ ngx_http_gzip_quantity(u_char *p, u_char *last)
         return 0;
     }
 
-    q = (c - '0') * 100;
+    q = (c - '0') * 1000;
 
     if (p == last) {
         return q;
@@ -2187,7 +2295,7 @@ ngx_http_gzip_quantity(u_char *p, u_char *last)
         return 0;
     }
 
-    n = 0;
+    n = 100;
 
     while (p < last) {
         c = *p++;
@@ -2196,22 +2304,23 @@ ngx_http_gzip_quantity(u_char *p, u_char *last)
             break;
         }
 
-        if (c >= '0' && c <= '9') {
-            q += c - '0';
-            n++;
+        if (c >= '0' && c <= '9' && n) {
+            q += (c - '0') * n;
+            n /= 10;
             continue;
         }
 
         return 0;
     }
 
-    if (q > 100 || n > 3) {
+    if (q > 1000) {
         return 0;
     }
 
     return q;
 }
 
+
 #endif
 
 
@@ -3212,6 +3321,15 @@ ngx_http_core_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+#if (NGX_HTTP_GZIP)
+    if (ngx_array_init(&cmcf->encodings, cf->pool, 4,
+                       sizeof(ngx_http_encoding_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+#endif
+
     cmcf->server_names_hash_max_size = NGX_CONF_UNSET_UINT;
     cmcf->server_names_hash_bucket_size = NGX_CONF_UNSET_UINT;
 
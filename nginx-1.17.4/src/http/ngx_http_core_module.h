@@ -149,6 +149,20 @@ typedef struct {
 } ngx_http_phase_t;
 
 
+#if (NGX_HTTP_GZIP)
+
+#define NGX_HTTP_MAX_ENCODINGS     15
+
+typedef ngx_int_t (*ngx_http_encoding_test_pt)(ngx_http_request_t *r);
+
+typedef struct {
+    ngx_str_t                  name;
+    ngx_http_encoding_test_pt  test;
+} ngx_http_encoding_t;
+
+#endif
+
+
 typedef struct {
     ngx_array_t                servers;         /* ngx_http_core_srv_conf_t */
 
@@ -173,6 +187,10 @@ typedef struct {
     ngx_array_t               *ports;
 
     ngx_http_phase_t           phases[NGX_HTTP_LOG_PHASE + 1];
+
+#if (NGX_HTTP_GZIP)
+    ngx_array_t                encodings;         /* ngx_http_encoding_t */
+#endif
 } ngx_http_core_main_conf_t;
 
 
@@ -495,6 +513,9 @@ u_char *ngx_http_map_uri_to_path(ngx_http_request_t *r, ngx_str_t *name,
 ngx_int_t ngx_http_auth_basic_user(ngx_http_request_t *r);
 #if (NGX_HTTP_GZIP)
 ngx_int_t ngx_http_gzip_ok(ngx_http_request_t *r);
+ngx_int_t ngx_http_add_encoding(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_http_encoding_test_pt test);
+ngx_int_t ngx_http_select_encoding(ngx_http_request_t *r);
 #endif
 
 
@@ -45,6 +45,7 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
+static void ngx_http_file_cache_encoded_cleanup(void *data);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
@@ -1594,15 +1595,28 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return rc;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    if (c->encoded) {
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
+        /* an encoded representation was selected by a header filter */
+
+        b->file_pos = c->encoded->body_start;
+        b->file_last = c->encoded->length;
+
+        b->file->fd = c->encoded->file.fd;
+        b->file->name = c->encoded->file.name;
+
+    } else {
+        b->file_pos = c->body_start;
+        b->file_last = c->length;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+    }
+
+    b->in_file = (b->file_last - b->file_pos) ? 1: 0;
     b->last_buf = (r == r->main) ? 1: 0;
     b->last_in_chain = 1;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
     b->file->log = r->connection->log;
 
     out.buf = b;
@@ -1612,6 +1626,370 @@ ngx_http_cache_send(ngx_http_request_t *r)
 }
 
 
+ngx_int_t
+ngx_http_file_cache_encoded_init(ngx_http_request_t *r,
+    ngx_http_cache_encoded_t *e, ngx_str_t *encoding)
+{
+    u_char            *p;
+    ngx_md5_t          md5;
+    ngx_path_t        *path;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+    path = c->file_cache->path;
+
+    /*
+     * an encoded representation is kept as a separate cache entry
+     * keyed by the key of the identity response and the content coding
+     */
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    ngx_md5_update(&md5, encoding->data, encoding->len);
+    ngx_md5_final(e->key, &md5);
+
+    ngx_memzero(&e->file, sizeof(ngx_file_t));
+
+    e->file.fd = NGX_INVALID_FILE;
+    e->file.log = r->connection->log;
+
+    e->file.name.len = path->name.len + 1 + path->len
+                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    e->file.name.data = ngx_pnalloc(r->pool, e->file.name.len + 1);
+    if (e->file.name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(e->file.name.data, path->name.data, path->name.len);
+
+    p = e->file.name.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, e->key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, e->file.name.data, e->file.name.len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache file \"%V\": \"%s\"", encoding, e->file.name.data);
+
+    e->body_start = 0;
+    e->length = 0;
+    e->node = NULL;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_file_cache_encoded_open(ngx_http_request_t *r,
+    ngx_http_cache_encoded_t *e)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_pool_cleanup_t            *cln;
+    ngx_pool_cleanup_file_t       *clnf;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_node_t    *fcn;
+    ngx_http_file_cache_header_t   h;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(cache, e->key);
+
+    /*
+     * a file the cache loader has not added yet cannot be pinned,
+     * it is replaced by a new one instead
+     */
+
+    if (fcn == NULL || !fcn->exists || fcn->deleting) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&fcn->queue);
+
+    fcn->uses++;
+    fcn->count++;
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    e->cache = cache;
+    e->node = fcn;
+
+    cln->handler = ngx_http_file_cache_encoded_cleanup;
+    cln->data = e;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    e->file.fd = ngx_open_file(e->file.name.data, NGX_FILE_RDONLY,
+                               NGX_FILE_OPEN, 0);
+
+    if (e->file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           e->file.name.data);
+            return NGX_DECLINED;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", e->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = e->file.fd;
+    clnf->name = e->file.name.data;
+    clnf->log = r->pool->log;
+
+    if (ngx_fd_info(e->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", e->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    n = ngx_read_file(&e->file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        return NGX_DECLINED;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" is too small", e->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    /*
+     * the encoded representation is only valid for the very response
+     * it was made from; a new response or a revalidation changes the date
+     */
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.crc32 != c->crc32
+        || h.date != c->date
+        || h.last_modified != c->last_modified
+        || (size_t) h.header_start != c->header_start
+        || h.body_start != h.header_start
+        || (off_t) h.body_start > ngx_file_size(&fi))
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" is stale", e->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    e->body_start = h.body_start;
+    e->length = ngx_file_size(&fi);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_encoded_cleanup(void *data)
+{
+    ngx_http_cache_encoded_t  *e = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, e->file.log, 0,
+                   "http file cache encoded cleanup");
+
+    ngx_shmtx_lock(&e->cache->shpool->mutex);
+
+    e->node->count--;
+
+    ngx_shmtx_unlock(&e->cache->shpool->mutex);
+
+    e->node = NULL;
+}
+
+
+void
+ngx_http_file_cache_encoded_update(ngx_http_request_t *r,
+    ngx_http_cache_encoded_t *e, ngx_temp_file_t *tf)
+{
+    u_char                        *buf, *p;
+    off_t                          fs_size;
+    ssize_t                        n;
+    ngx_int_t                      rc;
+    ngx_str_t                     *key;
+    ngx_uint_t                     i;
+    ngx_file_uniq_t                uniq;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_ext_rename_file_t          ext;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_node_t    *fcn;
+    ngx_http_file_cache_header_t  *h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache encoded update");
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    buf = ngx_pnalloc(r->pool, c->header_start);
+    if (buf == NULL) {
+        return;
+    }
+
+    h = (ngx_http_file_cache_header_t *) buf;
+
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = NGX_HTTP_CACHE_VERSION;
+    h->valid_sec = c->valid_sec;
+    h->updating_sec = c->updating_sec;
+    h->error_sec = c->error_sec;
+    h->last_modified = c->last_modified;
+    h->date = c->date;
+    h->crc32 = c->crc32;
+    h->valid_msec = (u_short) c->valid_msec;
+    h->header_start = (u_short) c->header_start;
+    h->body_start = (u_short) c->header_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h->etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    }
+
+    p = buf + sizeof(ngx_http_file_cache_header_t);
+
+    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_copy(p, key[i].data, key[i].len);
+    }
+
+    *p = LF;
+
+    n = ngx_write_file(&tf->file, buf, c->header_start, 0);
+
+    if (n != (ssize_t) c->header_start) {
+        return;
+    }
+
+    /* pin the node so that the cache manager won't delete it meanwhile */
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(cache, e->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
+
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
+        }
+
+        cache->sh->count++;
+
+        ngx_memcpy((u_char *) &fcn->node.key, e->key,
+                   sizeof(ngx_rbtree_key_t));
+
+        ngx_memcpy(fcn->key, &e->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+        fcn->uses = 1;
+
+    } else if (fcn->deleting) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+
+    } else {
+        ngx_queue_remove(&fcn->queue);
+    }
+
+    fcn->count++;
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    uniq = 0;
+    fs_size = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache rename: \"%s\" to \"%s\"",
+                   tf->file.name.data, e->file.name.data);
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = r->connection->log;
+
+    rc = ngx_ext_rename_file(&tf->file.name, &e->file.name, &ext);
+
+    if (rc == NGX_OK) {
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+            rc = NGX_ERROR;
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        }
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn->count--;
+
+    if (rc == NGX_OK) {
+        fcn->uniq = uniq;
+        fcn->body_start = c->header_start;
+
+        cache->sh->size += fs_size - fcn->fs_size;
+        fcn->fs_size = fs_size;
+
+        fcn->exists = 1;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
 void
 ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
 {
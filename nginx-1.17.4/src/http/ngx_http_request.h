@@ -497,6 +497,8 @@ struct ngx_http_request_s {
     unsigned                          gzip_tested:1;
     unsigned                          gzip_ok:1;
     unsigned                          gzip_vary:1;
+    unsigned                          encoding_tested:1;
+    unsigned                          encoding:4;
 #endif
 
 #if (NGX_PCRE)
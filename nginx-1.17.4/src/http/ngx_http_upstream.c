@@ -69,6 +69,12 @@ static void ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_http_upstream_init_upgraded_splice(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+#endif
+static void ngx_http_upstream_release_upgraded_buffer(ngx_http_request_t *r,
+    ngx_buf_t *b);
 static void
     ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r);
 static void
@@ -1687,7 +1693,21 @@ ngx_http_upstream_ssl_init_connection(ngx_http_request_t *r,
     if (u->conf->ssl_session_reuse) {
         c->ssl->save_session = ngx_http_upstream_ssl_save_session;
 
-        if (u->peer.set_session(&u->peer, u->peer.data) != NGX_OK) {
+        if (u->conf->ssl_session_cache) {
+            /* the name is checked against the certificate if verified */
+
+            rc = ngx_ssl_set_cached_client_session(c,
+                                        u->conf->ssl_session_cache,
+                                        (u->conf->ssl_server_name
+                                         || u->conf->ssl_verify)
+                                        ? &u->ssl_name : NULL,
+                                        &u->conf->ssl_session_id);
+
+        } else {
+            rc = u->peer.set_session(&u->peer, u->peer.data);
+        }
+
+        if (rc != NGX_OK) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_INTERNAL_SERVER_ERROR);
             return;
@@ -1803,9 +1823,17 @@ ngx_http_upstream_ssl_save_session(ngx_connection_t *c)
     r = c->data;
 
     u = r->upstream;
-    c = r->connection;
 
-    ngx_http_set_log_request(c->log, r);
+    ngx_http_set_log_request(r->connection->log, r);
+
+    if (u->conf->ssl_session_cache) {
+        ngx_ssl_save_cached_client_session(c, u->conf->ssl_session_cache,
+                                           (u->conf->ssl_server_name
+                                            || u->conf->ssl_verify)
+                                           ? &u->ssl_name : NULL,
+                                           &u->conf->ssl_session_id);
+        return;
+    }
 
     u->peer.save_session(&u->peer, u->peer.data);
 }
@@ -3285,6 +3313,24 @@ ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    if (u->conf->upgrade_splice
+        && c->type == SOCK_STREAM
+#if (NGX_HTTP_SSL)
+        && c->ssl == NULL
+        && u->peer.connection->ssl == NULL
+#endif
+       )
+    {
+        if (ngx_http_upstream_init_upgraded_splice(r, u) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     if (u->peer.connection->read->ready
         || u->buffer.pos != u->buffer.last)
     {
@@ -3297,6 +3343,37 @@ ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_http_upstream_init_upgraded_splice(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+    u->upstream_pipe = ngx_splice_pipe_create(r->pool, u->conf->buffer_size,
+                                              c->log);
+    if (u->upstream_pipe == NULL) {
+        return NGX_ERROR;
+    }
+
+    u->downstream_pipe = ngx_splice_pipe_create(r->pool,
+                                                u->conf->buffer_size, c->log);
+    if (u->downstream_pipe == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream upgraded splice");
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static void
 ngx_http_upstream_upgraded_read_downstream(ngx_http_request_t *r)
 {
@@ -3334,10 +3411,13 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
     size_t                     size;
     ssize_t                    n;
     ngx_buf_t                 *b;
-    ngx_uint_t                 flags;
+    ngx_uint_t                 flags, upstream_pending, downstream_pending;
     ngx_connection_t          *c, *downstream, *upstream, *dst, *src;
     ngx_http_upstream_t       *u;
     ngx_http_core_loc_conf_t  *clcf;
+#if (NGX_HAVE_SPLICE)
+    ngx_splice_pipe_t         *sp;
+#endif
 
     c = r->connection;
     u = r->upstream;
@@ -3366,30 +3446,24 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         dst = downstream;
         b = &u->buffer;
 
+#if (NGX_HAVE_SPLICE)
+        sp = u->upstream_pipe;
+#endif
+
     } else {
         src = downstream;
         dst = upstream;
         b = &u->from_client;
 
+#if (NGX_HAVE_SPLICE)
+        sp = u->downstream_pipe;
+#endif
+
         if (r->header_in->last > r->header_in->pos) {
             b = r->header_in;
             b->end = b->last;
             do_write = 1;
         }
-
-        if (b->start == NULL) {
-            b->start = ngx_palloc(r->pool, u->conf->buffer_size);
-            if (b->start == NULL) {
-                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
-                return;
-            }
-
-            b->pos = b->start;
-            b->last = b->start;
-            b->end = b->start + u->conf->buffer_size;
-            b->temporary = 1;
-            b->tag = u->output.tag;
-        }
     }
 
     for ( ;; ) {
@@ -3418,6 +3492,66 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
             }
         }
 
+#if (NGX_HAVE_SPLICE)
+
+        if (sp) {
+
+            /* data read before the upgrade are sent from the buffer first */
+
+            if (b->pos != b->last) {
+                break;
+            }
+
+            if (do_write && sp->size && dst->write->ready) {
+                if (ngx_splice_send(dst, sp) == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return;
+                }
+            }
+
+            if (sp->size || !src->read->ready) {
+                break;
+            }
+
+            n = ngx_splice_recv(src, sp, sp->capacity);
+
+            if (n == NGX_AGAIN || n == 0) {
+                break;
+            }
+
+            if (n > 0) {
+                do_write = 1;
+
+                if (from_upstream) {
+                    u->state->bytes_received += n;
+                }
+
+                continue;
+            }
+
+            if (n == NGX_ERROR) {
+                src->read->eof = 1;
+            }
+
+            break;
+        }
+
+#endif
+
+        if (b->start == NULL && src->read->ready) {
+            b->start = ngx_palloc(r->pool, u->conf->buffer_size);
+            if (b->start == NULL) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+            b->end = b->start + u->conf->buffer_size;
+            b->temporary = 1;
+            b->tag = u->output.tag;
+        }
+
         size = b->end - b->last;
 
         if (size && src->read->ready) {
@@ -3447,8 +3581,20 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         break;
     }
 
-    if ((upstream->read->eof && u->buffer.pos == u->buffer.last)
-        || (downstream->read->eof && u->from_client.pos == u->from_client.last)
+    upstream_pending = (u->buffer.pos != u->buffer.last);
+    downstream_pending = (u->from_client.pos != u->from_client.last);
+
+#if (NGX_HAVE_SPLICE)
+
+    if (u->upstream_pipe) {
+        upstream_pending |= (u->upstream_pipe->size != 0);
+        downstream_pending |= (u->downstream_pipe->size != 0);
+    }
+
+#endif
+
+    if ((upstream->read->eof && !upstream_pending)
+        || (downstream->read->eof && !downstream_pending)
         || (downstream->read->eof && upstream->read->eof))
     {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -3457,6 +3603,16 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         return;
     }
 
+    if (u->conf->upgrade_release_buffers
+#if (NGX_HAVE_SPLICE)
+        || u->upstream_pipe
+#endif
+       )
+    {
+        ngx_http_upstream_release_upgraded_buffer(r, &u->buffer);
+        ngx_http_upstream_release_upgraded_buffer(r, &u->from_client);
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     if (ngx_handle_write_event(upstream->write, u->conf->send_lowat)
@@ -3520,6 +3676,33 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
 }
 
 
+/*
+ * an idle tunnel keeps no buffers: an empty buffer is returned to
+ * the pool and allocated again when the next data arrive
+ */
+
+static void
+ngx_http_upstream_release_upgraded_buffer(ngx_http_request_t *r,
+    ngx_buf_t *b)
+{
+    if (b->start == NULL || b->pos != b->last) {
+        return;
+    }
+
+    if (ngx_pfree(r->pool, b->start) != NGX_OK) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream release upgraded buffer: %p", b->start);
+
+    b->start = NULL;
+    b->pos = NULL;
+    b->last = NULL;
+    b->end = NULL;
+}
+
+
 static void
 ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
 {
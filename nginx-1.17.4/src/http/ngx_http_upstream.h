@@ -191,6 +191,9 @@ typedef struct {
     ngx_http_upstream_local_t       *local;
     ngx_flag_t                       socket_keepalive;
 
+    ngx_flag_t                       upgrade_splice;
+    ngx_flag_t                       upgrade_release_buffers;
+
 #if (NGX_HTTP_CACHE)
     ngx_shm_zone_t                  *cache_zone;
     ngx_http_complex_value_t        *cache_value;
@@ -230,6 +233,8 @@ typedef struct {
 #if (NGX_HTTP_SSL || NGX_COMPAT)
     ngx_ssl_t                       *ssl;
     ngx_flag_t                       ssl_session_reuse;
+    ngx_shm_zone_t                  *ssl_session_cache;
+    ngx_str_t                        ssl_session_id;
 
     ngx_http_complex_value_t        *ssl_name;
     ngx_flag_t                       ssl_server_name;
@@ -344,6 +349,11 @@ struct ngx_http_upstream_s {
     ngx_buf_t                        buffer;
     off_t                            length;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_splice_pipe_t               *upstream_pipe;
+    ngx_splice_pipe_t               *downstream_pipe;
+#endif
+
     ngx_chain_t                     *out_bufs;
     ngx_chain_t                     *busy_bufs;
     ngx_chain_t                     *free_bufs;
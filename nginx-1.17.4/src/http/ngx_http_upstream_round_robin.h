@@ -40,6 +40,9 @@ struct ngx_http_upstream_rr_peer_s {
 
     ngx_uint_t                      down;
 
+    ngx_uint_t                      response_time;
+    ngx_msec_t                      response_updated;
+
 #if (NGX_HTTP_SSL || NGX_COMPAT)
     void                           *ssl_session;
     int                             ssl_session_len;
@@ -600,7 +600,7 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
     h2c->last_out = frame;
 
     if (!wev->ready) {
-        ngx_add_timer(wev, clcf->send_timeout);
+        ngx_add_deadline(wev, clcf->send_timeout);
         return NGX_AGAIN;
     }
 
@@ -667,7 +667,7 @@ ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
     h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
                                          ngx_http_v2_module);
     if (h2c->state.incomplete) {
-        ngx_add_timer(c->read, h2scf->recv_timeout);
+        ngx_add_deadline(c->read, h2scf->recv_timeout);
         return;
     }
 
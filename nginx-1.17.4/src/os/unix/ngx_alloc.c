@@ -51,6 +51,54 @@ ngx_calloc(size_t size, ngx_log_t *log)
 }
 
 
+#if (NGX_HAVE_HUGE_PAGES)
+
+/*
+ * the memory is not freed, it is used for process-wide arrays
+ * allocated once by a worker process
+ */
+
+void *
+ngx_huge_alloc(size_t size, ngx_uint_t huge, ngx_log_t *log)
+{
+    void  *p;
+
+    if (huge == NGX_HUGE_PAGES_OFF || size < NGX_HUGE_PAGE_SIZE) {
+        return ngx_alloc(size, log);
+    }
+
+    if (huge == NGX_HUGE_PAGES_ON) {
+        p = mmap(NULL, ngx_align(size, NGX_HUGE_PAGE_SIZE),
+                 PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE|MAP_HUGETLB,
+                 -1, 0);
+
+        if (p != MAP_FAILED) {
+            ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0,
+                           "mmap(MAP_HUGETLB): %p:%uz", p, size);
+            return p;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, log, ngx_errno,
+                      "mmap(MAP_HUGETLB, %uz) failed, "
+                      "using transparent huge pages", size);
+    }
+
+    p = ngx_memalign(NGX_HUGE_PAGE_SIZE, size, log);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    if (madvise(p, size, MADV_HUGEPAGE) == -1) {
+        ngx_log_error(NGX_LOG_INFO, log, ngx_errno,
+                      "madvise(%p, %uz, MADV_HUGEPAGE) failed", p, size);
+    }
+
+    return p;
+}
+
+#endif
+
+
 #if (NGX_HAVE_POSIX_MEMALIGN)
 
 void *
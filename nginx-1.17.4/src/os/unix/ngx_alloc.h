@@ -19,6 +19,25 @@ void *ngx_calloc(size_t size, ngx_log_t *log);
 #define ngx_free          free
 
 
+#define NGX_HUGE_PAGES_OFF          0
+#define NGX_HUGE_PAGES_ON           1
+#define NGX_HUGE_PAGES_TRANSPARENT  2
+
+/* the default huge page size with 4K base pages */
+#define NGX_HUGE_PAGE_SIZE          (2 * 1024 * 1024)
+
+
+#if (NGX_HAVE_HUGE_PAGES)
+
+void *ngx_huge_alloc(size_t size, ngx_uint_t huge, ngx_log_t *log);
+
+#else
+
+#define ngx_huge_alloc(size, huge, log)  ngx_alloc(size, log)
+
+#endif
+
+
 /*
  * Linux has memalign() or posix_memalign()
  * Solaris has memalign()
@@ -29,6 +29,7 @@ typedef int               ngx_err_t;
 #define NGX_EXDEV         EXDEV
 #define NGX_ENOTDIR       ENOTDIR
 #define NGX_EISDIR        EISDIR
+#define NGX_EIO           EIO
 #define NGX_EINVAL        EINVAL
 #define NGX_ENFILE        ENFILE
 #define NGX_EMFILE        EMFILE
@@ -13,4 +13,52 @@ ngx_chain_t *ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in,
     off_t limit);
 
 
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    ngx_fd_t    fd[2];
+    /* the amount of data in the pipe */
+    size_t      size;
+    size_t      capacity;
+    ngx_log_t  *log;
+} ngx_splice_pipe_t;
+
+
+ngx_splice_pipe_t *ngx_splice_pipe_create(ngx_pool_t *pool, size_t size,
+    ngx_log_t *log);
+ssize_t ngx_splice_recv(ngx_connection_t *c, ngx_splice_pipe_t *p,
+    size_t size);
+ssize_t ngx_splice_send(ngx_connection_t *c, ngx_splice_pipe_t *p);
+
+#endif
+
+
+#if (NGX_HAVE_NUMA)
+
+typedef struct {
+    ngx_uint_t  local;
+    ngx_uint_t  remote;
+    ngx_uint_t  unknown;
+} ngx_numa_stats_t;
+
+
+ngx_int_t ngx_numa_bind(ngx_cycle_t *cycle);
+void ngx_numa_account(ngx_socket_t s, ngx_log_t *log);
+
+
+extern ngx_int_t         ngx_numa_node;
+extern ngx_int_t         ngx_numa_cpu;
+extern ngx_numa_stats_t  ngx_numa_stats;
+
+#endif
+
+
+#if (NGX_HAVE_REUSEPORT_BPF)
+
+ngx_int_t ngx_reuseport_attach_bpf(ngx_socket_t *fds, ngx_uint_t n,
+    ngx_uint_t steering, ngx_log_t *log);
+
+#endif
+
+
 #endif /* _NGX_LINUX_H_INCLUDED_ */
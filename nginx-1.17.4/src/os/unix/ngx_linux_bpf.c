@@ -0,0 +1,171 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#if (NGX_HAVE_REUSEPORT_BPF)
+
+#define NGX_BPF_LOG_SIZE  4096
+
+
+static int ngx_bpf(int cmd, union bpf_attr *attr);
+
+
+/*
+ * the program selects a socket from a sockarray map indexed
+ * by the worker number; unlike SO_ATTACH_REUSEPORT_CBPF, which
+ * returns an index in the reuseport group, the selection does not
+ * depend on the order of sockets in the group, which changes
+ * when sockets are closed on reconfiguration
+ */
+
+static struct bpf_insn  ngx_reuseport_program[] = {
+
+    /* r6 = ctx */
+    { BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_6, BPF_REG_1, 0, 0 },
+
+    /* r0 = ctx->hash, replaced with bpf_get_smp_processor_id() for cpu */
+    { BPF_LDX|BPF_W|BPF_MEM, BPF_REG_0, BPF_REG_6,
+      offsetof(struct sk_reuseport_md, hash), 0 },
+
+    /* key = r0 % workers */
+    { BPF_ALU|BPF_MOD|BPF_K, BPF_REG_0, 0, 0, 0 },
+    { BPF_STX|BPF_W|BPF_MEM, BPF_REG_10, BPF_REG_0, -4, 0 },
+
+    /* bpf_sk_select_reuseport(ctx, map, &key, 0) */
+    { BPF_LD|BPF_DW|BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, 0 },
+    { 0, 0, 0, 0, 0 },
+    { BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_1, BPF_REG_6, 0, 0 },
+    { BPF_ALU64|BPF_MOV|BPF_X, BPF_REG_3, BPF_REG_10, 0, 0 },
+    { BPF_ALU64|BPF_ADD|BPF_K, BPF_REG_3, 0, 0, -4 },
+    { BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_4, 0, 0, 0 },
+    { BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport },
+
+    /* the kernel falls back to its own selection if none was made */
+    { BPF_ALU64|BPF_MOV|BPF_K, BPF_REG_0, 0, 0, SK_PASS },
+    { BPF_JMP|BPF_EXIT, 0, 0, 0, 0 }
+};
+
+
+ngx_int_t
+ngx_reuseport_attach_bpf(ngx_socket_t *fds, ngx_uint_t n,
+    ngx_uint_t steering, ngx_log_t *log)
+{
+    int              map, prog;
+    char             buf[NGX_BPF_LOG_SIZE];
+    uint32_t         key;
+    uint64_t         value;
+    ngx_int_t        rc;
+    union bpf_attr   attr;
+    struct bpf_insn  insns[sizeof(ngx_reuseport_program)
+                           / sizeof(struct bpf_insn)];
+
+    rc = NGX_ERROR;
+    prog = -1;
+
+    ngx_memzero(&attr, sizeof(union bpf_attr));
+
+    attr.map_type = BPF_MAP_TYPE_REUSEPORT_SOCKARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint64_t);
+    attr.max_entries = n;
+
+    map = ngx_bpf(BPF_MAP_CREATE, &attr);
+
+    if (map == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "bpf(BPF_MAP_CREATE) failed");
+        return NGX_ERROR;
+    }
+
+    for (key = 0; key < n; key++) {
+        value = fds[key];
+
+        ngx_memzero(&attr, sizeof(union bpf_attr));
+
+        attr.map_fd = map;
+        attr.key = (uintptr_t) &key;
+        attr.value = (uintptr_t) &value;
+        attr.flags = BPF_ANY;
+
+        if (ngx_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "bpf(BPF_MAP_UPDATE_ELEM, %uD) failed", key);
+            goto done;
+        }
+    }
+
+    ngx_memcpy(insns, ngx_reuseport_program, sizeof(insns));
+
+    if (steering == NGX_REUSEPORT_STEERING_CPU) {
+        ngx_memzero(&insns[1], sizeof(struct bpf_insn));
+        insns[1].code = BPF_JMP|BPF_CALL;
+        insns[1].imm = BPF_FUNC_get_smp_processor_id;
+    }
+
+    insns[2].imm = n;
+    insns[4].imm = map;
+
+    buf[0] = '\0';
+
+    ngx_memzero(&attr, sizeof(union bpf_attr));
+
+    attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+    attr.insns = (uintptr_t) insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(struct bpf_insn);
+    attr.license = (uintptr_t) "BSD";
+    attr.log_buf = (uintptr_t) buf;
+    attr.log_size = NGX_BPF_LOG_SIZE;
+    attr.log_level = 1;
+
+    prog = ngx_bpf(BPF_PROG_LOAD, &attr);
+
+    if (prog == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "bpf(BPF_PROG_LOAD) failed: %s", buf);
+        goto done;
+    }
+
+    /* the program is shared by the group and outlives the descriptors */
+
+    if (setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+                   (const void *) &prog, sizeof(int))
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "setsockopt(SO_ATTACH_REUSEPORT_EBPF) failed");
+        goto done;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "reuseport steering: %ui sockets, mode:%ui", n, steering);
+
+    rc = NGX_OK;
+
+done:
+
+    if (prog != -1 && close(prog) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "close() bpf failed");
+    }
+
+    if (close(map) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "close() bpf failed");
+    }
+
+    return rc;
+}
+
+
+static int
+ngx_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(SYS_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+#endif
@@ -44,6 +44,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>        /* TCP_NODELAY, TCP_CORK */
+#include <netinet/udp.h>        /* UDP_SEGMENT, UDP_GRO */
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/un.h>
@@ -104,6 +105,21 @@ typedef struct iocb  ngx_aiocb_t;
 #endif
 
 
+#if (NGX_HAVE_FUTEX)
+#include <linux/futex.h>
+#endif
+
+
+#if (NGX_HAVE_NUMA)
+#include <linux/mempolicy.h>
+#endif
+
+
+#if (NGX_HAVE_REUSEPORT_BPF)
+#include <linux/bpf.h>
+#endif
+
+
 #define NGX_LISTEN_BACKLOG        511
 
 
@@ -0,0 +1,192 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#if (NGX_HAVE_NUMA)
+
+#define NGX_NUMA_MAX_CPUS   CPU_SETSIZE
+#define NGX_NUMA_MAX_NODES  (8 * sizeof(unsigned long))
+
+
+static ngx_int_t ngx_numa_cpu_node(ngx_uint_t cpu, ngx_log_t *log);
+
+
+ngx_int_t          ngx_numa_node = -1;
+ngx_int_t          ngx_numa_cpu = -1;
+ngx_numa_stats_t   ngx_numa_stats;
+
+/* node + 1 for each cpu, 0 if not known yet, -1 if not found */
+static int16_t     ngx_numa_nodes[NGX_NUMA_MAX_CPUS];
+
+
+/*
+ * binds the memory policy of a worker process to the node
+ * of the cpu it runs on; memory allocated by the master process
+ * before fork() is not migrated
+ */
+
+ngx_int_t
+ngx_numa_bind(ngx_cycle_t *cycle)
+{
+    int               cpu;
+    unsigned int      c, node;
+    ngx_uint_t        i;
+    unsigned long     mask;
+    ngx_listening_t  *ls;
+
+    if (syscall(SYS_getcpu, &c, &node, NULL) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "getcpu() failed");
+        return NGX_ERROR;
+    }
+
+    if (node >= NGX_NUMA_MAX_NODES) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "numa node #%ud is not supported", node);
+        return NGX_ERROR;
+    }
+
+    mask = 1UL << node;
+
+    /* the kernel ignores the last bit of maxnode */
+
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+                NGX_NUMA_MAX_NODES + 1)
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "set_mempolicy(MPOL_PREFERRED, #%ud) failed", node);
+        return NGX_ERROR;
+    }
+
+    ngx_numa_node = node;
+    ngx_numa_cpu = c;
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                  "using numa node #%ud for cpu #%ud", node, c);
+
+    /*
+     * prefer reuseport sockets of this worker for connections
+     * whose packets are received on its cpu
+     */
+
+    cpu = c;
+
+    ls = cycle->listening.elts;
+    for (i = 0; i < cycle->listening.nelts; i++) {
+
+        if (!ls[i].reuseport || ls[i].worker != ngx_worker) {
+            continue;
+        }
+
+        if (setsockopt(ls[i].fd, SOL_SOCKET, SO_INCOMING_CPU,
+                       (const void *) &cpu, sizeof(int))
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          "setsockopt(SO_INCOMING_CPU, %d) for %V failed",
+                          cpu, &ls[i].addr_text);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_numa_account(ngx_socket_t s, ngx_log_t *log)
+{
+    int        cpu;
+    ngx_int_t  node;
+    socklen_t  len;
+
+    len = sizeof(int);
+
+    if (getsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, (void *) &cpu, &len)
+        == -1
+        || cpu < 0)
+    {
+        ngx_numa_stats.unknown++;
+        return;
+    }
+
+    node = ngx_numa_cpu_node(cpu, log);
+
+    if (node == -1) {
+        ngx_numa_stats.unknown++;
+
+    } else if (node == ngx_numa_node) {
+        ngx_numa_stats.local++;
+
+    } else {
+        ngx_numa_stats.remote++;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "numa: connection received on cpu #%d node #%i, "
+                       "worker node #%i", cpu, node, ngx_numa_node);
+    }
+}
+
+
+static ngx_int_t
+ngx_numa_cpu_node(ngx_uint_t cpu, ngx_log_t *log)
+{
+    u_char      *p;
+    ngx_int_t    n;
+    ngx_str_t    name;
+    ngx_dir_t    dir;
+    u_char       path[sizeof("/sys/devices/system/cpu/cpu") + NGX_INT_T_LEN];
+
+    if (cpu >= NGX_NUMA_MAX_CPUS) {
+        return -1;
+    }
+
+    if (ngx_numa_nodes[cpu]) {
+        return (ngx_numa_nodes[cpu] > 0) ? ngx_numa_nodes[cpu] - 1 : -1;
+    }
+
+    ngx_numa_nodes[cpu] = -1;
+
+    p = ngx_sprintf(path, "/sys/devices/system/cpu/cpu%ui%Z", cpu);
+
+    name.len = p - path - 1;
+    name.data = path;
+
+    if (ngx_open_dir(&name, &dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_INFO, log, ngx_errno,
+                      ngx_open_dir_n " \"%V\" failed", &name);
+        return -1;
+    }
+
+    while (ngx_read_dir(&dir) == NGX_OK) {
+
+        p = ngx_de_name(&dir);
+
+        if (ngx_strncmp(p, "node", 4) != 0) {
+            continue;
+        }
+
+        n = ngx_atoi(p + 4, ngx_strlen(p + 4));
+
+        if (n != NGX_ERROR && n < (ngx_int_t) NGX_NUMA_MAX_NODES) {
+            ngx_numa_nodes[cpu] = n + 1;
+            break;
+        }
+    }
+
+    if (ngx_close_dir(&dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_dir_n " \"%V\" failed", &name);
+    }
+
+    return (ngx_numa_nodes[cpu] > 0) ? ngx_numa_nodes[cpu] - 1 : -1;
+}
+
+#endif
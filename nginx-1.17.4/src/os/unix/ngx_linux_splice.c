@@ -0,0 +1,220 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#if (NGX_HAVE_SPLICE)
+
+static void ngx_splice_pipe_cleanup(void *data);
+
+
+/*
+ * a pipe moves data between two sockets inside the kernel;
+ * data are received into the pipe only when it is empty, so EAGAIN
+ * from splice() always refers to the socket and never to a full pipe
+ */
+
+ngx_splice_pipe_t *
+ngx_splice_pipe_create(ngx_pool_t *pool, size_t size, ngx_log_t *log)
+{
+    int                  n;
+    ngx_fd_t             fd[2];
+    ngx_pool_cleanup_t  *cln;
+    ngx_splice_pipe_t   *p;
+
+    cln = ngx_pool_cleanup_add(pool, sizeof(ngx_splice_pipe_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    if (pipe2(fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "pipe2() failed");
+        return NULL;
+    }
+
+    p = cln->data;
+
+    p->fd[0] = fd[0];
+    p->fd[1] = fd[1];
+    p->size = 0;
+    p->log = log;
+
+    cln->handler = ngx_splice_pipe_cleanup;
+
+    n = fcntl(fd[1], F_SETPIPE_SZ, (int) size);
+
+    if (n == -1) {
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, ngx_errno,
+                       "fcntl(F_SETPIPE_SZ, %uz) failed", size);
+
+        n = fcntl(fd[1], F_GETPIPE_SZ);
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "fcntl(F_GETPIPE_SZ) failed");
+            return NULL;
+        }
+    }
+
+    p->capacity = n;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "splice pipe: %d:%d %uz", fd[0], fd[1], p->capacity);
+
+    return p;
+}
+
+
+static void
+ngx_splice_pipe_cleanup(void *data)
+{
+    ngx_splice_pipe_t  *p = data;
+
+    if (close(p->fd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, p->log, ngx_errno, "close() pipe failed");
+    }
+
+    if (close(p->fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, p->log, ngx_errno, "close() pipe failed");
+    }
+}
+
+
+ssize_t
+ngx_splice_recv(ngx_connection_t *c, ngx_splice_pipe_t *p, size_t size)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *rev;
+
+    rev = c->read;
+
+    if (size > p->capacity - p->size) {
+        size = p->capacity - p->size;
+    }
+
+    if (size == 0) {
+        return NGX_AGAIN;
+    }
+
+#if (NGX_HAVE_EPOLLRDHUP)
+
+    if (ngx_event_flags & NGX_USE_EPOLL_EVENT) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice recv: eof:%d, avail:%d",
+                       rev->pending_eof, rev->available);
+
+        if (!rev->available && !rev->pending_eof) {
+            rev->ready = 0;
+            return NGX_AGAIN;
+        }
+    }
+
+#endif
+
+    for ( ;; ) {
+        n = splice(c->fd, NULL, p->fd[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice recv: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n == 0) {
+            rev->ready = 0;
+            rev->eof = 1;
+            return 0;
+        }
+
+        /*
+         * a short splice() does not mean that the socket is drained:
+         * the pipe may run out of buffers before it runs out of bytes,
+         * so the event stays ready until splice() returns EAGAIN
+         */
+
+        if (n > 0) {
+            p->size += n;
+            return n;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        rev->ready = 0;
+
+        if (err == NGX_EAGAIN) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "splice() not ready");
+            return NGX_AGAIN;
+        }
+
+        rev->error = 1;
+
+        return ngx_connection_error(c, err, "splice() failed");
+    }
+}
+
+
+ssize_t
+ngx_splice_send(ngx_connection_t *c, ngx_splice_pipe_t *p)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *wev;
+
+    wev = c->write;
+
+    while (p->size) {
+        n = splice(p->fd[0], NULL, c->fd, NULL, p->size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice send: fd:%d %z of %uz", c->fd, n, p->size);
+
+        if (n > 0) {
+            p->size -= n;
+            c->sent += n;
+
+            continue;
+        }
+
+        err = ngx_socket_errno;
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, err,
+                          "splice() returned zero");
+            wev->ready = 0;
+            return NGX_AGAIN;
+        }
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+            wev->ready = 0;
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "splice() not ready");
+
+            return NGX_AGAIN;
+        }
+
+        wev->error = 1;
+        (void) ngx_connection_error(c, err, "splice() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
@@ -604,6 +604,10 @@ ngx_unlock_mutexes(ngx_pid_t pid)
                           "shared memory zone \"%V\" was locked by %P",
                           &shm_zone[i].shm.name, pid);
         }
+
+        if (shm_zone[i].unlock) {
+            shm_zone[i].unlock(&shm_zone[i], pid);
+        }
     }
 }
 
@@ -288,13 +288,18 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
 void
 ngx_single_process_cycle(ngx_cycle_t *cycle)
 {
-    ngx_uint_t  i;
+    ngx_uint_t        i;
+    ngx_core_conf_t  *ccf;
 
     if (ngx_set_environment(cycle, NULL) == NULL) {
         /* fatal */
         exit(2);
     }
 
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    ngx_pool_cache_init(ccf->pool_cache);
+
     for (i = 0; cycle->modules[i]; i++) {
         if (cycle->modules[i]->init_process) {
             if (cycle->modules[i]->init_process(cycle) == NGX_ERROR) {
@@ -796,6 +801,12 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
 
     ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
 
+    ngx_pool_cache_init(ccf->pool_cache);
+
+    if (worker >= 0) {
+        ngx_slab_enable_magazines(ccf->worker_processes);
+    }
+
     if (worker >= 0 && ccf->priority != 0) {
         if (setpriority(PRIO_PROCESS, 0, ccf->priority) == -1) {
             ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
@@ -885,6 +896,12 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
         if (cpu_affinity) {
             ngx_setaffinity(cpu_affinity, cycle->log);
         }
+
+#if (NGX_HAVE_NUMA)
+        if (ccf->numa) {
+            (void) ngx_numa_bind(cycle);
+        }
+#endif
     }
 
 #if (NGX_HAVE_PR_SET_DUMPABLE)
@@ -986,18 +1003,21 @@ ngx_worker_process_exit(ngx_cycle_t *cycle)
         }
     }
 
+    ngx_slab_flush_magazines();
+
     if (ngx_exiting) {
-        c = cycle->connections;
         for (i = 0; i < cycle->connection_n; i++) {
-            if (c[i].fd != -1
-                && c[i].read
-                && !c[i].read->accept
-                && !c[i].read->channel
-                && !c[i].read->resolver)
+            c = ngx_cycle_connection(cycle, i);
+
+            if (c->fd != -1
+                && c->read
+                && !c->read->accept
+                && !c->read->channel
+                && !c->read->resolver)
             {
                 ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
                               "*%uA open socket #%d left in connection %ui",
-                              c[i].number, c[i].fd, i);
+                              c->number, c->fd, i);
                 ngx_debug_quit = 1;
             }
         }
@@ -1029,6 +1049,24 @@ ngx_worker_process_exit(ngx_cycle_t *cycle)
 
     ngx_destroy_pool(cycle->pool);
 
+    if (ngx_pool_cache_stats.hits || ngx_pool_cache_stats.misses) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "pool cache: %ui hits, %ui misses, %ui drops, "
+                      "%uz bytes cached",
+                      ngx_pool_cache_stats.hits, ngx_pool_cache_stats.misses,
+                      ngx_pool_cache_stats.drops, ngx_pool_cache_stats.size);
+    }
+
+#if (NGX_HAVE_NUMA)
+    if (ngx_numa_node != -1) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "numa node #%i: %ui local, %ui remote, "
+                      "%ui unknown connections",
+                      ngx_numa_node, ngx_numa_stats.local,
+                      ngx_numa_stats.remote, ngx_numa_stats.unknown);
+    }
+#endif
+
     ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0, "exit");
 
     exit(0);
@@ -14,6 +14,36 @@
 ngx_int_t
 ngx_shm_alloc(ngx_shm_t *shm)
 {
+#if (NGX_HAVE_HUGE_PAGES)
+
+    if (shm->size < NGX_HUGE_PAGE_SIZE) {
+        shm->huge = NGX_HUGE_PAGES_OFF;
+    }
+
+    if (shm->huge == NGX_HUGE_PAGES_ON) {
+        shm->addr = (u_char *) mmap(NULL,
+                                    ngx_align(shm->size, NGX_HUGE_PAGE_SIZE),
+                                    PROT_READ|PROT_WRITE,
+                                    MAP_ANON|MAP_SHARED|MAP_HUGETLB, -1, 0);
+
+        if (shm->addr != MAP_FAILED) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, shm->log, ngx_errno,
+                      "mmap(MAP_HUGETLB, %uz) failed, using transparent "
+                      "huge pages for shared zone \"%V\"",
+                      shm->size, &shm->name);
+
+        shm->huge = NGX_HUGE_PAGES_TRANSPARENT;
+    }
+
+#else
+
+    shm->huge = NGX_HUGE_PAGES_OFF;
+
+#endif
+
     shm->addr = (u_char *) mmap(NULL, shm->size,
                                 PROT_READ|PROT_WRITE,
                                 MAP_ANON|MAP_SHARED, -1, 0);
@@ -24,6 +54,20 @@ ngx_shm_alloc(ngx_shm_t *shm)
         return NGX_ERROR;
     }
 
+#if (NGX_HAVE_HUGE_PAGES)
+
+    if (shm->huge == NGX_HUGE_PAGES_TRANSPARENT
+        && madvise(shm->addr, shm->size, MADV_HUGEPAGE) == -1)
+    {
+        ngx_log_error(NGX_LOG_NOTICE, shm->log, ngx_errno,
+                      "madvise(MADV_HUGEPAGE) failed for shared zone \"%V\"",
+                      &shm->name);
+
+        shm->huge = NGX_HUGE_PAGES_OFF;
+    }
+
+#endif
+
     return NGX_OK;
 }
 
@@ -31,9 +75,21 @@ ngx_shm_alloc(ngx_shm_t *shm)
 void
 ngx_shm_free(ngx_shm_t *shm)
 {
-    if (munmap((void *) shm->addr, shm->size) == -1) {
+    size_t  size;
+
+    size = shm->size;
+
+#if (NGX_HAVE_HUGE_PAGES)
+
+    if (shm->huge == NGX_HUGE_PAGES_ON) {
+        size = ngx_align(size, NGX_HUGE_PAGE_SIZE);
+    }
+
+#endif
+
+    if (munmap((void *) shm->addr, size) == -1) {
         ngx_log_error(NGX_LOG_ALERT, shm->log, ngx_errno,
-                      "munmap(%p, %uz) failed", shm->addr, shm->size);
+                      "munmap(%p, %uz) failed", shm->addr, size);
     }
 }
 
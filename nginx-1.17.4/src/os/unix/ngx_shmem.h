@@ -19,6 +19,8 @@ typedef struct {
     ngx_str_t    name;
     ngx_log_t   *log;
     ngx_uint_t   exists;   /* unsigned  exists:1;  */
+    /* requested huge pages mode, set to the mode in use by ngx_shm_alloc() */
+    ngx_uint_t   huge;
 } ngx_shm_t;
 
 
@@ -10,20 +10,67 @@
 #include <ngx_event.h>
 
 
+#if (NGX_HAVE_MMSG)
+#define NGX_UDP_SEND_BATCH     NGX_UDP_MAX_BATCH
+#else
+#define NGX_UDP_SEND_BATCH     1
+#endif
+
+/* the kernel limits of a datagram sent with segmentation offload */
+#define NGX_UDP_MAX_SEGMENTS   64
+#define NGX_UDP_MAX_GSO_SIZE   65000
+
+
+typedef struct {
+    ngx_iovec_t         vec;
+    size_t              segment;
+    ngx_uint_t          nsegments;
+} ngx_udp_msg_t;
+
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
+#define NGX_UDP_PKTINFO_SIZE  CMSG_SPACE(sizeof(struct in6_pktinfo))
+#elif (NGX_HAVE_IP_PKTINFO)
+#define NGX_UDP_PKTINFO_SIZE  CMSG_SPACE(sizeof(struct in_pktinfo))
+#else
+#define NGX_UDP_PKTINFO_SIZE  CMSG_SPACE(sizeof(struct in_addr))
+#endif
+
+typedef union {
+    struct cmsghdr      cmsg;
+    u_char              data[NGX_UDP_PKTINFO_SIZE
+                             + CMSG_SPACE(sizeof(uint16_t))];
+} ngx_sendmsg_control_t;
+
+#endif
+
+
+static ngx_chain_t *ngx_udp_output_chain_to_msgs(ngx_connection_t *c,
+    ngx_udp_msg_t *msgs, ngx_uint_t *nmsgs, struct iovec *iovs,
+    ngx_chain_t *in, off_t limit, ngx_uint_t gso);
 static ngx_chain_t *ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec,
     ngx_chain_t *in, ngx_log_t *log);
-static ssize_t ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec);
+static ssize_t ngx_sendmsg(ngx_connection_t *c, ngx_udp_msg_t *m);
+#if (NGX_HAVE_MMSG)
+static ssize_t ngx_sendmmsg(ngx_connection_t *c, ngx_udp_msg_t *msgs,
+    ngx_uint_t nmsgs);
+#endif
+static void ngx_udp_init_msghdr(ngx_connection_t *c, struct msghdr *msg,
+    ngx_udp_msg_t *m, void *control);
 
 
 ngx_chain_t *
 ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
-    ssize_t        n;
-    off_t          send;
-    ngx_chain_t   *cl;
-    ngx_event_t   *wev;
-    ngx_iovec_t    vec;
-    struct iovec   iovs[NGX_IOVS_PREALLOCATE];
+    ssize_t         n;
+    off_t           send;
+    ngx_uint_t      nmsgs, gso;
+    ngx_chain_t    *cl;
+    ngx_event_t    *wev;
+    ngx_udp_msg_t   msgs[NGX_UDP_SEND_BATCH];
+    struct iovec    iovs[NGX_IOVS_PREALLOCATE];
 
     wev = c->write;
 
@@ -50,14 +97,26 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
     send = 0;
 
-    vec.iovs = iovs;
-    vec.nalloc = NGX_IOVS_PREALLOCATE;
+    /*
+     * segmentation offload is only used for datagrams sent to clients:
+     * the address family of upstream sockets is not known here, and
+     * AF_UNIX sockets silently ignore the UDP_SEGMENT control message
+     */
+
+#if (NGX_HAVE_UDP_SEGMENT)
+    gso = ngx_udp_segmentation
+          && c->sockaddr
+          && c->sockaddr->sa_family != AF_UNIX;
+#else
+    gso = 0;
+#endif
 
     for ( ;; ) {
 
-        /* create the iovec and coalesce the neighbouring bufs */
+        /* create the iovecs and coalesce the neighbouring bufs */
 
-        cl = ngx_udp_output_chain_to_iovec(&vec, in, c->log);
+        cl = ngx_udp_output_chain_to_msgs(c, msgs, &nmsgs, iovs, in,
+                                          limit - send, gso);
 
         if (cl == NGX_CHAIN_ERROR) {
             return NGX_CHAIN_ERROR;
@@ -86,9 +145,15 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             return in;
         }
 
-        send += vec.size;
+#if (NGX_HAVE_MMSG)
+        if (nmsgs > 1) {
+            n = ngx_sendmmsg(c, msgs, nmsgs);
 
-        n = ngx_sendmsg(c, &vec);
+        } else
+#endif
+        {
+            n = ngx_sendmsg(c, &msgs[0]);
+        }
 
         if (n == NGX_ERROR) {
             return NGX_CHAIN_ERROR;
@@ -99,6 +164,15 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             return in;
         }
 
+        if (n == NGX_DECLINED) {
+
+            /* segmentation offload was rejected, resend without it */
+
+            gso = 0;
+            continue;
+        }
+
+        send += n;
         c->sent += n;
 
         in = ngx_chain_update_sent(in, n);
@@ -110,6 +184,105 @@ ngx_udp_unix_sendmsg_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 }
 
 
+static ngx_chain_t *
+ngx_udp_output_chain_to_msgs(ngx_connection_t *c, ngx_udp_msg_t *msgs,
+    ngx_uint_t *nmsgs, struct iovec *iovs, ngx_chain_t *in, off_t limit,
+    ngx_uint_t gso)
+{
+    ngx_uint_t      n;
+    ngx_chain_t    *cl;
+    ngx_udp_msg_t  *m;
+#if (NGX_HAVE_MMSG)
+    off_t           send;
+    size_t          segment;
+    ngx_uint_t      niovs;
+    ngx_iovec_t     vec;
+#endif
+
+    m = &msgs[0];
+
+    m->vec.iovs = iovs;
+    m->vec.nalloc = NGX_IOVS_PREALLOCATE;
+    m->segment = 0;
+    m->nsegments = 1;
+
+    cl = ngx_udp_output_chain_to_iovec(&m->vec, in, c->log);
+
+    n = 1;
+
+#if (NGX_HAVE_MMSG)
+
+    if (cl == NGX_CHAIN_ERROR || cl == in) {
+        goto done;
+    }
+
+    send = m->vec.size;
+    niovs = m->vec.count;
+
+    /*
+     * the following datagrams are added while they fit into the iovecs;
+     * a datagram which does not is left for the next call
+     */
+
+    while (cl
+           && send < limit
+           && n < NGX_UDP_SEND_BATCH
+           && niovs < NGX_IOVS_PREALLOCATE)
+    {
+        vec.iovs = iovs + niovs;
+        vec.nalloc = NGX_IOVS_PREALLOCATE - niovs;
+
+        in = cl;
+
+        cl = ngx_udp_output_chain_to_iovec(&vec, in, NULL);
+
+        if (cl == NGX_CHAIN_ERROR || cl == in) {
+            cl = in;
+            break;
+        }
+
+        send += vec.size;
+        niovs += vec.count;
+
+        /*
+         * datagrams of the same size follow each other in one message
+         * sent with segmentation offload, only the last one may be shorter
+         */
+
+        segment = (m->nsegments == 1) ? m->vec.size : m->segment;
+
+        if (gso
+            && vec.size
+            && vec.size <= segment
+            && m->vec.size == segment * m->nsegments
+            && m->nsegments < NGX_UDP_MAX_SEGMENTS
+            && m->vec.size + vec.size <= NGX_UDP_MAX_GSO_SIZE)
+        {
+            m->vec.count += vec.count;
+            m->vec.size += vec.size;
+            m->segment = segment;
+            m->nsegments++;
+
+            continue;
+        }
+
+        m = &msgs[n++];
+
+        m->vec = vec;
+        m->segment = 0;
+        m->nsegments = 1;
+    }
+
+done:
+
+#endif
+
+    *nmsgs = n;
+
+    return cl;
+}
+
+
 static ngx_chain_t *
 ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
 {
@@ -141,6 +314,13 @@ ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
         }
 
         if (!ngx_buf_in_memory(in->buf)) {
+
+            /* reported when the buf is the first one in the next call */
+
+            if (log == NULL) {
+                return NGX_CHAIN_ERROR;
+            }
+
             ngx_log_error(NGX_LOG_ALERT, log, 0,
                           "bad buf in output chain "
                           "t:%d r:%d f:%d %p %p-%p %p %O-%O",
@@ -166,8 +346,11 @@ ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
 
         } else {
             if (n == vec->nalloc) {
-                ngx_log_error(NGX_LOG_ALERT, log, 0,
-                              "too many parts in a datagram");
+                if (log) {
+                    ngx_log_error(NGX_LOG_ALERT, log, 0,
+                                  "too many parts in a datagram");
+                }
+
                 return NGX_CHAIN_ERROR;
             }
 
@@ -197,38 +380,184 @@ ngx_udp_output_chain_to_iovec(ngx_iovec_t *vec, ngx_chain_t *in, ngx_log_t *log)
 
 
 static ssize_t
-ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
+ngx_sendmsg(ngx_connection_t *c, ngx_udp_msg_t *m)
 {
-    ssize_t        n;
-    ngx_err_t      err;
-    struct msghdr  msg;
+    ssize_t                 n;
+    ngx_err_t               err;
+    struct msghdr           msg;
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+    ngx_sendmsg_control_t   control;
+#else
+    void                   *control = NULL;
+#endif
+
+    ngx_udp_init_msghdr(c, &msg, m, &control);
+
+eintr:
+
+    n = sendmsg(c->fd, &msg, 0);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendmsg: %z of %uz, segments:%ui",
+                   n, m->vec.size, m->nsegments);
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        switch (err) {
+        case NGX_EAGAIN:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmsg() not ready");
+            return NGX_AGAIN;
+
+        case NGX_EINTR:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmsg() was interrupted");
+            goto eintr;
+
+        default:
+
+#if (NGX_HAVE_UDP_SEGMENT)
+            if (m->nsegments > 1 && (err == NGX_EIO || err == NGX_EINVAL)) {
+                goto gso_failed;
+            }
+#endif
+
+            c->write->error = 1;
+            ngx_connection_error(c, err, "sendmsg() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return n;
+
+#if (NGX_HAVE_UDP_SEGMENT)
+
+gso_failed:
+
+    /*
+     * EINVAL: the segment size exceeds the path MTU,
+     * EIO: the device does not support checksum offload
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                   "sendmsg() with segmentation offload failed");
+
+    if (err == NGX_EIO && ngx_udp_segmentation) {
+        ngx_log_error(NGX_LOG_NOTICE, c->log, err,
+                      "sendmsg() with segmentation offload failed, "
+                      "segmentation offload disabled");
 
+        ngx_udp_segmentation = 0;
+    }
+
+    return NGX_DECLINED;
+
+#endif
+}
+
+
+#if (NGX_HAVE_MMSG)
+
+static ssize_t
+ngx_sendmmsg(ngx_connection_t *c, ngx_udp_msg_t *msgs, ngx_uint_t nmsgs)
+{
+    int                     n;
+    size_t                  sent;
+    ngx_err_t               err;
+    ngx_uint_t              i;
+    struct mmsghdr          mmsgs[NGX_UDP_SEND_BATCH];
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+    ngx_sendmsg_control_t   control[NGX_UDP_SEND_BATCH];
+#else
+    void                   *control[NGX_UDP_SEND_BATCH];
+#endif
 
-#if (NGX_HAVE_IP_SENDSRCADDR)
-    u_char         msg_control[CMSG_SPACE(sizeof(struct in_addr))];
-#elif (NGX_HAVE_IP_PKTINFO)
-    u_char         msg_control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    for (i = 0; i < nmsgs; i++) {
+        ngx_udp_init_msghdr(c, &mmsgs[i].msg_hdr, &msgs[i], &control[i]);
+        mmsgs[i].msg_len = 0;
+    }
+
+eintr:
+
+    n = sendmmsg(c->fd, mmsgs, nmsgs, 0);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendmmsg: %d of %ui", n, nmsgs);
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        switch (err) {
+        case NGX_EAGAIN:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmmsg() not ready");
+            return NGX_AGAIN;
+
+        case NGX_EINTR:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmmsg() was interrupted");
+            goto eintr;
+
+        default:
+
+#if (NGX_HAVE_UDP_SEGMENT)
+
+            /*
+             * the error refers to the first message; if it was rejected
+             * because of segmentation offload, it is sent once again with
+             * sendmsg() to handle this in the same way
+             */
+
+            if (msgs[0].nsegments > 1
+                && (err == NGX_EIO || err == NGX_EINVAL))
+            {
+                return ngx_sendmsg(c, &msgs[0]);
+            }
 #endif
 
-#if (NGX_HAVE_INET6 && NGX_HAVE_IPV6_RECVPKTINFO)
-    u_char         msg_control6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+            c->write->error = 1;
+            ngx_connection_error(c, err, "sendmmsg() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    sent = 0;
+
+    for (i = 0; i < (ngx_uint_t) n; i++) {
+        sent += mmsgs[i].msg_len;
+    }
+
+    return sent;
+}
+
 #endif
 
+
+static void
+ngx_udp_init_msghdr(ngx_connection_t *c, struct msghdr *msg,
+    ngx_udp_msg_t *m, void *control)
+{
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+    u_char  *p;
+    size_t   len;
 #endif
 
-    ngx_memzero(&msg, sizeof(struct msghdr));
+    ngx_memzero(msg, sizeof(struct msghdr));
 
     if (c->socklen) {
-        msg.msg_name = c->sockaddr;
-        msg.msg_namelen = c->socklen;
+        msg->msg_name = c->sockaddr;
+        msg->msg_namelen = c->socklen;
     }
 
-    msg.msg_iov = vec->iovs;
-    msg.msg_iovlen = vec->count;
+    msg->msg_iov = m->vec.iovs;
+    msg->msg_iovlen = m->vec.count;
 
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
 
+    p = control;
+    len = 0;
+
     if (c->listening && c->listening->wildcard && c->local_sockaddr) {
 
 #if (NGX_HAVE_IP_SENDSRCADDR)
@@ -238,10 +567,7 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             struct in_addr      *addr;
             struct sockaddr_in  *sin;
 
-            msg.msg_control = &msg_control;
-            msg.msg_controllen = sizeof(msg_control);
-
-            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg = (struct cmsghdr *) p;
             cmsg->cmsg_level = IPPROTO_IP;
             cmsg->cmsg_type = IP_SENDSRCADDR;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
@@ -250,6 +576,8 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
 
             addr = (struct in_addr *) CMSG_DATA(cmsg);
             *addr = sin->sin_addr;
+
+            len = CMSG_SPACE(sizeof(struct in_addr));
         }
 
 #elif (NGX_HAVE_IP_PKTINFO)
@@ -259,10 +587,7 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             struct in_pktinfo   *pkt;
             struct sockaddr_in  *sin;
 
-            msg.msg_control = &msg_control;
-            msg.msg_controllen = sizeof(msg_control);
-
-            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg = (struct cmsghdr *) p;
             cmsg->cmsg_level = IPPROTO_IP;
             cmsg->cmsg_type = IP_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
@@ -272,6 +597,8 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
             ngx_memzero(pkt, sizeof(struct in_pktinfo));
             pkt->ipi_spec_dst = sin->sin_addr;
+
+            len = CMSG_SPACE(sizeof(struct in_pktinfo));
         }
 
 #endif
@@ -283,10 +610,7 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             struct in6_pktinfo   *pkt6;
             struct sockaddr_in6  *sin6;
 
-            msg.msg_control = &msg_control6;
-            msg.msg_controllen = sizeof(msg_control6);
-
-            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg = (struct cmsghdr *) p;
             cmsg->cmsg_level = IPPROTO_IPV6;
             cmsg->cmsg_type = IPV6_PKTINFO;
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
@@ -296,40 +620,34 @@ ngx_sendmsg(ngx_connection_t *c, ngx_iovec_t *vec)
             pkt6 = (struct in6_pktinfo *) CMSG_DATA(cmsg);
             ngx_memzero(pkt6, sizeof(struct in6_pktinfo));
             pkt6->ipi6_addr = sin6->sin6_addr;
+
+            len = CMSG_SPACE(sizeof(struct in6_pktinfo));
         }
 
 #endif
     }
 
-#endif
+#if (NGX_HAVE_UDP_SEGMENT)
 
-eintr:
+    if (m->nsegments > 1) {
+        struct cmsghdr  *cmsg;
 
-    n = sendmsg(c->fd, &msg, 0);
-
-    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "sendmsg: %z of %uz", n, vec->size);
+        cmsg = (struct cmsghdr *) (p + len);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
 
-    if (n == -1) {
-        err = ngx_errno;
+        *(uint16_t *) CMSG_DATA(cmsg) = (uint16_t) m->segment;
 
-        switch (err) {
-        case NGX_EAGAIN:
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
-                           "sendmsg() not ready");
-            return NGX_AGAIN;
+        len += CMSG_SPACE(sizeof(uint16_t));
+    }
 
-        case NGX_EINTR:
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
-                           "sendmsg() was interrupted");
-            goto eintr;
+#endif
 
-        default:
-            c->write->error = 1;
-            ngx_connection_error(c, err, "sendmsg() failed");
-            return NGX_ERROR;
-        }
+    if (len) {
+        msg->msg_control = control;
+        msg->msg_controllen = len;
     }
 
-    return n;
+#endif
 }
@@ -19,6 +19,20 @@ typedef struct {
 } ngx_stream_upstream_local_t;
 
 
+/*
+ * server names are kept in nested per-label hashes built by
+ * ngx_hash_wildcard_init(), with labels of "*.example.com" reversed,
+ * so a lookup costs a hash probe per label of the name
+ */
+
+typedef struct {
+    ngx_hash_combined_t              hash;
+    ngx_hash_keys_arrays_t          *keys;
+    ngx_stream_upstream_srv_conf_t  *default_upstream;
+    ngx_int_t                        index;
+} ngx_stream_proxy_sni_route_t;
+
+
 typedef struct {
     ngx_msec_t                       connect_timeout;
     ngx_msec_t                       timeout;
@@ -31,12 +45,16 @@ typedef struct {
     ngx_uint_t                       next_upstream_tries;
     ngx_flag_t                       next_upstream;
     ngx_flag_t                       proxy_protocol;
+    ngx_uint_t                       proxy_protocol_version;
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
+    ngx_flag_t                       splice;
 
 #if (NGX_STREAM_SSL)
     ngx_flag_t                       ssl_enable;
     ngx_flag_t                       ssl_session_reuse;
+    ngx_shm_zone_t                  *ssl_session_cache;
+    ngx_str_t                        ssl_session_id;
     ngx_uint_t                       ssl_protocols;
     ngx_str_t                        ssl_ciphers;
     ngx_stream_complex_value_t      *ssl_name;
@@ -55,16 +73,32 @@ typedef struct {
 
     ngx_stream_upstream_srv_conf_t  *upstream;
     ngx_stream_complex_value_t      *upstream_value;
+
+    ngx_stream_proxy_sni_route_t    *sni_route;
+    ngx_uint_t                       sni_route_hash_max_size;
+    ngx_uint_t                       sni_route_hash_bucket_size;
 } ngx_stream_proxy_srv_conf_t;
 
 
+typedef struct {
+    ngx_hash_keys_arrays_t          *keys;
+    ngx_conf_t                      *cf;
+    ngx_stream_proxy_sni_route_t    *route;
+} ngx_stream_proxy_sni_route_ctx_t;
+
+
 static void ngx_stream_proxy_handler(ngx_stream_session_t *s);
 static ngx_int_t ngx_stream_proxy_eval(ngx_stream_session_t *s,
     ngx_stream_proxy_srv_conf_t *pscf);
+static ngx_stream_upstream_srv_conf_t *ngx_stream_proxy_sni_route_find(
+    ngx_stream_session_t *s, ngx_stream_proxy_sni_route_t *route);
 static ngx_int_t ngx_stream_proxy_set_local(ngx_stream_session_t *s,
     ngx_stream_upstream_t *u, ngx_stream_upstream_local_t *local);
 static void ngx_stream_proxy_connect(ngx_stream_session_t *s);
 static void ngx_stream_proxy_init_upstream(ngx_stream_session_t *s);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_init_splice(ngx_stream_session_t *s);
+#endif
 static void ngx_stream_proxy_resolve_handler(ngx_resolver_ctx_t *ctx);
 static void ngx_stream_proxy_upstream_handler(ngx_event_t *ev);
 static void ngx_stream_proxy_downstream_handler(ngx_event_t *ev);
@@ -74,6 +108,8 @@ static void ngx_stream_proxy_connect_handler(ngx_event_t *ev);
 static ngx_int_t ngx_stream_proxy_test_connect(ngx_connection_t *c);
 static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
+static ngx_uint_t ngx_stream_proxy_datagram_fits(ngx_connection_t *pc,
+    size_t size);
 static ngx_int_t ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream);
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
@@ -88,10 +124,25 @@ static char *ngx_stream_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_stream_proxy_sni_route_block(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_stream_proxy_sni_route(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf);
+static char *ngx_stream_proxy_sni_route_init(ngx_conf_t *cf,
+    ngx_stream_proxy_srv_conf_t *conf);
+static int ngx_libc_cdecl ngx_stream_proxy_cmp_dns_wildcards(const void *one,
+    const void *two);
+static void ngx_stream_proxy_check_keepalive(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_stream_proxy_init(ngx_conf_t *cf);
+static char *ngx_stream_proxy_splice_check(ngx_conf_t *cf, void *post,
+    void *data);
 
 #if (NGX_STREAM_SSL)
 
 static ngx_int_t ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s);
+static char *ngx_stream_proxy_ssl_session_cache(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 static char *ngx_stream_proxy_ssl_password_file(ngx_conf_t *cf,
     ngx_command_t *cmd, void *conf);
 static void ngx_stream_proxy_ssl_init_connection(ngx_stream_session_t *s);
@@ -115,6 +166,13 @@ static ngx_conf_bitmask_t  ngx_stream_proxy_ssl_protocols[] = {
 #endif
 
 
+static ngx_conf_enum_t  ngx_stream_proxy_protocol_versions[] = {
+    { ngx_string("1"), 1 },
+    { ngx_string("2"), 2 },
+    { ngx_null_string, 0 }
+};
+
+
 static ngx_conf_deprecated_t  ngx_conf_deprecated_proxy_downstream_buffer = {
     ngx_conf_deprecated, "proxy_downstream_buffer", "proxy_buffer_size"
 };
@@ -124,6 +182,10 @@ static ngx_conf_deprecated_t  ngx_conf_deprecated_proxy_upstream_buffer = {
 };
 
 
+static ngx_conf_post_t  ngx_stream_proxy_splice_post =
+    { ngx_stream_proxy_splice_check };
+
+
 static ngx_command_t  ngx_stream_proxy_commands[] = {
 
     { ngx_string("proxy_pass"),
@@ -133,6 +195,27 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       0,
       NULL },
 
+    { ngx_string("proxy_sni_route"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_BLOCK|NGX_CONF_NOARGS,
+      ngx_stream_proxy_sni_route_block,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("proxy_sni_route_hash_max_size"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, sni_route_hash_max_size),
+      NULL },
+
+    { ngx_string("proxy_sni_route_hash_bucket_size"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, sni_route_hash_bucket_size),
+      NULL },
+
     { ngx_string("proxy_bind"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE12,
       ngx_stream_proxy_bind,
@@ -147,6 +230,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, socket_keepalive),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      &ngx_stream_proxy_splice_post },
+
     { ngx_string("proxy_connect_timeout"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -238,6 +328,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, proxy_protocol),
       NULL },
 
+    { ngx_string("proxy_protocol_version"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, proxy_protocol_version),
+      &ngx_stream_proxy_protocol_versions },
+
 #if (NGX_STREAM_SSL)
 
     { ngx_string("proxy_ssl"),
@@ -254,6 +351,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, ssl_session_reuse),
       NULL },
 
+    { ngx_string("proxy_ssl_session_cache"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_stream_proxy_ssl_session_cache,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("proxy_ssl_protocols"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_1MORE,
       ngx_conf_set_bitmask_slot,
@@ -339,7 +443,7 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
 
 static ngx_stream_module_t  ngx_stream_proxy_module_ctx = {
     NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_stream_proxy_init,                 /* postconfiguration */
 
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
@@ -438,6 +542,17 @@ ngx_stream_proxy_handler(ngx_stream_session_t *s)
         ngx_post_event(c->read, &ngx_posted_events);
     }
 
+    if (pscf->sni_route) {
+        uscf = ngx_stream_proxy_sni_route_find(s, pscf->sni_route);
+
+        if (uscf == NULL) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_BAD_GATEWAY);
+            return;
+        }
+
+        goto found;
+    }
+
     if (pscf->upstream_value) {
         if (ngx_stream_proxy_eval(s, pscf) != NGX_OK) {
             ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
@@ -617,6 +732,54 @@ ngx_stream_proxy_eval(ngx_stream_session_t *s,
 }
 
 
+static ngx_stream_upstream_srv_conf_t *
+ngx_stream_proxy_sni_route_find(ngx_stream_session_t *s,
+    ngx_stream_proxy_sni_route_t *route)
+{
+    size_t                           len;
+    ngx_uint_t                       key;
+    ngx_stream_variable_value_t     *vv;
+    ngx_stream_upstream_srv_conf_t  *uscf;
+    u_char                           name[256];
+
+    vv = ngx_stream_get_indexed_variable(s, route->index);
+
+    uscf = NULL;
+
+    if (vv && !vv->not_found) {
+        len = vv->len;
+
+        if (len && vv->data[len - 1] == '.') {
+            len--;
+        }
+
+        /* a server name is at most 255 bytes long */
+
+        if (len && len < sizeof(name)) {
+            key = ngx_hash_strlow(name, vv->data, len);
+
+            uscf = ngx_hash_find_combined(&route->hash, key, name, len);
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                       "sni route: \"%*s\"", vv->len, vv->data);
+    }
+
+    if (uscf == NULL) {
+        uscf = route->default_upstream;
+    }
+
+    if (uscf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "no upstream for server name \"%*s\"",
+                      (vv && !vv->not_found) ? vv->len : 0,
+                      (vv && !vv->not_found) ? vv->data : NULL);
+    }
+
+    return uscf;
+}
+
+
 static ngx_int_t
 ngx_stream_proxy_set_local(ngx_stream_session_t *s, ngx_stream_upstream_t *u,
     ngx_stream_upstream_local_t *local)
@@ -869,7 +1032,7 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
             return;
         }
 
-        p = ngx_pnalloc(c->pool, NGX_PROXY_PROTOCOL_MAX_HEADER);
+        p = ngx_pnalloc(c->pool, NGX_PROXY_PROTOCOL_V1_MAX_HEADER);
         if (p == NULL) {
             ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
@@ -877,7 +1040,15 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 
         cl->buf->pos = p;
 
-        p = ngx_proxy_protocol_write(c, p, p + NGX_PROXY_PROTOCOL_MAX_HEADER);
+        if (pscf->proxy_protocol_version == 2) {
+            p = ngx_proxy_protocol_v2_write(c, p,
+                                         p + NGX_PROXY_PROTOCOL_V1_MAX_HEADER);
+
+        } else {
+            p = ngx_proxy_protocol_write(c, p,
+                                         p + NGX_PROXY_PROTOCOL_V1_MAX_HEADER);
+        }
+
         if (p == NULL) {
             ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
@@ -895,6 +1066,24 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
         u->proxy_protocol = 0;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    if (pscf->splice
+        && pc->type == SOCK_STREAM
+#if (NGX_STREAM_SSL)
+        && c->ssl == NULL
+        && pc->ssl == NULL
+#endif
+        && u->upstream_pipe == NULL)
+    {
+        if (ngx_stream_proxy_init_splice(s) != NGX_OK) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     u->upload_rate = ngx_stream_complex_value_size(s, pscf->upload_rate, 0);
     u->download_rate = ngx_stream_complex_value_size(s, pscf->download_rate, 0);
 
@@ -911,6 +1100,40 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_stream_proxy_init_splice(ngx_stream_session_t *s)
+{
+    ngx_connection_t             *c;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    c = s->connection;
+    u = s->upstream;
+
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    u->upstream_pipe = ngx_splice_pipe_create(c->pool, pscf->buffer_size,
+                                              c->log);
+    if (u->upstream_pipe == NULL) {
+        return NGX_ERROR;
+    }
+
+    u->downstream_pipe = ngx_splice_pipe_create(c->pool, pscf->buffer_size,
+                                                c->log);
+    if (u->downstream_pipe == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "stream proxy splice");
+
+    return NGX_OK;
+}
+
+#endif
+
+
 #if (NGX_STREAM_SSL)
 
 static ngx_int_t
@@ -921,14 +1144,24 @@ ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s)
     ngx_connection_t             *c, *pc;
     ngx_stream_upstream_t        *u;
     ngx_stream_proxy_srv_conf_t  *pscf;
-    u_char                        buf[NGX_PROXY_PROTOCOL_MAX_HEADER];
+    u_char                        buf[NGX_PROXY_PROTOCOL_V1_MAX_HEADER];
 
     c = s->connection;
 
     ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0,
                    "stream proxy send PROXY protocol header");
 
-    p = ngx_proxy_protocol_write(c, buf, buf + NGX_PROXY_PROTOCOL_MAX_HEADER);
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (pscf->proxy_protocol_version == 2) {
+        p = ngx_proxy_protocol_v2_write(c, buf,
+                                        buf + NGX_PROXY_PROTOCOL_V1_MAX_HEADER);
+
+    } else {
+        p = ngx_proxy_protocol_write(c, buf,
+                                     buf + NGX_PROXY_PROTOCOL_V1_MAX_HEADER);
+    }
+
     if (p == NULL) {
         ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
         return NGX_ERROR;
@@ -948,8 +1181,6 @@ ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s)
             return NGX_ERROR;
         }
 
-        pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
-
         ngx_add_timer(pc->write, pscf->timeout);
 
         pc->write->handler = ngx_stream_proxy_connect_handler;
@@ -983,6 +1214,35 @@ ngx_stream_proxy_send_proxy_protocol(ngx_stream_session_t *s)
 }
 
 
+static char *
+ngx_stream_proxy_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
+
+    ngx_str_t  *value;
+
+    if (pscf->ssl_session_cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        pscf->ssl_session_cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    pscf->ssl_session_cache = ngx_ssl_client_session_cache_add(cf, &value[1]);
+
+    if (pscf->ssl_session_cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_stream_proxy_ssl_password_file(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf)
@@ -1038,7 +1298,20 @@ ngx_stream_proxy_ssl_init_connection(ngx_stream_session_t *s)
     if (pscf->ssl_session_reuse) {
         pc->ssl->save_session = ngx_stream_proxy_ssl_save_session;
 
-        if (u->peer.set_session(&u->peer, u->peer.data) != NGX_OK) {
+        if (pscf->ssl_session_cache) {
+            /* the name is checked against the certificate if verified */
+
+            rc = ngx_ssl_set_cached_client_session(pc, pscf->ssl_session_cache,
+                                      (pscf->ssl_server_name
+                                       || pscf->ssl_verify)
+                                      ? &u->ssl_name : NULL,
+                                      &pscf->ssl_session_id);
+
+        } else {
+            rc = u->peer.set_session(&u->peer, u->peer.data);
+        }
+
+        if (rc != NGX_OK) {
             ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
             return;
         }
@@ -1114,12 +1387,24 @@ failed:
 static void
 ngx_stream_proxy_ssl_save_session(ngx_connection_t *c)
 {
-    ngx_stream_session_t   *s;
-    ngx_stream_upstream_t  *u;
+    ngx_stream_session_t         *s;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_srv_conf_t  *pscf;
 
     s = c->data;
     u = s->upstream;
 
+    pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+    if (pscf->ssl_session_cache) {
+        ngx_ssl_save_cached_client_session(c, pscf->ssl_session_cache,
+                                           (pscf->ssl_server_name
+                                            || pscf->ssl_verify)
+                                           ? &u->ssl_name : NULL,
+                                           &pscf->ssl_session_id);
+        return;
+    }
+
     u->peer.save_session(&u->peer, u->peer.data);
 }
 
@@ -1346,7 +1631,7 @@ ngx_stream_proxy_process_connection(ngx_event_t *ev, ngx_uint_t from_upstream)
                 }
 
                 if (u->connected && !c->read->delayed && !pc->read->delayed) {
-                    ngx_add_timer(c->write, pscf->timeout);
+                    ngx_add_deadline(c->write, pscf->timeout);
                 }
 
                 return;
@@ -1501,13 +1786,16 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
     ssize_t                       n;
     ngx_buf_t                    *b;
     ngx_int_t                     rc;
-    ngx_uint_t                    flags, *packets;
+    ngx_uint_t                    flags, batch, *packets;
     ngx_msec_t                    delay;
     ngx_chain_t                  *cl, **ll, **out, **busy;
     ngx_connection_t             *c, *pc, *src, *dst;
     ngx_log_handler_pt            handler;
     ngx_stream_upstream_t        *u;
     ngx_stream_proxy_srv_conf_t  *pscf;
+#if (NGX_HAVE_SPLICE)
+    ngx_splice_pipe_t            *sp;
+#endif
 
     u = s->upstream;
 
@@ -1542,6 +1830,9 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         busy = &u->downstream_busy;
         recv_action = "proxying and reading from upstream";
         send_action = "proxying and sending to client";
+#if (NGX_HAVE_SPLICE)
+        sp = u->upstream_pipe;
+#endif
 
     } else {
         src = c;
@@ -1554,11 +1845,16 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         busy = &u->upstream_busy;
         recv_action = "proxying and reading from client";
         send_action = "proxying and sending to upstream";
+#if (NGX_HAVE_SPLICE)
+        sp = u->downstream_pipe;
+#endif
     }
 
+    batch = 0;
+
     for ( ;; ) {
 
-        if (do_write && dst) {
+        if (do_write && dst && !batch) {
 
             if (*out || *busy || dst->buffered) {
                 c->log->action = send_action;
@@ -1582,6 +1878,34 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 
         size = b->end - b->last;
 
+#if (NGX_HAVE_SPLICE)
+
+        if (sp) {
+
+            /* data buffered before splicing was enabled go first */
+
+            if (*out || *busy) {
+                break;
+            }
+
+            if (do_write && sp->size) {
+                c->log->action = send_action;
+
+                if (ngx_splice_send(dst, sp) == NGX_ERROR) {
+                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                    return;
+                }
+            }
+
+            if (sp->size) {
+                break;
+            }
+
+            size = sp->capacity;
+        }
+
+#endif
+
         if (size && src->read->ready && !src->read->delayed
             && !src->read->error)
         {
@@ -1603,9 +1927,23 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 
             c->log->action = recv_action;
 
-            n = src->recv(src, b->last, size);
+#if (NGX_HAVE_SPLICE)
+            if (sp) {
+                n = ngx_splice_recv(src, sp, size);
+
+            } else
+#endif
+            {
+                n = src->recv(src, b->last, size);
+            }
 
             if (n == NGX_AGAIN) {
+
+                if (batch) {
+                    batch = 0;
+                    continue;
+                }
+
                 break;
             }
 
@@ -1631,6 +1969,16 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                     }
                 }
 
+#if (NGX_HAVE_SPLICE)
+                if (sp) {
+                    (*packets)++;
+                    *received += n;
+                    do_write = 1;
+
+                    continue;
+                }
+#endif
+
                 for (ll = out; *ll; ll = &(*ll)->next) { /* void */ }
 
                 cl = ngx_chain_get_free_buf(c->pool, &u->free);
@@ -1655,10 +2003,29 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                 b->last += n;
                 do_write = 1;
 
+                /*
+                 * datagrams read in a row are sent at once; a datagram
+                 * from upstream is truncated if it does not fit into
+                 * the buffer, so they are only batched while it has
+                 * room for the next one
+                 */
+
+                batch = (c->type == SOCK_DGRAM
+                         && n
+                         && src->read->ready
+                         && (src == c
+                             || ngx_stream_proxy_datagram_fits(src,
+                                                        b->end - b->last)));
+
                 continue;
             }
         }
 
+        if (batch) {
+            batch = 0;
+            continue;
+        }
+
         break;
     }
 
@@ -1682,7 +2049,7 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         }
 
         if (!c->read->delayed && !pc->read->delayed) {
-            ngx_add_timer(c->write, pscf->timeout);
+            ngx_add_deadline(c->write, pscf->timeout);
 
         } else if (c->write->timer_set) {
             ngx_del_timer(c->write);
@@ -1691,6 +2058,45 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 }
 
 
+static ngx_uint_t
+ngx_stream_proxy_datagram_fits(ngx_connection_t *pc, size_t size)
+{
+#if (NGX_LINUX)
+    ssize_t  n;
+#endif
+
+    if (size >= NGX_UDP_DATAGRAM_SIZE) {
+        return 1;
+    }
+
+#if (NGX_LINUX)
+
+    /* MSG_TRUNC makes recv() return the size of the next datagram */
+
+    n = recv(pc->fd, NULL, 0, MSG_PEEK|MSG_TRUNC);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "stream proxy next datagram: %z of %uz", n, size);
+
+    if (n == -1) {
+
+        /* there is no datagram, and the next read ends the batch */
+
+        return (ngx_socket_errno == NGX_EAGAIN);
+    }
+
+    return ((size_t) n <= size);
+
+#else
+
+    /* the size of the next datagram is not known */
+
+    return 0;
+
+#endif
+}
+
+
 static ngx_int_t
 ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream)
@@ -1726,6 +2132,18 @@ ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
             return NGX_DECLINED;
         }
 
+        /*
+         * only datagram sessions are kept alive: a datagram carries
+         * a complete message, so once all the expected responses have
+         * arrived nothing of the session is left on the connection;
+         * a stream connection has no such boundary, and a pipelined
+         * leftover or state set by the client (authentication, selected
+         * database, transaction, subscription) would leak to the next
+         * session, so stream connections are always closed
+         */
+
+        u->keepalive = !pscf->proxy_protocol;
+
         handler = c->log->handler;
         c->log->handler = NULL;
 
@@ -1754,6 +2172,17 @@ ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
         return NGX_DECLINED;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    if (u->upstream_pipe
+        && ((!c->read->eof && u->upstream_pipe->size)
+            || (!pc->read->eof && u->downstream_pipe->size)))
+    {
+        return NGX_DECLINED;
+    }
+
+#endif
+
     handler = c->log->handler;
     c->log->handler = NULL;
 
@@ -1883,6 +2312,10 @@ ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc)
 
         u->peer.free(&u->peer, u->peer.data, state);
         u->peer.sockaddr = NULL;
+
+        /* the connection is kept by the keepalive module */
+
+        pc = u->peer.connection;
     }
 
     if (pc) {
@@ -1957,12 +2390,14 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
      *     conf->ssl_crl = { 0, NULL };
      *     conf->ssl_certificate = { 0, NULL };
      *     conf->ssl_certificate_key = { 0, NULL };
+     *     conf->ssl_session_id = { 0, NULL };
      *
      *     conf->upload_rate = NULL;
      *     conf->download_rate = NULL;
      *     conf->ssl = NULL;
      *     conf->upstream = NULL;
      *     conf->upstream_value = NULL;
+     *     conf->sni_route = NULL;
      */
 
     conf->connect_timeout = NGX_CONF_UNSET_MSEC;
@@ -1974,12 +2409,17 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->next_upstream_tries = NGX_CONF_UNSET_UINT;
     conf->next_upstream = NGX_CONF_UNSET;
     conf->proxy_protocol = NGX_CONF_UNSET;
+    conf->proxy_protocol_version = NGX_CONF_UNSET_UINT;
     conf->local = NGX_CONF_UNSET_PTR;
     conf->socket_keepalive = NGX_CONF_UNSET;
+    conf->splice = NGX_CONF_UNSET;
+    conf->sni_route_hash_max_size = NGX_CONF_UNSET_UINT;
+    conf->sni_route_hash_bucket_size = NGX_CONF_UNSET_UINT;
 
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
     conf->ssl_session_reuse = NGX_CONF_UNSET;
+    conf->ssl_session_cache = NGX_CONF_UNSET_PTR;
     conf->ssl_server_name = NGX_CONF_UNSET;
     conf->ssl_verify = NGX_CONF_UNSET;
     conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
@@ -2029,11 +2469,29 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->proxy_protocol, prev->proxy_protocol, 0);
 
+    ngx_conf_merge_uint_value(conf->proxy_protocol_version,
+                              prev->proxy_protocol_version, 1);
+
     ngx_conf_merge_ptr_value(conf->local, prev->local, NULL);
 
     ngx_conf_merge_value(conf->socket_keepalive,
                               prev->socket_keepalive, 0);
 
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+
+    ngx_conf_merge_uint_value(conf->sni_route_hash_max_size,
+                              prev->sni_route_hash_max_size, 2048);
+
+    ngx_conf_merge_uint_value(conf->sni_route_hash_bucket_size,
+                              prev->sni_route_hash_bucket_size,
+                              ngx_cacheline_size);
+
+    if (conf->sni_route
+        && ngx_stream_proxy_sni_route_init(cf, conf) != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
 #if (NGX_STREAM_SSL)
 
     ngx_conf_merge_value(conf->ssl_enable, prev->ssl_enable, 0);
@@ -2041,6 +2499,9 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->ssl_session_reuse,
                               prev->ssl_session_reuse, 1);
 
+    ngx_conf_merge_ptr_value(conf->ssl_session_cache,
+                              prev->ssl_session_cache, NULL);
+
     ngx_conf_merge_bitmask_value(conf->ssl_protocols, prev->ssl_protocols,
                               (NGX_CONF_BITMASK_SET|NGX_SSL_TLSv1
                                |NGX_SSL_TLSv1_1|NGX_SSL_TLSv1_2));
@@ -2155,6 +2616,18 @@ ngx_stream_proxy_set_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *pscf)
         return NGX_ERROR;
     }
 
+    if (pscf->ssl_session_cache
+        && ngx_ssl_client_session_id(cf, &pscf->ssl_session_id,
+                                     pscf->ssl_protocols, &pscf->ssl_ciphers,
+                                     &pscf->ssl_certificate, pscf->ssl_verify,
+                                     pscf->ssl_verify_depth,
+                                     &pscf->ssl_trusted_certificate,
+                                     &pscf->ssl_crl)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     return NGX_OK;
 }
 
@@ -2172,7 +2645,7 @@ ngx_stream_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_stream_core_srv_conf_t          *cscf;
     ngx_stream_compile_complex_value_t   ccv;
 
-    if (pscf->upstream || pscf->upstream_value) {
+    if (pscf->upstream || pscf->upstream_value || pscf->sni_route) {
         return "is duplicate";
     }
 
@@ -2220,6 +2693,298 @@ ngx_stream_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_stream_proxy_sni_route_block(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_proxy_srv_conf_t *pscf = conf;
+
+    char                              *rv;
+    ngx_str_t                          name;
+    ngx_conf_t                         save;
+    ngx_stream_core_srv_conf_t        *cscf;
+    ngx_stream_proxy_sni_route_t      *route;
+    ngx_stream_proxy_sni_route_ctx_t   ctx;
+
+    if (pscf->upstream || pscf->upstream_value || pscf->sni_route) {
+        return "is duplicate";
+    }
+
+    route = ngx_pcalloc(cf->pool, sizeof(ngx_stream_proxy_sni_route_t));
+    if (route == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_set(&name, "ssl_preread_server_name");
+
+    route->index = ngx_stream_get_variable_index(cf, &name);
+    if (route->index == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* the keys are only needed until the hash is built on merge */
+
+    route->keys = ngx_pcalloc(cf->temp_pool, sizeof(ngx_hash_keys_arrays_t));
+    if (route->keys == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    route->keys->pool = cf->pool;
+    route->keys->temp_pool = cf->temp_pool;
+
+    if (ngx_hash_keys_array_init(route->keys, NGX_HASH_LARGE) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx.keys = route->keys;
+    ctx.cf = &save;
+    ctx.route = route;
+
+    save = *cf;
+    cf->ctx = &ctx;
+    cf->handler = ngx_stream_proxy_sni_route;
+    cf->handler_conf = conf;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    pscf->sni_route = route;
+
+    cscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_core_module);
+
+    cscf->handler = ngx_stream_proxy_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_proxy_sni_route(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    ngx_int_t                          rc;
+    ngx_url_t                          u;
+    ngx_str_t                         *value;
+    ngx_stream_upstream_srv_conf_t    *uscf;
+    ngx_stream_proxy_sni_route_ctx_t  *ctx;
+
+    ctx = cf->ctx;
+
+    if (cf->args->nelts != 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of the sni route parameters");
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.no_resolve = 1;
+
+    uscf = ngx_stream_upstream_add(ctx->cf, &u, 0);
+    if (uscf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[0].data, "default") == 0) {
+
+        if (ctx->route->default_upstream) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate default sni route");
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->route->default_upstream = uscf;
+
+        return NGX_CONF_OK;
+    }
+
+    if (value[0].len && value[0].data[0] == '\\') {
+        value[0].len--;
+        value[0].data++;
+    }
+
+    rc = ngx_hash_add_key(ctx->keys, &value[0], uscf, NGX_HASH_WILDCARD_KEY);
+
+    if (rc == NGX_OK) {
+        return NGX_CONF_OK;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid server name or wildcard \"%V\"",
+                           &value[0]);
+    }
+
+    if (rc == NGX_BUSY) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "conflicting server name \"%V\"", &value[0]);
+    }
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_stream_proxy_sni_route_init(ngx_conf_t *cf,
+    ngx_stream_proxy_srv_conf_t *conf)
+{
+    ngx_uint_t                     i;
+    ngx_hash_key_t                *hk;
+    ngx_hash_init_t                hash;
+    ngx_hash_keys_arrays_t        *keys;
+    ngx_stream_proxy_sni_route_t  *route;
+
+    route = conf->sni_route;
+    keys = route->keys;
+
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = conf->sni_route_hash_max_size;
+    hash.bucket_size = ngx_align(conf->sni_route_hash_bucket_size,
+                                 ngx_cacheline_size);
+    hash.name = "proxy_sni_route_hash";
+    hash.pool = cf->pool;
+
+    if (keys->keys.nelts) {
+        hash.hash = &route->hash.hash;
+        hash.temp_pool = NULL;
+
+        if (ngx_hash_init(&hash, keys->keys.elts, keys->keys.nelts)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (keys->dns_wc_head.nelts) {
+
+        ngx_qsort(keys->dns_wc_head.elts, (size_t) keys->dns_wc_head.nelts,
+                  sizeof(ngx_hash_key_t), ngx_stream_proxy_cmp_dns_wildcards);
+
+        hash.hash = NULL;
+        hash.temp_pool = cf->temp_pool;
+
+        if (ngx_hash_wildcard_init(&hash, keys->dns_wc_head.elts,
+                                   keys->dns_wc_head.nelts)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        route->hash.wc_head = (ngx_hash_wildcard_t *) hash.hash;
+    }
+
+    if (keys->dns_wc_tail.nelts) {
+
+        ngx_qsort(keys->dns_wc_tail.elts, (size_t) keys->dns_wc_tail.nelts,
+                  sizeof(ngx_hash_key_t), ngx_stream_proxy_cmp_dns_wildcards);
+
+        hash.hash = NULL;
+        hash.temp_pool = cf->temp_pool;
+
+        if (ngx_hash_wildcard_init(&hash, keys->dns_wc_tail.elts,
+                                   keys->dns_wc_tail.nelts)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        route->hash.wc_tail = (ngx_hash_wildcard_t *) hash.hash;
+    }
+
+    /* routes are only used with TCP, since ssl_preread requires it */
+
+    if (route->default_upstream) {
+        ngx_stream_proxy_check_keepalive(cf, route->default_upstream);
+    }
+
+    hk = keys->keys.elts;
+    for (i = 0; i < keys->keys.nelts; i++) {
+        ngx_stream_proxy_check_keepalive(cf, hk[i].value);
+    }
+
+    hk = keys->dns_wc_head.elts;
+    for (i = 0; i < keys->dns_wc_head.nelts; i++) {
+        ngx_stream_proxy_check_keepalive(cf, hk[i].value);
+    }
+
+    hk = keys->dns_wc_tail.elts;
+    for (i = 0; i < keys->dns_wc_tail.nelts; i++) {
+        ngx_stream_proxy_check_keepalive(cf, hk[i].value);
+    }
+
+    route->keys = NULL;
+
+    return NGX_CONF_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_stream_proxy_cmp_dns_wildcards(const void *one, const void *two)
+{
+    ngx_hash_key_t  *first, *second;
+
+    first = (ngx_hash_key_t *) one;
+    second = (ngx_hash_key_t *) two;
+
+    return ngx_dns_strcmp(first->key.data, second->key.data);
+}
+
+
+/*
+ * the "keepalive" directive of stream upstreams only keeps UDP
+ * connections, since TCP has no message boundaries to tell when
+ * a connection is free to be handed to another session
+ */
+
+static void
+ngx_stream_proxy_check_keepalive(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *uscf)
+{
+    if (uscf->flags & NGX_STREAM_UPSTREAM_KEEPALIVE) {
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "\"keepalive\" in upstream \"%V\" in %s:%ui "
+                      "has no effect on TCP connections",
+                      &uscf->host, uscf->file_name, uscf->line);
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_proxy_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                    i;
+    ngx_stream_listen_t          *listen;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+    ngx_stream_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    listen = cmcf->listen.elts;
+
+    for (i = 0; i < cmcf->listen.nelts; i++) {
+
+        if (listen[i].type != SOCK_STREAM) {
+            continue;
+        }
+
+        pscf = listen[i].ctx->srv_conf[ngx_stream_proxy_module.ctx_index];
+
+        if (pscf->upstream) {
+            ngx_stream_proxy_check_keepalive(cf, pscf->upstream);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static char *
 ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -2315,3 +3080,23 @@ ngx_stream_proxy_bind(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_stream_proxy_splice_check(ngx_conf_t *cf, void *post, void *data)
+{
+#if !(NGX_HAVE_SPLICE)
+    ngx_flag_t *fp = data;
+
+    if (*fp) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"proxy_splice\" is not supported "
+                           "on this platform, ignored");
+
+        *fp = 0;
+    }
+
+#endif
+
+    return NGX_CONF_OK;
+}
@@ -22,6 +22,7 @@
 #define NGX_STREAM_UPSTREAM_DOWN          0x0010
 #define NGX_STREAM_UPSTREAM_BACKUP        0x0020
 #define NGX_STREAM_UPSTREAM_MAX_CONNS     0x0100
+#define NGX_STREAM_UPSTREAM_KEEPALIVE     0x0200
 
 
 #define NGX_STREAM_UPSTREAM_NOTIFY_CONNECT     0x1
@@ -140,8 +141,16 @@ typedef struct {
     ngx_stream_upstream_srv_conf_t    *upstream;
     ngx_stream_upstream_resolved_t    *resolved;
     ngx_stream_upstream_state_t       *state;
+
+#if (NGX_HAVE_SPLICE)
+    /* pipes for data from upstream and from client, if spliced */
+    ngx_splice_pipe_t                 *upstream_pipe;
+    ngx_splice_pipe_t                 *downstream_pipe;
+#endif
+
     unsigned                           connected:1;
     unsigned                           proxy_protocol:1;
+    unsigned                           keepalive:1;
 } ngx_stream_upstream_t;
 
 
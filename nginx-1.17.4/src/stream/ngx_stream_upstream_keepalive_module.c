@@ -0,0 +1,587 @@
+
+/*
+ * Copyright (C) Maxim Dounin
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_uint_t                           max_cached;
+    ngx_uint_t                           max_per_peer;
+    ngx_uint_t                           requests;
+    ngx_msec_t                           timeout;
+
+    ngx_queue_t                          cache;
+    ngx_queue_t                          free;
+
+    ngx_stream_upstream_init_pt          original_init_upstream;
+    ngx_stream_upstream_init_peer_pt     original_init_peer;
+
+} ngx_stream_upstream_keepalive_srv_conf_t;
+
+
+typedef struct {
+    ngx_stream_upstream_keepalive_srv_conf_t  *conf;
+
+    ngx_queue_t                          queue;
+    ngx_connection_t                    *connection;
+
+    socklen_t                            socklen;
+    ngx_sockaddr_t                       sockaddr;
+
+} ngx_stream_upstream_keepalive_cache_t;
+
+
+typedef struct {
+    ngx_stream_upstream_keepalive_srv_conf_t  *conf;
+
+    ngx_stream_upstream_t               *upstream;
+
+    void                                *data;
+
+    ngx_event_get_peer_pt                original_get_peer;
+    ngx_event_free_peer_pt               original_free_peer;
+
+#if (NGX_STREAM_SSL)
+    ngx_event_set_peer_session_pt        original_set_session;
+    ngx_event_save_peer_session_pt       original_save_session;
+#endif
+
+} ngx_stream_upstream_keepalive_peer_data_t;
+
+
+static ngx_int_t ngx_stream_upstream_init_keepalive_peer(
+    ngx_stream_session_t *s, ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_get_keepalive_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_stream_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static void ngx_stream_upstream_keepalive_dummy_handler(ngx_event_t *ev);
+static void ngx_stream_upstream_keepalive_close_handler(ngx_event_t *ev);
+
+#if (NGX_STREAM_SSL)
+static ngx_int_t ngx_stream_upstream_keepalive_set_session(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_stream_upstream_keepalive_save_session(
+    ngx_peer_connection_t *pc, void *data);
+#endif
+
+static void *ngx_stream_upstream_keepalive_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_keepalive_commands[] = {
+
+    { ngx_string("keepalive"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_stream_upstream_keepalive,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("keepalive_per_peer"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_upstream_keepalive_srv_conf_t, max_per_peer),
+      NULL },
+
+    { ngx_string("keepalive_timeout"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_upstream_keepalive_srv_conf_t, timeout),
+      NULL },
+
+    { ngx_string("keepalive_requests"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_upstream_keepalive_srv_conf_t, requests),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_keepalive_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_stream_upstream_keepalive_create_conf, /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_keepalive_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_keepalive_module_ctx, /* module context */
+    ngx_stream_upstream_keepalive_commands,    /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_init_keepalive(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                                 i;
+    ngx_stream_upstream_keepalive_srv_conf_t  *kcf;
+    ngx_stream_upstream_keepalive_cache_t     *cached;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, cf->log, 0,
+                   "init keepalive");
+
+    kcf = ngx_stream_conf_upstream_srv_conf(us,
+                                        ngx_stream_upstream_keepalive_module);
+
+    ngx_conf_init_msec_value(kcf->timeout, 60000);
+    ngx_conf_init_uint_value(kcf->requests, 100);
+    ngx_conf_init_uint_value(kcf->max_per_peer, 0);
+
+    if (kcf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    kcf->original_init_peer = us->peer.init;
+
+    us->peer.init = ngx_stream_upstream_init_keepalive_peer;
+
+    /* allocate cache items and add to free queue */
+
+    cached = ngx_pcalloc(cf->pool,
+              sizeof(ngx_stream_upstream_keepalive_cache_t) * kcf->max_cached);
+    if (cached == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_init(&kcf->cache);
+    ngx_queue_init(&kcf->free);
+
+    for (i = 0; i < kcf->max_cached; i++) {
+        ngx_queue_insert_head(&kcf->free, &cached[i].queue);
+        cached[i].conf = kcf;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_keepalive_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_t                      *u;
+    ngx_stream_upstream_keepalive_peer_data_t  *kp;
+    ngx_stream_upstream_keepalive_srv_conf_t   *kcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
+                   "init keepalive peer");
+
+    kcf = ngx_stream_conf_upstream_srv_conf(us,
+                                        ngx_stream_upstream_keepalive_module);
+
+    kp = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_stream_upstream_keepalive_peer_data_t));
+    if (kp == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (kcf->original_init_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u = s->upstream;
+
+    kp->conf = kcf;
+    kp->upstream = u;
+    kp->data = u->peer.data;
+    kp->original_get_peer = u->peer.get;
+    kp->original_free_peer = u->peer.free;
+
+    u->peer.data = kp;
+    u->peer.get = ngx_stream_upstream_get_keepalive_peer;
+    u->peer.free = ngx_stream_upstream_free_keepalive_peer;
+
+#if (NGX_STREAM_SSL)
+    kp->original_set_session = u->peer.set_session;
+    kp->original_save_session = u->peer.save_session;
+    u->peer.set_session = ngx_stream_upstream_keepalive_set_session;
+    u->peer.save_session = ngx_stream_upstream_keepalive_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_stream_upstream_keepalive_cache_t      *item;
+
+    ngx_int_t          rc;
+    ngx_queue_t       *q, *cache;
+    ngx_connection_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get keepalive peer");
+
+    /* ask balancer */
+
+    rc = kp->original_get_peer(pc, kp->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    /* a PROXY protocol header is only sent on a new connection */
+
+    if (kp->upstream->proxy_protocol) {
+        return NGX_OK;
+    }
+
+    /* search cache for suitable connection */
+
+    cache = &kp->conf->cache;
+
+    for (q = ngx_queue_head(cache);
+         q != ngx_queue_sentinel(cache);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_stream_upstream_keepalive_cache_t, queue);
+        c = item->connection;
+
+        if (c->type == pc->type
+            && ngx_memn2cmp((u_char *) &item->sockaddr,
+                            (u_char *) pc->sockaddr,
+                            item->socklen, pc->socklen)
+               == 0)
+        {
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&kp->conf->free, q);
+
+            goto found;
+        }
+    }
+
+    return NGX_OK;
+
+found:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get keepalive peer: using connection %p", c);
+
+    c->idle = 0;
+    c->sent = 0;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_stream_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_stream_upstream_keepalive_cache_t      *item;
+
+    ngx_uint_t              n;
+    ngx_queue_t            *q;
+    ngx_connection_t       *c;
+    ngx_stream_upstream_t  *u;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free keepalive peer");
+
+    /* cache valid connections */
+
+    u = kp->upstream;
+    c = pc->connection;
+
+    if (state & NGX_PEER_FAILED
+        || c == NULL
+        || c->read->eof
+        || c->read->error
+        || c->read->timedout
+        || c->write->error
+        || c->write->timedout)
+    {
+        goto invalid;
+    }
+
+    if (++c->requests >= kp->conf->requests) {
+        goto invalid;
+    }
+
+    if (!u->keepalive) {
+        goto invalid;
+    }
+
+    if (ngx_terminate || ngx_exiting) {
+        goto invalid;
+    }
+
+    if (kp->conf->max_per_peer) {
+        n = 0;
+
+        for (q = ngx_queue_head(&kp->conf->cache);
+             q != ngx_queue_sentinel(&kp->conf->cache);
+             q = ngx_queue_next(q))
+        {
+            item = ngx_queue_data(q, ngx_stream_upstream_keepalive_cache_t,
+                                  queue);
+
+            if (ngx_memn2cmp((u_char *) &item->sockaddr,
+                             (u_char *) pc->sockaddr,
+                             item->socklen, pc->socklen)
+                == 0)
+            {
+                n++;
+            }
+        }
+
+        if (n >= kp->conf->max_per_peer) {
+            goto invalid;
+        }
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        goto invalid;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free keepalive peer: saving connection %p", c);
+
+    if (ngx_queue_empty(&kp->conf->free)) {
+
+        q = ngx_queue_last(&kp->conf->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_stream_upstream_keepalive_cache_t, queue);
+
+        ngx_close_connection(item->connection);
+
+    } else {
+        q = ngx_queue_head(&kp->conf->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_stream_upstream_keepalive_cache_t, queue);
+    }
+
+    ngx_queue_insert_head(&kp->conf->cache, q);
+
+    item->connection = c;
+
+    pc->connection = NULL;
+
+    c->read->delayed = 0;
+    c->write->delayed = 0;
+    ngx_add_timer(c->read, kp->conf->timeout);
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->write->handler = ngx_stream_upstream_keepalive_dummy_handler;
+    c->read->handler = ngx_stream_upstream_keepalive_close_handler;
+
+    /* the pool belongs to the session and is set again on reuse */
+
+    c->data = item;
+    c->idle = 1;
+    c->pool = NULL;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    item->socklen = pc->socklen;
+    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+
+    if (c->read->ready) {
+        ngx_stream_upstream_keepalive_close_handler(c->read);
+    }
+
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+static void
+ngx_stream_upstream_keepalive_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "keepalive dummy handler");
+}
+
+
+static void
+ngx_stream_upstream_keepalive_close_handler(ngx_event_t *ev)
+{
+    ngx_stream_upstream_keepalive_srv_conf_t  *conf;
+    ngx_stream_upstream_keepalive_cache_t     *item;
+
+    int                n;
+    char               buf[1];
+    ngx_connection_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "keepalive close handler");
+
+    c = ev->data;
+
+    if (c->close || c->read->timedout) {
+        goto close;
+    }
+
+    /* anything received on an idle connection is a late or stray reply */
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+    conf = item->conf;
+
+    ngx_close_connection(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&conf->free, &item->queue);
+}
+
+
+#if (NGX_STREAM_SSL)
+
+static ngx_int_t
+ngx_stream_upstream_keepalive_set_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp = data;
+
+    return kp->original_set_session(pc, kp->data);
+}
+
+
+static void
+ngx_stream_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_stream_upstream_keepalive_peer_data_t  *kp = data;
+
+    kp->original_save_session(pc, kp->data);
+    return;
+}
+
+#endif
+
+
+static void *
+ngx_stream_upstream_keepalive_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_keepalive_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_stream_upstream_keepalive_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->max_cached = 0;
+     */
+
+    conf->max_per_peer = NGX_CONF_UNSET_UINT;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->requests = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_srv_conf_t            *uscf;
+    ngx_stream_upstream_keepalive_srv_conf_t  *kcf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value;
+
+    if (kcf->max_cached) {
+        return "is duplicate";
+    }
+
+    /* read options */
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    kcf->max_cached = n;
+
+    /* init upstream handler */
+
+    uscf = ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    kcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_stream_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_stream_upstream_init_keepalive;
+
+    /* only UDP connections are kept, see ngx_stream_proxy_init() */
+
+    uscf->flags |= NGX_STREAM_UPSTREAM_KEEPALIVE;
+
+    return NGX_CONF_OK;
+}